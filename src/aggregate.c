@@ -0,0 +1,797 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+#define DEFAULT_REPORT_COUNT    64
+#define DEFAULT_BLOCK_COUNT     64
+#define OUTPUT_BUFFER_SIZE      (1 << 20)
+#define MAX_VALUE_LENGTH        32
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* What series and families are merged by; the first member of both. */
+struct key {
+    const char *name;
+    size_t len;
+};
+
+/* A series line of a report file: name ' ' value [' ' timestamp] '\n' */
+struct line {
+    struct key key;
+    const char *value;
+    const char *stamp;
+    size_t stamp_len;
+
+    /* Just after the '\n'. */
+    const char *end;
+};
+
+/* A family: its "# HELP" and "# TYPE" lines and then its series. */
+struct block {
+    struct key key;
+    const char *header;
+    size_t header_len;
+    metrics_type_t type;
+
+    struct line *lines;
+    size_t count;
+};
+
+/* One mapped report file. */
+struct report {
+    const char *map;
+    size_t size;
+
+    struct line *lines;
+
+    struct block *blocks;
+    size_t block_count;
+};
+
+/* The part of a sorted array of lines or blocks still to be merged. */
+struct run {
+    const char *at;
+    const char *end;
+    size_t size;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static int __load_dir( const struct metrics_aggregate_config*, struct report**,
+                       size_t* );
+static int __load( struct report*, int );
+static int __parse( struct report* );
+static struct block* __new_block( struct report*, size_t*, const char* );
+static void __free_report( struct report* );
+static void __free_reports( struct report*, size_t );
+static int __key_cmp( const struct key*, const struct key* );
+static int __line_cmp( const void*, const void* );
+static int __block_cmp( const void*, const void* );
+static void __heap_push( struct run*, size_t*, struct run );
+static struct run __heap_pop( struct run*, size_t* );
+static void __write_family( FILE*, const struct metrics_aggregate_config*,
+                            const struct block**, size_t, struct run*,
+                            const struct line** );
+static void __write_series( FILE*, const struct line**, size_t,
+                            metrics_type_t, metrics_gauge_rule_t );
+static metrics_gauge_rule_t __rule( const struct metrics_aggregate_config*,
+                                    const struct key* );
+static int __is_float( const char* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+int metrics_aggregate( const struct metrics_aggregate_config *c )
+{
+    struct report *reports = NULL;
+    size_t report_count = 0;
+    struct run *heap = NULL, *lines_heap = NULL;
+    const struct block **blocks = NULL;
+    const struct line **lines = NULL;
+    size_t n = 0, i;
+    char *tmp = NULL, *buf = NULL;
+    const char *base;
+    FILE *out = NULL;
+    int rv = -1;
+
+    if( (NULL == c) || (NULL == c->dir) || (NULL == c->output) ) {
+        return -1;
+    }
+
+    if( 0 != __load_dir(c, &reports, &report_count) ) {
+        return -1;
+    }
+
+    /* Everything the merge needs, so nothing is allocated during it. */
+    heap = (struct run*) malloc( (report_count + 1) * sizeof(struct run) );
+    lines_heap = (struct run*) malloc( (report_count + 1) *
+                                       sizeof(struct run) );
+    blocks = (const struct block**) malloc( (report_count + 1) *
+                                            sizeof(struct block*) );
+    lines = (const struct line**) malloc( (report_count + 1) *
+                                          sizeof(struct line*) );
+    tmp = (char*) malloc( strlen(c->output) + 6 );
+    buf = (char*) malloc( OUTPUT_BUFFER_SIZE );
+    if( (NULL == heap) || (NULL == lines_heap) || (NULL == blocks) ||
+        (NULL == lines) || (NULL == tmp) || (NULL == buf) )
+    {
+        goto done;
+    }
+
+    /* Readers only ever see a complete file, and the next run never reads
+     * one left by a run that did not finish. */
+    base = strrchr( c->output, '/' );
+    base = (NULL == base) ? c->output : base + 1;
+    sprintf( tmp, "%.*s.%s.tmp", (int) (base - c->output), c->output, base );
+    out = fopen( tmp, "w" );
+    if( NULL == out ) {
+        goto done;
+    }
+    setvbuf( out, buf, _IOFBF, OUTPUT_BUFFER_SIZE );
+
+    for( i = 0; i < report_count; i++ ) {
+        if( 0 < reports[i].block_count ) {
+            struct run r;
+
+            r.at = (const char*) reports[i].blocks;
+            r.end = (const char*) &reports[i].blocks[reports[i].block_count];
+            r.size = sizeof(struct block);
+            __heap_push( heap, &n, r );
+        }
+    }
+
+    /* Take every block of the smallest family name, from whichever files
+     * have it, and merge them. */
+    while( 0 < n ) {
+        const struct key *smallest = (const struct key*) heap[0].at;
+        size_t count = 0;
+
+        while( (0 < n) &&
+               (0 == __key_cmp(smallest, (const struct key*) heap[0].at)) )
+        {
+            struct run r = __heap_pop( heap, &n );
+
+            /* A file has each family once, but just in case. */
+            if( count <= report_count ) {
+                blocks[count++] = (const struct block*) r.at;
+            }
+            r.at += r.size;
+            if( r.at < r.end ) {
+                __heap_push( heap, &n, r );
+            }
+        }
+
+        __write_family( out, c, blocks, count, lines_heap, lines );
+    }
+
+    if( 0 != fflush(out) ) {
+        goto done;
+    }
+    if( 0 != fclose(out) ) {
+        out = NULL;
+        goto done;
+    }
+    out = NULL;
+
+    if( 0 == rename(tmp, c->output) ) {
+        rv = 0;
+    }
+
+done:
+    if( NULL != out ) {
+        fclose( out );
+    }
+    if( (0 != rv) && (NULL != tmp) ) {
+        unlink( tmp );
+    }
+    free( buf );
+    free( tmp );
+    free( lines );
+    free( blocks );
+    free( lines_heap );
+    free( heap );
+    __free_reports( reports, report_count );
+
+    return rv;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Maps and parses every report file in the directory: regular files whose
+ *  names do not start with '.', other than the output.
+ */
+static int __load_dir( const struct metrics_aggregate_config *c,
+                       struct report **reports, size_t *count )
+{
+    struct stat output;
+    struct dirent *entry;
+    size_t len = 0;
+    int dir_fd;
+    DIR *dir;
+
+    *reports = NULL;
+    *count = 0;
+
+    dir = opendir( c->dir );
+    if( NULL == dir ) {
+        return -1;
+    }
+    dir_fd = dirfd( dir );
+
+    if( 0 != stat(c->output, &output) ) {
+        output.st_dev = 0;
+        output.st_ino = 0;
+    }
+
+    while( NULL != (entry = readdir(dir)) ) {
+        struct stat st;
+        int fd;
+
+        if( '.' == entry->d_name[0] ) {
+            continue;
+        }
+
+        fd = openat( dir_fd, entry->d_name, O_RDONLY | O_CLOEXEC );
+        if( fd < 0 ) {
+            continue;
+        }
+
+        if( (0 != fstat(fd, &st)) || !S_ISREG(st.st_mode) ||
+            ((st.st_dev == output.st_dev) && (st.st_ino == output.st_ino)) )
+        {
+            close( fd );
+            continue;
+        }
+
+        if( *count == len ) {
+            size_t l = (0 == len) ? DEFAULT_REPORT_COUNT : 2 * len;
+            struct report *p;
+
+            p = (struct report*) realloc( *reports, l * sizeof(struct report) );
+            if( NULL == p ) {
+                close( fd );
+                closedir( dir );
+                __free_reports( *reports, *count );
+                *reports = NULL;
+                *count = 0;
+                return -1;
+            }
+            *reports = p;
+            len = l;
+        }
+
+        /* A file that cannot be read is left out. */
+        if( 0 == __load(&(*reports)[*count], fd) ) {
+            (*count)++;
+        }
+        close( fd );
+    }
+
+    closedir( dir );
+
+    return 0;
+}
+
+/**
+ *  Maps and parses one report file.  Binary and compressed reports, and
+ *  empty files, are left out.
+ */
+static int __load( struct report *r, int fd )
+{
+    struct stat st;
+    void *map;
+
+    memset( r, 0, sizeof(struct report) );
+
+    if( (0 != fstat(fd, &st)) || (0 == st.st_size) ) {
+        return -1;
+    }
+
+    map = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if( MAP_FAILED == map ) {
+        return -1;
+    }
+    r->map = (const char*) map;
+    r->size = (size_t) st.st_size;
+
+    if( ((4 <= r->size) && (0 == memcmp(r->map, "MTRK", 4))) ||
+        ((2 <= r->size) && (0 == memcmp(r->map, "\x1f\x8b", 2))) ||
+        (0 != __parse(r)) )
+    {
+        __free_report( r );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ *  Splits a report into families and their series, each in name order.  A
+ *  report is already in order apart from the top-K families, but the order
+ *  is checked rather than relied on.  A last line without a '\n' is a
+ *  report cut short and is left out.
+ */
+static int __parse( struct report *r )
+{
+    const char *p = r->map;
+    const char *end = r->map + r->size;
+    struct block *b = NULL;
+    size_t lines = 0, len = 0, i, j;
+    const char *nl;
+
+    for( nl = p; NULL != (nl = memchr(nl, '\n', end - nl)); nl++ ) {
+        lines++;
+    }
+    r->lines = (struct line*) malloc( (lines + 1) * sizeof(struct line) );
+    if( NULL == r->lines ) {
+        return -1;
+    }
+    lines = 0;
+
+    for( ; NULL != (nl = memchr(p, '\n', end - p)); p = nl + 1 ) {
+        if( p == nl ) {
+            continue;
+        }
+
+        if( '#' == *p ) {
+            /* A comment after series starts the next family. */
+            if( (NULL == b) || (0 < b->count) ) {
+                b = __new_block( r, &len, p );
+                if( NULL == b ) {
+                    return -1;
+                }
+                b->lines = &r->lines[lines];
+            }
+            b->header_len = nl + 1 - b->header;
+
+            if( ((size_t) (nl - p) > 7) &&
+                ((0 == memcmp(p, "# TYPE ", 7)) ||
+                 (0 == memcmp(p, "# HELP ", 7))) )
+            {
+                const char *name = p + 7;
+                const char *space = memchr( name, ' ', nl - name );
+
+                if( NULL == space ) {
+                    space = nl;
+                }
+                b->key.name = name;
+                b->key.len = space - name;
+
+                if( (0 == memcmp(p, "# TYPE ", 7)) && (8 == nl - space) &&
+                    (0 == memcmp(space + 1, "counter", 7)) )
+                {
+                    b->type = METRICS_COUNTER;
+                }
+            }
+        } else {
+            struct line *l = &r->lines[lines];
+            const char *name_end = NULL;
+            const char *q;
+
+            /* Label values may have spaces, but never after the '}'. */
+            for( q = nl - 1; p <= q; q-- ) {
+                if( '}' == *q ) {
+                    name_end = q + 1;
+                    break;
+                }
+            }
+            if( NULL == name_end ) {
+                name_end = memchr( p, ' ', nl - p );
+            }
+            if( (NULL == name_end) || (nl <= name_end) ||
+                (' ' != *name_end) || (nl == name_end + 1) )
+            {
+                continue;
+            }
+
+            l->key.name = p;
+            l->key.len = name_end - p;
+            l->value = name_end + 1;
+            l->stamp = memchr( l->value, ' ', nl - l->value );
+            if( NULL != l->stamp ) {
+                l->stamp++;
+                l->stamp_len = nl - l->stamp;
+            } else {
+                l->stamp_len = 0;
+            }
+            l->end = nl + 1;
+
+            /* Series with no header are a family of their own name. */
+            if( NULL == b ) {
+                b = __new_block( r, &len, NULL );
+                if( NULL == b ) {
+                    return -1;
+                }
+                b->lines = l;
+                q = memchr( p, '{', l->key.len );
+                b->key.name = p;
+                b->key.len = (NULL != q) ? (size_t) (q - p) : l->key.len;
+            }
+
+            b->count++;
+            lines++;
+        }
+    }
+
+    /* Drop headers with no name, and put the rest in order. */
+    for( i = 0, j = 0; i < r->block_count; i++ ) {
+        struct block *x = &r->blocks[i];
+        size_t k;
+
+        if( NULL == x->key.name ) {
+            continue;
+        }
+        for( k = 1; k < x->count; k++ ) {
+            if( 0 < __line_cmp(&x->lines[k - 1], &x->lines[k]) ) {
+                qsort( x->lines, x->count, sizeof(struct line), __line_cmp );
+                break;
+            }
+        }
+        r->blocks[j++] = *x;
+    }
+    r->block_count = j;
+
+    for( i = 1; i < r->block_count; i++ ) {
+        if( 0 < __block_cmp(&r->blocks[i - 1], &r->blocks[i]) ) {
+            qsort( r->blocks, r->block_count, sizeof(struct block),
+                   __block_cmp );
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static struct block* __new_block( struct report *r, size_t *len,
+                                  const char *header )
+{
+    struct block *b;
+
+    if( r->block_count == *len ) {
+        size_t l = (0 == *len) ? DEFAULT_BLOCK_COUNT : 2 * *len;
+        struct block *p;
+
+        p = (struct block*) realloc( r->blocks, l * sizeof(struct block) );
+        if( NULL == p ) {
+            return NULL;
+        }
+        r->blocks = p;
+        *len = l;
+    }
+
+    b = &r->blocks[r->block_count++];
+    memset( b, 0, sizeof(struct block) );
+    b->header = header;
+    b->type = METRICS_GAUGE;
+
+    return b;
+}
+
+static void __free_report( struct report *r )
+{
+    if( NULL != r->map ) {
+        munmap( (void*) r->map, r->size );
+    }
+    free( r->lines );
+    free( r->blocks );
+    memset( r, 0, sizeof(struct report) );
+}
+
+static void __free_reports( struct report *reports, size_t count )
+{
+    size_t i;
+
+    for( i = 0; i < count; i++ ) {
+        __free_report( &reports[i] );
+    }
+    free( reports );
+}
+
+static int __key_cmp( const struct key *a, const struct key *b )
+{
+    size_t len = (a->len < b->len) ? a->len : b->len;
+    int rv = memcmp( a->name, b->name, len );
+
+    if( 0 == rv ) {
+        rv = (a->len > b->len) - (a->len < b->len);
+    }
+
+    return rv;
+}
+
+static int __line_cmp( const void *a, const void *b )
+{
+    return __key_cmp( (const struct key*) a, (const struct key*) b );
+}
+
+/**
+ *  Orders families by name, keeping the file order of any with the same
+ *  name.
+ */
+static int __block_cmp( const void *a, const void *b )
+{
+    const struct block *x = (const struct block*) a;
+    const struct block *y = (const struct block*) b;
+    int rv = __key_cmp( &x->key, &y->key );
+
+    if( 0 == rv ) {
+        rv = (x->lines > y->lines) - (x->lines < y->lines);
+    }
+
+    return rv;
+}
+
+/**
+ *  A binary heap of runs by the key each one is at, smallest first.
+ */
+static void __heap_push( struct run *heap, size_t *n, struct run r )
+{
+    size_t i = (*n)++;
+
+    while( 0 < i ) {
+        size_t parent = (i - 1) / 2;
+
+        if( __key_cmp((const struct key*) heap[parent].at,
+                      (const struct key*) r.at) <= 0 )
+        {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = r;
+}
+
+static struct run __heap_pop( struct run *heap, size_t *n )
+{
+    struct run top = heap[0];
+    struct run last = heap[--(*n)];
+    size_t i = 0;
+
+    for( ;; ) {
+        size_t child = 2 * i + 1;
+
+        if( *n <= child ) {
+            break;
+        }
+        if( (child + 1 < *n) &&
+            (__key_cmp((const struct key*) heap[child + 1].at,
+                       (const struct key*) heap[child].at) < 0) )
+        {
+            child++;
+        }
+        if( __key_cmp((const struct key*) last.at,
+                      (const struct key*) heap[child].at) <= 0 )
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if( 0 < *n ) {
+        heap[i] = last;
+    }
+
+    return top;
+}
+
+/**
+ *  Writes the longest header of the family, so a "# HELP" line is kept,
+ *  then its series from every file merged by name.
+ */
+static void __write_family( FILE *out, const struct metrics_aggregate_config *c,
+                            const struct block **blocks, size_t count,
+                            struct run *heap, const struct line **lines )
+{
+    const struct block *header = blocks[0];
+    metrics_gauge_rule_t rule = __rule( c, &blocks[0]->key );
+    size_t n = 0, i;
+
+    for( i = 1; i < count; i++ ) {
+        if( header->header_len < blocks[i]->header_len ) {
+            header = blocks[i];
+        }
+    }
+    if( NULL != header->header ) {
+        fwrite( header->header, 1, header->header_len, out );
+    }
+
+    for( i = 0; i < count; i++ ) {
+        if( 0 < blocks[i]->count ) {
+            struct run r;
+
+            r.at = (const char*) blocks[i]->lines;
+            r.end = (const char*) &blocks[i]->lines[blocks[i]->count];
+            r.size = sizeof(struct line);
+            __heap_push( heap, &n, r );
+        }
+    }
+
+    while( 0 < n ) {
+        const struct key *smallest = (const struct key*) heap[0].at;
+        size_t same = 0;
+
+        while( (0 < n) &&
+               (0 == __key_cmp(smallest, (const struct key*) heap[0].at)) )
+        {
+            struct run r = __heap_pop( heap, &n );
+
+            if( same < count ) {
+                lines[same++] = (const struct line*) r.at;
+            }
+            r.at += r.size;
+            if( r.at < r.end ) {
+                __heap_push( heap, &n, r );
+            }
+        }
+
+        __write_series( out, lines, same, header->type, rule );
+    }
+}
+
+/**
+ *  Writes one series from the lines of every file that has it.  Counters
+ *  are added up, saturating rather than wrapping, and gauges combined by
+ *  the rule.  The latest timestamp is kept.
+ */
+static void __write_series( FILE *out, const struct line **lines, size_t count,
+                            metrics_type_t type, metrics_gauge_rule_t rule )
+{
+    const struct line *latest = lines[0];
+    char value[MAX_VALUE_LENGTH];
+    int is_float = 0;
+    size_t i;
+
+    /* Nothing to combine, so the line is copied as it is. */
+    if( 1 == count ) {
+        fwrite( lines[0]->key.name, 1, lines[0]->end - lines[0]->key.name,
+                out );
+        return;
+    }
+
+    for( i = 0; i < count; i++ ) {
+        const struct line *l = lines[i];
+
+        if( (l->stamp_len > latest->stamp_len) ||
+            ((0 < l->stamp_len) && (l->stamp_len == latest->stamp_len) &&
+             (0 < memcmp(l->stamp, latest->stamp, l->stamp_len))) )
+        {
+            latest = l;
+        }
+        is_float |= __is_float( l->value );
+    }
+
+    if( METRICS_COUNTER == type ) {
+        uint64_t sum = 0;
+
+        for( i = 0; i < count; i++ ) {
+            if( __builtin_add_overflow(sum, strtoull(lines[i]->value, NULL, 10),
+                                       &sum) )
+            {
+                sum = UINT64_MAX;
+            }
+        }
+        sprintf( value, "%"PRIu64, sum );
+    } else if( (0 != is_float) || (METRICS_GAUGE_AVERAGE == rule) ) {
+        double v = strtod( lines[0]->value, NULL );
+
+        for( i = 1; i < count; i++ ) {
+            double x = strtod( lines[i]->value, NULL );
+
+            if( METRICS_GAUGE_MIN == rule ) {
+                v = (x < v) ? x : v;
+            } else if( METRICS_GAUGE_MAX == rule ) {
+                v = (x > v) ? x : v;
+            } else {
+                v += x;
+            }
+        }
+        if( METRICS_GAUGE_AVERAGE == rule ) {
+            v /= (double) count;
+        }
+        sprintf( value, "%.6g", v );
+    } else {
+        int64_t v = strtoll( lines[0]->value, NULL, 10 );
+
+        for( i = 1; i < count; i++ ) {
+            int64_t x = strtoll( lines[i]->value, NULL, 10 );
+
+            if( METRICS_GAUGE_MIN == rule ) {
+                v = (x < v) ? x : v;
+            } else if( METRICS_GAUGE_MAX == rule ) {
+                v = (x > v) ? x : v;
+            } else if( __builtin_add_overflow(v, x, &v) ) {
+                v = (0 < x) ? INT64_MAX : INT64_MIN;
+            }
+        }
+        sprintf( value, "%"PRId64, v );
+    }
+
+    fwrite( lines[0]->key.name, 1, lines[0]->key.len, out );
+    fputc( ' ', out );
+    fputs( value, out );
+    if( 0 < latest->stamp_len ) {
+        fputc( ' ', out );
+        fwrite( latest->stamp, 1, latest->stamp_len, out );
+    }
+    fputc( '\n', out );
+}
+
+/**
+ *  The rule of the longest prefix of the family name, or the default.
+ */
+static metrics_gauge_rule_t __rule( const struct metrics_aggregate_config *c,
+                                    const struct key *family )
+{
+    metrics_gauge_rule_t rule = c->gauge_rule;
+    size_t longest = 0;
+    size_t i;
+
+    for( i = 0; i < c->rule_count; i++ ) {
+        size_t len = strlen( c->rules[i].prefix );
+
+        if( (len <= family->len) && (longest <= len) &&
+            (0 == memcmp(c->rules[i].prefix, family->name, len)) )
+        {
+            rule = c->rules[i].rule;
+            longest = len;
+        }
+    }
+
+    return rule;
+}
+
+/**
+ *  Whether a value (ended by ' ' or '\n') is not an integer.
+ */
+static int __is_float( const char *value )
+{
+    for( ; (' ' != *value) && ('\n' != *value); value++ ) {
+        if( ('.' == *value) || ('e' == *value) || ('n' == *value) ||
+            ('N' == *value) || ('i' == *value) || ('I' == *value) )
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
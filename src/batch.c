@@ -0,0 +1,307 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+#define DEFAULT_BATCH_SIZE  16
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+struct batch_entry {
+    metric_type_t type;
+
+    /* The batch owns a copy of the name so it can be compared against the
+     * name passed in the next time the batch is filled. */
+    char *name;
+
+    /* The resolved series for the metric, or NULL if not resolved yet. */
+    struct series *series;
+
+    union {
+        uint32_t inc;
+        int64_t value;
+    } u;
+};
+
+typedef struct {
+    __metrics_t *m;
+
+    /* The number of entries filled since the last apply. */
+    size_t used;
+
+    /* The number of entries holding a name (and possibly a series). */
+    size_t count;
+
+    size_t len;
+    struct batch_entry *entries;
+} __batch_t;
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct batch_entry* __next_entry( __batch_t*, metric_type_t,
+                                         const char*, char* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+metrics_batch_t metrics_batch_create( metrics_t m )
+{
+    __batch_t *b;
+
+    /* A disabled registry has nothing to apply to. */
+    if( (NULL == m) || (&__metrics_disabled == m) ) {
+        return NULL;
+    }
+
+    b = (__batch_t*) malloc( sizeof(__batch_t) );
+    if( NULL == b ) {
+        return NULL;
+    }
+
+    b->m = (__metrics_t*) m;
+    b->used = 0;
+    b->count = 0;
+    b->len = DEFAULT_BATCH_SIZE;
+    b->entries = (struct batch_entry*) malloc( b->len * sizeof(struct batch_entry) );
+    if( NULL == b->entries ) {
+        free( b );
+        return NULL;
+    }
+
+    return (metrics_batch_t) b;
+}
+
+/* See metrics.h for details. */
+void metrics_batch_destroy( metrics_batch_t __b )
+{
+    __batch_t *b = (__batch_t*) __b;
+    size_t i;
+
+    if( NULL != b ) {
+        for( i = 0; i < b->count; i++ ) {
+            free( b->entries[i].name );
+        }
+        free( b->entries );
+        free( b );
+    }
+}
+
+/* See metrics.h for details. */
+void metrics_batch_counter_inc( metrics_batch_t b, const char *name,
+                                uint32_t inc )
+{
+    struct batch_entry *e;
+
+    e = __next_entry( (__batch_t*) b, MT_COUNTER, name, NULL );
+    if( NULL != e ) {
+        e->u.inc = inc;
+    }
+}
+
+/* See metrics.h for details. */
+void metrics_batch_counter_inc_labels( metrics_batch_t b, const char *name,
+                                       uint32_t inc, size_t label_count, ... )
+{
+    struct batch_entry *e;
+    char *full;
+    va_list args;
+
+    if( NULL == b ) {
+        return;
+    }
+
+    va_start( args, label_count );
+    full = metrics_calculate_name_varidac( name, label_count, args );
+    va_end( args );
+
+    if( NULL == full ) {
+        return;
+    }
+
+    e = __next_entry( (__batch_t*) b, MT_COUNTER, full, full );
+    if( NULL != e ) {
+        e->u.inc = inc;
+    }
+}
+
+/* See metrics.h for details. */
+void metrics_batch_gauge_set( metrics_batch_t b, const char *name,
+                              int64_t value )
+{
+    struct batch_entry *e;
+
+    e = __next_entry( (__batch_t*) b, MT_GAUGE, name, NULL );
+    if( NULL != e ) {
+        e->u.value = value;
+    }
+}
+
+/* See metrics.h for details. */
+void metrics_batch_gauge_set_labels( metrics_batch_t b, const char *name,
+                                     int64_t value, size_t label_count, ... )
+{
+    struct batch_entry *e;
+    char *full;
+    va_list args;
+
+    if( NULL == b ) {
+        return;
+    }
+
+    va_start( args, label_count );
+    full = metrics_calculate_name_varidac( name, label_count, args );
+    va_end( args );
+
+    if( NULL == full ) {
+        return;
+    }
+
+    e = __next_entry( (__batch_t*) b, MT_GAUGE, full, full );
+    if( NULL != e ) {
+        e->u.value = value;
+    }
+}
+
+/* See metrics.h for details. */
+void metrics_batch_apply( metrics_batch_t __b )
+{
+    __batch_t *b = (__batch_t*) __b;
+    __metrics_t *m;
+    uint64_t now;
+    size_t i;
+
+    if( (NULL == b) || (0 == b->used) ) {
+        return;
+    }
+
+    m = b->m;
+    now = (0 != m->c->timestamps) ? __stamp_now() : 0;
+
+    pthread_mutex_lock( &m->mutex );
+    for( i = 0; i < b->used; i++ ) {
+        struct batch_entry *e = &b->entries[i];
+
+        if( NULL == e->series ) {
+            e->series = __unsafe_series( m, e->type, e->name );
+            if( NULL == e->series ) {
+                continue;
+            }
+        }
+
+        if( MT_COUNTER == e->type ) {
+            __atomic_add_fetch( e->series->slot, e->u.inc, __ATOMIC_RELAXED );
+        } else {
+            __atomic_store_n( (int64_t*) e->series->slot, e->u.value,
+                              __ATOMIC_RELAXED );
+        }
+        if( NULL != e->series->stamp ) {
+            __atomic_store_n( e->series->stamp, now, __ATOMIC_RELAXED );
+        }
+    }
+    pthread_mutex_unlock( &m->mutex );
+
+    b->used = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Returns the next entry in the batch to fill.  If the entry previously held
+ *  the same metric, the resolved series is kept so no lookup is needed when the
+ *  batch is applied.
+ *
+ *  @param b     - The batch to fill.
+ *  @param type  - The type of metric.
+ *  @param name  - The complete metric name.
+ *  @param owned - If not NULL, an allocated copy of name that is consumed
+ *                 by this function.
+ *
+ *  @return the entry to fill or NULL on error
+ */
+static struct batch_entry* __next_entry( __batch_t *b, metric_type_t type,
+                                         const char *name, char *owned )
+{
+    struct batch_entry *e;
+
+    if( (NULL == b) || (NULL == name) ) {
+        free( owned );
+        return NULL;
+    }
+
+    if( b->used == b->len ) {
+        struct batch_entry *tmp;
+
+        tmp = (struct batch_entry*) realloc( b->entries,
+                                             2 * b->len * sizeof(struct batch_entry) );
+        if( NULL == tmp ) {
+            free( owned );
+            return NULL;
+        }
+        b->entries = tmp;
+        b->len *= 2;
+    }
+
+    e = &b->entries[b->used];
+
+    if( b->used < b->count ) {
+        if( (type == e->type) && (0 == strcmp(name, e->name)) ) {
+            free( owned );
+            b->used++;
+            return e;
+        }
+
+        free( e->name );
+    } else {
+        b->count++;
+    }
+
+    e->type = type;
+    e->series = NULL;
+    e->name = (NULL != owned) ? owned : strdup( name );
+    if( NULL == e->name ) {
+        size_t i;
+
+        /* Forget everything after this entry so the batch stays consistent. */
+        for( i = b->used + 1; i < b->count; i++ ) {
+            free( b->entries[i].name );
+        }
+        b->count = b->used;
+        return NULL;
+    }
+
+    b->used++;
+
+    return e;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static int __reserve( struct snapshot*, size_t );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+int __snapshot_deltas( struct snapshot *s, const struct snapshot *prev,
+                       double elapsed )
+{
+    size_t common = (prev->ids < s->ids) ? prev->ids : s->ids;
+
+    if( 0 != __reserve(s, s->ids) ) {
+        return -1;
+    }
+
+    /* Series ids never change, so the values by id always line up with the
+     * previous report; series added since were 0 then. */
+    __kernels()->delta( s->deltas, s->raw, prev->raw, common );
+    memcpy( &s->deltas[common], &s->raw[common],
+            (s->ids - common) * sizeof(uint64_t) );
+
+    s->per_s = (0.0 < elapsed) ? 1.0 / elapsed : 0.0;
+    s->has_deltas = 1;
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static int __reserve( struct snapshot *s, size_t count )
+{
+    uint64_t *d;
+
+    if( count <= s->deltas_len ) {
+        return 0;
+    }
+
+    d = (uint64_t*) realloc( s->deltas, count * sizeof(uint64_t) );
+    if( NULL == d ) {
+        return -1;
+    }
+    s->deltas = d;
+    s->deltas_len = count;
+
+    return 0;
+}
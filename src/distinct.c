@@ -0,0 +1,305 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The number of hash bits that pick a register, see distinct_precision. */
+#define DISTINCT_DEFAULT_BITS   12
+#define DISTINCT_MIN_BITS       4
+#define DISTINCT_MAX_BITS       16
+
+#define HASH_P1                 0x9e3779b97f4a7c15ULL
+#define HASH_P2                 0xc2b2ae3d27d4eb4fULL
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct distinct* __unsafe_distinct( __metrics_t*, const char* );
+static int __bits( const __metrics_t* );
+static uint64_t __hash( const void*, size_t );
+static int __sample( const char*, void*, void* );
+static int __clear( const char*, void*, void* );
+static int __destroyer( const char*, void*, void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+void metrics_distinct_add( metrics_t __m, const char *name, const void *key,
+                           size_t len )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct distinct *d;
+    uint64_t h;
+    uint8_t *r, rank, old;
+
+    if( &__metrics_disabled == m ) {
+        return;
+    }
+
+    d = (struct distinct*) trie_search( m->distincts, name );
+    if( NULL == d ) {
+        pthread_mutex_lock( &m->mutex );
+        d = __unsafe_distinct( m, name );
+        pthread_mutex_unlock( &m->mutex );
+
+        if( NULL == d ) {
+            return;
+        }
+    }
+
+    /* The top bits pick the register, the rest give the rank: one more
+     * than the number of leading zeros, at most 64 - bits + 1. */
+    h = __hash( key, len );
+    r = &d->registers[h >> (64 - d->bits)];
+    rank = (uint8_t) (__builtin_clzll((h << d->bits) |
+                                      (1ULL << (d->bits - 1))) + 1);
+
+    /* Nearly every key after the first few seen leaves the register as it
+     * is, so only a load. */
+    old = __atomic_load_n( r, __ATOMIC_RELAXED );
+    while( (old < rank) &&
+           (0 == __atomic_compare_exchange_n(r, &old, rank, 1,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED)) )
+    {
+        ;
+    }
+}
+
+/* See metrics.h for details. */
+void metrics_distinct_add_labels( metrics_t __m, const char *name,
+                                  const void *key, size_t len,
+                                  size_t label_count, ... )
+{
+    char *full;
+    va_list args;
+
+    if( &__metrics_disabled == __m ) {
+        return;
+    }
+
+    va_start( args, label_count );
+    full = metrics_calculate_name_varidac( name, label_count, args );
+    va_end( args );
+
+    if( NULL == full ) {
+        return;
+    }
+
+    metrics_distinct_add( __m, full, key, len );
+
+    free( full );
+}
+
+/* See internal.h for details. */
+void __distinct_sample( __metrics_t *m )
+{
+    int reset = m->c->distinct_reset;
+
+    trie_visit( m->distincts, "", __sample, &reset );
+}
+
+/* See internal.h for details. */
+void __distincts_forked( __metrics_t *m )
+{
+    trie_visit( m->distincts, "", __clear, NULL );
+}
+
+/* See internal.h for details. */
+void __distincts_destroy( __metrics_t *m )
+{
+    trie_visit( m->distincts, "", __destroyer, NULL );
+    trie_free( m->distincts );
+    m->distincts = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Finds or creates the sketch of a complete name, along with the gauge its
+ *  estimate is reported as.
+ */
+static struct distinct* __unsafe_distinct( __metrics_t *m, const char *name )
+{
+    int bits = __bits( m );
+    struct distinct *d;
+
+    d = (struct distinct*) trie_search( m->distincts, name );
+    if( NULL != d ) {
+        return d;
+    }
+
+    d = (struct distinct*) calloc( 1, sizeof(struct distinct) +
+                                      ((size_t) 1 << bits) );
+    if( NULL == d ) {
+        return NULL;
+    }
+    d->bits = bits;
+
+    d->series = __unsafe_series( m, MT_GAUGE, name );
+    if( (NULL == d->series) || (0 != trie_insert(m->distincts, name, d)) ) {
+        free( d );
+        return NULL;
+    }
+
+    return d;
+}
+
+/**
+ *  The configured precision, within what the estimate is good for.
+ */
+static int __bits( const __metrics_t *m )
+{
+    int bits = m->c->distinct_precision;
+
+    if( 0 == bits ) {
+        return DISTINCT_DEFAULT_BITS;
+    }
+    if( bits < DISTINCT_MIN_BITS ) {
+        return DISTINCT_MIN_BITS;
+    }
+    if( DISTINCT_MAX_BITS < bits ) {
+        return DISTINCT_MAX_BITS;
+    }
+
+    return bits;
+}
+
+/**
+ *  A 64 bit hash of the key, 8 bytes at a time.  The sketch needs every bit
+ *  to be well mixed, not a hash that resists attack.
+ */
+static uint64_t __hash( const void *key, size_t len )
+{
+    const uint8_t *p = (const uint8_t*) key;
+    uint64_t h = (uint64_t) len * HASH_P2;
+    uint64_t w;
+
+    for( ; 8 <= len; p += 8, len -= 8 ) {
+        memcpy( &w, p, 8 );
+        h = (h ^ w) * HASH_P1;
+        h ^= h >> 29;
+    }
+    if( 0 < len ) {
+        w = 0;
+        memcpy( &w, p, len );
+        h = (h ^ w) * HASH_P1;
+        h ^= h >> 29;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P1;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/**
+ *  Sets the gauge of one sketch to its estimate.  With distinct_reset each
+ *  register is swapped for 0 as it is read, so a key added at the same time
+ *  is counted in this period or the next but never lost.
+ */
+static int __sample( const char *key, void *data, void *arg )
+{
+    struct distinct *d = (struct distinct*) data;
+    int reset = *((int*) arg);
+    size_t count = (size_t) 1 << d->bits;
+    size_t i, zeros = 0;
+    double sum = 0.0;
+    double alpha, estimate;
+    uint8_t v;
+
+    (void) key;
+
+    for( i = 0; i < count; i++ ) {
+        if( 0 != reset ) {
+            v = __atomic_exchange_n( &d->registers[i], 0, __ATOMIC_RELAXED );
+        } else {
+            v = __atomic_load_n( &d->registers[i], __ATOMIC_RELAXED );
+        }
+        sum += 1.0 / (double) (1ULL << v);
+        zeros += (0 == v);
+    }
+
+    switch( count ) {
+        case 16:    alpha = 0.673;                              break;
+        case 32:    alpha = 0.697;                              break;
+        case 64:    alpha = 0.709;                              break;
+        default:    alpha = 0.7213 / (1.0 + 1.079 / (double) count);
+    }
+    estimate = alpha * (double) count * (double) count / sum;
+
+    /* The raw estimate is biased while most registers are still empty, so
+     * count the empty ones instead.  With 64 bit hashes there is no
+     * correction at the top end. */
+    if( (estimate <= 2.5 * (double) count) && (0 < zeros) ) {
+        estimate = (double) count * log( (double) count / (double) zeros );
+    }
+
+    __series_set( d->series, (int64_t) (estimate + 0.5) );
+
+    return 0;
+}
+
+/**
+ *  Empties one sketch.
+ */
+static int __clear( const char *key, void *data, void *arg )
+{
+    struct distinct *d = (struct distinct*) data;
+
+    (void) key;
+    (void) arg;
+
+    memset( d->registers, 0, (size_t) 1 << d->bits );
+
+    return 0;
+}
+
+static int __destroyer( const char *key, void *data, void *arg )
+{
+    (void) key;
+    (void) arg;
+
+    free( data );
+
+    return 0;
+}
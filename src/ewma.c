@@ -0,0 +1,367 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The decay is applied every EWMA_TICK_MS, with 1 - exp(-tick / window) for
+ * the 1, 5 and 15 minute windows worked out beforehand. */
+#define EWMA_TICK_MS            5000
+#define EWMA_ALPHA_1M           0.07995558537067671
+#define EWMA_ALPHA_5M           0.01652854617838251
+#define EWMA_ALPHA_15M          0.005540151995103271
+
+#define DEFAULT_EWMA_SIZE       16
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static const double __alphas[EWMA_WINDOWS] = {
+    EWMA_ALPHA_1M,
+    EWMA_ALPHA_5M,
+    EWMA_ALPHA_15M,
+};
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct ewma* __unsafe_ewma( __metrics_t*, const char* );
+static int __advance( const char*, void*, void* );
+static int __by_family( const void*, const void* );
+static int __restart( const char*, void*, void* );
+static int __destroyer( const char*, void*, void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+void metrics_ewma_mark( metrics_t __m, const char *name, uint32_t count )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct ewma *e;
+    int first = 0;
+
+    if( &__metrics_disabled == m ) {
+        return;
+    }
+
+    e = (struct ewma*) trie_search( m->ewmas, name );
+    if( NULL == e ) {
+        pthread_mutex_lock( &m->mutex );
+        first = (0 == m->has_ewmas);
+        e = __unsafe_ewma( m, name );
+        pthread_mutex_unlock( &m->mutex );
+
+        if( NULL == e ) {
+            return;
+        }
+    }
+
+    __atomic_add_fetch( &e->pending, count, __ATOMIC_RELAXED );
+
+    /* The report thread may be asleep until the next report. */
+    if( 0 != first ) {
+        __reporter_wake( m );
+    }
+}
+
+/* See metrics.h for details. */
+void metrics_ewma_mark_labels( metrics_t __m, const char *name, uint32_t count,
+                               size_t label_count, ... )
+{
+    char *full;
+    va_list args;
+
+    if( &__metrics_disabled == __m ) {
+        return;
+    }
+
+    va_start( args, label_count );
+    full = metrics_calculate_name_varidac( name, label_count, args );
+    va_end( args );
+
+    if( NULL == full ) {
+        return;
+    }
+
+    metrics_ewma_mark( __m, full, count );
+
+    free( full );
+}
+
+/* See internal.h for details. */
+void __ewma_tick( __metrics_t *m )
+{
+    struct timespec now;
+    int64_t elapsed, ticks;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    elapsed = (int64_t) (now.tv_sec - m->ewma_ticked.tv_sec) * 1000 +
+              (now.tv_nsec - m->ewma_ticked.tv_nsec) / 1000000;
+
+    ticks = elapsed / EWMA_TICK_MS;
+    if( 0 < ticks ) {
+        int64_t ms = ticks * EWMA_TICK_MS;
+
+        /* Whatever is left over counts towards the next tick. */
+        m->ewma_ticked.tv_sec += (time_t) (ms / 1000);
+        m->ewma_ticked.tv_nsec += (long) (ms % 1000) * 1000000;
+        if( 1000000000 <= m->ewma_ticked.tv_nsec ) {
+            m->ewma_ticked.tv_sec++;
+            m->ewma_ticked.tv_nsec -= 1000000000;
+        }
+        __ewma_advance( m, (uint64_t) ticks );
+    }
+}
+
+/* See internal.h for details. */
+int __ewma_due( __metrics_t *m, struct timespec *due )
+{
+    if( 0 == __atomic_load_n(&m->has_ewmas, __ATOMIC_RELAXED) ) {
+        return 0;
+    }
+
+    due->tv_sec = m->ewma_ticked.tv_sec + EWMA_TICK_MS / 1000;
+    due->tv_nsec = m->ewma_ticked.tv_nsec + (EWMA_TICK_MS % 1000) * 1000000;
+    if( 1000000000 <= due->tv_nsec ) {
+        due->tv_sec++;
+        due->tv_nsec -= 1000000000;
+    }
+
+    return 1;
+}
+
+/* See internal.h for details. */
+void __ewma_advance( __metrics_t *m, uint64_t ticks )
+{
+    trie_visit( m->ewmas, "", __advance, &ticks );
+}
+
+/* See internal.h for details. */
+int __snapshot_ewmas( __metrics_t *m, struct snapshot *s, const char *prefix )
+{
+    struct trie_it *it;
+    size_t n, i;
+
+    s->ewma_count = 0;
+
+    it = trie_it_create( m->ewmas, prefix );
+    if( NULL == it ) {
+        return -1;
+    }
+
+    for( ; 0 == trie_it_done(it); trie_it_next(it) ) {
+        const struct ewma *e = (const struct ewma*) trie_it_data( it );
+
+        if( s->ewma_count == s->ewma_len ) {
+            size_t len = (0 == s->ewma_len) ? DEFAULT_EWMA_SIZE
+                                            : 2 * s->ewma_len;
+            const struct ewma **p;
+            double *r;
+
+            p = (const struct ewma**) realloc( s->ewmas,
+                                               len * sizeof(struct ewma*) );
+            if( NULL == p ) {
+                break;
+            }
+            s->ewmas = p;
+
+            r = (double*) realloc( s->ewma_rates,
+                                   len * EWMA_WINDOWS * sizeof(double) );
+            if( NULL == r ) {
+                break;
+            }
+            s->ewma_rates = r;
+            s->ewma_len = len;
+        }
+
+        s->ewmas[s->ewma_count++] = e;
+    }
+
+    if( (0 == trie_it_done(it)) || (0 != trie_it_error(it)) ) {
+        trie_it_free( it );
+        s->ewma_count = 0;
+        return -1;
+    }
+    trie_it_free( it );
+
+    /* "a_b" sorts between "a" and "a{", so put each family together. */
+    if( 1 < s->ewma_count ) {
+        qsort( s->ewmas, s->ewma_count, sizeof(struct ewma*), __by_family );
+    }
+
+    for( n = 0; n < s->ewma_count; n++ ) {
+        for( i = 0; i < EWMA_WINDOWS; i++ ) {
+            __atomic_load( &s->ewmas[n]->rates[i],
+                           &s->ewma_rates[n * EWMA_WINDOWS + i],
+                           __ATOMIC_RELAXED );
+        }
+    }
+
+    return 0;
+}
+
+/* See internal.h for details. */
+void __ewmas_forked( __metrics_t *m )
+{
+    trie_visit( m->ewmas, "", __restart, NULL );
+    clock_gettime( CLOCK_MONOTONIC, &m->ewma_ticked );
+}
+
+/* See internal.h for details. */
+void __ewmas_destroy( __metrics_t *m )
+{
+    trie_visit( m->ewmas, "", __destroyer, NULL );
+    trie_free( m->ewmas );
+    m->ewmas = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Finds or creates the moving average of a complete name.
+ */
+static struct ewma* __unsafe_ewma( __metrics_t *m, const char *name )
+{
+    size_t len = strlen( name );
+    const char *brace;
+    struct ewma *e;
+
+    e = (struct ewma*) trie_search( m->ewmas, name );
+    if( NULL != e ) {
+        return e;
+    }
+
+    e = (struct ewma*) calloc( 1, sizeof(struct ewma) + len + 1 );
+    if( NULL == e ) {
+        return NULL;
+    }
+    brace = strchr( name, '{' );
+    e->family_len = (NULL == brace) ? len : (size_t) (brace - name);
+    e->len = len;
+    memcpy( e->name, name, len + 1 );
+
+    if( 0 != trie_insert(m->ewmas, name, e) ) {
+        free( e );
+        return NULL;
+    }
+    __atomic_store_n( &m->has_ewmas, 1, __ATOMIC_RELAXED );
+
+    return e;
+}
+
+/**
+ *  Applies the ticks to one moving average.  The marks since the last tick
+ *  are spread evenly over the ticks, and the first tick starts the averages
+ *  at that rate rather than at 0.
+ */
+static int __advance( const char *key, void *data, void *arg )
+{
+    struct ewma *e = (struct ewma*) data;
+    uint64_t ticks = *((uint64_t*) arg);
+    uint64_t count;
+    double rate, instant;
+    uint64_t t;
+    size_t i;
+
+    (void) key;
+
+    count = __atomic_exchange_n( &e->pending, 0, __ATOMIC_RELAXED );
+    instant = (double) count * 1000.0 / (double) (ticks * EWMA_TICK_MS);
+
+    for( i = 0; i < EWMA_WINDOWS; i++ ) {
+        if( 0 == e->started ) {
+            rate = instant;
+        } else {
+            __atomic_load( &e->rates[i], &rate, __ATOMIC_RELAXED );
+            for( t = 0; t < ticks; t++ ) {
+                rate += __alphas[i] * (instant - rate);
+            }
+        }
+        __atomic_store( &e->rates[i], &rate, __ATOMIC_RELAXED );
+    }
+    e->started = 1;
+
+    return 0;
+}
+
+/**
+ *  Orders moving averages by family name, then by complete name.
+ */
+static int __by_family( const void *a, const void *b )
+{
+    const struct ewma *x = *((const struct ewma* const*) a);
+    const struct ewma *y = *((const struct ewma* const*) b);
+    size_t len = (x->family_len < y->family_len) ? x->family_len
+                                                 : y->family_len;
+    int rv;
+
+    rv = memcmp( x->name, y->name, len );
+    if( 0 == rv ) {
+        rv = (x->family_len > y->family_len) - (x->family_len < y->family_len);
+    }
+    if( 0 == rv ) {
+        rv = strcmp( x->name, y->name );
+    }
+
+    return rv;
+}
+
+/**
+ *  Forgets everything a moving average has seen.
+ */
+static int __restart( const char *key, void *data, void *arg )
+{
+    struct ewma *e = (struct ewma*) data;
+    size_t i;
+
+    (void) key;
+    (void) arg;
+
+    e->pending = 0;
+    for( i = 0; i < EWMA_WINDOWS; i++ ) {
+        e->rates[i] = 0.0;
+    }
+    e->started = 0;
+
+    return 0;
+}
+
+static int __destroyer( const char *key, void *data, void *arg )
+{
+    (void) key;
+    (void) arg;
+
+    free( data );
+
+    return 0;
+}
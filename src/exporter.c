@@ -0,0 +1,948 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+#define DEFAULT_REPORT_SIZE             1024
+#define BUFFER_SIZE_INCREASE            1024
+
+/* The longest decimal uint64_t/int64_t plus the sign; a %.6g double is
+ * shorter. */
+#define MAX_VALUE_LENGTH                21
+
+/* The rendered text is compressed whenever this much has built up, so the
+ * whole uncompressed report is never held in memory. */
+#define COMPRESS_CHUNK_SIZE             (64 * 1024)
+
+#define COMPRESSED_SUFFIX               ".gz"
+
+#define BINARY_MAGIC                    "MTRK"
+#define BINARY_VERSION                  1
+
+/* Where the number of series is in the header: after the magic and version. */
+#define BINARY_COUNT_OFFSET             8
+
+/* The largest datagram sent; the DogStatsD recommendation for UNIX sockets. */
+#define STATSD_PACKET_SIZE              8192
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+struct file_exporter {
+    struct metrics_exporter e;
+
+    char *filename;
+
+    /* Only set for the default exporter, used to record the buffer size. */
+    __metrics_t *m;
+
+    const char *base;
+    size_t base_len;
+
+    char *buf;
+    size_t len;
+    size_t used;
+
+    /* Writes the reports asynchronously if set, see uring.c */
+    struct uring_writer *uring;
+
+    /* Set when the report is compressed: the z_stream, and the compressed
+     * report that is written instead of buf. */
+    void *z;
+    char *out;
+    size_t out_len;
+    size_t out_used;
+};
+
+struct statsd_exporter {
+    struct metrics_exporter e;
+
+    int fd;
+    struct sockaddr_un addr;
+    int dogstatsd;
+
+    /* The counter values sent in the previous report, by name. */
+    struct trie *previous;
+
+    const char *base;
+    size_t base_len;
+
+    char packet[STATSD_PACKET_SIZE];
+    size_t used;
+};
+
+struct callback_exporter {
+    struct metrics_exporter e;
+
+    int (*fn)( void*, const char*, const struct metrics_series* );
+    void *arg;
+    const char *base;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct file_exporter* __file_exporter_create( const char*, size_t );
+static int __file_reserve( struct file_exporter*, size_t );
+static int __file_flush( void* );
+static void __file_destroy( void* );
+static int __compress_init( struct file_exporter*, int );
+static int __compress( struct file_exporter*, int );
+
+static int __text_begin( void*, const char*, size_t );
+static int __text_series( void*, const struct metrics_series* );
+
+static int __binary_begin( void*, const char*, size_t );
+static int __binary_series( void*, const struct metrics_series* );
+
+static int __statsd_begin( void*, const char*, size_t );
+static void __statsd_append( struct statsd_exporter*, const char*, size_t );
+static size_t __statsd_name( struct statsd_exporter*,
+                             const struct metrics_series*, char*, size_t,
+                             const char**, size_t* );
+static size_t __statsd_tags( const char*, size_t, char*, size_t );
+static char __statsd_unescape( const char**, const char* );
+static int __statsd_series( void*, const struct metrics_series* );
+static int __statsd_flush( void* );
+static void __statsd_destroy( void* );
+static int __destroyer( const char*, void*, void* );
+
+static int __callback_begin( void*, const char*, size_t );
+static int __callback_series( void*, const struct metrics_series* );
+static void __callback_destroy( void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+struct metrics_exporter* metrics_exporter_text_file( const char *filename )
+{
+    return __text_exporter_create( filename, 0, NULL );
+}
+
+/* See internal.h for details. */
+struct metrics_exporter* __text_exporter_create( const char *filename,
+                                                 size_t initial_size,
+                                                 __metrics_t *m )
+{
+    struct file_exporter *f;
+
+    f = __file_exporter_create( filename, initial_size );
+    if( NULL == f ) {
+        return NULL;
+    }
+
+    f->m = m;
+    f->e.begin = __text_begin;
+    f->e.series = __text_series;
+
+    if( (NULL != m) && (0 != m->c->compression_level) &&
+        (0 != __compress_init(f, m->c->compression_level)) )
+    {
+        __file_destroy( f );
+        return NULL;
+    }
+
+    if( (NULL != m) && (0 != m->c->async_file_io) ) {
+        f->uring = __uring_writer_create( f->filename );
+    }
+
+    if( NULL != m ) {
+        /* Record the report buffer size as metrics */
+        metrics_gauge_set_labels( (metrics_t) m, "metrics_report_buffer",
+                                  f->len, 1, "size", "default" );
+        metrics_gauge_set( (metrics_t) m, m->label__report_buffer, f->len );
+    }
+
+    return &f->e;
+}
+
+/* See internal.h for details. */
+size_t __text_line_size( size_t base_len, const struct metrics_series *s )
+{
+    /* header base '_' name ' ' value ' ' timestamp '\n' '\0' */
+    return s->header_len + base_len + s->name_len + 2 * MAX_VALUE_LENGTH + 5;
+}
+
+/* See internal.h for details. */
+size_t __text_line( char *buf, const char *base, size_t base_len,
+                    const struct metrics_series *s )
+{
+    char *p = buf;
+    int written;
+
+    if( NULL != s->header ) {
+        memcpy( p, s->header, s->header_len );
+        p += s->header_len;
+    }
+    if( 0 < base_len ) {
+        memcpy( p, base, base_len );
+        p += base_len;
+        *p++ = '_';
+    }
+    memcpy( p, s->name, s->name_len );
+    p += s->name_len;
+
+    if( METRICS_COUNTER == s->type ) {
+        written = sprintf( p, " %"PRIu64, s->value.counter );
+    } else if( METRICS_RATE == s->type ) {
+        written = sprintf( p, " %.6g", s->value.rate );
+    } else {
+        written = sprintf( p, " %"PRId64, s->value.gauge );
+    }
+    p += written;
+
+    if( 0 != s->timestamp_ms ) {
+        p += sprintf( p, " %"PRIu64, s->timestamp_ms );
+    }
+    *p++ = '\n';
+    *p = '\0';
+
+    return p - buf;
+}
+
+/* See metrics.h for details. */
+struct metrics_exporter* metrics_exporter_binary_file( const char *filename )
+{
+    struct file_exporter *f;
+
+    f = __file_exporter_create( filename, 0 );
+    if( NULL == f ) {
+        return NULL;
+    }
+
+    f->e.begin = __binary_begin;
+    f->e.series = __binary_series;
+
+    return &f->e;
+}
+
+/* See metrics.h for details. */
+struct metrics_exporter* metrics_exporter_statsd( const char *socket_path,
+                                                  int dogstatsd )
+{
+    struct statsd_exporter *s;
+
+    if( (NULL == socket_path) ||
+        (sizeof(s->addr.sun_path) <= strlen(socket_path)) )
+    {
+        return NULL;
+    }
+
+    s = (struct statsd_exporter*) malloc( sizeof(struct statsd_exporter) );
+    if( NULL == s ) {
+        return NULL;
+    }
+    memset( s, 0, sizeof(struct statsd_exporter) );
+
+    s->fd = socket( AF_UNIX, SOCK_DGRAM, 0 );
+    s->previous = trie_create();
+    if( (-1 == s->fd) || (NULL == s->previous) ) {
+        if( -1 != s->fd ) {
+            close( s->fd );
+        }
+        if( NULL != s->previous ) {
+            trie_free( s->previous );
+        }
+        free( s );
+        return NULL;
+    }
+
+    s->addr.sun_family = AF_UNIX;
+    strcpy( s->addr.sun_path, socket_path );
+    s->dogstatsd = dogstatsd;
+
+    s->e.ctx = s;
+    s->e.begin = __statsd_begin;
+    s->e.series = __statsd_series;
+    s->e.end = __statsd_flush;
+    s->e.flush = __statsd_flush;
+    s->e.destroy = __statsd_destroy;
+
+    return &s->e;
+}
+
+/* See metrics.h for details. */
+struct metrics_exporter* metrics_exporter_callback(
+                int (*fn)( void *arg, const char *base,
+                           const struct metrics_series *s ),
+                void *arg )
+{
+    struct callback_exporter *c;
+
+    if( NULL == fn ) {
+        return NULL;
+    }
+
+    c = (struct callback_exporter*) malloc( sizeof(struct callback_exporter) );
+    if( NULL == c ) {
+        return NULL;
+    }
+    memset( c, 0, sizeof(struct callback_exporter) );
+
+    c->fn = fn;
+    c->arg = arg;
+
+    c->e.ctx = c;
+    c->e.begin = __callback_begin;
+    c->e.series = __callback_series;
+    c->e.destroy = __callback_destroy;
+
+    return &c->e;
+}
+
+/* See metrics.h for details. */
+void metrics_exporter_destroy( struct metrics_exporter *e )
+{
+    if( (NULL != e) && (NULL != e->destroy) ) {
+        e->destroy( e->ctx );
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------- File Exporters -------------------------------*/
+
+static struct file_exporter* __file_exporter_create( const char *filename,
+                                                     size_t initial_size )
+{
+    struct file_exporter *f;
+
+    if( NULL == filename ) {
+        return NULL;
+    }
+
+    f = (struct file_exporter*) malloc( sizeof(struct file_exporter) );
+    if( NULL == f ) {
+        return NULL;
+    }
+    memset( f, 0, sizeof(struct file_exporter) );
+
+    f->len = DEFAULT_REPORT_SIZE;
+    if( 0 < initial_size ) {
+        f->len = initial_size;
+    }
+
+    f->filename = strdup( filename );
+    f->buf = (char*) malloc( f->len * sizeof(char) );
+    if( (NULL == f->filename) || (NULL == f->buf) ) {
+        __file_destroy( f );
+        return NULL;
+    }
+
+    f->e.ctx = f;
+    f->e.flush = __file_flush;
+    f->e.destroy = __file_destroy;
+
+    return f;
+}
+
+/**
+ *  Makes sure there are at least needed bytes free in the buffer.
+ */
+static int __file_reserve( struct file_exporter *f, size_t needed )
+{
+    size_t len;
+    char *tmp;
+
+    if( f->used + needed <= f->len ) {
+        return 0;
+    }
+
+    len = f->len + BUFFER_SIZE_INCREASE;
+    if( len < f->used + needed ) {
+        len = f->used + needed + BUFFER_SIZE_INCREASE;
+    }
+
+    tmp = (char*) realloc( f->buf, len * sizeof(char) );
+    if( NULL == tmp ) {
+        return -1;
+    }
+    f->buf = tmp;
+    f->len = len;
+
+    if( NULL != f->m ) {
+        metrics_gauge_set( (metrics_t) f->m, f->m->label__report_buffer,
+                           f->len );
+    }
+
+    return 0;
+}
+
+static int __file_flush( void *ctx )
+{
+    struct file_exporter *f = (struct file_exporter*) ctx;
+    char **buf = &f->buf;
+    size_t *len = &f->len;
+    size_t used = f->used;
+    int fd;
+
+    if( NULL != f->z ) {
+        if( 0 != __compress(f, 1) ) {
+            return -1;
+        }
+        buf = &f->out;
+        len = &f->out_len;
+        used = f->out_used;
+    }
+
+    if( NULL != f->uring ) {
+        /* The result is that of the previous report's write. */
+        int rv = __uring_writer_wait( f->uring );
+
+        if( 0 == __uring_writer_submit(f->uring, buf, len, used) ) {
+            return rv;
+        }
+
+        /* Could not be queued, so write this and later reports directly. */
+        __uring_writer_destroy( f->uring );
+        f->uring = NULL;
+    }
+
+    fd = open( f->filename, O_WRONLY | O_CREAT | O_TRUNC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
+
+    if( -1 == fd ) {
+        return -1;
+    }
+
+    if( used != (size_t) write(fd, *buf, used) ) {
+        close( fd );
+        return -1;
+    }
+
+    close( fd );
+
+    return 0;
+}
+
+static void __file_destroy( void *ctx )
+{
+    struct file_exporter *f = (struct file_exporter*) ctx;
+
+    __uring_writer_destroy( f->uring );
+#ifdef HAVE_ZLIB
+    if( NULL != f->z ) {
+        deflateEnd( (z_stream*) f->z );
+        free( f->z );
+    }
+#endif
+    free( f->out );
+    free( f->filename );
+    free( f->buf );
+    free( f );
+}
+
+/**
+ *  Sets the exporter up to write a gzip file, adding the ".gz" suffix to the
+ *  filename.  Without zlib the report is written uncompressed.
+ */
+static int __compress_init( struct file_exporter *f, int level )
+{
+#ifdef HAVE_ZLIB
+    size_t len = strlen( f->filename );
+    z_stream *z;
+    char *tmp;
+
+    tmp = (char*) realloc( f->filename, len + sizeof(COMPRESSED_SUFFIX) );
+    if( NULL == tmp ) {
+        return -1;
+    }
+    memcpy( &tmp[len], COMPRESSED_SUFFIX, sizeof(COMPRESSED_SUFFIX) );
+    f->filename = tmp;
+
+    z = (z_stream*) malloc( sizeof(z_stream) );
+    if( NULL == z ) {
+        return -1;
+    }
+    memset( z, 0, sizeof(z_stream) );
+
+    if( (level < Z_BEST_SPEED) || (Z_BEST_COMPRESSION < level) ) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
+
+    /* 16 + the default window selects the gzip wrapper. */
+    if( Z_OK != deflateInit2(z, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                             Z_DEFAULT_STRATEGY) )
+    {
+        free( z );
+        return -1;
+    }
+    f->z = z;
+#else
+    (void) f;
+    (void) level;
+#endif
+
+    return 0;
+}
+
+/**
+ *  Compresses the rendered text onto the end of the compressed report and
+ *  empties the text buffer; finish also ends the gzip stream.
+ */
+static int __compress( struct file_exporter *f, int finish )
+{
+#ifdef HAVE_ZLIB
+    z_stream *z = (z_stream*) f->z;
+    int rv;
+
+    z->next_in = (Bytef*) f->buf;
+    z->avail_in = (uInt) f->used;
+
+    do {
+        if( f->out_used == f->out_len ) {
+            size_t len = (0 == f->out_len) ? COMPRESS_CHUNK_SIZE : 2 * f->out_len;
+            char *tmp = (char*) realloc( f->out, len );
+
+            if( NULL == tmp ) {
+                return -1;
+            }
+            f->out = tmp;
+            f->out_len = len;
+        }
+
+        z->next_out = (Bytef*) &f->out[f->out_used];
+        z->avail_out = (uInt) (f->out_len - f->out_used);
+
+        rv = deflate( z, (0 != finish) ? Z_FINISH : Z_NO_FLUSH );
+        if( Z_STREAM_ERROR == rv ) {
+            return -1;
+        }
+
+        f->out_used = f->out_len - z->avail_out;
+    } while( (0 < z->avail_in) || (0 == z->avail_out) ||
+             ((0 != finish) && (Z_STREAM_END != rv)) );
+
+    f->used = 0;
+#else
+    (void) f;
+    (void) finish;
+#endif
+
+    return 0;
+}
+
+/*----------------------------- Text Exporter --------------------------------*/
+
+static int __text_begin( void *ctx, const char *base, size_t count )
+{
+    struct file_exporter *f = (struct file_exporter*) ctx;
+
+    (void) count;
+
+    f->base = base;
+    f->base_len = strlen( base );
+    f->used = 0;
+
+#ifdef HAVE_ZLIB
+    if( NULL != f->z ) {
+        deflateReset( (z_stream*) f->z );
+        f->out_used = 0;
+    }
+#endif
+
+    return 0;
+}
+
+static int __text_series( void *ctx, const struct metrics_series *s )
+{
+    struct file_exporter *f = (struct file_exporter*) ctx;
+
+    if( 0 != __file_reserve(f, __text_line_size(f->base_len, s)) ) {
+        return -1;
+    }
+
+    f->used += __text_line( &f->buf[f->used], f->base, f->base_len, s );
+
+    if( (NULL != f->z) && (COMPRESS_CHUNK_SIZE <= f->used) ) {
+        return __compress( f, 0 );
+    }
+
+    return 0;
+}
+
+/*---------------------------- Binary Exporter -------------------------------*/
+
+static int __binary_begin( void *ctx, const char *base, size_t count )
+{
+    struct file_exporter *f = (struct file_exporter*) ctx;
+    uint32_t version = BINARY_VERSION;
+    uint32_t n = (uint32_t) count;
+    uint16_t base_len;
+    char *p;
+
+    f->used = 0;
+    base_len = (uint16_t) strlen( base );
+
+    if( 0 != __file_reserve(f, 4 + 4 + 4 + 2 + base_len) ) {
+        return -1;
+    }
+
+    p = f->buf;
+    memcpy( p, BINARY_MAGIC, 4 );
+    p += 4;
+    memcpy( p, &version, sizeof(version) );
+    p += sizeof(version);
+    memcpy( p, &n, sizeof(n) );
+    p += sizeof(n);
+    memcpy( p, &base_len, sizeof(base_len) );
+    p += sizeof(base_len);
+    memcpy( p, base, base_len );
+    p += base_len;
+
+    f->used = p - f->buf;
+
+    return 0;
+}
+
+static int __binary_series( void *ctx, const struct metrics_series *s )
+{
+    struct file_exporter *f = (struct file_exporter*) ctx;
+    uint8_t type = (uint8_t) s->type;
+    uint16_t name_len = (uint16_t) s->name_len;
+    uint32_t n;
+    char *p;
+
+    /* The name cannot be framed, so the series is left out, and out of the
+     * count of series in the header. */
+    if( UINT16_MAX < s->name_len ) {
+        memcpy( &n, &f->buf[BINARY_COUNT_OFFSET], sizeof(n) );
+        n--;
+        memcpy( &f->buf[BINARY_COUNT_OFFSET], &n, sizeof(n) );
+        return -1;
+    }
+
+    if( 0 != __file_reserve(f, 1 + 2 + name_len + 8) ) {
+        return -1;
+    }
+
+    p = &f->buf[f->used];
+    *p++ = (char) type;
+    memcpy( p, &name_len, sizeof(name_len) );
+    p += sizeof(name_len);
+    memcpy( p, s->name, name_len );
+    p += name_len;
+    memcpy( p, &s->value.counter, sizeof(uint64_t) );
+    p += sizeof(uint64_t);
+
+    f->used = p - f->buf;
+
+    return 0;
+}
+
+/*---------------------------- StatsD Exporter -------------------------------*/
+
+static int __statsd_begin( void *ctx, const char *base, size_t count )
+{
+    struct statsd_exporter *s = (struct statsd_exporter*) ctx;
+
+    (void) count;
+
+    s->base = base;
+    s->base_len = strlen( base );
+    s->used = 0;
+
+    return 0;
+}
+
+/**
+ *  Appends a line to the pending packet, sending the packet first if the line
+ *  does not fit.
+ */
+static void __statsd_append( struct statsd_exporter *s, const char *line,
+                             size_t len )
+{
+    if( STATSD_PACKET_SIZE < len ) {
+        /* Can never be sent. */
+        return;
+    }
+
+    if( STATSD_PACKET_SIZE < s->used + len ) {
+        __statsd_flush( s );
+    }
+
+    memcpy( &s->packet[s->used], line, len );
+    s->used += len;
+}
+
+/**
+ *  Writes the statsd name for the series: the base, the name without labels
+ *  and (for plain statsd) the label values.  Returns the number of bytes
+ *  written, or 0 if it does not fit.  The labels are left in *labels for the
+ *  DogStatsD tags.
+ */
+static size_t __statsd_name( struct statsd_exporter *s,
+                             const struct metrics_series *series,
+                             char *buf, size_t len,
+                             const char **labels, size_t *labels_len )
+{
+    const char *brace;
+    size_t name_len;
+    size_t used = 0;
+
+    brace = memchr( series->name, '{', series->name_len );
+    name_len = (NULL == brace) ? series->name_len : (size_t) (brace - series->name);
+
+    *labels = brace;
+    *labels_len = (NULL == brace) ? 0 : series->name_len - name_len;
+
+    if( len < s->base_len + 1 + name_len ) {
+        return 0;
+    }
+
+    if( 0 < s->base_len ) {
+        memcpy( buf, s->base, s->base_len );
+        used = s->base_len;
+        buf[used++] = '_';
+    }
+    memcpy( &buf[used], series->name, name_len );
+    used += name_len;
+
+    if( (0 == s->dogstatsd) && (NULL != brace) ) {
+        const char *p = brace;
+        const char *end = series->name + series->name_len;
+        int in_value = 0;
+
+        /* Append each "value" as .value */
+        for( ; p < end; p++ ) {
+            if( len <= used + 1 ) {
+                return 0;
+            }
+
+            if( '"' == *p ) {
+                in_value = !in_value;
+                if( in_value ) {
+                    buf[used++] = '.';
+                }
+            } else if( in_value ) {
+                buf[used++] = __statsd_unescape( &p, end );
+            }
+        }
+    }
+
+    return used;
+}
+
+/**
+ *  Writes the DogStatsD tags for the labels: |#label:value,label:value
+ */
+static size_t __statsd_tags( const char *labels, size_t labels_len,
+                             char *buf, size_t len )
+{
+    const char *end = labels + labels_len - 1;
+    const char *p;
+    size_t used = 0;
+    int in_value = 0;
+
+    if( len < labels_len + 2 ) {
+        return 0;
+    }
+
+    buf[used++] = '|';
+    buf[used++] = '#';
+
+    /* Skip the braces, drop the quotes and turn = into : */
+    for( p = labels + 1; p < end; p++ ) {
+        if( '"' == *p ) {
+            in_value = !in_value;
+        } else if( in_value ) {
+            buf[used++] = __statsd_unescape( &p, end );
+        } else {
+            buf[used++] = ('=' == *p) ? ':' : *p;
+        }
+    }
+
+    return used;
+}
+
+/**
+ *  Returns the character at *p, undoing the exposition format escaping.  A
+ *  newline would end the StatsD line, so it is replaced.
+ */
+static char __statsd_unescape( const char **p, const char *end )
+{
+    if( ('\\' == **p) && (*p + 1 < end) ) {
+        (*p)++;
+        return ('n' == **p) ? '_' : **p;
+    }
+
+    return **p;
+}
+
+static int __statsd_series( void *ctx, const struct metrics_series *series )
+{
+    struct statsd_exporter *s = (struct statsd_exporter*) ctx;
+    char line[STATSD_PACKET_SIZE];
+    const char *labels;
+    size_t labels_len;
+    size_t name_len, tags_len = 0;
+    char tags[STATSD_PACKET_SIZE];
+    size_t len;
+
+    name_len = __statsd_name( s, series, line, sizeof(line) - MAX_VALUE_LENGTH - 6,
+                              &labels, &labels_len );
+    if( 0 == name_len ) {
+        return -1;
+    }
+
+    if( (0 != s->dogstatsd) && (0 < labels_len) ) {
+        tags_len = __statsd_tags( labels, labels_len, tags, sizeof(tags) );
+    }
+
+    if( METRICS_COUNTER == series->type ) {
+        uint64_t *prev;
+        uint64_t delta;
+
+        prev = (uint64_t*) trie_search( s->previous, series->name );
+        if( NULL == prev ) {
+            prev = (uint64_t*) malloc( sizeof(uint64_t) );
+            if( NULL == prev ) {
+                return -1;
+            }
+            *prev = 0;
+            trie_insert( s->previous, series->name, prev );
+        }
+
+        /* A counter that went backwards was reset. */
+        delta = (*prev <= series->value.counter) ? series->value.counter - *prev
+                                                 : series->value.counter;
+        *prev = series->value.counter;
+
+        if( 0 == delta ) {
+            return 0;
+        }
+
+        len = name_len + sprintf( &line[name_len], ":%"PRIu64"|c", delta );
+    } else if( METRICS_RATE == series->type ) {
+        len = name_len + sprintf( &line[name_len], ":%.6g|g", series->value.rate );
+    } else {
+        if( series->value.gauge < 0 ) {
+            /* A leading - means decrement in statsd; reset to 0 first.  The
+             * reset needs the same tags to reach the same series. */
+            len = name_len + sprintf( &line[name_len], ":0|g" );
+            if( sizeof(line) < len + tags_len + 1 ) {
+                return -1;
+            }
+            memcpy( &line[len], tags, tags_len );
+            len += tags_len;
+            line[len++] = '\n';
+            __statsd_append( s, line, len );
+        }
+        len = name_len + sprintf( &line[name_len], ":%"PRId64"|g", series->value.gauge );
+    }
+
+    if( sizeof(line) < len + tags_len + 1 ) {
+        return -1;
+    }
+    memcpy( &line[len], tags, tags_len );
+    len += tags_len;
+    line[len++] = '\n';
+
+    __statsd_append( s, line, len );
+
+    return 0;
+}
+
+static int __statsd_flush( void *ctx )
+{
+    struct statsd_exporter *s = (struct statsd_exporter*) ctx;
+    ssize_t rv;
+
+    if( 0 == s->used ) {
+        return 0;
+    }
+
+    /* Drop the trailing newline. */
+    rv = sendto( s->fd, s->packet, s->used - 1, MSG_DONTWAIT,
+                 (const struct sockaddr*) &s->addr, sizeof(s->addr) );
+    s->used = 0;
+
+    return (-1 == rv) ? -1 : 0;
+}
+
+static void __statsd_destroy( void *ctx )
+{
+    struct statsd_exporter *s = (struct statsd_exporter*) ctx;
+
+    close( s->fd );
+    trie_visit( s->previous, "", __destroyer, NULL );
+    trie_free( s->previous );
+    free( s );
+}
+
+static int __destroyer( const char *key, void *data, void *arg )
+{
+    (void) key;
+    (void) arg;
+
+    free( data );
+
+    return 0;
+}
+
+/*--------------------------- Callback Exporter ------------------------------*/
+
+static int __callback_begin( void *ctx, const char *base, size_t count )
+{
+    struct callback_exporter *c = (struct callback_exporter*) ctx;
+
+    (void) count;
+
+    c->base = base;
+
+    return 0;
+}
+
+static int __callback_series( void *ctx, const struct metrics_series *s )
+{
+    struct callback_exporter *c = (struct callback_exporter*) ctx;
+
+    return c->fn( c->arg, c->base, s );
+}
+
+static void __callback_destroy( void *ctx )
+{
+    free( ctx );
+}
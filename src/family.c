@@ -0,0 +1,273 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct trie* __families( __metrics_t*, metric_type_t );
+static int __update_header( __metrics_t*, struct family* );
+static size_t __help_escaped_len( const char* );
+static int __destroyer( const char*, void*, void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+int metrics_help( metrics_t __m, metrics_type_t type, const char *name,
+                  const char *help )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct family *f;
+    char *copy;
+    int rv = -1;
+
+    if( &__metrics_disabled == m ) {
+        return 0;
+    }
+
+    if( (NULL == m) || (NULL == name) || (NULL == help) ||
+        (NULL != strchr(name, '{')) )
+    {
+        return -1;
+    }
+
+    copy = strdup( help );
+    if( NULL == copy ) {
+        return -1;
+    }
+
+    pthread_mutex_lock( &m->mutex );
+    f = __unsafe_family( m, (METRICS_COUNTER == type) ? MT_COUNTER : MT_GAUGE,
+                         name, strlen(name) );
+    if( NULL != f ) {
+        /* The previous help is still referenced by the previous header. */
+        f->help = copy;
+        copy = NULL;
+        rv = __update_header( m, f );
+    }
+    pthread_mutex_unlock( &m->mutex );
+
+    free( copy );
+
+    return rv;
+}
+
+/* See internal.h for details. */
+struct family* __unsafe_family( __metrics_t *m, metric_type_t type,
+                                const char *name, size_t len )
+{
+    struct trie *t = __families( m, type );
+    struct family *f;
+    char *key;
+
+    /* name is not '\0' terminated at len when it has labels. */
+    key = (char*) malloc( 2 * (len + 2) );
+    if( NULL == key ) {
+        return NULL;
+    }
+    memcpy( key, name, len );
+    key[len] = '\0';
+
+    f = (struct family*) trie_search( t, key );
+    if( NULL != f ) {
+        free( key );
+        return f;
+    }
+
+    f = (struct family*) malloc( sizeof(struct family) );
+    if( NULL == f ) {
+        free( key );
+        return NULL;
+    }
+
+    /* Store both "name" and "name{" in the same allocation. */
+    f->name = key;
+    f->prefix = &key[len + 1];
+    memcpy( f->prefix, name, len );
+    f->prefix[len] = '{';
+    f->prefix[len + 1] = '\0';
+
+    f->len = len;
+    f->type = type;
+    f->help = NULL;
+    f->header = NULL;
+
+    if( (0 != __update_header(m, f)) || (0 != trie_insert(t, key, f)) ) {
+        __destroyer( NULL, f, NULL );
+        return NULL;
+    }
+
+    return f;
+}
+
+/* See internal.h for details. */
+void __families_destroy( __metrics_t *m )
+{
+    trie_visit( m->counter_families, "", __destroyer, NULL );
+    trie_free( m->counter_families );
+    trie_visit( m->gauge_families, "", __destroyer, NULL );
+    trie_free( m->gauge_families );
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static struct trie* __families( __metrics_t *m, metric_type_t type )
+{
+    return (MT_COUNTER == type) ? m->counter_families : m->gauge_families;
+}
+
+/**
+ *  Builds the exposition header for the family:
+ *
+ *      # HELP base_name help text
+ *      # TYPE base_name counter
+ *
+ *  The header is built once here so rendering is a single memcpy.  A
+ *  previous header stays allocated until shutdown because exporters may be
+ *  rendering it without the lock.
+ */
+static int __update_header( __metrics_t *m, struct family *f )
+{
+    const char *base = (NULL != m->c->base) ? m->c->base : "";
+    const char *type = (MT_COUNTER == f->type) ? "counter" : "gauge";
+    size_t base_len = strlen( base );
+    size_t name_len = base_len + ((0 < base_len) ? 1 : 0) + f->len;
+    size_t len;
+    struct header *h;
+    char *p;
+    const char *s;
+
+    /* "# TYPE " name ' ' type '\n' */
+    len = 7 + name_len + 1 + strlen( type ) + 1;
+    if( NULL != f->help ) {
+        /* "# HELP " name ' ' help '\n' */
+        len += 7 + name_len + 1 + __help_escaped_len( f->help ) + 1;
+    }
+
+    h = (struct header*) malloc( sizeof(struct header) + len + 1 );
+    if( NULL == h ) {
+        return -1;
+    }
+
+    h->prev = f->header;
+    h->help = f->help;
+    h->len = len;
+
+    p = h->text;
+    if( NULL != f->help ) {
+        memcpy( p, "# HELP ", 7 );
+        p += 7;
+        if( 0 < base_len ) {
+            memcpy( p, base, base_len );
+            p += base_len;
+            *p++ = '_';
+        }
+        memcpy( p, f->name, f->len );
+        p += f->len;
+        *p++ = ' ';
+        for( s = f->help; '\0' != *s; s++ ) {
+            if( '\\' == *s ) {
+                *p++ = '\\';
+                *p++ = '\\';
+            } else if( '\n' == *s ) {
+                *p++ = '\\';
+                *p++ = 'n';
+            } else {
+                *p++ = *s;
+            }
+        }
+        *p++ = '\n';
+    }
+
+    memcpy( p, "# TYPE ", 7 );
+    p += 7;
+    if( 0 < base_len ) {
+        memcpy( p, base, base_len );
+        p += base_len;
+        *p++ = '_';
+    }
+    memcpy( p, f->name, f->len );
+    p += f->len;
+    *p++ = ' ';
+    strcpy( p, type );
+    p += strlen( type );
+    *p++ = '\n';
+    *p = '\0';
+
+    __atomic_store_n( &f->header, h, __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+static size_t __help_escaped_len( const char *s )
+{
+    size_t len = 0;
+
+    for( ; '\0' != *s; s++ ) {
+        len += ( ('\\' == *s) || ('\n' == *s) ) ? 2 : 1;
+    }
+
+    return len;
+}
+
+static int __destroyer( const char *key, void *data, void *arg )
+{
+    struct family *f = (struct family*) data;
+    struct header *h;
+
+    (void) key;
+    (void) arg;
+
+    h = f->header;
+    while( NULL != h ) {
+        struct header *prev = h->prev;
+
+        /* Each help string belongs to the header that introduced it. */
+        if( (NULL == prev) || (prev->help != h->help) ) {
+            free( (char*) h->help );
+        }
+        free( h );
+        h = prev;
+    }
+
+    free( f->name );
+    free( f );
+
+    return 0;
+}
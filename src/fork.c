@@ -0,0 +1,139 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static pthread_once_t __atfork_once = PTHREAD_ONCE_INIT;
+
+/* Every live registry, linked through fork_next. */
+static pthread_mutex_t __registries_lock = PTHREAD_MUTEX_INITIALIZER;
+static __metrics_t *__registries = NULL;
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static void __atfork_init( void );
+static void __prepare( void );
+static void __parent( void );
+static void __child( void );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+void __fork_register( __metrics_t *m )
+{
+    pthread_once( &__atfork_once, __atfork_init );
+
+    pthread_mutex_lock( &__registries_lock );
+    m->fork_next = __registries;
+    __registries = m;
+    pthread_mutex_unlock( &__registries_lock );
+}
+
+/* See internal.h for details. */
+void __fork_unregister( __metrics_t *m )
+{
+    __metrics_t **p;
+
+    pthread_mutex_lock( &__registries_lock );
+    for( p = &__registries; NULL != *p; p = &(*p)->fork_next ) {
+        if( m == *p ) {
+            *p = m->fork_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &__registries_lock );
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static void __atfork_init( void )
+{
+    pthread_atfork( __prepare, __parent, __child );
+}
+
+/**
+ *  Takes every lock so the child gets a consistent copy of each registry.
+ *  The order matches the rest of the library: the shared reporter's locks
+ *  are never held while taking a registry's mutex.
+ */
+static void __prepare( void )
+{
+    __metrics_t *m;
+
+    pthread_mutex_lock( &__registries_lock );
+    __reporter_fork_prepare();
+    for( m = __registries; NULL != m; m = m->fork_next ) {
+        pthread_mutex_lock( &m->mutex );
+    }
+}
+
+static void __parent( void )
+{
+    __metrics_t *m;
+
+    for( m = __registries; NULL != m; m = m->fork_next ) {
+        pthread_mutex_unlock( &m->mutex );
+    }
+    __reporter_fork_parent();
+    pthread_mutex_unlock( &__registries_lock );
+}
+
+/**
+ *  Only the forking thread exists in the child, so the locks are initialized
+ *  again rather than unlocked, and every thread the library owns is started
+ *  again.
+ */
+static void __child( void )
+{
+    __metrics_t *m;
+
+    pthread_mutex_init( &__registries_lock, NULL );
+    __reporter_fork_child();
+
+    for( m = __registries; NULL != m; m = m->fork_next ) {
+        pthread_mutex_init( &m->mutex, NULL );
+        m->forked = 1;
+
+        __unsafe_thread_rings_forked( m );
+        __unsafe_values_forked( m );
+        __scrape_forked( m );
+        __persist_destroy( m );
+        __procfs_forked( m );
+        __ewmas_forked( m );
+        __distincts_forked( m );
+        __topks_forked( m );
+        __reporter_forked( m );
+    }
+}
@@ -0,0 +1,472 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The average number of keys per bucket. */
+#define MPH_LAMBDA          4
+
+/* How many seeds are tried before giving up, and how many displacements a
+ * bucket is tried with under each seed, per slot of the table. */
+#define MPH_SEEDS           16
+#define MPH_TRIES           64
+
+#define MPH_PRIME_1         0x9e3779b97f4a7c15ULL
+#define MPH_PRIME_2         0xff51afd7ed558ccdULL
+#define MPH_PRIME_3         0xc4ceb9fe1a85ec53ULL
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* Where the keys of a bucket go: key i with hashes h1, h2 is in slot
+ * (h1 + d0 * h2 + d1) % count. */
+struct displacement {
+    uint32_t d0;
+    uint32_t d1;
+};
+
+/* A minimal perfect hash of a fixed set of series names (CHD): every name
+ * hashes to a bucket, and each bucket has the displacement that puts all of
+ * its names in free slots.  With count slots for count names, a lookup is
+ * one hash, one probe and one compare. */
+struct mph {
+    uint64_t seed;
+    size_t count;
+    size_t buckets;
+    struct displacement *displacements;
+    struct series **series;
+};
+
+/* The tables built by metrics_freeze().  Lookups may still be using an
+ * earlier one, so they are all kept until shutdown. */
+struct frozen {
+    struct frozen *prev;
+    struct mph counters;
+    struct mph gauges;
+};
+
+/* The hashes of a name under a seed. */
+struct mph_key {
+    uint32_t bucket;
+    uint32_t h1;
+    uint32_t h2;
+};
+
+/* A bucket during the build. */
+struct mph_bucket {
+    uint32_t bucket;
+    uint32_t size;
+    uint32_t first;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct series** __unsafe_collect( struct trie*, size_t* );
+static int __build( struct mph*, struct series**, size_t );
+static int __try( struct mph*, struct series**, size_t, uint64_t );
+static int __place( struct mph*, const struct mph_key*, const uint32_t*,
+                    const struct mph_bucket*, uint8_t*, uint32_t*,
+                    struct series**, size_t* );
+static struct series* __mph_search( const struct mph*, const char* );
+static void __key( const char*, uint64_t, size_t, size_t, struct mph_key* );
+static uint64_t __mix( uint64_t );
+static uint32_t __reduce( uint64_t, size_t );
+static int __by_size( const void*, const void* );
+static void __mph_destroy( struct mph* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+int metrics_freeze( metrics_t __m )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct series **counters, **gauges;
+    size_t counter_count, gauge_count;
+    struct frozen *f;
+    int rv = -1;
+
+    if( NULL == m ) {
+        return -1;
+    }
+    if( &__metrics_disabled == m ) {
+        return 0;
+    }
+
+    f = (struct frozen*) calloc( 1, sizeof(struct frozen) );
+    if( NULL == f ) {
+        return -1;
+    }
+
+    pthread_mutex_lock( &m->mutex );
+    counters = __unsafe_collect( m->counters, &counter_count );
+    gauges = __unsafe_collect( m->gauges, &gauge_count );
+    pthread_mutex_unlock( &m->mutex );
+
+    /* Series added from here on are found in the tries. */
+    if( (NULL != counters) && (NULL != gauges) &&
+        (0 == __build(&f->counters, counters, counter_count)) &&
+        (0 == __build(&f->gauges, gauges, gauge_count)) )
+    {
+        pthread_mutex_lock( &m->mutex );
+        f->prev = m->frozen;
+        __atomic_store_n( &m->frozen, f, __ATOMIC_RELEASE );
+        pthread_mutex_unlock( &m->mutex );
+        rv = 0;
+    } else {
+        __mph_destroy( &f->counters );
+        __mph_destroy( &f->gauges );
+        free( f );
+    }
+
+    free( counters );
+    free( gauges );
+
+    return rv;
+}
+
+/* See internal.h for details. */
+struct series* __search( __metrics_t *m, metric_type_t type, const char *name )
+{
+    struct frozen *f = __atomic_load_n( &m->frozen, __ATOMIC_ACQUIRE );
+    struct series *s;
+
+    if( NULL != f ) {
+        s = __mph_search( (MT_COUNTER == type) ? &f->counters : &f->gauges,
+                          name );
+        if( NULL != s ) {
+            return s;
+        }
+    }
+
+    return (struct series*) trie_search( (MT_COUNTER == type) ? m->counters :
+                                                                m->gauges,
+                                         name );
+}
+
+/* See internal.h for details. */
+void __frozen_destroy( __metrics_t *m )
+{
+    struct frozen *f = m->frozen;
+
+    while( NULL != f ) {
+        struct frozen *prev = f->prev;
+
+        __mph_destroy( &f->counters );
+        __mph_destroy( &f->gauges );
+        free( f );
+        f = prev;
+    }
+    m->frozen = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Copies the series of a trie into an array.  The caller must hold
+ *  m->mutex.
+ */
+static struct series** __unsafe_collect( struct trie *t, size_t *count )
+{
+    struct series **rv;
+    struct trie_it *it;
+    size_t i = 0;
+
+    *count = trie_count( t, "" );
+    rv = (struct series**) malloc( (*count + 1) * sizeof(struct series*) );
+    if( NULL == rv ) {
+        return NULL;
+    }
+
+    it = trie_it_create( t, "" );
+    if( NULL == it ) {
+        free( rv );
+        return NULL;
+    }
+    for( ; (0 == trie_it_done(it)) && (i < *count); trie_it_next(it) ) {
+        rv[i++] = (struct series*) trie_it_data( it );
+    }
+    trie_it_free( it );
+    *count = i;
+
+    return rv;
+}
+
+/**
+ *  Builds the table for the series, trying a few seeds.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+static int __build( struct mph *t, struct series **series, size_t count )
+{
+    size_t i;
+
+    memset( t, 0, sizeof(struct mph) );
+    if( 0 == count ) {
+        return 0;
+    }
+    if( UINT32_MAX <= count ) {
+        return -1;
+    }
+
+    for( i = 0; i < MPH_SEEDS; i++ ) {
+        if( 0 == __try(t, series, count, (i + 1) * MPH_PRIME_1) ) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ *  Builds the table with one seed: the buckets are placed largest first,
+ *  while there is the most room.
+ *
+ *  @return 0 on success, non-zero if a bucket could not be placed or on
+ *          allocation failure
+ */
+static int __try( struct mph *t, struct series **series, size_t count,
+                  uint64_t seed )
+{
+    size_t buckets = (count + MPH_LAMBDA - 1) / MPH_LAMBDA;
+    struct mph_key *keys;
+    struct mph_bucket *b;
+    uint32_t *order, *slots;
+    uint8_t *taken;
+    size_t i, max = 0, free_slot = 0;
+    int rv = 0;
+
+    keys = (struct mph_key*) malloc( count * sizeof(struct mph_key) );
+    order = (uint32_t*) malloc( count * sizeof(uint32_t) );
+    b = (struct mph_bucket*) calloc( buckets, sizeof(struct mph_bucket) );
+    taken = (uint8_t*) calloc( count, sizeof(uint8_t) );
+    t->displacements = (struct displacement*)
+                            calloc( buckets, sizeof(struct displacement) );
+    t->series = (struct series**) malloc( count * sizeof(struct series*) );
+    if( (NULL == keys) || (NULL == order) || (NULL == b) || (NULL == taken) ||
+        (NULL == t->displacements) || (NULL == t->series) )
+    {
+        rv = -1;
+        goto done;
+    }
+    t->seed = seed;
+    t->count = count;
+    t->buckets = buckets;
+
+    /* Group the keys by bucket. */
+    for( i = 0; i < count; i++ ) {
+        __key( series[i]->name, seed, buckets, count, &keys[i] );
+        b[keys[i].bucket].size++;
+    }
+    for( i = 0; i < buckets; i++ ) {
+        b[i].bucket = (uint32_t) i;
+        b[i].first = (uint32_t) max;
+        max += b[i].size;
+        b[i].size = 0;
+    }
+    for( i = 0; i < count; i++ ) {
+        struct mph_bucket *k = &b[keys[i].bucket];
+
+        order[k->first + k->size++] = (uint32_t) i;
+    }
+
+    qsort( b, buckets, sizeof(struct mph_bucket), __by_size );
+
+    slots = (uint32_t*) malloc( b[0].size * sizeof(uint32_t) );
+    if( NULL == slots ) {
+        rv = -1;
+        goto done;
+    }
+    for( i = 0; (0 == rv) && (i < buckets) && (0 < b[i].size); i++ ) {
+        rv = __place( t, keys, order, &b[i], taken, slots, series,
+                      &free_slot );
+    }
+    free( slots );
+
+done:
+    free( keys );
+    free( order );
+    free( b );
+    free( taken );
+    if( 0 != rv ) {
+        __mph_destroy( t );
+    }
+
+    return rv;
+}
+
+/**
+ *  Finds a displacement that puts every key of the bucket in a free slot,
+ *  and puts them there.
+ *
+ *  @return 0 on success, non-zero if there is none within MPH_TRIES per slot
+ */
+static int __place( struct mph *t, const struct mph_key *keys,
+                    const uint32_t *order, const struct mph_bucket *b,
+                    uint8_t *taken, uint32_t *slots, struct series **series,
+                    size_t *free_slot )
+{
+    uint64_t tries = (uint64_t) MPH_TRIES * t->count;
+    uint64_t n;
+    uint32_t d0, d1, i, j;
+
+    if( 1 == b->size ) {
+        /* Any free slot will do; single key buckets come last, so this is
+         * where most of the table is taken. */
+        while( 0 != taken[*free_slot] ) {
+            (*free_slot)++;
+        }
+        taken[*free_slot] = 1;
+        t->displacements[b->bucket].d0 = 0;
+        t->displacements[b->bucket].d1 =
+            (uint32_t) ((*free_slot + t->count - keys[order[b->first]].h1) %
+                        t->count);
+        t->series[*free_slot] = series[order[b->first]];
+        return 0;
+    }
+
+    for( n = 0; n < tries; n++ ) {
+        /* Both run over every slot, so every slot is tried for each key. */
+        d0 = (uint32_t) (n % t->count);
+        d1 = (uint32_t) ((n / t->count) % t->count);
+
+        for( i = 0; i < b->size; i++ ) {
+            const struct mph_key *k = &keys[order[b->first + i]];
+
+            slots[i] = (uint32_t) ((k->h1 + (uint64_t) d0 * k->h2 + d1) %
+                                   t->count);
+            if( 0 != taken[slots[i]] ) {
+                break;
+            }
+            taken[slots[i]] = 1;
+        }
+
+        if( i == b->size ) {
+            t->displacements[b->bucket].d0 = d0;
+            t->displacements[b->bucket].d1 = d1;
+            for( j = 0; j < b->size; j++ ) {
+                t->series[slots[j]] = series[order[b->first + j]];
+            }
+            return 0;
+        }
+
+        for( j = 0; j < i; j++ ) {
+            taken[slots[j]] = 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ *  Looks a name up in the table.
+ *
+ *  @return the series or NULL if the name is not in the table
+ */
+static struct series* __mph_search( const struct mph *t, const char *name )
+{
+    const struct displacement *d;
+    struct mph_key k;
+    struct series *s;
+
+    if( 0 == t->count ) {
+        return NULL;
+    }
+
+    __key( name, t->seed, t->buckets, t->count, &k );
+    d = &t->displacements[k.bucket];
+    s = t->series[(k.h1 + (uint64_t) d->d0 * k.h2 + d->d1) % t->count];
+
+    return (0 == strcmp(s->name, name)) ? s : NULL;
+}
+
+/**
+ *  Hashes a name eight bytes at a time, and derives the bucket and the two
+ *  slot hashes from it.
+ */
+static void __key( const char *name, uint64_t seed, size_t buckets,
+                   size_t count, struct mph_key *k )
+{
+    size_t len = strlen( name );
+    uint64_t h = seed ^ (len * MPH_PRIME_2);
+    uint64_t w;
+
+    for( ; 8 <= len; name += 8, len -= 8 ) {
+        memcpy( &w, name, 8 );
+        h = (h ^ w) * MPH_PRIME_1;
+        h ^= h >> 29;
+    }
+    w = 0;
+    memcpy( &w, name, len );
+    h = __mix( h ^ w );
+
+    k->bucket = __reduce( h, buckets );
+    k->h1 = __reduce( h << 32, count );
+    k->h2 = __reduce( h * MPH_PRIME_1, count );
+}
+
+/**
+ *  The 64 bit finalizer of MurmurHash3.
+ */
+static uint64_t __mix( uint64_t h )
+{
+    h ^= h >> 33;
+    h *= MPH_PRIME_2;
+    h ^= h >> 33;
+    h *= MPH_PRIME_3;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/**
+ *  Maps a hash onto [0, n) with a multiply instead of a division.
+ */
+static uint32_t __reduce( uint64_t h, size_t n )
+{
+    return (uint32_t) (((h >> 32) * (uint64_t) n) >> 32);
+}
+
+static int __by_size( const void *a, const void *b )
+{
+    const struct mph_bucket *x = (const struct mph_bucket*) a;
+    const struct mph_bucket *y = (const struct mph_bucket*) b;
+
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+static void __mph_destroy( struct mph *t )
+{
+    free( t->displacements );
+    free( t->series );
+    memset( t, 0, sizeof(struct mph) );
+}
@@ -0,0 +1,995 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __METRICS_INTERNAL_H__
+#define __METRICS_INTERNAL_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/* The library itself is never built with METRIKS_DISABLED. */
+#define __METRIKS_INTERNAL__
+#include "metrics.h"
+#include "trie/trie.h"
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The 1, 5 and 15 minute moving averages, see ewma.c */
+#define EWMA_WINDOWS    3
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+typedef enum {
+    MT_COUNTER,
+    MT_GAUGE
+} metric_type_t;
+
+/* The cached exposition header of a family.  Headers are replaced (never
+ * modified) when the help text changes and released at shutdown. */
+struct header {
+    struct header *prev;
+    const char *help;
+    size_t len;
+    char text[];
+};
+
+/* A metric family: every series sharing the name before the labels. */
+struct family {
+    /* "name" and "name{" used to find the family's series in the tries. */
+    char *name;
+    char *prefix;
+    size_t len;
+
+    metric_type_t type;
+
+    /* The help text, protected by m->mutex. */
+    char *help;
+
+    /* The current header, published with release semantics so it can be
+     * read without the lock. */
+    struct header *header;
+};
+
+/* The record stored in the tries for every series. */
+struct series {
+    /* Where the value is kept: the series' entry in the value blocks, or the
+     * storage of a metric declared with METRIKS_COUNTER() or METRIKS_GAUGE().
+     * Values are only updated with atomic operations. */
+    uint64_t *slot;
+
+    /* The index of the series in the value blocks, see values.c */
+    size_t id;
+
+    /* Where the time of the last update is kept (see __stamp_now()), or
+     * NULL unless the registry was configured with timestamps. */
+    uint64_t *stamp;
+
+    metric_type_t type;
+
+    /* Set for a counter whose total is sampled from elsewhere (see procfs.c)
+     * rather than added to, so it is neither saved to the persistence file
+     * nor reset in a forked child. */
+    int sampled;
+
+    struct family *family;
+
+    size_t len;
+    char name[];
+};
+
+/* The moving averages of how often something happens, by name. */
+struct ewma {
+    /* The marks since the last tick, only updated with atomic operations. */
+    uint64_t pending;
+
+    /* Marks per second over each window, written by the thread reporting
+     * the registry with atomic stores, and whether they have a value yet. */
+    double rates[EWMA_WINDOWS];
+    int started;
+
+    /* The length of the name before the labels. */
+    size_t family_len;
+
+    size_t len;
+    char name[];
+};
+
+/* A HyperLogLog sketch of the distinct keys added under a name. */
+struct distinct {
+    /* The gauge the estimate is reported as. */
+    struct series *series;
+
+    /* There are 1 << bits registers, each the largest rank seen by the
+     * keys that hash to it, only updated with atomic operations. */
+    int bits;
+    uint8_t registers[];
+};
+
+/* One of the largest keys of a top-K metric, as a series of a snapshot. */
+struct top_entry {
+    /* The name of the top-K metric, shared by its keys. */
+    const char *family;
+    size_t family_len;
+
+    /* The complete name, with the key as the value of the label. */
+    char *name;
+    size_t len;
+
+    int64_t count;
+};
+
+/* A point in time copy of the values of every series, in report order.
+ * Stored as parallel arrays so passes over the values stay contiguous. */
+struct snapshot {
+    size_t count;
+    size_t len;
+
+    /* The counters come first; this is how many there are. */
+    size_t counters;
+
+    /* The registry's series_generation the order of series was built for. */
+    uint64_t generation;
+
+    const struct series **series;
+    uint64_t *values;
+
+    /* Every value by series id, copied from the value blocks in bulk. */
+    size_t ids;
+    size_t ids_len;
+    uint64_t *raw;
+
+    /* The increase since the previous report by series id and the factor
+     * for the rate per second, only valid when has_deltas is set by
+     * __snapshot_deltas().  There are no rates when per_s is 0. */
+    int has_deltas;
+    size_t deltas_len;
+    uint64_t *deltas;
+    double per_s;
+
+    /* The update times by series id and when the snapshot was taken, both
+     * by __stamp_now(), and the wall clock time of the snapshot in
+     * milliseconds since the epoch.  Only valid when the registry was
+     * configured with timestamps. */
+    uint64_t *stamps;
+    uint64_t taken;
+    uint64_t time_ms;
+
+    /* The moving averages in name order and their rates, EWMA_WINDOWS for
+     * each. */
+    size_t ewma_count;
+    size_t ewma_len;
+    const struct ewma **ewmas;
+    double *ewma_rates;
+
+    /* The largest keys of each top-K metric, see topk.c */
+    size_t top_count;
+    size_t top_len;
+    struct top_entry *tops;
+};
+
+struct thread_ring;
+struct uring_writer;
+
+typedef struct metrics_registry {
+    const struct metrics_config *c;
+
+    /* Unique within the process, see label_cache.c */
+    uint64_t id;
+
+    pthread_mutex_t mutex;
+
+    /* The report state, see reporter.c */
+    pthread_t report_thread;
+    pthread_cond_t report_cond;
+    volatile int keep_running;
+    struct timespec report_due;
+    struct snapshot report_snapshot;
+    struct snapshot report_previous;
+    struct timespec report_time;
+    struct metrics_exporter *default_exporter;
+
+    /* The registries served by the shared reporter, protected by its lock. */
+    struct metrics_registry *shared_next;
+    int reporting;
+
+    struct trie *counters;
+    struct trie *gauges;
+
+    /* Incremented whenever a series is added, protected by mutex. */
+    uint64_t series_generation;
+
+    /* The values of every series by id in fixed size blocks, so they are
+     * contiguous and never move, see values.c.  Protected by mutex. */
+    uint64_t **value_blocks;
+    size_t value_blocks_len;
+    size_t value_count;
+
+    /* With fork_shared_values, the ids below this are shared with the parent
+     * of a forked child, which reports them.  Protected by mutex. */
+    size_t shared_ids;
+
+    /* The series whose values live outside the blocks, see static.c */
+    struct series **statics;
+    size_t static_count;
+
+    /* The metric families by name, see family.c */
+    struct trie *counter_families;
+    struct trie *gauge_families;
+
+    /* The perfect hash tables of the series built by metrics_freeze(), see
+     * freeze.c.  Published with release semantics. */
+    struct frozen *frozen;
+
+    /* The moving averages by name, see ewma.c, and when they last ticked by
+     * CLOCK_MONOTONIC.  Only added to with mutex held; has_ewmas is set once
+     * the first one is, so the report thread starts ticking them. */
+    struct trie *ewmas;
+    struct timespec ewma_ticked;
+    int has_ewmas;
+
+    /* The distinct count sketches by name, see distinct.c.  Only added to
+     * with mutex held. */
+    struct trie *distincts;
+
+    /* The top-K metrics by name, see topk.c.  Only added to with mutex
+     * held. */
+    struct trie *topks;
+
+    /* The timers by name and labels, see timer.c.  Protected by mutex. */
+    struct trie *timers;
+
+    /* The scopes by prefix and labels, see scope.c.  Protected by mutex. */
+    struct trie *scopes;
+
+    /* The counter persistence file, see persist.c.  Only used by whichever
+     * thread reports. */
+    struct persist *persist;
+
+    /* The process metrics collector, see procfs.c.  Only used by whichever
+     * thread reports. */
+    struct procfs *procfs;
+
+    /* The optional scrape endpoint. */
+    pthread_t scrape_thread;
+    int scrape_fd;
+    int scrape_wake[2];
+
+    /* The per-thread counter rings, protected by mutex. */
+    struct thread_ring *rings;
+
+    /* The list of registries handled at fork, see fork.c, and whether this
+     * is the copy in a forked child. */
+    struct metrics_registry *fork_next;
+    int forked;
+
+    char *label__report_buffer;
+} __metrics_t;
+
+typedef enum {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2
+} kernel_level_t;
+
+/* The bulk value kernels, see kernels.c.  All arrays may be unaligned. */
+struct kernels {
+    const char *name;
+
+    /* dst[i] = src[i], reading each source value atomically. */
+    void (*copy)( uint64_t *dst, const uint64_t *src, size_t count );
+
+    /* dst[i] = cur[i] - prev[i], or cur[i] if the counter went backwards.
+     * dst may be the same array as cur or prev. */
+    void (*delta)( uint64_t *dst, const uint64_t *cur, const uint64_t *prev,
+                   size_t count );
+};
+
+/* The registry returned by metrics_init() when the configuration disables
+ * metrics.  Every public function ignores it. */
+extern __metrics_t __metrics_disabled;
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  The array version of metrics_calculate_name().
+ *
+ *  @param name        - The base metric name to build onto.
+ *  @param label_count - The number of label/value pairs.
+ *  @param pairs       - The label, value pairs.
+ *
+ *  @return the complete metric name to free, or NULL on error
+ */
+char* __calculate_name( const char *name, size_t label_count,
+                        const char *const *pairs );
+
+/**
+ *  Checks whether a complete metric name is the one __calculate_name()
+ *  would build, without building it.
+ *
+ *  @param full        - The complete metric name.
+ *  @param name        - The base metric name.
+ *  @param label_count - The number of label/value pairs.
+ *  @param pairs       - The label, value pairs.
+ *
+ *  @return 1 if it is, 0 otherwise
+ */
+int __name_matches( const char *full, const char *name, size_t label_count,
+                    const char *const *pairs );
+
+/**
+ *  Finds (or creates) the series for a base name and label pairs, using the
+ *  calling thread's cache of recent calls by the pointers they were made
+ *  with.
+ *
+ *  @param m           - The metric object to reference.
+ *  @param type        - The type of the metric.
+ *  @param name        - The base metric name.
+ *  @param label_count - The number of label/value pairs.
+ *  @param args        - The label, value pairs.
+ *
+ *  @return the series or NULL on allocation failure
+ */
+struct series* __label_series( __metrics_t *m, metric_type_t type,
+                               const char *name, size_t label_count,
+                               va_list args );
+
+/**
+ *  Increments a counter, through the calling thread's ring if the registry
+ *  buffers counters.  Takes no lock.
+ *
+ *  @param m   - The metric object to reference.
+ *  @param s   - The counter.
+ *  @param inc - The quantity to increment by.
+ */
+void __series_inc( __metrics_t *m, struct series *s, uint32_t inc );
+
+/**
+ *  Sets a gauge.  Takes no lock.
+ *
+ *  @param s     - The gauge.
+ *  @param value - The value to set.
+ */
+void __series_set( struct series *s, int64_t value );
+
+/**
+ *  Finds the series record for a metric without locking: in the tables of
+ *  metrics_freeze() if the registry was frozen, or else in the tries.
+ *
+ *  @param m    - The metric object to reference.
+ *  @param type - The type of the metric.
+ *  @param name - The complete metric name.
+ *
+ *  @return the series or NULL if there is none yet
+ */
+struct series* __search( __metrics_t *m, metric_type_t type, const char *name );
+
+/**
+ *  Releases the tables of metrics_freeze() during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __frozen_destroy( __metrics_t *m );
+
+/**
+ *  Finds (or creates) the series record for a metric.  The caller must hold
+ *  m->mutex.  The record stays valid until metrics_shutdown().
+ *
+ *  @param m    - The metric object to reference.
+ *  @param type - The type of the metric.
+ *  @param name - The complete metric name.
+ *
+ *  @return the series or NULL on allocation failure
+ */
+struct series* __unsafe_series( __metrics_t *m, metric_type_t type,
+                                const char *name );
+
+/**
+ *  Returns the fastest kernels the CPU supports, selected once.
+ */
+const struct kernels* __kernels( void );
+
+/**
+ *  Returns the kernels of a specific level, for tests and benchmarks.
+ *
+ *  @param level - The instruction set to use.
+ *
+ *  @return the kernels or NULL if the CPU does not support the level
+ */
+const struct kernels* __kernels_get( kernel_level_t level );
+
+/**
+ *  Allocates the value of a new series, zeroed.  The caller must hold
+ *  m->mutex.
+ *
+ *  @param m     - The metric object to reference.
+ *  @param id    - Set to the id of the value.
+ *  @param stamp - Set to the update time of the value, or NULL if the
+ *                 registry does not keep timestamps.
+ *
+ *  @return the value or NULL on allocation failure
+ */
+uint64_t* __unsafe_value_alloc( __metrics_t *m, size_t *id, uint64_t **stamp );
+
+/**
+ *  Returns the time used for update times, in milliseconds of
+ *  CLOCK_MONOTONIC_COARSE.  This is read through the vDSO without entering
+ *  the kernel and is only as precise as the kernel tick.
+ */
+uint64_t __stamp_now( void );
+
+/**
+ *  Sizes the snapshot for every value there is now and sets s->ids.  The
+ *  caller must hold m->mutex.
+ *
+ *  @param m - The metric object to reference.
+ *  @param s - The snapshot to fill.
+ *
+ *  @return 0 on success, non-zero on allocation failure
+ */
+int __unsafe_values_reserve( __metrics_t *m, struct snapshot *s );
+
+/**
+ *  Copies the values from series id from into the snapshot by series id, at
+ *  least max of them but in whole blocks, and the static metrics with the
+ *  last ones.  The caller must hold m->mutex, which may be released between
+ *  calls.
+ *
+ *  @param m    - The metric object to reference.
+ *  @param s    - The snapshot reserved by __unsafe_values_reserve().
+ *  @param from - The first series id to copy.
+ *  @param max  - The number of values to copy.
+ *
+ *  @return the series id to continue from, s->ids when done
+ */
+size_t __unsafe_values_copy( __metrics_t *m, struct snapshot *s, size_t from,
+                             size_t max );
+
+/**
+ *  Releases the value blocks during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __values_destroy( __metrics_t *m );
+
+/**
+ *  Prepares the values of a forked child.  Counters start again from 0, or
+ *  with fork_shared_values the new series of the child are kept out of the
+ *  blocks it shares with the parent, and only the static counters, which are
+ *  not shared, start again from 0.  The caller must hold m->mutex.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __unsafe_values_forked( __metrics_t *m );
+
+/**
+ *  Tells whether the value of a series is shared with the parent of a forked
+ *  child, which reports it, so the child must not.  The caller must hold
+ *  m->mutex.
+ *
+ *  @param m      - The metric object to reference.
+ *  @param series - The series to check.
+ *
+ *  @return non-zero if the value is the parent's, 0 otherwise
+ */
+int __unsafe_value_shared( const __metrics_t *m, const struct series *series );
+
+/**
+ *  Adds every metric declared with METRIKS_COUNTER() or METRIKS_GAUGE() to
+ *  the registry.  The caller must hold m->mutex.
+ *
+ *  @param m - The metric object to reference.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+int __unsafe_register_static( __metrics_t *m );
+
+/**
+ *  Finds (or creates) the family for a metric name.  The caller must hold
+ *  m->mutex.
+ *
+ *  @param m    - The metric object to reference.
+ *  @param type - The type of the family.
+ *  @param name - The family name; does not need to be '\0' terminated.
+ *  @param len  - The length of the family name.
+ *
+ *  @return the family or NULL on allocation failure
+ */
+struct family* __unsafe_family( __metrics_t *m, metric_type_t type,
+                                const char *name, size_t len );
+
+/**
+ *  Releases every family during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __families_destroy( __metrics_t *m );
+
+/**
+ *  Starts reporting the registry, either from its own thread or from the
+ *  shared reporter thread when shared_reporter is configured.
+ *
+ *  @param m - The metric object to reference.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+int __reporter_start( __metrics_t *m );
+
+/**
+ *  Stops reporting the registry and writes one final report.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __reporter_stop( __metrics_t *m );
+
+/**
+ *  Locks the shared reporter before a fork, see fork.c
+ */
+void __reporter_fork_prepare( void );
+
+/**
+ *  Unlocks the shared reporter in the parent after a fork.
+ */
+void __reporter_fork_parent( void );
+
+/**
+ *  Resets the shared reporter in a forked child, which has none of the
+ *  parent's threads.
+ */
+void __reporter_fork_child( void );
+
+/**
+ *  Restarts reporting of the registry in a forked child under a file name
+ *  with the child's pid.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __reporter_forked( __metrics_t *m );
+
+/**
+ *  Makes the thread reporting the registry work out when it next has to wake
+ *  up again, for example when the first moving average is created.  Called
+ *  without the registry's mutex held.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __reporter_wake( __metrics_t *m );
+
+/**
+ *  Starts the scrape endpoint if scrape_socket_path is configured.
+ *
+ *  @param m - The metric object to reference.
+ *
+ *  @return 0 on success (or if not configured), non-zero on error
+ */
+int __scrape_start( __metrics_t *m );
+
+/**
+ *  Stops the scrape endpoint if it is running.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __scrape_stop( __metrics_t *m );
+
+/**
+ *  Drops the parent's scrape endpoint in a forked child; it keeps serving
+ *  from the parent.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __scrape_forked( __metrics_t *m );
+
+/**
+ *  Releases every scope during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __scopes_destroy( __metrics_t *m );
+
+/**
+ *  Prepares the counter persistence file, if one is configured.
+ *
+ *  @param m - The metric object to reference.
+ *
+ *  @return 0 on success, non-zero on allocation failure
+ */
+int __persist_start( __metrics_t *m );
+
+/**
+ *  Adds the counter values saved in the persistence file to the registry,
+ *  using the newest intact copy.  A missing or damaged file restores
+ *  nothing.  The caller must hold m->mutex, or be metrics_init().
+ *
+ *  @param m - The metric object to reference.
+ *
+ *  @return the number of counters restored
+ */
+size_t __unsafe_persist_restore( __metrics_t *m );
+
+/**
+ *  Saves the counters of a report snapshot to the persistence file.
+ *
+ *  @param m - The metric object to reference.
+ *  @param s - The snapshot just taken.
+ */
+void __persist_save( __metrics_t *m, const struct snapshot *s );
+
+/**
+ *  Applies the decay to every moving average for each tick that has passed
+ *  since the last one.  Only called by the thread reporting the registry.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __ewma_tick( __metrics_t *m );
+
+/**
+ *  Works out when the moving averages next need to tick.
+ *
+ *  @param m   - The metric object to reference.
+ *  @param due - Set to the time of the next tick by CLOCK_MONOTONIC.
+ *
+ *  @return non-zero if there are moving averages to tick, 0 otherwise
+ */
+int __ewma_due( __metrics_t *m, struct timespec *due );
+
+/**
+ *  Applies a number of ticks to every moving average.
+ *
+ *  @param m     - The metric object to reference.
+ *  @param ticks - The number of ticks that have passed.
+ */
+void __ewma_advance( __metrics_t *m, uint64_t ticks );
+
+/**
+ *  Copies the rates of the moving averages whose names start with the prefix
+ *  into the snapshot.
+ *
+ *  @param m      - The metric object to reference.
+ *  @param s      - The snapshot to fill.
+ *  @param prefix - The start of the names to include, "" for all.
+ *
+ *  @return 0 on success, non-zero on allocation failure
+ */
+int __snapshot_ewmas( __metrics_t *m, struct snapshot *s, const char *prefix );
+
+/**
+ *  Works out whether timers can use the TSC and how long a tick is, the
+ *  first time it is called.
+ */
+void __timer_calibrate( void );
+
+/**
+ *  Releases every timer during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __timers_destroy( __metrics_t *m );
+
+/**
+ *  Merges the shards of the top-K metrics whose names start with the prefix
+ *  and copies their largest keys into the snapshot.
+ *
+ *  @param m      - The metric object to reference.
+ *  @param s      - The snapshot to fill.
+ *  @param prefix - The start of the names to include, "" for all.
+ *
+ *  @return 0 on success, non-zero on allocation failure
+ */
+int __snapshot_tops( __metrics_t *m, struct snapshot *s, const char *prefix );
+
+/**
+ *  Releases the keys copied into the snapshot.
+ *
+ *  @param s - The snapshot to release the keys of.
+ */
+void __snapshot_tops_destroy( struct snapshot *s );
+
+/**
+ *  Empties the top-K metrics of a forked child.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __topks_forked( __metrics_t *m );
+
+/**
+ *  Releases every top-K metric during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __topks_destroy( __metrics_t *m );
+
+/**
+ *  Sets the gauge of every distinct count to its estimate, emptying the
+ *  sketches with distinct_reset.  Only called by the thread reporting the
+ *  registry.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __distinct_sample( __metrics_t *m );
+
+/**
+ *  Empties the distinct count sketches of a forked child.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __distincts_forked( __metrics_t *m );
+
+/**
+ *  Releases every distinct count sketch during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __distincts_destroy( __metrics_t *m );
+
+/**
+ *  Starts the moving averages of a forked child again, without the marks or
+ *  rates of the parent.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __ewmas_forked( __metrics_t *m );
+
+/**
+ *  Releases every moving average during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __ewmas_destroy( __metrics_t *m );
+
+/**
+ *  Starts collecting the process metrics, if configured: opens the files of
+ *  /proc/self and adds the gauges of those that could be opened.  The caller
+ *  must hold m->mutex.
+ *
+ *  @param m - The metric object to reference.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+int __unsafe_procfs_start( __metrics_t *m );
+
+/**
+ *  Samples the process metrics into their gauges.  Only called by the
+ *  thread reporting the registry.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __procfs_sample( __metrics_t *m );
+
+/**
+ *  Opens the files of /proc/self again in a forked child.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __procfs_forked( __metrics_t *m );
+
+/**
+ *  Stops collecting the process metrics during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __procfs_destroy( __metrics_t *m );
+
+/**
+ *  Releases the persistence file, leaving it as it is.  Also used by a
+ *  forked child, as the file stays the parent's.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __persist_destroy( __metrics_t *m );
+
+/**
+ *  Tracks the registry so it is made safe across fork(), see fork.c
+ *
+ *  @param m - The metric object to reference.
+ */
+void __fork_register( __metrics_t *m );
+
+/**
+ *  Stops tracking the registry during shutdown.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __fork_unregister( __metrics_t *m );
+
+/**
+ *  Initializes an empty snapshot.
+ *
+ *  @param s - The snapshot to initialize.
+ */
+void __snapshot_init( struct snapshot *s );
+
+/**
+ *  Replaces the contents of the snapshot with the current values of every
+ *  series.  This takes m->mutex for the duration of the copy.
+ *
+ *  @param m - The metric object to reference.
+ *  @param s - The snapshot to fill.
+ *
+ *  @return 0 on success, non-zero if the snapshot is incomplete
+ */
+int __snapshot_take( __metrics_t *m, struct snapshot *s );
+
+/**
+ *  Like __snapshot_take() but only with the families whose names start with
+ *  the prefix.
+ *
+ *  @param m      - The metric object to reference.
+ *  @param s      - The snapshot to fill.
+ *  @param prefix - The start of the family names to include.
+ *
+ *  @return 0 on success, non-zero if the snapshot is incomplete
+ */
+int __snapshot_take_prefix( __metrics_t *m, struct snapshot *s,
+                            const char *prefix );
+
+/**
+ *  Fills in the deltas and rate factor of the snapshot relative to the
+ *  previous report.  Counters that went backwards were reset and count
+ *  from 0.
+ *
+ *  @param s       - The snapshot of this report.
+ *  @param prev    - The snapshot of the previous report.
+ *  @param elapsed - The seconds since the previous report, or 0 to leave
+ *                   the rates out.
+ *
+ *  @return 0 on success, non-zero on allocation failure
+ */
+int __snapshot_deltas( struct snapshot *s, const struct snapshot *prev,
+                       double elapsed );
+
+/**
+ *  Passes the snapshot through an exporter.
+ *
+ *  @param s    - The snapshot to export.
+ *  @param base - The base prefix for the names.
+ *  @param e    - The exporter to call.
+ */
+void __snapshot_export( const struct snapshot *s, const char *base,
+                        struct metrics_exporter *e );
+
+/**
+ *  Releases the memory held by the snapshot.
+ *
+ *  @param s - The snapshot to release.
+ */
+void __snapshot_destroy( struct snapshot *s );
+
+/**
+ *  Creates the text file exporter.  When m is not NULL the size of the report
+ *  buffer is recorded in the metrics_report_buffer gauges.
+ *
+ *  @param filename     - The file to write, copied by the function.
+ *  @param initial_size - The initial report buffer size, 0 for the default.
+ *  @param m            - The metric object to record the buffer size in.
+ *
+ *  @return the exporter or NULL on error
+ */
+struct metrics_exporter* __text_exporter_create( const char *filename,
+                                                 size_t initial_size,
+                                                 __metrics_t *m );
+
+/**
+ *  Works out the room __text_line() needs for a series.
+ *
+ *  @param base_len - The length of the base prefix.
+ *  @param s        - The series to format.
+ *
+ *  @return the most bytes written, including the '\0'
+ */
+size_t __text_line_size( size_t base_len, const struct metrics_series *s );
+
+/**
+ *  Formats a series as a line of the text format, after the family header if
+ *  the series starts a family.  Used by the text exporter and the scrape
+ *  endpoint, so both always render the same text.
+ *
+ *  @param buf      - Where to write, with room for __text_line_size() bytes.
+ *  @param base     - The base prefix.
+ *  @param base_len - The length of the base prefix.
+ *  @param s        - The series to format.
+ *
+ *  @return the number of bytes written, not counting the '\0'
+ */
+size_t __text_line( char *buf, const char *base, size_t base_len,
+                    const struct metrics_series *s );
+
+/**
+ *  Creates a writer that replaces a file asynchronously with io_uring: the
+ *  contents are written to filename.tmp, synced, and renamed over filename
+ *  as one linked chain, so the caller never waits on the disk.
+ *
+ *  @param filename - The file to replace, copied by the function.
+ *
+ *  @return the writer, or NULL if io_uring is not available
+ */
+struct uring_writer* __uring_writer_create( const char *filename );
+
+/**
+ *  Waits for the previous write (if any) to finish.  This only blocks if the
+ *  disk has fallen a whole report behind.
+ *
+ *  @param w - The writer.
+ *
+ *  @return 0 if the previous write succeeded, -1 if it failed
+ */
+int __uring_writer_wait( struct uring_writer *w );
+
+/**
+ *  Queues the buffer to be written.  The writer keeps the buffer until the
+ *  write is done and hands back its other buffer for the next report.
+ *
+ *  @param w    - The writer, with no write in progress.
+ *  @param buf  - The buffer to write, replaced by the one to fill next.
+ *  @param len  - The size of *buf, replaced along with it.
+ *  @param used - The bytes of *buf to write.
+ *
+ *  @return 0 if queued, -1 if the caller has to write the buffer itself
+ */
+int __uring_writer_submit( struct uring_writer *w, char **buf, size_t *len,
+                           size_t used );
+
+/**
+ *  Waits for any write in progress and releases the writer.
+ *
+ *  @param w - The writer, may be NULL.
+ */
+void __uring_writer_destroy( struct uring_writer *w );
+
+/**
+ *  Adds a counter increment to the calling thread's running total for the
+ *  counter.  This never blocks and uses no atomic read-modify-write
+ *  operations.  The update time of the counter is that of the drain that
+ *  applies the increment.
+ *
+ *  @param m      - The metric object to reference.
+ *  @param series - The counter to increment.
+ *  @param inc    - The quantity to increment by.
+ *
+ *  @return 0 if the increment was buffered, non-zero if the caller must apply
+ *          it directly because the thread already buffers too many other
+ *          counters
+ */
+int __thread_ring_push( __metrics_t *m, struct series *series, uint32_t inc );
+
+/**
+ *  Applies all the buffered increments from every thread's ring and releases
+ *  the rings of threads that have exited.  The caller must hold m->mutex.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __unsafe_thread_rings_drain( __metrics_t *m );
+
+/**
+ *  Detaches every ring from the metrics object during shutdown.  Buffered
+ *  increments that have not been drained are discarded.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __thread_rings_destroy( __metrics_t *m );
+
+/**
+ *  Discards the buffered increments in a forked child, which the parent
+ *  applies, and releases the rings of threads the child does not have.  The
+ *  caller must hold m->mutex.
+ *
+ *  @param m - The metric object to reference.
+ */
+void __unsafe_thread_rings_forked( __metrics_t *m );
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* ThreadSanitizer cannot see vector loads as atomic reads of the live values,
+ * so sanitized builds always use the scalar kernels. */
+#if defined(__SANITIZE_THREAD__)
+#undef HAVE_X86_KERNELS
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static pthread_once_t __kernels_once = PTHREAD_ONCE_INIT;
+static const struct kernels *__selected = NULL;
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static void __select( void );
+
+static void __scalar_copy( uint64_t*, const uint64_t*, size_t );
+static void __scalar_delta( uint64_t*, const uint64_t*, const uint64_t*, size_t );
+
+#ifdef HAVE_X86_KERNELS
+static void __sse2_copy( uint64_t*, const uint64_t*, size_t );
+static void __sse2_delta( uint64_t*, const uint64_t*, const uint64_t*, size_t );
+
+static void __avx2_copy( uint64_t*, const uint64_t*, size_t );
+static void __avx2_delta( uint64_t*, const uint64_t*, const uint64_t*, size_t );
+#endif
+
+static const struct kernels __scalar = {
+    "scalar",
+    __scalar_copy,
+    __scalar_delta
+};
+
+#ifdef HAVE_X86_KERNELS
+static const struct kernels __sse2 = {
+    "sse2",
+    __sse2_copy,
+    __sse2_delta
+};
+
+static const struct kernels __avx2 = {
+    "avx2",
+    __avx2_copy,
+    __avx2_delta
+};
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+const struct kernels* __kernels( void )
+{
+    pthread_once( &__kernels_once, __select );
+
+    return __selected;
+}
+
+/* See internal.h for details. */
+const struct kernels* __kernels_get( kernel_level_t level )
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if( (KERNEL_AVX2 == level) && __builtin_cpu_supports("avx2") ) {
+        return &__avx2;
+    }
+    if( (KERNEL_SSE2 == level) && __builtin_cpu_supports("sse2") ) {
+        return &__sse2;
+    }
+#endif
+    if( KERNEL_SCALAR == level ) {
+        return &__scalar;
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static void __select( void )
+{
+    const struct kernels *k;
+
+    k = __kernels_get( KERNEL_AVX2 );
+    if( NULL == k ) {
+        k = __kernels_get( KERNEL_SSE2 );
+    }
+    if( NULL == k ) {
+        k = &__scalar;
+    }
+
+    __selected = k;
+}
+
+/*------------------------------ Scalar Kernels ------------------------------*/
+
+/* The scalar kernels are the reference behavior; the vector kernels must
+ * produce identical results. */
+
+static void __scalar_copy( uint64_t *dst, const uint64_t *src, size_t count )
+{
+    size_t i;
+
+    /* The source values may be updated concurrently. */
+    for( i = 0; i < count; i++ ) {
+        dst[i] = __atomic_load_n( &src[i], __ATOMIC_RELAXED );
+    }
+}
+
+static void __scalar_delta( uint64_t *dst, const uint64_t *cur,
+                            const uint64_t *prev, size_t count )
+{
+    size_t i;
+
+    for( i = 0; i < count; i++ ) {
+        /* A counter that went backwards was reset. */
+        dst[i] = (prev[i] <= cur[i]) ? cur[i] - prev[i] : cur[i];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*------------------------------- SSE2 Kernels -------------------------------*/
+
+/* SSE2 has no 64 bit compares, so the unsigned borrow is derived from the
+ * sign bits and widened into a mask with 0 - bit. */
+
+__attribute__((target("sse2")))
+static void __sse2_copy( uint64_t *dst, const uint64_t *src, size_t count )
+{
+    size_t i = 0;
+
+    /* Each aligned 64 bit element of a vector load is read at once, so no
+     * value is torn by a concurrent update. */
+    for( ; i + 2 <= count; i += 2 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i*) &src[i] );
+        _mm_storeu_si128( (__m128i*) &dst[i], v );
+    }
+
+    __scalar_copy( &dst[i], &src[i], count - i );
+}
+
+__attribute__((target("sse2")))
+static void __sse2_delta( uint64_t *dst, const uint64_t *cur,
+                          const uint64_t *prev, size_t count )
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for( ; i + 2 <= count; i += 2 ) {
+        __m128i c = _mm_loadu_si128( (const __m128i*) &cur[i] );
+        __m128i p = _mm_loadu_si128( (const __m128i*) &prev[i] );
+        __m128i d = _mm_sub_epi64( c, p );
+        __m128i borrow, mask;
+
+        /* borrow = (~c & p) | (~(c ^ p) & d), in the top bit */
+        borrow = _mm_or_si128( _mm_andnot_si128(c, p),
+                               _mm_andnot_si128(_mm_xor_si128(c, p), d) );
+        mask = _mm_sub_epi64( zero, _mm_srli_epi64(borrow, 63) );
+
+        d = _mm_or_si128( _mm_andnot_si128(mask, d), _mm_and_si128(mask, c) );
+        _mm_storeu_si128( (__m128i*) &dst[i], d );
+    }
+
+    __scalar_delta( &dst[i], &cur[i], &prev[i], count - i );
+}
+
+/*------------------------------- AVX2 Kernels -------------------------------*/
+
+__attribute__((target("avx2")))
+static void __avx2_copy( uint64_t *dst, const uint64_t *src, size_t count )
+{
+    size_t i = 0;
+
+    for( ; i + 4 <= count; i += 4 ) {
+        __m256i v = _mm256_loadu_si256( (const __m256i*) &src[i] );
+        _mm256_storeu_si256( (__m256i*) &dst[i], v );
+    }
+
+    __scalar_copy( &dst[i], &src[i], count - i );
+}
+
+__attribute__((target("avx2")))
+static void __avx2_delta( uint64_t *dst, const uint64_t *cur,
+                          const uint64_t *prev, size_t count )
+{
+    const __m256i sign = _mm256_set1_epi64x( (long long) 0x8000000000000000ULL );
+    size_t i = 0;
+
+    for( ; i + 4 <= count; i += 4 ) {
+        __m256i c = _mm256_loadu_si256( (const __m256i*) &cur[i] );
+        __m256i p = _mm256_loadu_si256( (const __m256i*) &prev[i] );
+        __m256i d = _mm256_sub_epi64( c, p );
+        __m256i reset;
+
+        /* Unsigned p > c, by flipping the sign bits for a signed compare. */
+        reset = _mm256_cmpgt_epi64( _mm256_xor_si256(p, sign),
+                                    _mm256_xor_si256(c, sign) );
+
+        d = _mm256_blendv_epi8( d, c, reset );
+        _mm256_storeu_si256( (__m256i*) &dst[i], d );
+    }
+
+    __scalar_delta( &dst[i], &cur[i], &prev[i], count - i );
+}
+
+#endif
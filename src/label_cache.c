@@ -0,0 +1,189 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The cache has 1 << LABEL_CACHE_BITS entries per thread. */
+#define LABEL_CACHE_BITS    6
+#define LABEL_CACHE_SIZE    (1 << LABEL_CACHE_BITS)
+
+/* Calls with more labels than this are never cached. */
+#define LABEL_CACHE_LABELS  4
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* A series found by the pointers a *_labels() call was made with. */
+struct label_entry {
+    /* The registry and its id, since a registry shut down and one created
+     * later may have the same address. */
+    __metrics_t *m;
+    uint64_t registry_id;
+
+    metric_type_t type;
+    const char *name;
+    size_t label_count;
+    const char *pairs[2 * LABEL_CACHE_LABELS];
+
+    struct series *series;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* Only ever touched by the owning thread, so there is nothing to lock. */
+static __thread struct label_entry __cache[LABEL_CACHE_SIZE];
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static size_t __hash( __metrics_t*, metric_type_t, const char*, size_t,
+                      const char *const* );
+static int __hit( const struct label_entry*, __metrics_t*, metric_type_t,
+                  const char*, size_t, const char *const* );
+static struct series* __find( __metrics_t*, metric_type_t, const char* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+struct series* __label_series( __metrics_t *m, metric_type_t type,
+                               const char *name, size_t label_count,
+                               va_list args )
+{
+    const char *pairs[2 * LABEL_CACHE_LABELS];
+    struct label_entry *e;
+    struct series *s;
+    char *full;
+    size_t i;
+
+    if( LABEL_CACHE_LABELS < label_count ) {
+        full = metrics_calculate_name_varidac( name, label_count, args );
+        if( NULL == full ) {
+            return NULL;
+        }
+        s = __find( m, type, full );
+        free( full );
+
+        return s;
+    }
+
+    for( i = 0; i < 2 * label_count; i++ ) {
+        pairs[i] = va_arg( args, const char* );
+    }
+
+    e = &__cache[__hash(m, type, name, label_count, pairs)];
+    if( 0 != __hit(e, m, type, name, label_count, pairs) ) {
+        return e->series;
+    }
+
+    full = __calculate_name( name, label_count, pairs );
+    if( NULL == full ) {
+        return NULL;
+    }
+    s = __find( m, type, full );
+    free( full );
+
+    if( NULL != s ) {
+        e->m = m;
+        e->registry_id = m->id;
+        e->type = type;
+        e->name = name;
+        e->label_count = label_count;
+        memcpy( e->pairs, pairs, 2 * label_count * sizeof(char*) );
+        e->series = s;
+    }
+
+    return s;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Picks the entry for the pointers of a call.
+ */
+static size_t __hash( __metrics_t *m, metric_type_t type, const char *name,
+                      size_t label_count, const char *const *pairs )
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t h;
+    size_t i;
+
+    h = ((uint64_t) (uintptr_t) m ^ (uint64_t) type) * k;
+    h = (h ^ (uint64_t) (uintptr_t) name) * k;
+    for( i = 0; i < 2 * label_count; i++ ) {
+        h = (h ^ (uint64_t) (uintptr_t) pairs[i]) * k;
+    }
+    h = (h ^ label_count) * k;
+
+    return (size_t) (h >> (64 - LABEL_CACHE_BITS));
+}
+
+/**
+ *  Checks whether the entry holds the series of a call.  The same pointers
+ *  are not enough: a label value is often formatted into the same buffer
+ *  every time, so the strings are compared with the series name too.  That
+ *  still needs no allocation and no trie.
+ */
+static int __hit( const struct label_entry *e, __metrics_t *m,
+                  metric_type_t type, const char *name, size_t label_count,
+                  const char *const *pairs )
+{
+    size_t i;
+
+    if( (m != e->m) || (m->id != e->registry_id) || (type != e->type) ||
+        (name != e->name) || (label_count != e->label_count) )
+    {
+        return 0;
+    }
+
+    for( i = 0; i < 2 * label_count; i++ ) {
+        if( pairs[i] != e->pairs[i] ) {
+            return 0;
+        }
+    }
+
+    return __name_matches( e->series->name, name, label_count, pairs );
+}
+
+/**
+ *  Finds or creates the series of a complete name.
+ */
+static struct series* __find( __metrics_t *m, metric_type_t type,
+                              const char *full )
+{
+    struct series *s;
+
+    s = __search( m, type, full );
+    if( NULL == s ) {
+        pthread_mutex_lock( &m->mutex );
+        s = __unsafe_series( m, type, full );
+        pthread_mutex_unlock( &m->mutex );
+    }
+
+    return s;
+}
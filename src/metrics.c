@@ -14,78 +14,46 @@
  * limitations under the License.
  */
 
-#include "metrics.h"
-#include "trie/trie.h"
+#include "internal.h"
 
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <fcntl.h>
-
-#define __STDC_FORMAT_MACROS
-#include <inttypes.h>
 
 /*----------------------------------------------------------------------------*/
 /*                                   Macros                                   */
 /*----------------------------------------------------------------------------*/
-#define DEFAULT_METRICS_PATH            "/tmp/metrics"
-#define DEFAULT_PROCESS_NAME            "example.metrics"
-
-#define DEFAULT_REPORT_PERIOD           900
-#define DEFAULT_REPORT_SIZE             1024
-#define MAX_LINE_LENGTH_BEFORE_REALLOC  128
-#define BUFFER_SIZE_INCREASE            1024
+/* none */
 
 /*----------------------------------------------------------------------------*/
 /*                               Data Structures                              */
 /*----------------------------------------------------------------------------*/
-typedef enum {
-    MT_COUNTER,
-    MT_GAUGE
-} metric_type_t;
-
-typedef struct {
-    const struct metrics_config *c;
-
-    pthread_mutex_t mutex;
-
-    pthread_t report_thread;
-    volatile int keep_running;
-
-    struct trie *counters;
-    struct trie *gauges;
-
-    char *label__report_buffer;
-} __metrics_t;
-
-struct trie_visitor {
-    __metrics_t *m;
-    metric_type_t type;
-    char *buf;
-    size_t len;
-    size_t used;
-};
+/* none */
 
 /*----------------------------------------------------------------------------*/
 /*                            File Scoped Variables                           */
 /*----------------------------------------------------------------------------*/
-/* none */
+/* See internal.h for details. */
+__metrics_t __metrics_disabled;
+
+/* The last registry id handed out. */
+static uint64_t __last_id = 0;
 
 /*----------------------------------------------------------------------------*/
 /*                             Function Prototypes                            */
 /*----------------------------------------------------------------------------*/
-static void* __report_loop( void* );
-static int __visitor( const char*, void*, void* );
 static int __destroyer( const char*, void*, void* );
 
-void __generate_report( metrics_t, char**, size_t* );
 static void __unsafe_gauge_set( __metrics_t*, const char*, int64_t );
 static void __unsafe_counter_inc( __metrics_t*, const char*, uint32_t );
+static size_t __escaped_len( const char* );
+static size_t __escape( char*, const char* );
+static size_t __copy( char*, const char* );
+static const char* __expect( const char*, char );
+static const char* __skip( const char*, const char* );
+static const char* __skip_escaped( const char*, const char* );
 
 /*----------------------------------------------------------------------------*/
 /*                             External Functions                             */
@@ -94,29 +62,77 @@ static void __unsafe_counter_inc( __metrics_t*, const char*, uint32_t );
 /* See metrics.h for details. */
 metrics_t metrics_init( const struct metrics_config *c )
 {
-    int rv;
     __metrics_t *m;
 
+    if( 0 != c->disabled ) {
+        return (metrics_t) &__metrics_disabled;
+    }
+
     m = (__metrics_t*) malloc( sizeof(__metrics_t) );
+    if( NULL == m ) {
+        return NULL;
+    }
     m->c = c;
+    m->id = __atomic_add_fetch( &__last_id, 1, __ATOMIC_RELAXED );
 
     pthread_mutex_init( &m->mutex, NULL );
 
     m->counters = trie_create();
     m->gauges = trie_create();
+    m->series_generation = 0;
+    m->value_blocks = NULL;
+    m->value_blocks_len = 0;
+    m->value_count = 0;
+    m->statics = NULL;
+    m->static_count = 0;
+    m->counter_families = trie_create();
+    m->gauge_families = trie_create();
+    m->frozen = NULL;
+    m->ewmas = trie_create();
+    clock_gettime( CLOCK_MONOTONIC, &m->ewma_ticked );
+    m->has_ewmas = 0;
+    m->distincts = trie_create();
+    m->topks = trie_create();
+    m->timers = trie_create();
+    m->procfs = NULL;
+    m->scopes = trie_create();
+    m->rings = NULL;
+    m->shared_ids = 0;
+    m->fork_next = NULL;
+    m->forked = 0;
+    m->scrape_fd = -1;
+    m->scrape_wake[0] = -1;
+    m->scrape_wake[1] = -1;
+
+    __timer_calibrate();
 
     m->label__report_buffer = metrics_calculate_name( "metrics_report_buffer",
                                                       1, "size", "current" );
 
+    /* A static metric that cannot be added is simply not reported. */
+    __unsafe_register_static( m );
+
+    /* Nor is a persistence file that cannot be set up used. */
+    __persist_start( m );
+    __unsafe_persist_restore( m );
+
+    /* Nor are the process metrics that cannot be read. */
+    __unsafe_procfs_start( m );
+
     __unsafe_gauge_set( (metrics_t) m, "metrics_boot_time",
                         (uint64_t) c->unix_time );
-    m->keep_running = 1;
-    rv = pthread_create( &m->report_thread, NULL, __report_loop, m );
-    if( 0 != rv ) {
+    if( 0 != __reporter_start(m) ) {
         metrics_shutdown( m );
-        m = NULL;
+        return NULL;
     }
 
+    if( 0 != __scrape_start(m) ) {
+        metrics_shutdown( m );
+        return NULL;
+    }
+
+    __fork_register( m );
+
     return (metrics_t) m;
 }
 
@@ -125,13 +141,25 @@ void metrics_shutdown( metrics_t __m )
 {
     __metrics_t *m = (__metrics_t*) __m;
 
-    if( NULL != m ) {
-        m->keep_running = 0;
-        pthread_join( m->report_thread, NULL );
+    if( (NULL != m) && (&__metrics_disabled != m) ) {
+        __fork_unregister( m );
+        __scrape_stop( m );
+        __reporter_stop( m );
+        __persist_destroy( m );
+        __procfs_destroy( m );
+        __thread_rings_destroy( m );
+        __scopes_destroy( m );
+        __frozen_destroy( m );
+        __ewmas_destroy( m );
+        __distincts_destroy( m );
+        __topks_destroy( m );
+        __timers_destroy( m );
         trie_visit( m->counters, "", __destroyer, NULL );
         trie_free( m->counters );
         trie_visit( m->gauges, "", __destroyer, NULL );
         trie_free( m->gauges );
+        __families_destroy( m );
+        __values_destroy( m );
         free( m->label__report_buffer );
 
         pthread_mutex_lock( &m->mutex );
@@ -146,58 +174,21 @@ void metrics_shutdown( metrics_t __m )
 char* metrics_calculate_name_varidac( const char *name, size_t label_count,
                                       va_list args )
 {
-    size_t i;
-    size_t bytes = 0;
-    va_list va_copy;
-    char _buf[1024];
-    char *buf = &_buf[0];
+    const char **pairs;
     char *rv;
+    size_t i;
 
-    va_copy( va_copy, args );
-   
-    bytes += strlen( name );
-    for( i = 0; i < label_count; i++ ) {
-        bytes += strlen( va_arg(va_copy, const char*) );
-        bytes += strlen( va_arg(va_copy, const char*) );
+    pairs = (const char**) malloc( (2 * label_count + 1) * sizeof(char*) );
+    if( NULL == pairs ) {
+        return NULL;
     }
 
-    /* TODO: correct the character escaping */
-
-    /* Output format:
-     * name{label="value",label2="value"}
-     *
-     * A bit slopy, but simple way to calulate is the sum of:
-     * 1. The lenth of the strings
-     * 2. The {} characters = 2
-     * 3. The ="", per label pair is 4 - the extra comma accounts for the
-     *    trailing '\0' needed. */
-    bytes += 2 + label_count * 4;
-
-    if( sizeof(_buf)/sizeof(char) < bytes ) {
-        buf = (char*) malloc( bytes * sizeof(char) );
+    for( i = 0; i < 2 * label_count; i++ ) {
+        pairs[i] = va_arg( args, const char* );
     }
 
-    strcpy( buf, name );
-    if( 0 < label_count ) {
-        strcat( buf, "{" );
-
-        for( i = 0; i < label_count; i++ ) {
-            if( 0 != i ) {
-                strcat( buf, "," );
-            }
-            strcat( buf, va_arg(args, const char*) );
-            strcat( buf, "=\"" );
-            strcat( buf, va_arg(args, const char*) );
-            strcat( buf, "\"" );
-        }
-        strcat( buf, "}" );
-    }
-
-    rv = strdup( buf );
-
-    if( buf != _buf ) {
-        free( buf );
-    }
+    rv = __calculate_name( name, label_count, pairs );
+    free( pairs );
 
     return rv;
 }
@@ -220,13 +211,15 @@ char* metrics_calculate_name( const char *name, size_t label_count, ... )
 void metrics_counter_inc( metrics_t __m, const char *name, uint32_t inc )
 {
     __metrics_t *m = (__metrics_t*) __m;
-    uint64_t *counter;
+    struct series *s;
 
-    counter = (uint64_t*) trie_search( m->counters, name );
-    if( NULL != counter ) {
-        pthread_mutex_lock( &m->mutex );
-        *counter += inc;
-        pthread_mutex_unlock( &m->mutex );
+    if( &__metrics_disabled == m ) {
+        return;
+    }
+
+    s = __search( m, MT_COUNTER, name );
+    if( NULL != s ) {
+        __series_inc( m, s, inc );
         return;
     }
 
@@ -240,34 +233,38 @@ void metrics_counter_inc( metrics_t __m, const char *name, uint32_t inc )
 void metrics_counter_inc_labels( metrics_t __m, const char *name, uint32_t inc,
                                  size_t label_count, ... )
 {
-    char *full;
+    __metrics_t *m = (__metrics_t*) __m;
+    struct series *s;
     va_list args;
 
-    va_start( args, label_count );
-    full = metrics_calculate_name_varidac( name, label_count, args );
-    va_end( args );
-
-    if( NULL == full ) {
-        /* Not sure what happened, but we're toast... bail. */
+    if( &__metrics_disabled == m ) {
         return;
     }
 
-    metrics_counter_inc( __m, full, inc );
+    /* Repeated calls with the same strings are found in the thread's label
+     * cache, see label_cache.c */
+    va_start( args, label_count );
+    s = __label_series( m, MT_COUNTER, name, label_count, args );
+    va_end( args );
 
-    free( full );
+    if( NULL != s ) {
+        __series_inc( m, s, inc );
+    }
 }
 
 /* See metrics.h for details. */
 void metrics_gauge_set( metrics_t __m, const char *name, int64_t value )
 {
     __metrics_t *m = (__metrics_t*) __m;
-    int64_t *gauge;
+    struct series *s;
 
-    gauge = (int64_t*) trie_search( m->gauges, name );
-    if( NULL != gauge ) {
-        pthread_mutex_lock( &m->mutex );
-        *gauge = value;
-        pthread_mutex_unlock( &m->mutex );
+    if( &__metrics_disabled == m ) {
+        return;
+    }
+
+    s = __search( m, MT_GAUGE, name );
+    if( NULL != s ) {
+        __series_set( s, value );
         return;
     }
 
@@ -281,205 +278,294 @@ void metrics_gauge_set( metrics_t __m, const char *name, int64_t value )
 void metrics_gauge_set_labels( metrics_t __m, const char *name, int64_t value,
                                size_t label_count, ... )
 {
-    char *full;
+    __metrics_t *m = (__metrics_t*) __m;
+    struct series *s;
     va_list args;
 
-    va_start( args, label_count );
-    full = metrics_calculate_name_varidac( name, label_count, args );
-    va_end( args );
-
-    if( NULL == full ) {
-        /* Not sure what happened, but we're toast... bail. */
+    if( &__metrics_disabled == m ) {
         return;
     }
 
-    metrics_gauge_set( __m, full, value );
+    /* Repeated calls with the same strings are found in the thread's label
+     * cache, see label_cache.c */
+    va_start( args, label_count );
+    s = __label_series( m, MT_GAUGE, name, label_count, args );
+    va_end( args );
 
-    free( full );
+    if( NULL != s ) {
+        __series_set( s, value );
+    }
 }
 
 /*----------------------------------------------------------------------------*/
 /*                             Internal functions                             */
 /*----------------------------------------------------------------------------*/
-static void __unsafe_gauge_set( __metrics_t* m, const char *name, int64_t value )
+/* See internal.h for details. */
+void __series_inc( __metrics_t *m, struct series *s, uint32_t inc )
 {
-    int64_t *gauge;
+    if( (0 != m->c->thread_buffered_counters) &&
+        (0 == __thread_ring_push(m, s, inc)) )
+    {
+        return;
+    }
 
-    gauge = (int64_t*) trie_search( m->gauges, name );
-    if( NULL == gauge ) {
-        gauge = (int64_t*) malloc( sizeof(int64_t) );
-        *gauge = value;
-        trie_insert(m->gauges, name, gauge);
+    __atomic_add_fetch( s->slot, inc, __ATOMIC_RELAXED );
+    if( NULL != s->stamp ) {
+        __atomic_store_n( s->stamp, __stamp_now(), __ATOMIC_RELAXED );
     }
+}
 
-    *gauge = value;
+/* See internal.h for details. */
+void __series_set( struct series *s, int64_t value )
+{
+    __atomic_store_n( (int64_t*) s->slot, value, __ATOMIC_RELAXED );
+    if( NULL != s->stamp ) {
+        __atomic_store_n( s->stamp, __stamp_now(), __ATOMIC_RELAXED );
+    }
 }
 
-static void __unsafe_counter_inc( __metrics_t* m, const char *name, uint32_t inc )
+/* See internal.h for details. */
+char* __calculate_name( const char *name, size_t label_count,
+                        const char *const *pairs )
 {
-    uint64_t *counter;
+    size_t i;
+    size_t bytes = 0;
+    char *rv;
+    char *p;
 
-    counter = (uint64_t*) trie_search( m->counters, name );
-    if( NULL == counter ) {
-        counter = (uint64_t*) malloc( sizeof(uint64_t) );
-        *counter = 0;
-        trie_insert(m->counters, name, counter);
+    /* Output format:
+     * name{label="value",label2="value"}
+     *
+     * The size is the sum of:
+     * 1. The length of the name and labels
+     * 2. The length of the values after escaping
+     * 3. The {} characters = 2
+     * 4. The ="", per label pair is 4 - the extra comma accounts for the
+     *    trailing '\0' needed. */
+    bytes += strlen( name ) + 2 + label_count * 4;
+    for( i = 0; i < label_count; i++ ) {
+        bytes += strlen( pairs[2 * i] );
+        bytes += __escaped_len( pairs[2 * i + 1] );
     }
 
-    *counter += inc;
+    rv = (char*) malloc( bytes * sizeof(char) );
+    if( NULL == rv ) {
+        return NULL;
+    }
 
-}
+    p = rv;
+    p += __copy( p, name );
+    if( 0 < label_count ) {
+        *p++ = '{';
 
-static uint32_t __get_report_period( __metrics_t *m )
-{
-    if( 0 < m->c->report_period_s ) {
-        return m->c->report_period_s;
+        for( i = 0; i < label_count; i++ ) {
+            if( 0 != i ) {
+                *p++ = ',';
+            }
+            p += __copy( p, pairs[2 * i] );
+            *p++ = '=';
+            *p++ = '"';
+            p += __escape( p, pairs[2 * i + 1] );
+            *p++ = '"';
+        }
+        *p++ = '}';
     }
+    *p = '\0';
 
-    return DEFAULT_REPORT_PERIOD;
+    return rv;
 }
 
-static void __mkdir( __metrics_t *m )
+/* See internal.h for details. */
+int __name_matches( const char *full, const char *name, size_t label_count,
+                    const char *const *pairs )
 {
-    const char *path = m->c->metrics_path;
+    const char *p;
+    size_t i;
 
-    if( NULL == path ) {
-        path = DEFAULT_METRICS_PATH;
+    /* The same format as __calculate_name(), without building it. */
+    p = __skip( full, name );
+    if( 0 < label_count ) {
+        p = __expect( p, '{' );
+        for( i = 0; i < label_count; i++ ) {
+            if( 0 != i ) {
+                p = __expect( p, ',' );
+            }
+            p = __skip( p, pairs[2 * i] );
+            p = __expect( p, '=' );
+            p = __expect( p, '"' );
+            p = __skip_escaped( p, pairs[2 * i + 1] );
+            p = __expect( p, '"' );
+        }
+        p = __expect( p, '}' );
     }
 
-    mkdir( path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH );
+    return ((NULL != p) && ('\0' == *p)) ? 1 : 0;
 }
 
-static char* __get_filename( __metrics_t *m )
+/* See internal.h for details. */
+struct series* __unsafe_series( __metrics_t *m, metric_type_t type,
+                                const char *name )
 {
-    const char *path, *name;
-    char *rv;
-    size_t len;
-
-    path = m->c->metrics_path;
-    name = m->c->process_name;
+    struct trie *t = (MT_COUNTER == type) ? m->counters : m->gauges;
+    struct series *s;
+
+    s = (struct series*) trie_search( t, name );
+    if( NULL == s ) {
+        size_t len = strlen( name );
+        const char *brace = strchr( name, '{' );
+        struct family *f;
+
+        f = __unsafe_family( m, type, name,
+                             (NULL == brace) ? len : (size_t) (brace - name) );
+        if( NULL == f ) {
+            return NULL;
+        }
 
-    if( NULL == path ) {
-        path = DEFAULT_METRICS_PATH;
+        s = (struct series*) malloc( sizeof(struct series) + len + 1 );
+        if( NULL == s ) {
+            return NULL;
+        }
+        s->slot = __unsafe_value_alloc( m, &s->id, &s->stamp );
+        if( NULL == s->slot ) {
+            free( s );
+            return NULL;
+        }
+        s->type = type;
+        s->sampled = 0;
+        s->family = f;
+        s->len = len;
+        memcpy( s->name, name, len + 1 );
+        trie_insert( t, name, s );
+        m->series_generation++;
     }
 
-    if( NULL == name ) {
-        name = DEFAULT_PROCESS_NAME;
-    }
+    return s;
+}
 
-    len = strlen( path ) + 1 + strlen( name ) + 1;
-    rv = (char*) malloc( len * sizeof(char) );
-    sprintf( rv, "%s/%s", path, name );
+static void __unsafe_gauge_set( __metrics_t* m, const char *name, int64_t value )
+{
+    struct series *s;
 
-    return rv;
+    s = __unsafe_series( m, MT_GAUGE, name );
+    if( NULL != s ) {
+        __atomic_store_n( (int64_t*) s->slot, value, __ATOMIC_RELAXED );
+        if( NULL != s->stamp ) {
+            __atomic_store_n( s->stamp, __stamp_now(), __ATOMIC_RELAXED );
+        }
+    }
 }
 
-static void* __report_loop( void *__m )
+static void __unsafe_counter_inc( __metrics_t* m, const char *name, uint32_t inc )
 {
-    __metrics_t *m = (__metrics_t*) __m;
-    char *buf;
-    size_t len;
-    char *filename;
+    struct series *s;
 
-    len = DEFAULT_REPORT_SIZE;
-    if( 0 < m->c->initial_report_size ) {
-        len = m->c->initial_report_size;
+    s = __unsafe_series( m, MT_COUNTER, name );
+    if( NULL != s ) {
+        __atomic_add_fetch( s->slot, inc, __ATOMIC_RELAXED );
+        if( NULL != s->stamp ) {
+            __atomic_store_n( s->stamp, __stamp_now(), __ATOMIC_RELAXED );
+        }
     }
-    buf = (char*) malloc( len * sizeof(char) );
-    memset( buf, 0, len );
+}
 
-    /* Record the report buffer size as metrics */
-    metrics_gauge_set_labels( (metrics_t) m, "metrics_report_buffer",
-                              len, 1, "size", "default" );
-    metrics_gauge_set( (metrics_t) m, m->label__report_buffer, len );
+/**
+ *  Returns the string after the character c, or NULL if it does not start
+ *  with it or is NULL.
+ */
+static const char* __expect( const char *p, char c )
+{
+    return ((NULL != p) && (c == *p)) ? p + 1 : NULL;
+}
 
-    __mkdir( m );
-    filename = __get_filename( m );
+/**
+ *  Returns the string after the prefix s, or NULL if it does not start with
+ *  it or is NULL.
+ */
+static const char* __skip( const char *p, const char *s )
+{
+    size_t len = strlen( s );
 
-    while( 0 != m->keep_running ) {
-        int fd;
+    return ((NULL != p) && (0 == strncmp(p, s, len))) ? p + len : NULL;
+}
 
-        sleep( __get_report_period(m) );
-        __generate_report( m, &buf, &len );
+/**
+ *  __skip() for a label value as __escape() writes it.
+ */
+static const char* __skip_escaped( const char *p, const char *s )
+{
+    size_t len;
 
-        fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 
-                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
+    while( (NULL != p) && ('\0' != *s) ) {
+        /* Compare what needs no escaping in one go. */
+        len = strcspn( s, "\\\"\n" );
+        p = (0 == strncmp(p, s, len)) ? p + len : NULL;
+        s += len;
 
-        if( -1 != fd ) {
-            write( fd, buf, len );
-            close( fd );
+        if( '\0' != *s ) {
+            p = __expect( __expect(p, '\\'), ('\n' == *s) ? 'n' : *s );
+            s++;
         }
     }
 
-    free( buf );
-    free( filename );
-
-    return NULL;
+    return p;
 }
 
-void __generate_report( metrics_t __m, char **buf, size_t *len )
+/**
+ *  Returns the length of a label value once escaped.
+ */
+static size_t __escaped_len( const char *s )
 {
-    struct trie_visitor d;
-    __metrics_t *m = (__metrics_t*) __m;
-
-    __unsafe_counter_inc( (metrics_t) m, "metrics_report_count", 1 );
+    size_t len = 0;
 
-    d.m = m;
-    d.buf = *buf;
-    d.len = *len;
-    d.used = 0;
-
-    pthread_mutex_lock( &m->mutex );
-
-    d.type = MT_COUNTER;
-    trie_visit( m->counters, "", __visitor, &d );
-
-    d.type = MT_GAUGE;
-    trie_visit( m->gauges, "", __visitor, &d );
-
-    pthread_mutex_unlock( &m->mutex );
+    for( ; '\0' != *s; s++ ) {
+        len += ( ('\\' == *s) || ('"' == *s) || ('\n' == *s) ) ? 2 : 1;
+    }
 
-    *buf = d.buf;
-    *len = d.len;
+    return len;
 }
 
-static int __visitor( const char *key, void *data, void *arg )
+/**
+ *  Copies a label value escaping \, " and newline as the exposition format
+ *  requires.  The destination is not '\0' terminated.
+ *
+ *  @return the number of bytes written
+ */
+static size_t __escape( char *dst, const char *s )
 {
-    struct trie_visitor *tv = (struct trie_visitor*) arg;
-    char *p;
-    size_t left;
-    int written;
-
-    if( tv->len <= (tv->used + MAX_LINE_LENGTH_BEFORE_REALLOC) ) {
-
-        tv->len += BUFFER_SIZE_INCREASE;
-        
-        tv->buf = (char*) realloc( tv->buf, tv->len * sizeof(char) );
-        __unsafe_gauge_set( (metrics_t) tv->m, tv->m->label__report_buffer,
-                            tv->len );
+    char *p = dst;
+
+    for( ; '\0' != *s; s++ ) {
+        switch( *s ) {
+            case '\\':
+            case '"':
+                *p++ = '\\';
+                *p++ = *s;
+                break;
+            case '\n':
+                *p++ = '\\';
+                *p++ = 'n';
+                break;
+            default:
+                *p++ = *s;
+                break;
+        }
     }
 
-    left = tv->len - tv->used - 1; // -1 for ensuring space for the trailing '\0'
-    p = &tv->buf[tv->used];
-
-    written = 0;
-    switch( tv->type ) {
-        case MT_COUNTER:
-            written = snprintf( p, left, "%s_%s %"PRIu64"\n", tv->m->c->base,
-                                key, *((uint64_t*) data) );
-            break;
-        case MT_GAUGE:
-            written = snprintf( p, left, "%s_%s %"PRId64"\n", tv->m->c->base,
-                                key, *((int64_t*) data) );
-            break;
-        default:
-            break;
-    }
+    return p - dst;
+}
 
-    p[written] = '\0';
-    tv->used += written;
+/**
+ *  Copies a string without the trailing '\0'.
+ *
+ *  @return the number of bytes written
+ */
+static size_t __copy( char *dst, const char *s )
+{
+    size_t len = strlen( s );
 
-    return 0;
+    memcpy( dst, s, len );
+
+    return len;
 }
 
 static int __destroyer( const char *key, void *data, void *arg )
@@ -29,6 +29,78 @@
 /*----------------------------------------------------------------------------*/
 /*                               Data Structures                              */
 /*----------------------------------------------------------------------------*/
+typedef enum {
+    METRICS_COUNTER,
+    METRICS_GAUGE,
+
+    /* A per second rate derived at report time, see report_deltas and
+     * metrics_ewma_mark(). */
+    METRICS_RATE
+} metrics_type_t;
+
+/* A single series of a report snapshot, as seen by an exporter. */
+struct metrics_series {
+    /* The complete metric name including labels, without the base prefix.
+     * Valid until metrics_shutdown() is called, except for the series
+     * derived with report_deltas which are only valid during the call. */
+    const char *name;
+    size_t name_len;
+
+    metrics_type_t type;
+
+    union {
+        uint64_t counter;
+        int64_t gauge;
+        double rate;
+    } value;
+
+    /* With timestamps configured, when the snapshot was taken and when the
+     * series was last updated, in milliseconds since the epoch; otherwise 0.
+     * updated_ms is also 0 if the series has not been updated by name since
+     * metrics_init(), e.g. a static metric only updated with METRIKS_INC(). */
+    uint64_t timestamp_ms;
+    uint64_t updated_ms;
+
+    /* Series are grouped by family (the name without labels).  On the first
+     * series of each family this is the family's "# HELP" and "# TYPE"
+     * exposition lines (already escaped and including the base prefix);
+     * otherwise it is NULL. */
+    const char *header;
+    size_t header_len;
+};
+
+/*
+ *  An exporter receives every report.  The snapshot of the metrics is taken
+ *  once per report period and the same snapshot is passed through every
+ *  exporter in order:
+ *
+ *      begin() -> series() for each series -> end() -> flush()
+ *
+ *  Exporters are called from the report thread without the metrics lock
+ *  held.  Any function pointer may be NULL.  The return values are currently
+ *  informational; 0 means success.
+ */
+struct metrics_exporter {
+    void *ctx;
+
+    /* Called at the start of a report with the base prefix and the number of
+     * series in the snapshot. */
+    int (*begin)( void *ctx, const char *base, size_t count );
+
+    /* Called once per series, counters first.  Families are in
+     * lexicographical order and all the series of a family are together. */
+    int (*series)( void *ctx, const struct metrics_series *s );
+
+    /* Called after the last series of the report. */
+    int (*end)( void *ctx );
+
+    /* Called to deliver anything still buffered to the destination. */
+    int (*flush)( void *ctx );
+
+    /* Called by metrics_exporter_destroy(). */
+    void (*destroy)( void *ctx );
+};
+
 struct metrics_config {
     /* The name to prefix all the metrics with. */
     const char *base;
@@ -45,13 +117,169 @@ struct metrics_config {
 
     const char *metrics_path;
 
-    /** Only used if ENABLE_PROCFS flag is enabled */
-    /* The reporting period in seconds.  0 means use the default: 15s */
+    /* The reporting period in seconds.  0 means use the default: 900s */
     uint32_t report_period_s;
+
+    /* The reporting period in milliseconds.  If non-zero it is used instead
+     * of report_period_s. */
+    uint32_t report_period_ms;
+
+    /* The most series a report collects, or values it copies, each time it
+     * takes the registry lock.  The lock is released in between, so adding a
+     * series never waits for more than one slice however many series there
+     * are.  0 means use the default: 1024 */
+    size_t report_slice_size;
+
+    /* If non-zero, metrics_counter_inc() only adds the increment to the
+     * calling thread's own running total of the counter, for up to about 256
+     * counters a thread, so threads incrementing the same counter never share
+     * a cache line.  The totals are drained into the registry by the report
+     * thread (or by metrics_thread_flush()), so totals are eventually
+     * consistent within one report period. */
+    int thread_buffered_counters;
+
+    /* The exporters each report is sent to.  If exporter_count is 0 the
+     * report is written as text to metrics_path/process_name.  The exporters
+     * are owned by the caller and must outlive the metrics object. */
+    struct metrics_exporter **exporters;
+    size_t exporter_count;
+
+    /* If not NULL, a thread serves the current metrics over HTTP on a UNIX
+     * stream socket at this path.  A "GET /metrics" request returns a fresh
+     * snapshot in the same text format as the report file, independent of
+     * report_period_s. */
+    const char *scrape_socket_path;
+
+    /* If non-zero, the registry is reported by a single thread shared by
+     * every registry in the process with this set, instead of starting a
+     * thread of its own.  Each report still only locks its own registry. */
+    int shared_reporter;
+
+    /* If non-zero, metrics_init() returns a registry that ignores every
+     * update and never reports.  See METRIKS_DISABLED to remove the calls at
+     * compile time instead. */
+    int disabled;
+
+    /* If non-zero, every report also includes, after each counter family,
+     * the increase of each counter since the previous report and that
+     * increase per second, measured with a monotonic clock:
+     *
+     *     base_name_delta{label="value"} 30
+     *     base_name_rate_per_s{label="value"} 2
+     *
+     * The first report counts from metrics_init(), and a counter that went
+     * backwards counts from 0.  A report less than half a period after the
+     * previous one, such as the final report at shutdown, has the deltas but
+     * not the rates.  The scrape endpoint is not affected. */
+    int report_deltas;
+
+    /* If non-zero, each series of a snapshot carries the time the snapshot
+     * was taken and the time the series was last updated (see struct
+     * metrics_series).  The text format, in reports and scrapes alike,
+     * appends the snapshot time:
+     *
+     *     base_name{label="value"} 123 1571234567890
+     *
+     * Updates read CLOCK_MONOTONIC_COARSE, which never enters the kernel, so
+     * the update times are only as precise as the kernel tick (1-10ms).
+     * Increments buffered by thread_buffered_counters are stamped when they
+     * are applied. */
+    int timestamps;
+
+    /* If non-zero, the default report file is written with io_uring where
+     * the kernel allows it: each report is written to a temporary file,
+     * synced and renamed over metrics_path/process_name in the background,
+     * while the next report is rendered into a second buffer.  Readers
+     * always see a complete report.  Otherwise, and where io_uring is not
+     * available, the file is rewritten in place with blocking writes. */
+    int async_file_io;
+
+    /* If non-zero, the default report file is gzip compressed at this zlib
+     * level (1 fastest - 9 smallest; out of range means zlib's default) and
+     * ".gz" is added to its name.  The text is compressed in chunks as it is
+     * rendered, so only the compressed report is kept in memory.  Ignored
+     * if the library was built without zlib. */
+    int compression_level;
+
+    /* If non-zero, the values of the series are kept in shared memory, so
+     * after fork() the updates a child makes to the series that existed at
+     * the fork are seen (and reported) by the parent, with no messages
+     * between the processes.  Series the child creates afterwards, and
+     * static metrics (whose counters start again from 0), stay private to
+     * the child.  Otherwise a forked child starts its counters again from 0.
+     *
+     * Either way a forked child reports on a thread of its own to
+     * metrics_path/process_name.<pid>; the scrape endpoint stays with the
+     * parent.  A child only reports the series that are its own, so adding
+     * up the reports of every process (see metrics_aggregate()) counts each
+     * update once. */
+    int fork_shared_values;
+
+    /* If not NULL, every report also saves the counters to this file, and
+     * metrics_init() adds the values saved there, so counters carry on from
+     * where the previous process left off instead of starting from 0.
+     *
+     * The file is binary and written through a memory mapping: the names
+     * only when counters are added, otherwise just the values, alternating
+     * between two checksummed copies so a write cut short by a crash leaves
+     * the other one.  A damaged file restores nothing.  Gauges are not
+     * saved.  Each registry needs a file of its own, and a forked child does
+     * not write to its parent's. */
+    const char *persist_path;
+
+    /* If non-zero, every report first samples the process from /proc/self
+     * into these counters:
+     *
+     *     process_cpu_user_ms, process_cpu_system_ms,
+     *     process_voluntary_context_switches,
+     *     process_involuntary_context_switches, process_read_bytes,
+     *     process_write_bytes, process_storage_read_bytes,
+     *     process_storage_write_bytes
+     *
+     * and these gauges:
+     *
+     *     process_threads, process_virtual_memory_bytes,
+     *     process_resident_memory_bytes, process_open_fds
+     *
+     * The counters are the kernel's totals for the process, so they are not
+     * saved to persist_path.  With fork_shared_values a forked child leaves
+     * all of them to its parent, whose values they share.
+     *
+     * The files are kept open and read with pread() into a fixed buffer, so
+     * a sample makes no allocations and takes a few system calls.  Metrics
+     * whose file cannot be opened (such as /proc/self/io without the kernel
+     * option) are left out.  Linux only. */
+    int process_metrics;
+
+    /* The number of hash bits that pick a register of a distinct count, from
+     * 4 to 16, or 0 for 12.  Each distinct count takes 1 << bits bytes and
+     * is off by about 1.04 / sqrt(1 << bits): 4 KB and 1.6% by default. */
+    int distinct_precision;
+
+    /* If non-zero, each report counts only the keys added since the one
+     * before, otherwise every key since the start. */
+    int distinct_reset;
+
+    /* The number of keys each top-K metric reports, or 0 for 10. */
+    int topk_size;
 };
 
 typedef void* metrics_t;
 
+/* The storage of a metric declared with METRIKS_COUNTER() or METRIKS_GAUGE().
+ * The members are private; use the METRIKS_ macros. */
+struct metrics_static {
+    union {
+        uint64_t counter;
+        int64_t gauge;
+    } value;
+
+    metrics_type_t type;
+
+    /* The metric name followed by the label, value pairs; NULL terminated. */
+    const char *const *names;
+};
+
 /*----------------------------------------------------------------------------*/
 /*                               Common Functions                             */
 /*----------------------------------------------------------------------------*/
@@ -99,6 +327,46 @@ char* metrics_calculate_name_varidac( const char *name, size_t label_count,
                                       va_list args );
 
 
+/**
+ *  Sets the help text reported for a metric family (the metric name without
+ *  labels).  The help text is escaped and the exposition header is built
+ *  once, when this is called, so rendering stays a copy.
+ *
+ *  @param m    - The metric object to reference.
+ *  @param type - The type of the metric family.
+ *  @param name - The metric name without labels.
+ *  @param help - The help text, copied.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+int metrics_help( metrics_t m, metrics_type_t type, const char *name,
+                  const char *help );
+
+/**
+ *  Drains every thread's buffered counter increments into the registry, not
+ *  only the calling thread's, holding the registry lock while it does.  This
+ *  is only needed when thread_buffered_counters is enabled and the updates
+ *  must be visible before the next report.
+ *
+ *  @param m - The metric object to reference.
+ */
+void metrics_thread_flush( metrics_t m );
+
+/**
+ *  Builds a minimal perfect hash of the names of every series there is now.
+ *  From then on metrics_counter_inc(), metrics_gauge_set() and the *_labels()
+ *  functions find these series with one hash, one table probe and one
+ *  compare.  Series added later still work, they are just found the slower
+ *  way.  Call it once startup has created the series, and again if many
+ *  more have been added since.
+ *
+ *  @param m - The metric object to reference.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+int metrics_freeze( metrics_t m );
+
+
 /*----------------------------------------------------------------------------*/
 /*                              Counter Functions                             */
 /*----------------------------------------------------------------------------*/
@@ -134,9 +402,11 @@ void metrics_counter_inc(metrics_t m, const char *name, uint32_t inc );
 /**
  *  This function increments a metrics counter a specified amount.
  *
- *  @note If you are performing repeated metric updates to the same metric,
- *        this is slower then using metrics_calculate_name() and locally
- *        caching the name.
+ *  @note Each thread caches the metrics of its recent calls by the name and
+ *        label pointers, so repeated calls with the same string literals
+ *        skip building the complete name.  Calls with more than 4 labels
+ *        are not cached and are slower than using metrics_calculate_name()
+ *        and locally caching the name.
  *
  *  @param m           - The metric object to reference.
  *  @param name        - The metric name to increment.
@@ -180,9 +450,11 @@ void metrics_gauge_set( metrics_t m, const char *name, int64_t value );
 /**
  *  This function updates a metrics gauge to a specified value.
  *
- *  @note If you are performing repeated metric updates to the same metric,
- *        this is slower then using metrics_calculate_name() and locally
- *        caching the name.
+ *  @note Each thread caches the metrics of its recent calls by the name and
+ *        label pointers, so repeated calls with the same string literals
+ *        skip building the complete name.  Calls with more than 4 labels
+ *        are not cached and are slower than using metrics_calculate_name()
+ *        and locally caching the name.
  *
  *  @param m           - The metric object to reference.
  *  @param name        - The base metric name to update.
@@ -193,6 +465,617 @@ void metrics_gauge_set( metrics_t m, const char *name, int64_t value );
 void metrics_gauge_set_labels( metrics_t m, const char *name, int64_t value,
                                size_t label_count, ... );
 
+/*----------------------------------------------------------------------------*/
+/*                        Moving Average Functions                            */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  A moving average tracks how often something happens, smoothed the way the
+ *  load average is: the 1, 5 and 15 minute exponentially weighted moving
+ *  averages of the rate per second, reported (and scraped) as
+ *
+ *      base_name_rate_1m{label="value"} 12.5
+ *      base_name_rate_5m{label="value"} 11.9
+ *      base_name_rate_15m{label="value"} 10.2
+ *
+ *  Marking only adds to a count.  The report thread applies the decay every
+ *  5 seconds whatever the report period, waking up between reports to do so
+ *  once any moving average exists, so the averages move in 5 second steps and
+ *  a report period shorter than that sees the same values more than once.
+ */
+
+/**
+ *  Records that something happened count times.
+ *
+ *  @param m     - The metric object to reference.
+ *  @param name  - The metric name, possibly with labels.
+ *  @param count - The number of times it happened.
+ */
+void metrics_ewma_mark( metrics_t m, const char *name, uint32_t count );
+
+/**
+ *  Records that something happened count times, with labels.
+ *
+ *  @param m           - The metric object to reference.
+ *  @param name        - The base metric name.
+ *  @param count       - The number of times it happened.
+ *  @param label_count - The number of label pairs to associate with this metric.
+ *  @param ...         - Label, value pair to associate with the metric.
+ */
+void metrics_ewma_mark_labels( metrics_t m, const char *name, uint32_t count,
+                               size_t label_count, ... );
+
+/*----------------------------------------------------------------------------*/
+/*                          Distinct Count Functions                          */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  A distinct count estimates how many different keys (devices, clients,
+ *  users) were added under a name, in a fixed amount of memory however many
+ *  there are, with a HyperLogLog sketch.  Each report sets a gauge of the
+ *  same name to the estimate; see distinct_precision and distinct_reset.
+ *
+ *  Adding a key hashes it and at most raises one register with an atomic
+ *  compare and swap, so it takes no lock once the name has been seen.
+ */
+
+/**
+ *  Adds a key to a distinct count.
+ *
+ *  @param m    - The metric object to reference.
+ *  @param name - The metric name, possibly with labels.
+ *  @param key  - The bytes of the key.
+ *  @param len  - The length of the key in bytes.
+ */
+void metrics_distinct_add( metrics_t m, const char *name, const void *key,
+                           size_t len );
+
+/**
+ *  Adds a key to a distinct count, with labels.
+ *
+ *  @param m           - The metric object to reference.
+ *  @param name        - The base metric name.
+ *  @param key         - The bytes of the key.
+ *  @param len         - The length of the key in bytes.
+ *  @param label_count - The number of label pairs to associate with this metric.
+ *  @param ...         - Label, value pair to associate with the metric.
+ */
+void metrics_distinct_add_labels( metrics_t m, const char *name,
+                                  const void *key, size_t len,
+                                  size_t label_count, ... );
+
+/*----------------------------------------------------------------------------*/
+/*                              Top-K Functions                               */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  A top-K metric counts the keys of a dimension with too many values to
+ *  give each one a series (endpoints, device models, error strings) and
+ *  reports only the topk_size most counted, as a gauge family:
+ *
+ *      base_name{label="key"} 1234
+ *
+ *  It keeps a fixed number of keys with the Space-Saving algorithm, so a
+ *  key's count may include some of the keys it replaced and a key that
+ *  drops out loses its count.  Keys longer than 63 bytes are cut short.
+ *  The counts are since the start and are not saved by persist_path.
+ *
+ *  The keys are split over a few sketches, each with its own lock, and a
+ *  thread always uses the same one, so adding rarely waits.
+ */
+
+/**
+ *  Counts a key of a top-K metric.
+ *
+ *  @param m     - The metric object to reference.
+ *  @param name  - The metric name, without labels.
+ *  @param label - The label the keys are reported as the values of.  Only
+ *                 the one given the first time is used.
+ *  @param key   - The key to count.
+ *  @param count - How many times to count it.
+ */
+void metrics_topk_add( metrics_t m, const char *name, const char *label,
+                       const char *key, uint32_t count );
+
+/*----------------------------------------------------------------------------*/
+/*                            Aggregation Functions                           */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  Many processes on a host each write their own metrics_path/process_name
+ *  report.  metrics_aggregate() (or the metriks-aggregate tool) merges every
+ *  text report in a directory into a single file for the host:
+ *
+ *      - series with the same name are combined into one: counters are added
+ *        up and gauges combined by the rule of their family,
+ *      - the latest timestamp of a series is kept,
+ *      - each family keeps the longest of its headers, so "# HELP" lines
+ *        are not lost.
+ *
+ *  The files are mapped rather than read and merged in one pass, family by
+ *  family and then series by series, relying on the name order reports are
+ *  written in.  Files whose names start with '.', binary and compressed
+ *  reports, and the output itself, are left out.  A report cut short keeps
+ *  its complete lines.
+ */
+
+typedef enum {
+    METRICS_GAUGE_SUM,
+    METRICS_GAUGE_MIN,
+    METRICS_GAUGE_MAX,
+    METRICS_GAUGE_AVERAGE
+} metrics_gauge_rule_t;
+
+/* How to combine the gauges of the families whose names start with prefix,
+ * including the base. */
+struct metrics_gauge_rule {
+    const char *prefix;
+    metrics_gauge_rule_t rule;
+};
+
+struct metrics_aggregate_config {
+    /* The directory of the report files. */
+    const char *dir;
+
+    /* The file to write, replaced once it is complete. */
+    const char *output;
+
+    /* How to combine gauges with no rule of their own. */
+    metrics_gauge_rule_t gauge_rule;
+
+    /* The rules by prefix; the longest matching prefix wins. */
+    const struct metrics_gauge_rule *rules;
+    size_t rule_count;
+};
+
+/**
+ *  Merges every report in a directory into one file.
+ *
+ *  @param c - What to merge and how.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+int metrics_aggregate( const struct metrics_aggregate_config *c );
+
+/*----------------------------------------------------------------------------*/
+/*                              Exporter Functions                            */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Creates an exporter that writes the text report to a file.  This is the
+ *  format written to metrics_path/process_name by default:
+ *
+ *      base_name{label="value"} 123
+ *
+ *  @param filename - The file to write, copied by the function.
+ *
+ *  @return the exporter or NULL on error
+ */
+struct metrics_exporter* metrics_exporter_text_file( const char *filename );
+
+/**
+ *  Creates an exporter that writes a binary report to a file.  All integers
+ *  are in host byte order:
+ *
+ *      header:  "MTRK" | uint32_t version (1) | uint32_t count |
+ *               uint16_t base_len | base
+ *      series:  uint8_t type | uint16_t name_len | name | uint64_t value
+ *
+ *  The type is a metrics_type_t value; gauges are stored as int64_t and
+ *  rates as a double.  A series whose name is longer than 65535 bytes is
+ *  left out, and not counted.
+ *
+ *  @param filename - The file to write, copied by the function.
+ *
+ *  @return the exporter or NULL on error
+ */
+struct metrics_exporter* metrics_exporter_binary_file( const char *filename );
+
+/**
+ *  Creates an exporter that sends the report as StatsD lines to a local UNIX
+ *  datagram socket.  Counters are sent as the increase since the previous
+ *  report, gauges as their value.  Sends never block; if the collector is not
+ *  listening the report is dropped.
+ *
+ *  With dogstatsd set the labels are sent as DogStatsD tags:
+ *
+ *      base_name:1|c|#label:value
+ *
+ *  Otherwise the label values are appended to the name:
+ *
+ *      base_name.value:1|c
+ *
+ *  @param socket_path - The path of the collector's socket, copied.
+ *  @param dogstatsd   - Non-zero to use the DogStatsD tag extension.
+ *
+ *  @return the exporter or NULL on error
+ */
+struct metrics_exporter* metrics_exporter_statsd( const char *socket_path,
+                                                  int dogstatsd );
+
+/**
+ *  Creates an exporter that calls back into the application for each series.
+ *
+ *  @param fn  - The function to call for each series.
+ *  @param arg - The argument passed to fn.
+ *
+ *  @return the exporter or NULL on error
+ */
+struct metrics_exporter* metrics_exporter_callback(
+                int (*fn)( void *arg, const char *base,
+                           const struct metrics_series *s ),
+                void *arg );
+
+/**
+ *  Destroys an exporter created by one of the functions above, or any
+ *  exporter providing a destroy() function.
+ *
+ *  @param e - The exporter to destroy.
+ */
+void metrics_exporter_destroy( struct metrics_exporter *e );
+
+/*----------------------------------------------------------------------------*/
+/*                               Batch Functions                              */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  A batch collects a number of counter and gauge updates and applies them
+ *  to the metrics object in a single pass while holding the lock once.
+ *
+ *  Batches are designed to be reused.  When the same batch is filled with the
+ *  same sequence of metric names (the common case of a request handler that
+ *  always emits the same series) the storage resolved during the previous
+ *  metrics_batch_apply() is reused, so applying the batch does not need to
+ *  look up any of the names again.
+ *
+ *  A batch is not thread safe; use one batch per thread.
+ *
+ *  Example
+ *  -------
+ *
+ *  metrics_batch_t b = metrics_batch_create( m );
+ *
+ *  for each request {
+ *      metrics_batch_counter_inc( b, "bytes_in", in );
+ *      metrics_batch_counter_inc( b, "bytes_out", out );
+ *      metrics_batch_gauge_set( b, "latency_ms", latency );
+ *      metrics_batch_apply( b );
+ *  }
+ *
+ *  metrics_batch_destroy( b );
+ */
+
+typedef void* metrics_batch_t;
+
+/**
+ *  Creates a batch bound to a metrics object.
+ *
+ *  @param m - The metric object the batch applies to.
+ *
+ *  @return the batch or NULL on error
+ */
+metrics_batch_t metrics_batch_create( metrics_t m );
+
+/**
+ *  Destroys a batch.  Any updates not yet applied are discarded.
+ *
+ *  @note The batch must be destroyed before metrics_shutdown() is called on
+ *        the metrics object it is bound to.
+ *
+ *  @param b - The batch to destroy.
+ */
+void metrics_batch_destroy( metrics_batch_t b );
+
+/**
+ *  Adds a counter increment to the batch.
+ *
+ *  @param b    - The batch to add to.
+ *  @param name - The metric name to increment.
+ *  @param inc  - The quantity to increment by.
+ */
+void metrics_batch_counter_inc( metrics_batch_t b, const char *name,
+                                uint32_t inc );
+
+/**
+ *  Adds a counter increment with labels to the batch.
+ *
+ *  @param b           - The batch to add to.
+ *  @param name        - The base metric name to increment.
+ *  @param inc         - The quantity to increment by.
+ *  @param label_count - The number of label pairs to associate with this metric.
+ *  @param ...         - Label, value pair to associate with the metric.
+ */
+void metrics_batch_counter_inc_labels( metrics_batch_t b, const char *name,
+                                       uint32_t inc, size_t label_count, ... );
+
+/**
+ *  Adds a gauge update to the batch.
+ *
+ *  @param b     - The batch to add to.
+ *  @param name  - The metric name to update.
+ *  @param value - The value to set the gauge to.
+ */
+void metrics_batch_gauge_set( metrics_batch_t b, const char *name,
+                              int64_t value );
+
+/**
+ *  Adds a gauge update with labels to the batch.
+ *
+ *  @param b           - The batch to add to.
+ *  @param name        - The base metric name to update.
+ *  @param value       - The value to set the gauge to.
+ *  @param label_count - The number of label pairs to associate with this metric.
+ *  @param ...         - Label, value pair to associate with the metric.
+ */
+void metrics_batch_gauge_set_labels( metrics_batch_t b, const char *name,
+                                     int64_t value, size_t label_count, ... );
+
+/**
+ *  Applies all the updates collected in the batch, in the order they were
+ *  added, and empties the batch so it can be filled again.
+ *
+ *  @param b - The batch to apply.
+ */
+void metrics_batch_apply( metrics_batch_t b );
+
+/*----------------------------------------------------------------------------*/
+/*                               Scope Functions                              */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  A scope gives a component its own view of a metrics object: every name
+ *  used through the scope is reported as the scope's prefix followed by the
+ *  name, with the scope's labels.  The prefix and labels are resolved once,
+ *  when the scope is created, so an update only looks up the short name the
+ *  component passes in.
+ *
+ *  Scopes belong to the metrics object.  Asking for the same prefix and
+ *  labels again returns the same scope, and scopes stay valid until
+ *  metrics_shutdown() is called.  Scopes are thread safe.
+ *
+ *  Example
+ *  -------
+ *
+ *  metrics_scope_t s = metrics_scope( m, "cache_", 1, "shard", "3" );
+ *
+ *  metrics_scope_counter_inc( s, "hits", 1 );   // cache_hits{shard="3"}
+ *  metrics_scope_gauge_set( s, "entries", n );  // cache_entries{shard="3"}
+ *
+ *  metrics_scope_report( s, e );                // only the cache_ series
+ */
+
+typedef void* metrics_scope_t;
+
+/**
+ *  Gets the scope for a prefix and labels.
+ *
+ *  @param m           - The metric object the scope belongs to.
+ *  @param prefix      - The prefix of every name used through the scope,
+ *                       which may not contain labels.
+ *  @param label_count - The number of label pairs every series gets.
+ *  @param ...         - Label, value pairs.
+ *
+ *  @return the scope or NULL on error
+ */
+metrics_scope_t metrics_scope( metrics_t m, const char *prefix,
+                               size_t label_count, ... );
+
+/**
+ *  Increments a counter through a scope.
+ *
+ *  @param s    - The scope to use.
+ *  @param name - The metric name after the prefix, without labels.
+ *  @param inc  - The quantity to increment by.
+ */
+void metrics_scope_counter_inc( metrics_scope_t s, const char *name,
+                                uint32_t inc );
+
+/**
+ *  Sets a gauge through a scope.
+ *
+ *  @param s     - The scope to use.
+ *  @param name  - The metric name after the prefix, without labels.
+ *  @param value - The value to set the gauge to.
+ */
+void metrics_scope_gauge_set( metrics_scope_t s, const char *name,
+                              int64_t value );
+
+/**
+ *  Exports every family starting with the scope's prefix right away, apart
+ *  from the periodic reports.  Series of the families are exported whatever
+ *  their labels, including the ones not updated through this scope.
+ *
+ *  @param s - The scope to report.
+ *  @param e - The exporter to use, which is not taken over.
+ *
+ *  @return 0 on success, non-zero on error
+ */
+int metrics_scope_report( metrics_scope_t s, struct metrics_exporter *e );
+
+/*----------------------------------------------------------------------------*/
+/*                               Timer Functions                              */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  A timer adds how long something took to two counters:
+ *
+ *  metrics_timer_t t = metrics_timer( m, "db_query", 1, "op", "get" );
+ *
+ *  uint64_t start = metrics_timer_start();
+ *  ...
+ *  metrics_timer_stop( t, start );  // db_query_duration_ns{op="get"}
+ *                                   // db_query_count{op="get"}
+ *
+ *  On x86 CPUs whose TSC runs at a constant rate the times are read with
+ *  rdtsc and rdtscp, which take tens of cycles, otherwise with
+ *  CLOCK_MONOTONIC.  The first metrics_init() works out how long a TSC
+ *  tick is, taking about 2 ms, so timing only works once it has run.
+ */
+
+typedef void* metrics_timer_t;
+
+/**
+ *  Gets the timer for a name and labels.  The timer stays valid until the
+ *  registry is shut down.
+ *
+ *  @param m           - The metric object the timer belongs to.
+ *  @param name        - The base metric name, without labels.
+ *  @param label_count - The number of label pairs the series get.
+ *  @param ...         - Label, value pairs.
+ *
+ *  @return the timer or NULL on error
+ */
+metrics_timer_t metrics_timer( metrics_t m, const char *name,
+                               size_t label_count, ... );
+
+/**
+ *  Reads the time to start timing from, in ticks that only
+ *  metrics_timer_stop() understands.
+ *
+ *  @return the start of the time
+ */
+uint64_t metrics_timer_start( void );
+
+/**
+ *  Adds the time since start, in nanoseconds, and 1 to the counters of the
+ *  timer.
+ *
+ *  @param t     - The timer to add to.
+ *  @param start - The value of metrics_timer_start() to time from.
+ */
+void metrics_timer_stop( metrics_timer_t t, uint64_t start );
+
+/*----------------------------------------------------------------------------*/
+/*                                Static Metrics                              */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  Metrics known at compile time can be declared with static storage.  The
+ *  declarations are collected in the "metriks_static" linker section and
+ *  metrics_init() adds all of them to the registry in one pass, so updating
+ *  them needs no lookup and no allocation; an update is a single atomic
+ *  operation on the static variable.
+ *
+ *  The variable is a C identifier; the metric name and label, value pairs
+ *  follow.  Each combination of name and labels must be declared once.
+ *
+ *  Static metrics belong to the process: every registry reports them and
+ *  they are never reset or freed.  They are also visible to
+ *  metrics_counter_inc() and metrics_gauge_set() by their complete name.
+ *
+ *  Example
+ *  -------
+ *
+ *  METRIKS_COUNTER( requests_get, "requests", "method", "get" );
+ *  METRIKS_GAUGE( queue_depth, "queue_depth" );
+ *
+ *  void handle( void )
+ *  {
+ *      METRIKS_INC( requests_get, 1 );
+ *      METRIKS_SET( queue_depth, depth );
+ *  }
+ */
+
+#define __METRIKS_STATIC( var, type, ... )                                    \
+    static const char *const __metriks_names_##var[] = { __VA_ARGS__, NULL }; \
+    static struct metrics_static var = { { 0 }, type, __metriks_names_##var };\
+    static struct metrics_static *const __metriks_static_##var                \
+        __attribute__((used, section("metriks_static"))) = &var
+
+/**
+ *  Declares a static counter.
+ *
+ *  @param var - The variable to declare.
+ *  @param ... - The metric name, then optional label, value pairs.
+ */
+#define METRIKS_COUNTER( var, ... )                                           \
+    __METRIKS_STATIC( var, METRICS_COUNTER, __VA_ARGS__ )
+
+/**
+ *  Declares a static gauge.
+ *
+ *  @param var - The variable to declare.
+ *  @param ... - The metric name, then optional label, value pairs.
+ */
+#define METRIKS_GAUGE( var, ... )                                             \
+    __METRIKS_STATIC( var, METRICS_GAUGE, __VA_ARGS__ )
+
+/**
+ *  Increments a static counter.
+ */
+#define METRIKS_INC( var, inc )                                               \
+    ((void) __atomic_add_fetch( &(var).value.counter, (inc), __ATOMIC_RELAXED ))
+
+/**
+ *  Sets a static gauge.
+ */
+#define METRIKS_SET( var, v )                                                 \
+    __atomic_store_n( &(var).value.gauge, (int64_t) (v), __ATOMIC_RELAXED )
+
+/*----------------------------------------------------------------------------*/
+/*                               Disabled Builds                              */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  Defining METRIKS_DISABLED before including this header replaces every
+ *  call with a constant expression, so a build with metrics turned off has
+ *  no calls, no argument evaluation beyond the handles and no library to
+ *  link against.
+ */
+#if defined(METRIKS_DISABLED) && !defined(__METRIKS_INTERNAL__)
+
+#define metrics_init( c )                                   ((void) (c), (metrics_t) NULL)
+#define metrics_shutdown( m )                               ((void) (m))
+#define metrics_calculate_name( name, ... )                 ((void) (name), (char*) NULL)
+#define metrics_calculate_name_varidac( name, count, args ) ((void) (name), (char*) NULL)
+#define metrics_help( m, type, name, help )                 ((void) (m), 0)
+#define metrics_thread_flush( m )                           ((void) (m))
+#define metrics_freeze( m )                                 ((void) (m), 0)
+#define metrics_counter_inc( m, name, inc )                 ((void) (m))
+#define metrics_counter_inc_labels( m, ... )                ((void) (m))
+#define metrics_gauge_set( m, name, value )                 ((void) (m))
+#define metrics_gauge_set_labels( m, ... )                  ((void) (m))
+#define metrics_ewma_mark( m, name, count )                 ((void) (m))
+#define metrics_ewma_mark_labels( m, ... )                  ((void) (m))
+#define metrics_distinct_add( m, name, key, len )           ((void) (m))
+#define metrics_distinct_add_labels( m, ... )               ((void) (m))
+#define metrics_topk_add( m, name, label, key, count )      ((void) (m))
+#define metrics_aggregate( c )                              ((void) (c), 0)
+
+#define metrics_exporter_text_file( filename )              ((struct metrics_exporter*) NULL)
+#define metrics_exporter_binary_file( filename )            ((struct metrics_exporter*) NULL)
+#define metrics_exporter_statsd( path, dogstatsd )          ((struct metrics_exporter*) NULL)
+#define metrics_exporter_callback( fn, arg )                ((void) (fn), (void) (arg), (struct metrics_exporter*) NULL)
+#define metrics_exporter_destroy( e )                       ((void) (e))
+
+#define metrics_batch_create( m )                           ((void) (m), (metrics_batch_t) NULL)
+#define metrics_batch_destroy( b )                          ((void) (b))
+#define metrics_batch_counter_inc( b, name, inc )           ((void) (b))
+#define metrics_batch_counter_inc_labels( b, ... )          ((void) (b))
+#define metrics_batch_gauge_set( b, name, value )           ((void) (b))
+#define metrics_batch_gauge_set_labels( b, ... )            ((void) (b))
+#define metrics_batch_apply( b )                            ((void) (b))
+
+#define metrics_scope( m, ... )                             ((void) (m), (metrics_scope_t) NULL)
+#define metrics_scope_counter_inc( s, name, inc )           ((void) (s))
+#define metrics_scope_gauge_set( s, name, value )           ((void) (s))
+#define metrics_scope_report( s, e )                        ((void) (s), (void) (e), 0)
+
+#define metrics_timer( m, ... )                             ((void) (m), (metrics_timer_t) NULL)
+#define metrics_timer_start()                               ((uint64_t) 0)
+#define metrics_timer_stop( t, start )                      ((void) (t), (void) (start))
+
+#undef METRIKS_COUNTER
+#undef METRIKS_GAUGE
+#undef METRIKS_INC
+#undef METRIKS_SET
+#define METRIKS_COUNTER( var, ... )                         extern int __metriks_disabled_##var
+#define METRIKS_GAUGE( var, ... )                           extern int __metriks_disabled_##var
+#define METRIKS_INC( var, inc )                             ((void) 0)
+#define METRIKS_SET( var, v )                               ((void) 0)
+
+#endif
+
 /*----------------------------------------------------------------------------*/
 /*                            Histogram Functions                             */
 /*----------------------------------------------------------------------------*/
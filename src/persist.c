@@ -0,0 +1,487 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+#define PERSIST_MAGIC           "MTRKPST1"
+#define PERSIST_VERSION         1
+
+#define TMP_SUFFIX              ".tmp"
+
+#define CHECKSUM_PRIME_1        0x9e3779b185ebca87ULL
+#define CHECKSUM_PRIME_2        0xc2b2ae3d27d4eb4fULL
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+
+/*
+ *  The file is laid out as:
+ *
+ *      header | records | names (padded to 8 bytes) | slot 0 | slot 1
+ *
+ *  The names only change when counters are added, and the file is then
+ *  written again and renamed into place.  Otherwise each report writes the
+ *  values into the older of the two slots, so a write torn by a crash only
+ *  ever damages one copy and the checksums tell which.
+ */
+struct persist_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t names_len;
+
+    /* The checksum of the records and the names. */
+    uint64_t layout_sum;
+
+    /* The checksum of everything above. */
+    uint64_t header_sum;
+};
+
+/* A counter's name: NUL terminated at offset into the names. */
+struct persist_record {
+    uint32_t offset;
+    uint32_t len;
+};
+
+struct persist_slot {
+    /* Which report wrote it; 0 is never written. */
+    uint64_t seq;
+
+    /* The checksum of seq and the values. */
+    uint64_t sum;
+
+    uint64_t values[];
+};
+
+struct persist {
+    char *filename;
+    char *tmpname;
+
+    void *map;
+    size_t map_len;
+
+    /* The counters the file is laid out for, in snapshot order. */
+    const struct series **series;
+    size_t count;
+
+    /* The snapshot positions of the counters in the file, or NULL if they
+     * are all of them.  Sampled counters are left out. */
+    size_t *index;
+    size_t kept;
+
+    struct persist_slot *slots[2];
+    uint64_t seq;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static size_t __names_offset( size_t );
+static size_t __slot_offset( size_t, uint64_t, int );
+static const struct persist_slot* __newest_slot( const void*, size_t,
+                                                 const struct persist_header* );
+static int __layout( struct persist*, const struct snapshot* );
+static void __write_slot( struct persist_slot*, uint64_t, const uint64_t*,
+                          const size_t*, size_t );
+static uint64_t __slot_sum( const struct persist_slot*, size_t );
+static uint64_t __checksum( uint64_t, const void*, size_t );
+static void __unmap( struct persist* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+int __persist_start( __metrics_t *m )
+{
+    const char *path = m->c->persist_path;
+    struct persist *p;
+
+    m->persist = NULL;
+    if( NULL == path ) {
+        return 0;
+    }
+
+    p = (struct persist*) calloc( 1, sizeof(struct persist) );
+    if( NULL == p ) {
+        return -1;
+    }
+
+    p->filename = strdup( path );
+    p->tmpname = (char*) malloc( strlen(path) + sizeof(TMP_SUFFIX) );
+    if( (NULL == p->filename) || (NULL == p->tmpname) ) {
+        free( p->filename );
+        free( p->tmpname );
+        free( p );
+        return -1;
+    }
+    strcpy( p->tmpname, path );
+    strcat( p->tmpname, TMP_SUFFIX );
+
+    m->persist = p;
+
+    return 0;
+}
+
+/* See internal.h for details. */
+size_t __unsafe_persist_restore( __metrics_t *m )
+{
+    const struct persist_header *h;
+    const struct persist_record *r;
+    const struct persist_slot *slot;
+    const char *names;
+    struct stat st;
+    size_t restored = 0;
+    void *map;
+    uint32_t i;
+    int fd;
+
+    if( NULL == m->persist ) {
+        return 0;
+    }
+
+    fd = open( m->persist->filename, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 ) {
+        return 0;
+    }
+    if( (0 != fstat(fd, &st)) || (st.st_size < (off_t) sizeof(*h)) ) {
+        close( fd );
+        return 0;
+    }
+
+    map = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( MAP_FAILED == map ) {
+        return 0;
+    }
+
+    h = (const struct persist_header*) map;
+    slot = __newest_slot( map, (size_t) st.st_size, h );
+    if( NULL != slot ) {
+        r = (const struct persist_record*) &h[1];
+        names = (const char*) map + __names_offset( h->count );
+
+        for( i = 0; i < h->count; i++ ) {
+            struct series *s;
+
+            /* A name that is not terminated where it says is not used. */
+            if( ((uint64_t) r[i].offset + r[i].len >= h->names_len) ||
+                ('\0' != names[r[i].offset + r[i].len]) )
+            {
+                continue;
+            }
+
+            s = __unsafe_series( m, MT_COUNTER, &names[r[i].offset] );
+            if( NULL != s ) {
+                /* Added, as static counters may have counted already. */
+                __atomic_add_fetch( s->slot, slot->values[i], __ATOMIC_RELAXED );
+                restored++;
+            }
+        }
+    }
+
+    munmap( map, (size_t) st.st_size );
+
+    return restored;
+}
+
+/* See internal.h for details. */
+void __persist_save( __metrics_t *m, const struct snapshot *s )
+{
+    struct persist *p = m->persist;
+    int same;
+
+    if( NULL == p ) {
+        return;
+    }
+
+    /* The snapshot order only changes when counters are added, so this is
+     * almost always the same. */
+    same = (NULL != p->map) && (p->count == s->counters) &&
+           ((0 == p->count) ||
+            (0 == memcmp(p->series, s->series, p->count * sizeof(struct series*))));
+
+    p->seq++;
+    if( 0 != same ) {
+        __write_slot( p->slots[p->seq & 1], p->seq, s->values, p->index,
+                      p->kept );
+    } else {
+        __layout( p, s );
+    }
+}
+
+/* See internal.h for details. */
+void __persist_destroy( __metrics_t *m )
+{
+    struct persist *p = m->persist;
+
+    if( NULL != p ) {
+        __unmap( p );
+        free( p->filename );
+        free( p->tmpname );
+        free( p );
+        m->persist = NULL;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static size_t __names_offset( size_t count )
+{
+    return sizeof(struct persist_header) + count * sizeof(struct persist_record);
+}
+
+static size_t __slot_offset( size_t count, uint64_t names_len, int which )
+{
+    size_t offset = __names_offset( count ) + (size_t) ((names_len + 7) & ~7ULL);
+
+    return offset + (size_t) which * (sizeof(struct persist_slot) +
+                                      count * sizeof(uint64_t));
+}
+
+/**
+ *  Checks the file and returns the newest slot that is intact, or NULL.
+ */
+static const struct persist_slot* __newest_slot( const void *map, size_t len,
+                                                 const struct persist_header *h )
+{
+    const struct persist_slot *newest = NULL;
+    int i;
+
+    if( (0 != memcmp(h->magic, PERSIST_MAGIC, sizeof(h->magic))) ||
+        (PERSIST_VERSION != h->version) ||
+        (h->header_sum != __checksum(0, h, offsetof(struct persist_header, header_sum))) ||
+        (h->names_len > len) ||
+        (__slot_offset(h->count, h->names_len, 2) != len) ||
+        (h->layout_sum != __checksum(0, &h[1], __names_offset(h->count) -
+                                               sizeof(*h) + h->names_len)) )
+    {
+        return NULL;
+    }
+
+    for( i = 0; i < 2; i++ ) {
+        const struct persist_slot *slot;
+
+        slot = (const struct persist_slot*)
+                    ((const char*) map + __slot_offset(h->count, h->names_len, i));
+        if( (0 != slot->seq) && (slot->sum == __slot_sum(slot, h->count)) &&
+            ((NULL == newest) || (newest->seq < slot->seq)) )
+        {
+            newest = slot;
+        }
+    }
+
+    return newest;
+}
+
+/**
+ *  Writes the file again for the counters of the snapshot, with the values
+ *  in the first slot, and renames it into place.
+ */
+static int __layout( struct persist *p, const struct snapshot *s )
+{
+    struct persist_header *h;
+    struct persist_record *r;
+    const struct series **series;
+    uint64_t names_len = 0;
+    size_t i, len, kept;
+    size_t *index;
+    char *names;
+    void *map;
+    int fd;
+
+    __unmap( p );
+
+    series = (const struct series**) malloc( (s->counters + 1) * sizeof(struct series*) );
+    index = (size_t*) malloc( (s->counters + 1) * sizeof(size_t) );
+    if( (NULL == series) || (NULL == index) ) {
+        free( series );
+        free( index );
+        return -1;
+    }
+    memcpy( series, s->series, s->counters * sizeof(struct series*) );
+
+    for( kept = 0, i = 0; i < s->counters; i++ ) {
+        if( 0 == s->series[i]->sampled ) {
+            index[kept++] = i;
+            names_len += s->series[i]->len + 1;
+        }
+    }
+    if( kept == s->counters ) {
+        free( index );
+        index = NULL;
+    }
+    if( UINT32_MAX < names_len ) {
+        free( series );
+        free( index );
+        return -1;
+    }
+
+    len = __slot_offset( kept, names_len, 2 );
+
+    fd = open( p->tmpname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if( fd < 0 ) {
+        free( series );
+        free( index );
+        return -1;
+    }
+    if( 0 != ftruncate(fd, (off_t) len) ) {
+        close( fd );
+        unlink( p->tmpname );
+        free( series );
+        free( index );
+        return -1;
+    }
+    map = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( MAP_FAILED == map ) {
+        unlink( p->tmpname );
+        free( series );
+        free( index );
+        return -1;
+    }
+
+    /* The file is zeroed, so the second slot is never valid. */
+    h = (struct persist_header*) map;
+    r = (struct persist_record*) &h[1];
+    names = (char*) map + __names_offset( kept );
+
+    for( names_len = 0, i = 0; i < kept; i++ ) {
+        const struct series *c = s->series[(NULL == index) ? i : index[i]];
+
+        r[i].offset = (uint32_t) names_len;
+        r[i].len = (uint32_t) c->len;
+        memcpy( &names[names_len], c->name, c->len + 1 );
+        names_len += c->len + 1;
+    }
+
+    memcpy( h->magic, PERSIST_MAGIC, sizeof(h->magic) );
+    h->version = PERSIST_VERSION;
+    h->count = (uint32_t) kept;
+    h->names_len = names_len;
+    h->layout_sum = __checksum( 0, r, __names_offset(kept) - sizeof(*h) +
+                                      names_len );
+    h->header_sum = __checksum( 0, h, offsetof(struct persist_header, header_sum) );
+
+    p->map = map;
+    p->map_len = len;
+    p->series = series;
+    p->count = s->counters;
+    p->index = index;
+    p->kept = kept;
+    p->slots[0] = (struct persist_slot*) ((char*) map + __slot_offset(kept, names_len, 0));
+    p->slots[1] = (struct persist_slot*) ((char*) map + __slot_offset(kept, names_len, 1));
+
+    /* The slot for this sequence number, so the next write goes to the
+     * other one. */
+    __write_slot( p->slots[p->seq & 1], p->seq, s->values, index, kept );
+
+    if( 0 != rename(p->tmpname, p->filename) ) {
+        unlink( p->tmpname );
+        __unmap( p );
+        return -1;
+    }
+
+    return 0;
+}
+
+static void __write_slot( struct persist_slot *slot, uint64_t seq,
+                          const uint64_t *values, const size_t *index,
+                          size_t count )
+{
+    size_t i;
+
+    slot->seq = seq;
+    if( NULL == index ) {
+        memcpy( slot->values, values, count * sizeof(uint64_t) );
+    } else {
+        for( i = 0; i < count; i++ ) {
+            slot->values[i] = values[index[i]];
+        }
+    }
+    slot->sum = __slot_sum( slot, count );
+}
+
+static uint64_t __slot_sum( const struct persist_slot *slot, size_t count )
+{
+    return __checksum( slot->seq, slot->values, count * sizeof(uint64_t) );
+}
+
+/**
+ *  A fast, non-cryptographic checksum, a word at a time.
+ */
+static uint64_t __checksum( uint64_t seed, const void *data, size_t len )
+{
+    const unsigned char *p = (const unsigned char*) data;
+    uint64_t h = seed ^ (len * CHECKSUM_PRIME_1);
+    uint64_t w;
+
+    for( ; 8 <= len; p += 8, len -= 8 ) {
+        memcpy( &w, p, 8 );
+        h ^= w * CHECKSUM_PRIME_2;
+        h = ((h << 31) | (h >> 33)) * CHECKSUM_PRIME_1;
+    }
+
+    if( 0 < len ) {
+        w = 0;
+        memcpy( &w, p, len );
+        h ^= w * CHECKSUM_PRIME_2;
+        h = ((h << 31) | (h >> 33)) * CHECKSUM_PRIME_1;
+    }
+
+    h ^= h >> 33;
+    h *= CHECKSUM_PRIME_2;
+    h ^= h >> 29;
+
+    return h;
+}
+
+static void __unmap( struct persist *p )
+{
+    if( NULL != p->map ) {
+        munmap( p->map, p->map_len );
+    }
+    free( p->series );
+    free( p->index );
+
+    p->map = NULL;
+    p->map_len = 0;
+    p->series = NULL;
+    p->count = 0;
+    p->index = NULL;
+    p->kept = 0;
+    p->slots[0] = NULL;
+    p->slots[1] = NULL;
+}
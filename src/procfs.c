@@ -0,0 +1,526 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* Large enough for /proc/self/status, the longest of the files. */
+#define PROCFS_BUFFER_SIZE      4096
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+typedef enum {
+    PROC_STAT,
+    PROC_STATM,
+    PROC_STATUS,
+    PROC_IO,
+    PROC_FD,
+
+    PROC_FILE_COUNT
+} proc_file_t;
+
+typedef enum {
+    PROC_CPU_USER,
+    PROC_CPU_SYSTEM,
+    PROC_THREADS,
+    PROC_VIRTUAL,
+    PROC_RESIDENT,
+    PROC_VOLUNTARY,
+    PROC_INVOLUNTARY,
+    PROC_READ,
+    PROC_WRITE,
+    PROC_DISK_READ,
+    PROC_DISK_WRITE,
+    PROC_OPEN_FDS,
+
+    PROC_METRIC_COUNT
+} proc_metric_t;
+
+struct proc_metric {
+    const char *name;
+    metric_type_t type;
+    proc_file_t file;
+};
+
+/* The files stay open and are read again from the start for each sample,
+ * into a buffer that is only used by whichever thread reports. */
+struct procfs {
+    int fds[PROC_FILE_COUNT];
+
+    /* The series, or NULL where the file could not be opened. */
+    struct series *series[PROC_METRIC_COUNT];
+
+    int64_t ticks_per_s;
+    int64_t page_size;
+
+    char buffer[PROCFS_BUFFER_SIZE];
+};
+
+/* The layout of the records getdents64() returns. */
+struct proc_dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static const char *__paths[PROC_FILE_COUNT] = {
+    "/proc/self/stat",
+    "/proc/self/statm",
+    "/proc/self/status",
+    "/proc/self/io",
+    "/proc/self/fd",
+};
+
+static const struct proc_metric __metrics[PROC_METRIC_COUNT] = {
+    { "process_cpu_user_ms",                    MT_COUNTER, PROC_STAT   },
+    { "process_cpu_system_ms",                  MT_COUNTER, PROC_STAT   },
+    { "process_threads",                        MT_GAUGE,   PROC_STAT   },
+    { "process_virtual_memory_bytes",           MT_GAUGE,   PROC_STATM  },
+    { "process_resident_memory_bytes",          MT_GAUGE,   PROC_STATM  },
+    { "process_voluntary_context_switches",     MT_COUNTER, PROC_STATUS },
+    { "process_involuntary_context_switches",   MT_COUNTER, PROC_STATUS },
+    { "process_read_bytes",                     MT_COUNTER, PROC_IO     },
+    { "process_write_bytes",                    MT_COUNTER, PROC_IO     },
+    { "process_storage_read_bytes",             MT_COUNTER, PROC_IO     },
+    { "process_storage_write_bytes",            MT_COUNTER, PROC_IO     },
+    { "process_open_fds",                       MT_GAUGE,   PROC_FD     },
+};
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static void __open( struct procfs* );
+static void __close( struct procfs* );
+static ssize_t __read( struct procfs*, proc_file_t );
+static int __stat( struct procfs*, int64_t* );
+static int __statm( struct procfs*, int64_t* );
+static int __status( struct procfs*, int64_t* );
+static int __io( struct procfs*, int64_t* );
+static int __open_fds( struct procfs*, int64_t* );
+static int __value( const char*, const char*, const char*, int64_t* );
+static const char* __number( const char*, const char*, int64_t* );
+static const char* __skip_fields( const char*, const char*, size_t );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+int __unsafe_procfs_start( __metrics_t *m )
+{
+    struct procfs *p;
+    long ticks, page;
+    size_t i;
+
+    if( 0 == m->c->process_metrics ) {
+        return 0;
+    }
+
+    ticks = sysconf( _SC_CLK_TCK );
+    page = sysconf( _SC_PAGESIZE );
+    if( (ticks <= 0) || (page <= 0) ) {
+        return -1;
+    }
+
+    p = (struct procfs*) calloc( 1, sizeof(struct procfs) );
+    if( NULL == p ) {
+        return -1;
+    }
+    p->ticks_per_s = ticks;
+    p->page_size = page;
+
+    __open( p );
+    for( i = 0; i < PROC_METRIC_COUNT; i++ ) {
+        if( 0 <= p->fds[__metrics[i].file] ) {
+            p->series[i] = __unsafe_series( m, __metrics[i].type,
+                                            __metrics[i].name );
+        }
+
+        /* The kernel keeps the totals; they are only ever set. */
+        if( (NULL != p->series[i]) && (MT_COUNTER == __metrics[i].type) ) {
+            p->series[i]->sampled = 1;
+        }
+    }
+    m->procfs = p;
+
+    return 0;
+}
+
+/* See internal.h for details. */
+void __procfs_sample( __metrics_t *m )
+{
+    struct procfs *p = m->procfs;
+    int64_t values[PROC_METRIC_COUNT];
+    size_t i;
+
+    if( NULL == p ) {
+        return;
+    }
+
+    /* A file that cannot be read or parsed leaves its series as they were. */
+    memset( values, 0xff, sizeof(values) );
+    __stat( p, values );
+    __statm( p, values );
+    __status( p, values );
+    __io( p, values );
+    __open_fds( p, values );
+
+    for( i = 0; i < PROC_METRIC_COUNT; i++ ) {
+        if( (NULL != p->series[i]) && (0 <= values[i]) ) {
+            __series_set( p->series[i], values[i] );
+        }
+    }
+}
+
+/* See internal.h for details. */
+void __procfs_forked( __metrics_t *m )
+{
+    struct procfs *p = m->procfs;
+    size_t i;
+
+    if( NULL != p ) {
+        /* The files opened as /proc/self are still the parent's. */
+        __close( p );
+        __open( p );
+
+        /* Values shared with the parent are the parent's to sample. */
+        for( i = 0; i < PROC_METRIC_COUNT; i++ ) {
+            if( (NULL != p->series[i]) &&
+                (0 != __unsafe_value_shared(m, p->series[i])) )
+            {
+                p->series[i] = NULL;
+            }
+        }
+    }
+}
+
+/* See internal.h for details. */
+void __procfs_destroy( __metrics_t *m )
+{
+    if( NULL != m->procfs ) {
+        __close( m->procfs );
+        free( m->procfs );
+        m->procfs = NULL;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+static void __open( struct procfs *p )
+{
+    size_t i;
+
+    for( i = 0; i < PROC_FILE_COUNT; i++ ) {
+        int flags = O_RDONLY | O_CLOEXEC;
+
+        if( PROC_FD == i ) {
+            flags |= O_DIRECTORY;
+        }
+        p->fds[i] = open( __paths[i], flags );
+    }
+}
+
+static void __close( struct procfs *p )
+{
+    size_t i;
+
+    for( i = 0; i < PROC_FILE_COUNT; i++ ) {
+        if( 0 <= p->fds[i] ) {
+            close( p->fds[i] );
+            p->fds[i] = -1;
+        }
+    }
+}
+
+/**
+ *  Reads a file again from the start into the buffer, '\0' terminated.
+ *
+ *  @return the number of bytes read, or -1 on error
+ */
+static ssize_t __read( struct procfs *p, proc_file_t file )
+{
+    ssize_t len;
+
+    if( p->fds[file] < 0 ) {
+        return -1;
+    }
+
+    len = pread( p->fds[file], p->buffer, PROCFS_BUFFER_SIZE - 1, 0 );
+    if( len < 0 ) {
+        return -1;
+    }
+    p->buffer[len] = '\0';
+
+    return len;
+}
+
+/**
+ *  Parses /proc/self/stat:
+ *
+ *      pid (comm) state ppid ... utime stime ... num_threads ...
+ *
+ *  The command may itself contain spaces and parentheses, so the fields are
+ *  counted from the last ')'.
+ */
+static int __stat( struct procfs *p, int64_t *values )
+{
+    const char *end, *at;
+    ssize_t len;
+    int64_t utime, stime;
+
+    len = __read( p, PROC_STAT );
+    if( len <= 0 ) {
+        return -1;
+    }
+    end = &p->buffer[len];
+
+    for( at = end - 1; (p->buffer < at) && (')' != *at); at-- ) {
+        ;
+    }
+    if( ')' != *at ) {
+        return -1;
+    }
+
+    /* Field 14 is utime and 15 stime; the ')' ends field 2. */
+    at = __skip_fields( at + 1, end, 11 );
+    at = __number( at, end, &utime );
+    at = __number( at, end, &stime );
+    at = __skip_fields( at, end, 4 );
+    at = __number( at, end, &values[PROC_THREADS] );
+    if( NULL == at ) {
+        return -1;
+    }
+
+    values[PROC_CPU_USER] = utime * 1000 / p->ticks_per_s;
+    values[PROC_CPU_SYSTEM] = stime * 1000 / p->ticks_per_s;
+
+    return 0;
+}
+
+/**
+ *  Parses /proc/self/statm: size resident shared text lib data dt, in pages.
+ */
+static int __statm( struct procfs *p, int64_t *values )
+{
+    int64_t size, resident;
+    const char *at;
+    ssize_t len;
+
+    len = __read( p, PROC_STATM );
+    if( len <= 0 ) {
+        return -1;
+    }
+
+    at = __number( p->buffer, &p->buffer[len], &size );
+    at = __number( at, &p->buffer[len], &resident );
+    if( NULL == at ) {
+        return -1;
+    }
+
+    values[PROC_VIRTUAL] = size * p->page_size;
+    values[PROC_RESIDENT] = resident * p->page_size;
+
+    return 0;
+}
+
+/**
+ *  Parses the context switches of /proc/self/status.
+ */
+static int __status( struct procfs *p, int64_t *values )
+{
+    const char *end;
+    ssize_t len;
+
+    len = __read( p, PROC_STATUS );
+    if( len <= 0 ) {
+        return -1;
+    }
+    end = &p->buffer[len];
+
+    __value( p->buffer, end, "voluntary_ctxt_switches:",
+             &values[PROC_VOLUNTARY] );
+    __value( p->buffer, end, "nonvoluntary_ctxt_switches:",
+             &values[PROC_INVOLUNTARY] );
+
+    return 0;
+}
+
+/**
+ *  Parses /proc/self/io: the bytes passed to read() and write() style calls
+ *  and the bytes fetched from and sent to storage.
+ */
+static int __io( struct procfs *p, int64_t *values )
+{
+    const char *end;
+    ssize_t len;
+
+    len = __read( p, PROC_IO );
+    if( len <= 0 ) {
+        return -1;
+    }
+    end = &p->buffer[len];
+
+    __value( p->buffer, end, "rchar:", &values[PROC_READ] );
+    __value( p->buffer, end, "wchar:", &values[PROC_WRITE] );
+    __value( p->buffer, end, "read_bytes:", &values[PROC_DISK_READ] );
+    __value( p->buffer, end, "write_bytes:", &values[PROC_DISK_WRITE] );
+
+    return 0;
+}
+
+/**
+ *  Counts the entries of /proc/self/fd, not counting the files the collector
+ *  keeps open.
+ */
+static int __open_fds( struct procfs *p, int64_t *values )
+{
+#ifdef SYS_getdents64
+    int fd = p->fds[PROC_FD];
+    int64_t count = 0;
+    long len, i;
+    size_t f;
+
+    if( (fd < 0) || (0 != lseek(fd, 0, SEEK_SET)) ) {
+        return -1;
+    }
+
+    while( 0 < (len = syscall(SYS_getdents64, fd, p->buffer,
+                              PROCFS_BUFFER_SIZE)) )
+    {
+        for( i = 0; i < len; ) {
+            const struct proc_dirent *d = (const struct proc_dirent*) &p->buffer[i];
+
+            if( '.' != d->d_name[0] ) {
+                count++;
+            }
+            i += d->d_reclen;
+        }
+    }
+    if( len < 0 ) {
+        return -1;
+    }
+
+    for( f = 0; f < PROC_FILE_COUNT; f++ ) {
+        count -= (0 <= p->fds[f]) ? 1 : 0;
+    }
+    values[PROC_OPEN_FDS] = count;
+
+    return 0;
+#else
+    (void) p;
+    (void) values;
+
+    return -1;
+#endif
+}
+
+/**
+ *  Finds the line starting with key and parses the number after it.
+ */
+static int __value( const char *buf, const char *end, const char *key,
+                    int64_t *value )
+{
+    size_t len = strlen( key );
+    const char *line = buf;
+
+    while( line < end ) {
+        const char *next = memchr( line, '\n', end - line );
+
+        if( NULL == next ) {
+            next = end;
+        }
+        if( ((size_t) (next - line) > len) && (0 == memcmp(line, key, len)) ) {
+            return (NULL != __number(&line[len], next, value)) ? 0 : -1;
+        }
+        line = next + 1;
+    }
+
+    return -1;
+}
+
+/**
+ *  Parses a decimal number after optional blanks.
+ *
+ *  @return what follows the number, or NULL if there is none or at is NULL
+ */
+static const char* __number( const char *at, const char *end, int64_t *value )
+{
+    int64_t v = 0;
+    const char *start;
+
+    if( NULL == at ) {
+        return NULL;
+    }
+
+    while( (at < end) && ((' ' == *at) || ('\t' == *at)) ) {
+        at++;
+    }
+
+    for( start = at; (at < end) && ('0' <= *at) && ('9' >= *at); at++ ) {
+        v = v * 10 + (*at - '0');
+    }
+    if( start == at ) {
+        return NULL;
+    }
+    *value = v;
+
+    return at;
+}
+
+/**
+ *  Skips count space separated fields.
+ *
+ *  @return what follows the last field skipped, or NULL if there are not
+ *          enough or at is NULL
+ */
+static const char* __skip_fields( const char *at, const char *end,
+                                  size_t count )
+{
+    if( NULL == at ) {
+        return NULL;
+    }
+
+    while( 0 < count ) {
+        while( (at < end) && (' ' == *at) ) {
+            at++;
+        }
+        if( at == end ) {
+            return NULL;
+        }
+        while( (at < end) && (' ' != *at) ) {
+            at++;
+        }
+        count--;
+    }
+
+    return at;
+}
@@ -0,0 +1,604 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+#define DEFAULT_METRICS_PATH            "/tmp/metrics"
+#define DEFAULT_PROCESS_NAME            "example.metrics"
+
+#define DEFAULT_REPORT_PERIOD_MS        (900 * 1000)
+
+/* The longest decimal int. */
+#define MAX_PID_LENGTH                  11
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+
+/* The process wide reporter used by registries with shared_reporter set. */
+struct shared_reporter {
+    /* Serializes starting and joining the thread. */
+    pthread_mutex_t lifecycle;
+
+    /* Protects everything below. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    pthread_t thread;
+    int started;
+    int keep_running;
+
+    /* The registries served, see __metrics_t.shared_next */
+    __metrics_t *list;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static struct shared_reporter __shared = {
+    .lifecycle = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t __shared_once = PTHREAD_ONCE_INIT;
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static void* __report_loop( void* );
+static void* __shared_loop( void* );
+static void __shared_init( void );
+static int __shared_add( __metrics_t* );
+static void __shared_remove( __metrics_t* );
+static void __report( __metrics_t* );
+static void __next_wake( __metrics_t*, struct timespec* );
+static int __wake( __metrics_t*, const struct timespec* );
+static void __deltas( __metrics_t* );
+static void __cond_init( pthread_cond_t* );
+static void __next_due( __metrics_t*, const struct timespec* );
+static void __add_ms( struct timespec*, const struct timespec*, uint64_t );
+static int __before( const struct timespec*, const struct timespec* );
+static uint64_t __get_report_period_ms( __metrics_t* );
+static void __mkdir( __metrics_t* );
+static char* __get_filename( __metrics_t* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+int __reporter_start( __metrics_t *m )
+{
+    struct timespec now;
+
+    m->default_exporter = NULL;
+    m->shared_next = NULL;
+    m->reporting = 0;
+    __snapshot_init( &m->report_snapshot );
+    __snapshot_init( &m->report_previous );
+    __cond_init( &m->report_cond );
+
+    /* The restored counters are not an increase. */
+    if( (0 != m->c->report_deltas) && (NULL != m->persist) ) {
+        __snapshot_take( m, &m->report_previous );
+    }
+
+    if( 0 == m->c->exporter_count ) {
+        char *filename;
+
+        __mkdir( m );
+        filename = __get_filename( m );
+        if( NULL != filename ) {
+            m->default_exporter = __text_exporter_create( filename,
+                                                          m->c->initial_report_size,
+                                                          m );
+            free( filename );
+        }
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    m->report_time = now;
+    __next_due( m, &now );
+
+    m->keep_running = 1;
+    if( 0 != m->c->shared_reporter ) {
+        if( 0 == __shared_add(m) ) {
+            return 0;
+        }
+    } else if( 0 == pthread_create(&m->report_thread, NULL, __report_loop, m) ) {
+        return 0;
+    }
+
+    m->keep_running = 0;
+    return -1;
+}
+
+/* See internal.h for details. */
+void __reporter_stop( __metrics_t *m )
+{
+    int running;
+
+    pthread_mutex_lock( &m->mutex );
+    running = m->keep_running;
+    m->keep_running = 0;
+    pthread_cond_signal( &m->report_cond );
+    pthread_mutex_unlock( &m->mutex );
+
+    if( 0 != running ) {
+        if( 0 != m->c->shared_reporter ) {
+            __shared_remove( m );
+        } else {
+            pthread_join( m->report_thread, NULL );
+        }
+
+        /* The final values are always reported. */
+        __report( m );
+    }
+
+    __snapshot_destroy( &m->report_snapshot );
+    __snapshot_destroy( &m->report_previous );
+    metrics_exporter_destroy( m->default_exporter );
+    m->default_exporter = NULL;
+    pthread_cond_destroy( &m->report_cond );
+}
+
+/* See internal.h for details. */
+void __reporter_fork_prepare( void )
+{
+    pthread_mutex_lock( &__shared.lifecycle );
+    pthread_mutex_lock( &__shared.mutex );
+}
+
+/* See internal.h for details. */
+void __reporter_fork_parent( void )
+{
+    pthread_mutex_unlock( &__shared.mutex );
+    pthread_mutex_unlock( &__shared.lifecycle );
+}
+
+/* See internal.h for details. */
+void __reporter_fork_child( void )
+{
+    pthread_mutex_init( &__shared.lifecycle, NULL );
+    pthread_mutex_init( &__shared.mutex, NULL );
+    __cond_init( &__shared.cond );
+    __shared.started = 0;
+    __shared.keep_running = 0;
+    __shared.list = NULL;
+}
+
+/* See internal.h for details. */
+void __reporter_forked( __metrics_t *m )
+{
+    /* Whatever the parent's report thread was doing is gone with it; the
+     * child's first report counts from now. */
+    __snapshot_destroy( &m->report_snapshot );
+    __snapshot_destroy( &m->report_previous );
+    metrics_exporter_destroy( m->default_exporter );
+    m->default_exporter = NULL;
+
+    if( 0 != m->keep_running ) {
+        __reporter_start( m );
+    }
+}
+
+/* See internal.h for details. */
+void __reporter_wake( __metrics_t *m )
+{
+    if( 0 != m->c->shared_reporter ) {
+        pthread_mutex_lock( &__shared.mutex );
+        pthread_cond_broadcast( &__shared.cond );
+        pthread_mutex_unlock( &__shared.mutex );
+    } else {
+        pthread_mutex_lock( &m->mutex );
+        pthread_cond_signal( &m->report_cond );
+        pthread_mutex_unlock( &m->mutex );
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  The report thread owned by a single registry.  It sleeps on a condition
+ *  so a shutdown does not have to wait out the report period.
+ */
+static void* __report_loop( void *__m )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct timespec wake, due;
+    int reported;
+
+    pthread_mutex_lock( &m->mutex );
+    while( 0 != m->keep_running ) {
+        __next_wake( m, &wake );
+        if( ETIMEDOUT != pthread_cond_timedwait(&m->report_cond, &m->mutex,
+                                                &wake) )
+        {
+            /* Woken early; re-check keep_running. */
+            continue;
+        }
+
+        due = m->report_due;
+        pthread_mutex_unlock( &m->mutex );
+        reported = __wake( m, &due );
+        pthread_mutex_lock( &m->mutex );
+
+        /* Scheduled after the report, so a report longer than the period
+         * still leaves the lock free for a while. */
+        if( 0 != reported ) {
+            __next_due( m, &m->report_due );
+        }
+    }
+    pthread_mutex_unlock( &m->mutex );
+
+    return NULL;
+}
+
+/**
+ *  The shared report thread.  It reports whichever registry is due first;
+ *  each report only takes that registry's own lock, so registries never
+ *  contend with each other.
+ */
+static void* __shared_loop( void *arg )
+{
+    (void) arg;
+
+    pthread_mutex_lock( &__shared.mutex );
+    while( 0 != __shared.keep_running ) {
+        __metrics_t *next = NULL;
+        __metrics_t *p;
+        struct timespec now, wake, next_wake, due;
+        int reported;
+
+        for( p = __shared.list; NULL != p; p = p->shared_next ) {
+            __next_wake( p, &wake );
+            if( (NULL == next) || __before(&wake, &next_wake) ) {
+                next = p;
+                next_wake = wake;
+            }
+        }
+
+        if( NULL == next ) {
+            pthread_cond_wait( &__shared.cond, &__shared.mutex );
+            continue;
+        }
+
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        if( __before(&now, &next_wake) ) {
+            /* next may be removed while waiting. */
+            pthread_cond_timedwait( &__shared.cond, &__shared.mutex,
+                                    &next_wake );
+            continue;
+        }
+
+        /* A registry being reported is not removed from the list until the
+         * report is done, see __shared_remove(). */
+        next->reporting = 1;
+        due = next->report_due;
+        pthread_mutex_unlock( &__shared.mutex );
+        reported = __wake( next, &due );
+        pthread_mutex_lock( &__shared.mutex );
+        if( 0 != reported ) {
+            __next_due( next, &next->report_due );
+        }
+        next->reporting = 0;
+        pthread_cond_broadcast( &__shared.cond );
+    }
+    pthread_mutex_unlock( &__shared.mutex );
+
+    return NULL;
+}
+
+/**
+ *  Works out when a registry next needs its report thread: for its next
+ *  report, or before then for the next tick of its moving averages.
+ */
+static void __next_wake( __metrics_t *m, struct timespec *wake )
+{
+    struct timespec tick;
+
+    *wake = m->report_due;
+    if( (0 != __ewma_due(m, &tick)) && __before(&tick, wake) ) {
+        *wake = tick;
+    }
+}
+
+/**
+ *  Reports a registry once its report is due; before then only its moving
+ *  averages tick, so they decay on time whatever the report period.
+ *
+ *  @return non-zero if the registry was reported, 0 otherwise
+ */
+static int __wake( __metrics_t *m, const struct timespec *due )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    if( __before(&now, due) ) {
+        __ewma_tick( m );
+        return 0;
+    }
+
+    __report( m );
+    return 1;
+}
+
+static void __shared_init( void )
+{
+    __cond_init( &__shared.cond );
+}
+
+/**
+ *  Adds a registry to the shared reporter, starting the thread if this is the
+ *  first one.
+ */
+static int __shared_add( __metrics_t *m )
+{
+    int rv = 0;
+
+    pthread_once( &__shared_once, __shared_init );
+
+    pthread_mutex_lock( &__shared.lifecycle );
+
+    pthread_mutex_lock( &__shared.mutex );
+    m->shared_next = __shared.list;
+    __shared.list = m;
+    pthread_cond_broadcast( &__shared.cond );
+    pthread_mutex_unlock( &__shared.mutex );
+
+    if( 0 == __shared.started ) {
+        __shared.keep_running = 1;
+        if( 0 == pthread_create(&__shared.thread, NULL, __shared_loop, NULL) ) {
+            __shared.started = 1;
+        } else {
+            __shared.keep_running = 0;
+            pthread_mutex_lock( &__shared.mutex );
+            __shared.list = m->shared_next;
+            pthread_mutex_unlock( &__shared.mutex );
+            rv = -1;
+        }
+    }
+
+    pthread_mutex_unlock( &__shared.lifecycle );
+
+    return rv;
+}
+
+/**
+ *  Removes a registry from the shared reporter, waiting for a report of it
+ *  that is in progress.  The thread exits with the last registry.
+ */
+static void __shared_remove( __metrics_t *m )
+{
+    __metrics_t **p;
+    int last;
+
+    pthread_mutex_lock( &__shared.lifecycle );
+
+    pthread_mutex_lock( &__shared.mutex );
+    while( 0 != m->reporting ) {
+        pthread_cond_wait( &__shared.cond, &__shared.mutex );
+    }
+
+    for( p = &__shared.list; NULL != *p; p = &(*p)->shared_next ) {
+        if( m == *p ) {
+            *p = m->shared_next;
+            break;
+        }
+    }
+
+    last = (NULL == __shared.list);
+    if( 0 != last ) {
+        __shared.keep_running = 0;
+    }
+    pthread_cond_broadcast( &__shared.cond );
+    pthread_mutex_unlock( &__shared.mutex );
+
+    if( (0 != last) && (0 != __shared.started) ) {
+        pthread_join( __shared.thread, NULL );
+        __shared.started = 0;
+    }
+
+    pthread_mutex_unlock( &__shared.lifecycle );
+}
+
+/**
+ *  Takes a snapshot of the registry once and passes it through every
+ *  exporter.  Only one thread reports a registry at a time.
+ */
+static void __report( __metrics_t *m )
+{
+    struct metrics_exporter **exporters = m->c->exporters;
+    size_t count = m->c->exporter_count;
+    const char *base;
+    size_t i;
+
+    if( 0 == count ) {
+        exporters = &m->default_exporter;
+        count = (NULL != m->default_exporter) ? 1 : 0;
+    }
+
+    base = (NULL != m->c->base) ? m->c->base : "";
+
+    metrics_counter_inc( (metrics_t) m, "metrics_report_count", 1 );
+    __procfs_sample( m );
+    __ewma_tick( m );
+    __distinct_sample( m );
+
+    /* A failed snapshot is empty.  Leave the last report in place, and keep
+     * the previous snapshot and its time so the next report's deltas still
+     * cover everything since the last good one. */
+    if( 0 != __snapshot_take(m, &m->report_snapshot) ) {
+        return;
+    }
+    __persist_save( m, &m->report_snapshot );
+
+    if( 0 != m->c->report_deltas ) {
+        __deltas( m );
+    }
+
+    for( i = 0; i < count; i++ ) {
+        __snapshot_export( &m->report_snapshot, base, exporters[i] );
+    }
+
+    if( 0 != m->c->report_deltas ) {
+        /* Keep this snapshot for the next report and reuse the older one. */
+        struct snapshot tmp = m->report_previous;
+
+        m->report_previous = m->report_snapshot;
+        m->report_snapshot = tmp;
+    }
+}
+
+/**
+ *  Computes the deltas of the report snapshot against the previous report.
+ */
+static void __deltas( __metrics_t *m )
+{
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    elapsed = (double) (now.tv_sec - m->report_time.tv_sec) +
+              (double) (now.tv_nsec - m->report_time.tv_nsec) / 1e9;
+    m->report_time = now;
+
+    /* A rate over much less than a period, as in the final report soon
+     * after the last one, mostly measures when the reports ran. */
+    if( elapsed * 2000.0 < (double) __get_report_period_ms(m) ) {
+        elapsed = 0.0;
+    }
+
+    __snapshot_deltas( &m->report_snapshot, &m->report_previous, elapsed );
+}
+
+/**
+ *  Initializes a condition that times out against CLOCK_MONOTONIC so wall
+ *  clock changes do not move the reports.
+ */
+static void __cond_init( pthread_cond_t *cond )
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( cond, &attr );
+    pthread_condattr_destroy( &attr );
+}
+
+/**
+ *  Sets the next report time one period after the given time.  If reports
+ *  have fallen behind by more than a period the missed ones are skipped.
+ */
+static void __next_due( __metrics_t *m, const struct timespec *from )
+{
+    uint64_t period_ms = __get_report_period_ms( m );
+    struct timespec now;
+
+    __add_ms( &m->report_due, from, period_ms );
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    if( __before(&m->report_due, &now) ) {
+        __add_ms( &m->report_due, &now, period_ms );
+    }
+}
+
+static void __add_ms( struct timespec *to, const struct timespec *from,
+                      uint64_t ms )
+{
+    uint64_t nsec = (uint64_t) from->tv_nsec + (ms % 1000) * 1000000;
+
+    to->tv_sec = from->tv_sec + (time_t) (ms / 1000 + nsec / 1000000000);
+    to->tv_nsec = (long) (nsec % 1000000000);
+}
+
+static int __before( const struct timespec *a, const struct timespec *b )
+{
+    if( a->tv_sec != b->tv_sec ) {
+        return a->tv_sec < b->tv_sec;
+    }
+
+    return a->tv_nsec < b->tv_nsec;
+}
+
+static uint64_t __get_report_period_ms( __metrics_t *m )
+{
+    if( 0 < m->c->report_period_ms ) {
+        return m->c->report_period_ms;
+    }
+
+    if( 0 < m->c->report_period_s ) {
+        return (uint64_t) m->c->report_period_s * 1000;
+    }
+
+    return DEFAULT_REPORT_PERIOD_MS;
+}
+
+static void __mkdir( __metrics_t *m )
+{
+    const char *path = m->c->metrics_path;
+
+    if( NULL == path ) {
+        path = DEFAULT_METRICS_PATH;
+    }
+
+    mkdir( path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH );
+}
+
+static char* __get_filename( __metrics_t *m )
+{
+    const char *path, *name;
+    char *rv;
+    size_t len;
+
+    path = m->c->metrics_path;
+    name = m->c->process_name;
+
+    if( NULL == path ) {
+        path = DEFAULT_METRICS_PATH;
+    }
+
+    if( NULL == name ) {
+        name = DEFAULT_PROCESS_NAME;
+    }
+
+    /* A forked child reports to its own file: name.pid */
+    len = strlen( path ) + 1 + strlen( name ) + 1 + MAX_PID_LENGTH + 1;
+    rv = (char*) malloc( len * sizeof(char) );
+    if( NULL != rv ) {
+        if( 0 != m->forked ) {
+            sprintf( rv, "%s/%s.%d", path, name, (int) getpid() );
+        } else {
+            sprintf( rv, "%s/%s", path, name );
+        }
+    }
+
+    return rv;
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+struct scope {
+    __metrics_t *m;
+
+    /* The series used through the scope by the name passed in, so a lookup
+     * only walks the name and never builds the complete name again.  Entries
+     * are only added with m->mutex held. */
+    struct trie *counters;
+    struct trie *gauges;
+
+    char *prefix;
+    size_t prefix_len;
+
+    /* The scope's labels as {label="value",...} or "" without labels. */
+    char *labels;
+    size_t labels_len;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct scope* __unsafe_scope( __metrics_t*, const char*, char* );
+static struct series* __scope_series( struct scope*, metric_type_t,
+                                      const char* );
+static void __scope_destroy( struct scope* );
+static int __destroyer( const char*, void*, void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+metrics_scope_t metrics_scope( metrics_t __m, const char *prefix,
+                               size_t label_count, ... )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct scope *sc;
+    va_list args;
+    char *labels;
+
+    if( (NULL == m) || (&__metrics_disabled == m) || (NULL == prefix) ||
+        (NULL != strchr(prefix, '{')) )
+    {
+        return NULL;
+    }
+
+    /* With no name this is just the labels. */
+    va_start( args, label_count );
+    labels = metrics_calculate_name_varidac( "", label_count, args );
+    va_end( args );
+
+    if( NULL == labels ) {
+        return NULL;
+    }
+
+    pthread_mutex_lock( &m->mutex );
+    sc = __unsafe_scope( m, prefix, labels );
+    pthread_mutex_unlock( &m->mutex );
+
+    return (metrics_scope_t) sc;
+}
+
+/* See metrics.h for details. */
+void metrics_scope_counter_inc( metrics_scope_t __sc, const char *name,
+                                uint32_t inc )
+{
+    struct scope *sc = (struct scope*) __sc;
+    struct series *s;
+
+    if( NULL == sc ) {
+        return;
+    }
+
+    s = (struct series*) trie_search( sc->counters, name );
+    if( NULL == s ) {
+        s = __scope_series( sc, MT_COUNTER, name );
+        if( NULL == s ) {
+            return;
+        }
+    }
+
+    __series_inc( sc->m, s, inc );
+}
+
+/* See metrics.h for details. */
+void metrics_scope_gauge_set( metrics_scope_t __sc, const char *name,
+                              int64_t value )
+{
+    struct scope *sc = (struct scope*) __sc;
+    struct series *s;
+
+    if( NULL == sc ) {
+        return;
+    }
+
+    s = (struct series*) trie_search( sc->gauges, name );
+    if( NULL == s ) {
+        s = __scope_series( sc, MT_GAUGE, name );
+        if( NULL == s ) {
+            return;
+        }
+    }
+
+    __series_set( s, value );
+}
+
+/* See metrics.h for details. */
+int metrics_scope_report( metrics_scope_t __sc, struct metrics_exporter *e )
+{
+    struct scope *sc = (struct scope*) __sc;
+    struct snapshot snap;
+    const char *base;
+    int rv;
+
+    if( (NULL == sc) || (NULL == e) ) {
+        return -1;
+    }
+
+    base = (NULL != sc->m->c->base) ? sc->m->c->base : "";
+
+    __snapshot_init( &snap );
+    rv = __snapshot_take_prefix( sc->m, &snap, sc->prefix );
+    if( 0 == rv ) {
+        __snapshot_export( &snap, base, e );
+    }
+    __snapshot_destroy( &snap );
+
+    return rv;
+}
+
+/* See internal.h for details. */
+void __scopes_destroy( __metrics_t *m )
+{
+    trie_visit( m->scopes, "", __destroyer, NULL );
+    trie_free( m->scopes );
+    m->scopes = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Finds or creates the scope for the prefix and labels.  The labels are
+ *  taken over by the scope or freed.
+ */
+static struct scope* __unsafe_scope( __metrics_t *m, const char *prefix,
+                                     char *labels )
+{
+    size_t prefix_len = strlen( prefix );
+    size_t labels_len = strlen( labels );
+    struct scope *sc;
+    char *key;
+
+    key = (char*) malloc( prefix_len + labels_len + 1 );
+    if( NULL == key ) {
+        free( labels );
+        return NULL;
+    }
+    memcpy( key, prefix, prefix_len );
+    memcpy( &key[prefix_len], labels, labels_len + 1 );
+
+    sc = (struct scope*) trie_search( m->scopes, key );
+    if( NULL != sc ) {
+        free( labels );
+        free( key );
+        return sc;
+    }
+
+    sc = (struct scope*) malloc( sizeof(struct scope) );
+    if( NULL == sc ) {
+        free( labels );
+        free( key );
+        return NULL;
+    }
+    sc->m = m;
+    sc->counters = trie_create();
+    sc->gauges = trie_create();
+    sc->prefix = strdup( prefix );
+    sc->prefix_len = prefix_len;
+    sc->labels = labels;
+    sc->labels_len = labels_len;
+
+    if( (NULL == sc->counters) || (NULL == sc->gauges) ||
+        (NULL == sc->prefix) || (0 != trie_insert(m->scopes, key, sc)) )
+    {
+        __scope_destroy( sc );
+        sc = NULL;
+    }
+    free( key );
+
+    return sc;
+}
+
+/**
+ *  Resolves a name used through the scope the first time: the complete name
+ *  is prefix name labels.
+ */
+static struct series* __scope_series( struct scope *sc, metric_type_t type,
+                                      const char *name )
+{
+    struct trie *t = (MT_COUNTER == type) ? sc->counters : sc->gauges;
+    struct series *s;
+    size_t len = strlen( name );
+    char *full;
+
+    full = (char*) malloc( sc->prefix_len + len + sc->labels_len + 1 );
+    if( NULL == full ) {
+        return NULL;
+    }
+    memcpy( full, sc->prefix, sc->prefix_len );
+    memcpy( &full[sc->prefix_len], name, len );
+    memcpy( &full[sc->prefix_len + len], sc->labels, sc->labels_len + 1 );
+
+    pthread_mutex_lock( &sc->m->mutex );
+    s = (struct series*) trie_search( t, name );
+    if( NULL == s ) {
+        s = __unsafe_series( sc->m, type, full );
+        if( NULL != s ) {
+            /* On failure the series is still usable, it is just resolved the
+             * slow way again next time. */
+            (void) trie_insert( t, name, s );
+        }
+    }
+    pthread_mutex_unlock( &sc->m->mutex );
+
+    free( full );
+
+    return s;
+}
+
+static void __scope_destroy( struct scope *sc )
+{
+    if( NULL != sc->counters ) {
+        trie_free( sc->counters );
+    }
+    if( NULL != sc->gauges ) {
+        trie_free( sc->gauges );
+    }
+    free( sc->prefix );
+    free( sc->labels );
+    free( sc );
+}
+
+static int __destroyer( const char *key, void *data, void *arg )
+{
+    (void) key;
+    (void) arg;
+
+    __scope_destroy( (struct scope*) data );
+
+    return 0;
+}
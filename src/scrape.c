@@ -0,0 +1,399 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The text is sent whenever this much has built up, so the whole exposition
+ * is never held in memory. */
+#define SCRAPE_CHUNK_SIZE   (16 * 1024)
+
+#define MAX_REQUEST_SIZE    1024
+#define CLIENT_TIMEOUT_S    5
+
+#define HTTP_OK             "HTTP/1.0 200 OK\r\n"                           \
+                            "Content-Type: text/plain; version=0.0.4\r\n"   \
+                            "Connection: close\r\n\r\n"
+#define HTTP_NOT_FOUND      "HTTP/1.0 404 Not Found\r\n"                    \
+                            "Content-Length: 0\r\n"                         \
+                            "Connection: close\r\n\r\n"
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* The exporter a snapshot is exported through to answer a scrape, so the
+ * scrape has everything a report has.  Reused from one scrape to the next. */
+struct scrape_sink {
+    struct metrics_exporter e;
+
+    /* The connection being answered, and whether sending to it failed. */
+    int fd;
+    int failed;
+
+    const char *base;
+    size_t base_len;
+
+    char *buf;
+    size_t len;
+    size_t used;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static void* __scrape_loop( void* );
+static void __serve( __metrics_t*, int, struct snapshot*, struct scrape_sink* );
+static int __read_request( int, char*, size_t );
+static int __send_all( int, struct iovec*, int );
+static int __sink_begin( void*, const char*, size_t );
+static int __sink_series( void*, const struct metrics_series* );
+static int __sink_flush( void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+int __scrape_start( __metrics_t *m )
+{
+    const char *path = m->c->scrape_socket_path;
+    struct sockaddr_un addr;
+
+    m->scrape_fd = -1;
+    m->scrape_wake[0] = -1;
+    m->scrape_wake[1] = -1;
+
+    if( NULL == path ) {
+        return 0;
+    }
+
+    if( sizeof(addr.sun_path) <= strlen(path) ) {
+        return -1;
+    }
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+
+    m->scrape_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( -1 == m->scrape_fd ) {
+        return -1;
+    }
+
+    unlink( path );
+    if( (0 != bind(m->scrape_fd, (struct sockaddr*) &addr, sizeof(addr))) ||
+        (0 != listen(m->scrape_fd, 8)) ||
+        (0 != pipe(m->scrape_wake)) )
+    {
+        __scrape_stop( m );
+        return -1;
+    }
+
+    if( 0 != pthread_create(&m->scrape_thread, NULL, __scrape_loop, m) ) {
+        /* There is no thread to wake and join. */
+        close( m->scrape_wake[1] );
+        close( m->scrape_wake[0] );
+        m->scrape_wake[0] = -1;
+        m->scrape_wake[1] = -1;
+        __scrape_stop( m );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* See internal.h for details. */
+void __scrape_stop( __metrics_t *m )
+{
+    if( -1 != m->scrape_wake[1] ) {
+        if( 1 == write(m->scrape_wake[1], "x", 1) ) {
+            pthread_join( m->scrape_thread, NULL );
+        }
+        close( m->scrape_wake[1] );
+        close( m->scrape_wake[0] );
+        m->scrape_wake[0] = -1;
+        m->scrape_wake[1] = -1;
+    }
+
+    if( -1 != m->scrape_fd ) {
+        close( m->scrape_fd );
+        unlink( m->c->scrape_socket_path );
+        m->scrape_fd = -1;
+    }
+}
+
+/* See internal.h for details. */
+void __scrape_forked( __metrics_t *m )
+{
+    /* Only close the child's copies; the socket file is the parent's. */
+    if( -1 != m->scrape_wake[1] ) {
+        close( m->scrape_wake[1] );
+        close( m->scrape_wake[0] );
+        m->scrape_wake[0] = -1;
+        m->scrape_wake[1] = -1;
+    }
+
+    if( -1 != m->scrape_fd ) {
+        close( m->scrape_fd );
+        m->scrape_fd = -1;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static void* __scrape_loop( void *__m )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct scrape_sink sink;
+    struct snapshot snap;
+
+    memset( &sink, 0, sizeof(sink) );
+    sink.len = SCRAPE_CHUNK_SIZE;
+    sink.buf = (char*) malloc( sink.len );
+    if( NULL == sink.buf ) {
+        return NULL;
+    }
+    sink.e.ctx = &sink;
+    sink.e.begin = __sink_begin;
+    sink.e.series = __sink_series;
+    sink.e.end = __sink_flush;
+
+    __snapshot_init( &snap );
+
+    while( 1 ) {
+        struct pollfd fds[2];
+        int client;
+
+        fds[0].fd = m->scrape_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = m->scrape_wake[0];
+        fds[1].events = POLLIN;
+
+        if( -1 == poll(fds, 2, -1) ) {
+            if( EINTR == errno ) {
+                continue;
+            }
+            break;
+        }
+
+        if( 0 != fds[1].revents ) {
+            break;
+        }
+
+        client = accept( m->scrape_fd, NULL, NULL );
+        if( -1 != client ) {
+            __serve( m, client, &snap, &sink );
+            close( client );
+        }
+    }
+
+    __snapshot_destroy( &snap );
+    free( sink.buf );
+
+    return NULL;
+}
+
+/**
+ *  Answers a single HTTP request on the connection.
+ */
+static void __serve( __metrics_t *m, int fd, struct snapshot *snap,
+                     struct scrape_sink *sink )
+{
+    struct timeval tv = { CLIENT_TIMEOUT_S, 0 };
+    char request[MAX_REQUEST_SIZE];
+    struct iovec iov;
+
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+    setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+
+    if( 0 != __read_request(fd, request, sizeof(request)) ) {
+        return;
+    }
+
+    if( (0 != strncmp(request, "GET /metrics ", 13)) &&
+        (0 != strncmp(request, "GET / ", 6)) )
+    {
+        iov.iov_base = (void*) HTTP_NOT_FOUND;
+        iov.iov_len = sizeof(HTTP_NOT_FOUND) - 1;
+        __send_all( fd, &iov, 1 );
+        return;
+    }
+
+    metrics_counter_inc( (metrics_t) m, "metrics_scrape_count", 1 );
+    if( 0 != __snapshot_take(m, snap) ) {
+        return;
+    }
+
+    iov.iov_base = (void*) HTTP_OK;
+    iov.iov_len = sizeof(HTTP_OK) - 1;
+    if( 0 == __send_all(fd, &iov, 1) ) {
+        sink->fd = fd;
+        __snapshot_export( snap, (NULL != m->c->base) ? m->c->base : "",
+                           &sink->e );
+    }
+}
+
+/**
+ *  Reads until the end of the request headers.  Only the request line is
+ *  used; the rest of the request is ignored.
+ */
+static int __read_request( int fd, char *buf, size_t len )
+{
+    size_t used = 0;
+
+    while( used < len - 1 ) {
+        ssize_t got = recv( fd, &buf[used], len - 1 - used, 0 );
+
+        if( got <= 0 ) {
+            if( (-1 == got) && (EINTR == errno) ) {
+                continue;
+            }
+            return -1;
+        }
+        used += got;
+        buf[used] = '\0';
+
+        if( (NULL != strstr(buf, "\r\n\r\n")) || (NULL != strstr(buf, "\n\n")) ) {
+            return 0;
+        }
+    }
+
+    /* Oversized headers; the request line is all that is needed anyway. */
+    return (NULL != strchr(buf, '\n')) ? 0 : -1;
+}
+
+/**
+ *  Sends the iovecs completely, resuming after partial writes.
+ */
+static int __send_all( int fd, struct iovec *iov, int count )
+{
+    struct msghdr msg;
+
+    while( 0 < count ) {
+        ssize_t sent;
+
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        /* sendmsg() is writev() with MSG_NOSIGNAL so a client that hangs up
+         * does not raise SIGPIPE in the application. */
+        sent = sendmsg( fd, &msg, MSG_NOSIGNAL );
+        if( -1 == sent ) {
+            if( EINTR == errno ) {
+                continue;
+            }
+            return -1;
+        }
+
+        while( (0 < count) && ((size_t) sent >= iov->iov_len) ) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if( 0 < count ) {
+            iov->iov_base = (char*) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+static int __sink_begin( void *ctx, const char *base, size_t count )
+{
+    struct scrape_sink *sink = (struct scrape_sink*) ctx;
+
+    (void) count;
+
+    sink->base = base;
+    sink->base_len = strlen( base );
+    sink->used = 0;
+    sink->failed = 0;
+
+    return 0;
+}
+
+static int __sink_series( void *ctx, const struct metrics_series *s )
+{
+    struct scrape_sink *sink = (struct scrape_sink*) ctx;
+    size_t needed = __text_line_size( sink->base_len, s );
+
+    if( 0 != sink->failed ) {
+        return -1;
+    }
+
+    if( (sink->len < sink->used + needed) && (0 != __sink_flush(sink)) ) {
+        return -1;
+    }
+
+    /* Only a single line longer than a chunk needs more room. */
+    if( sink->len < needed ) {
+        char *tmp = (char*) realloc( sink->buf, needed );
+
+        if( NULL == tmp ) {
+            sink->failed = 1;
+            return -1;
+        }
+        sink->buf = tmp;
+        sink->len = needed;
+    }
+
+    sink->used += __text_line( &sink->buf[sink->used], sink->base,
+                               sink->base_len, s );
+
+    return 0;
+}
+
+/**
+ *  Sends the text built up so far.  Once sending failed the rest of the
+ *  scrape is dropped.
+ */
+static int __sink_flush( void *ctx )
+{
+    struct scrape_sink *sink = (struct scrape_sink*) ctx;
+    struct iovec iov;
+
+    if( (0 == sink->failed) && (0 < sink->used) ) {
+        iov.iov_base = sink->buf;
+        iov.iov_len = sink->used;
+        if( 0 != __send_all(sink->fd, &iov, 1) ) {
+            sink->failed = 1;
+        }
+    }
+    sink->used = 0;
+
+    return (0 != sink->failed) ? -1 : 0;
+}
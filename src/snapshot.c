@@ -0,0 +1,709 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+#define DEFAULT_SNAPSHOT_SIZE   64
+
+#define DEFAULT_SLICE_SIZE      1024
+
+/* Never matches the registry, so the order is built again. */
+#define INVALID_GENERATION      (~((uint64_t) 0))
+
+#define DELTA_SUFFIX            "_delta"
+#define RATE_SUFFIX             "_rate_per_s"
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* Where the order walk of one type of series is between slices. */
+struct walk {
+    const __metrics_t *m;
+    struct snapshot *s;
+    struct trie *series;
+    struct trie_it *families;
+
+    /* The labeled series of the current family, if started. */
+    struct trie_it *labeled;
+};
+
+/* The scratch space for the names of the derived delta and rate series. */
+struct derived {
+    const char *base;
+    char *buf;
+    size_t len;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* The suffixes of the moving average windows, see ewma.c */
+static const char *__ewma_suffixes[EWMA_WINDOWS] = {
+    "_rate_1m",
+    "_rate_5m",
+    "_rate_15m",
+};
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static int __walk( __metrics_t*, struct snapshot*, struct trie*, struct trie*,
+                   const char*, size_t );
+static int __unsafe_walk_slice( struct walk*, size_t );
+static int __collect( struct snapshot*, const struct series* );
+static int __copy( __metrics_t*, struct snapshot*, size_t );
+static size_t __slice_size( const __metrics_t* );
+static void __export_family( const struct snapshot*, size_t, size_t,
+                             struct metrics_exporter* );
+static void __export_derived( const struct snapshot*, size_t, size_t,
+                              struct metrics_exporter*, struct derived*, int );
+static void __export_ewma( const struct snapshot*, size_t, size_t,
+                           struct metrics_exporter*, struct derived*, size_t );
+static void __export_tops( const struct snapshot*, size_t, size_t,
+                           struct metrics_exporter*, struct derived* );
+static char* __derived_header( struct derived*, const char*, size_t,
+                               const char*, size_t );
+static uint64_t __updated_ms( const struct snapshot*, size_t );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+void __snapshot_init( struct snapshot *s )
+{
+    memset( s, 0, sizeof(struct snapshot) );
+}
+
+/* See internal.h for details. */
+int __snapshot_take( __metrics_t *m, struct snapshot *s )
+{
+    return __snapshot_take_prefix( m, s, "" );
+}
+
+/* See internal.h for details. */
+int __snapshot_take_prefix( __metrics_t *m, struct snapshot *s,
+                            const char *prefix )
+{
+    size_t slice = __slice_size( m );
+    uint64_t generation;
+    int rv = 0;
+    size_t i;
+
+    s->has_deltas = 0;
+
+    pthread_mutex_lock( &m->mutex );
+
+    __unsafe_thread_rings_drain( m );
+    generation = m->series_generation;
+
+    s->time_ms = 0;
+    if( 0 != m->c->timestamps ) {
+        struct timespec now;
+
+        clock_gettime( CLOCK_REALTIME, &now );
+        s->time_ms = (uint64_t) now.tv_sec * 1000 +
+                     (uint64_t) now.tv_nsec / 1000000;
+        s->taken = __stamp_now();
+    }
+
+    pthread_mutex_unlock( &m->mutex );
+
+    /* The order of the series only changes when series are added.  A
+     * snapshot is always taken with the same prefix.  Series added while the
+     * order is built may be missed, but then the generation has moved on and
+     * the next snapshot builds it again. */
+    if( s->generation != generation ) {
+        s->count = 0;
+        s->counters = 0;
+
+        /* Walk the families in order and collect each family's series, so
+         * the series of a family are always next to each other. */
+        rv = __walk( m, s, m->counter_families, m->counters, prefix, slice );
+        s->counters = s->count;
+        if( 0 == rv ) {
+            rv = __walk( m, s, m->gauge_families, m->gauges, prefix, slice );
+        }
+        s->generation = generation;
+    }
+
+    /* After the walk, so every series collected has a value. */
+    if( 0 == rv ) {
+        rv = __copy( m, s, slice );
+    }
+    if( 0 == rv ) {
+        rv = __snapshot_ewmas( m, s, prefix );
+    }
+    if( 0 == rv ) {
+        rv = __snapshot_tops( m, s, prefix );
+    }
+
+    if( 0 != rv ) {
+        s->count = 0;
+        s->counters = 0;
+        s->generation = INVALID_GENERATION;
+        return rv;
+    }
+
+    /* Put the values in report order without holding the lock. */
+    for( i = 0; i < s->count; i++ ) {
+        s->values[i] = s->raw[s->series[i]->id];
+    }
+
+    return 0;
+}
+
+/* See internal.h for details. */
+void __snapshot_export( const struct snapshot *s, const char *base,
+                        struct metrics_exporter *e )
+{
+    struct derived d;
+    size_t count = s->count;
+    size_t i, end;
+
+    if( 0 != s->has_deltas ) {
+        count += (0.0 < s->per_s) ? 2 * s->counters : s->counters;
+    }
+    count += EWMA_WINDOWS * s->ewma_count;
+    count += s->top_count;
+
+    if( NULL != e->begin ) {
+        e->begin( e->ctx, base, count );
+    }
+
+    if( NULL != e->series ) {
+        d.base = base;
+        d.buf = NULL;
+        d.len = 0;
+
+        for( i = 0; i < s->count; i = end ) {
+            const struct family *family = s->series[i]->family;
+
+            end = i + 1;
+            while( (end < s->count) && (family == s->series[end]->family) ) {
+                end++;
+            }
+
+            __export_family( s, i, end, e );
+
+            if( (0 != s->has_deltas) && (i < s->counters) ) {
+                __export_derived( s, i, end, e, &d, 0 );
+                if( 0.0 < s->per_s ) {
+                    __export_derived( s, i, end, e, &d, 1 );
+                }
+            }
+        }
+
+        for( i = 0; i < s->ewma_count; i = end ) {
+            const struct ewma *first = s->ewmas[i];
+            size_t w;
+
+            end = i + 1;
+            while( (end < s->ewma_count) &&
+                   (first->family_len == s->ewmas[end]->family_len) &&
+                   (0 == memcmp(first->name, s->ewmas[end]->name,
+                                first->family_len)) )
+            {
+                end++;
+            }
+
+            for( w = 0; w < EWMA_WINDOWS; w++ ) {
+                __export_ewma( s, i, end, e, &d, w );
+            }
+        }
+
+        for( i = 0; i < s->top_count; i = end ) {
+            end = i + 1;
+            while( (end < s->top_count) &&
+                   (s->tops[i].family == s->tops[end].family) )
+            {
+                end++;
+            }
+
+            __export_tops( s, i, end, e, &d );
+        }
+
+        free( d.buf );
+    }
+
+    if( NULL != e->end ) {
+        e->end( e->ctx );
+    }
+
+    if( NULL != e->flush ) {
+        e->flush( e->ctx );
+    }
+}
+
+/* See internal.h for details. */
+void __snapshot_destroy( struct snapshot *s )
+{
+    free( s->series );
+    free( s->values );
+    free( s->raw );
+    free( s->deltas );
+    free( s->stamps );
+    free( s->ewmas );
+    free( s->ewma_rates );
+    __snapshot_tops_destroy( s );
+    __snapshot_init( s );
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+/**
+ *  Collects the series of the families of one type in order, holding the
+ *  lock for at most slice series at a time.  The iterators stay valid while
+ *  the lock is released, as trie nodes never move or go away.
+ */
+static int __walk( __metrics_t *m, struct snapshot *s, struct trie *families,
+                   struct trie *series, const char *prefix, size_t slice )
+{
+    struct walk w;
+    int rv;
+
+    w.m = m;
+    w.s = s;
+    w.series = series;
+    w.labeled = NULL;
+
+    pthread_mutex_lock( &m->mutex );
+    w.families = trie_it_create( families, prefix );
+    pthread_mutex_unlock( &m->mutex );
+
+    if( NULL == w.families ) {
+        return -1;
+    }
+
+    do {
+        pthread_mutex_lock( &m->mutex );
+        rv = __unsafe_walk_slice( &w, slice );
+        pthread_mutex_unlock( &m->mutex );
+    } while( 0 < rv );
+
+    if( NULL != w.labeled ) {
+        trie_it_free( w.labeled );
+    }
+    trie_it_free( w.families );
+
+    return rv;
+}
+
+/**
+ *  Collects the next slice series.
+ *
+ *  @return 1 if there are more, 0 when done, -1 on error
+ */
+static int __unsafe_walk_slice( struct walk *w, size_t slice )
+{
+    size_t left;
+
+    for( left = slice; 0 < left; left-- ) {
+        const struct series *series;
+
+        while( NULL == w->labeled ) {
+            const struct family *f;
+
+            if( 0 != trie_it_done(w->families) ) {
+                return (0 != trie_it_error(w->families)) ? -1 : 0;
+            }
+            f = (const struct family*) trie_it_data( w->families );
+            trie_it_next( w->families );
+
+            /* The series without labels sorts before the ones with. */
+            series = (const struct series*) trie_search( w->series, f->name );
+            if( (NULL != series) && (0 == __unsafe_value_shared(w->m, series)) ) {
+                if( 0 != __collect(w->s, series) ) {
+                    return -1;
+                }
+            }
+
+            w->labeled = trie_it_create( w->series, f->prefix );
+            if( NULL == w->labeled ) {
+                return -1;
+            }
+        }
+
+        if( 0 != trie_it_done(w->labeled) ) {
+            int error = trie_it_error( w->labeled );
+
+            trie_it_free( w->labeled );
+            w->labeled = NULL;
+            if( 0 != error ) {
+                return -1;
+            }
+            continue;
+        }
+
+        series = (const struct series*) trie_it_data( w->labeled );
+        if( (0 == __unsafe_value_shared(w->m, series)) &&
+            (0 != __collect(w->s, series)) )
+        {
+            return -1;
+        }
+        trie_it_next( w->labeled );
+    }
+
+    return 1;
+}
+
+static int __collect( struct snapshot *s, const struct series *series )
+{
+    if( s->count == s->len ) {
+        size_t len = (0 == s->len) ? DEFAULT_SNAPSHOT_SIZE : 2 * s->len;
+        const struct series **p;
+        uint64_t *v;
+
+        p = (const struct series**) realloc( s->series, len * sizeof(struct series*) );
+        if( NULL == p ) {
+            return -1;
+        }
+        s->series = p;
+
+        v = (uint64_t*) realloc( s->values, len * sizeof(uint64_t) );
+        if( NULL == v ) {
+            return -1;
+        }
+        s->values = v;
+
+        s->len = len;
+    }
+
+    s->series[s->count] = series;
+    s->count++;
+
+    return 0;
+}
+
+/**
+ *  Copies every value by series id, holding the lock for about slice values
+ *  at a time.
+ */
+static int __copy( __metrics_t *m, struct snapshot *s, size_t slice )
+{
+    size_t from = 0;
+    int rv;
+
+    pthread_mutex_lock( &m->mutex );
+    rv = __unsafe_values_reserve( m, s );
+    pthread_mutex_unlock( &m->mutex );
+
+    while( (0 == rv) && (from < s->ids) ) {
+        pthread_mutex_lock( &m->mutex );
+        from = __unsafe_values_copy( m, s, from, slice );
+        pthread_mutex_unlock( &m->mutex );
+    }
+
+    return rv;
+}
+
+static size_t __slice_size( const __metrics_t *m )
+{
+    if( 0 < m->c->report_slice_size ) {
+        return m->c->report_slice_size;
+    }
+
+    return DEFAULT_SLICE_SIZE;
+}
+
+/**
+ *  Exports the series of one family, the family header with the first.
+ */
+static void __export_family( const struct snapshot *s, size_t begin, size_t end,
+                             struct metrics_exporter *e )
+{
+    const struct header *h;
+    struct metrics_series ms;
+    size_t i;
+
+    h = __atomic_load_n( &s->series[begin]->family->header, __ATOMIC_ACQUIRE );
+    ms.header = h->text;
+    ms.header_len = h->len;
+    ms.timestamp_ms = s->time_ms;
+
+    for( i = begin; i < end; i++ ) {
+        ms.name = s->series[i]->name;
+        ms.name_len = s->series[i]->len;
+        ms.updated_ms = __updated_ms( s, s->series[i]->id );
+        if( MT_COUNTER == s->series[i]->type ) {
+            ms.type = METRICS_COUNTER;
+            ms.value.counter = s->values[i];
+        } else {
+            ms.type = METRICS_GAUGE;
+            ms.value.gauge = (int64_t) s->values[i];
+        }
+
+        e->series( e->ctx, &ms );
+
+        ms.header = NULL;
+        ms.header_len = 0;
+    }
+}
+
+/**
+ *  Exports the delta or rate of each counter of one family as a family of
+ *  its own, with the suffix added to the family name:
+ *
+ *      # TYPE base_name_rate_per_s gauge
+ *      base_name_rate_per_s{label="value"} 0.5
+ */
+static void __export_derived( const struct snapshot *s, size_t begin,
+                              size_t end, struct metrics_exporter *e,
+                              struct derived *d, int rate )
+{
+    const struct family *f = s->series[begin]->family;
+    const char *suffix = (0 != rate) ? RATE_SUFFIX : DELTA_SUFFIX;
+    size_t suffix_len = strlen( suffix );
+    size_t longest = 0;
+    struct metrics_series ms;
+    char *name;
+    size_t i;
+
+    for( i = begin; i < end; i++ ) {
+        if( longest < s->series[i]->len ) {
+            longest = s->series[i]->len;
+        }
+    }
+
+    name = __derived_header( d, f->name, f->len, suffix, longest );
+    if( NULL == name ) {
+        return;
+    }
+
+    ms.header = d->buf;
+    ms.header_len = name - d->buf;
+    ms.timestamp_ms = s->time_ms;
+
+    for( i = begin; i < end; i++ ) {
+        const struct series *series = s->series[i];
+
+        /* Then the labels, if any. */
+        memcpy( &name[f->len + suffix_len], &series->name[f->len],
+                series->len - f->len + 1 );
+
+        ms.name = name;
+        ms.name_len = series->len + suffix_len;
+        ms.updated_ms = __updated_ms( s, series->id );
+        if( 0 != rate ) {
+            ms.type = METRICS_RATE;
+            ms.value.rate = (double) s->deltas[series->id] * s->per_s;
+        } else {
+            ms.type = METRICS_GAUGE;
+            ms.value.gauge = (int64_t) s->deltas[series->id];
+        }
+
+        e->series( e->ctx, &ms );
+
+        ms.header = NULL;
+        ms.header_len = 0;
+    }
+}
+
+/**
+ *  Exports one window of the moving averages of one family, as a family
+ *  with the window's suffix added to the name:
+ *
+ *      # TYPE base_name_rate_5m gauge
+ *      base_name_rate_5m{label="value"} 12.5
+ */
+static void __export_ewma( const struct snapshot *s, size_t begin, size_t end,
+                           struct metrics_exporter *e, struct derived *d,
+                           size_t window )
+{
+    const struct ewma *first = s->ewmas[begin];
+    const char *suffix = __ewma_suffixes[window];
+    size_t suffix_len = strlen( suffix );
+    size_t longest = 0;
+    struct metrics_series ms;
+    char *name;
+    size_t i;
+
+    for( i = begin; i < end; i++ ) {
+        if( longest < s->ewmas[i]->len ) {
+            longest = s->ewmas[i]->len;
+        }
+    }
+
+    name = __derived_header( d, first->name, first->family_len, suffix,
+                             longest );
+    if( NULL == name ) {
+        return;
+    }
+
+    ms.header = d->buf;
+    ms.header_len = name - d->buf;
+    ms.timestamp_ms = s->time_ms;
+    ms.updated_ms = 0;
+    ms.type = METRICS_RATE;
+
+    for( i = begin; i < end; i++ ) {
+        const struct ewma *ewma = s->ewmas[i];
+
+        memcpy( &name[ewma->family_len + suffix_len],
+                &ewma->name[ewma->family_len],
+                ewma->len - ewma->family_len + 1 );
+
+        ms.name = name;
+        ms.name_len = ewma->len + suffix_len;
+        ms.value.rate = s->ewma_rates[i * EWMA_WINDOWS + window];
+
+        e->series( e->ctx, &ms );
+
+        ms.header = NULL;
+        ms.header_len = 0;
+    }
+}
+
+/**
+ *  Exports the largest keys of a top-K metric as a gauge family:
+ *
+ *      # TYPE base_name gauge
+ *      base_name{label="key"} 1234
+ */
+static void __export_tops( const struct snapshot *s, size_t begin, size_t end,
+                           struct metrics_exporter *e, struct derived *d )
+{
+    const struct top_entry *first = &s->tops[begin];
+    size_t longest = 0;
+    struct metrics_series ms;
+    char *name;
+    size_t i;
+
+    for( i = begin; i < end; i++ ) {
+        if( longest < s->tops[i].len ) {
+            longest = s->tops[i].len;
+        }
+    }
+
+    name = __derived_header( d, first->family, first->family_len, "",
+                             longest );
+    if( NULL == name ) {
+        return;
+    }
+
+    ms.header = d->buf;
+    ms.header_len = name - d->buf;
+    ms.timestamp_ms = s->time_ms;
+    ms.updated_ms = 0;
+    ms.type = METRICS_GAUGE;
+
+    for( i = begin; i < end; i++ ) {
+        const struct top_entry *top = &s->tops[i];
+
+        memcpy( &name[top->family_len], &top->name[top->family_len],
+                top->len - top->family_len + 1 );
+
+        ms.name = name;
+        ms.name_len = top->len;
+        ms.value.gauge = top->count;
+
+        e->series( e->ctx, &ms );
+
+        ms.header = NULL;
+        ms.header_len = 0;
+    }
+}
+
+/**
+ *  Writes the header of a derived family into the scratch space, followed
+ *  by the family name and suffix the names of its series start with:
+ *
+ *      # TYPE base_name_suffix gauge
+ *      name_suffix
+ *
+ *  There is room after the name for the labels of a complete name of up to
+ *  longest bytes.
+ *
+ *  @return where the names start, or NULL on allocation failure
+ */
+static char* __derived_header( struct derived *d, const char *family,
+                               size_t family_len, const char *suffix,
+                               size_t longest )
+{
+    size_t base_len = strlen( d->base );
+    size_t suffix_len = strlen( suffix );
+    size_t header_len;
+    char *p;
+
+    /* "# TYPE " base '_' name suffix " gauge\n" then the name and '\0' */
+    header_len = 7 + base_len + 1 + family_len + suffix_len + 7;
+    if( d->len < header_len + longest + suffix_len + 1 ) {
+        size_t len = header_len + longest + suffix_len + 1;
+        char *tmp = (char*) realloc( d->buf, len );
+
+        if( NULL == tmp ) {
+            return NULL;
+        }
+        d->buf = tmp;
+        d->len = len;
+    }
+
+    p = d->buf;
+    memcpy( p, "# TYPE ", 7 );
+    p += 7;
+    if( 0 < base_len ) {
+        memcpy( p, d->base, base_len );
+        p += base_len;
+        *p++ = '_';
+    }
+    memcpy( p, family, family_len );
+    p += family_len;
+    memcpy( p, suffix, suffix_len );
+    p += suffix_len;
+    memcpy( p, " gauge\n", 7 );
+    p += 7;
+
+    /* The family name and suffix are the same for every series. */
+    memcpy( p, family, family_len );
+    memcpy( &p[family_len], suffix, suffix_len );
+
+    return p;
+}
+
+/**
+ *  Converts the update time of a series to milliseconds since the epoch,
+ *  relative to when the snapshot was taken so wall clock changes since the
+ *  update do not matter.  Returns 0 if it is not known.
+ */
+static uint64_t __updated_ms( const struct snapshot *s, size_t id )
+{
+    uint64_t stamp;
+
+    if( 0 == s->time_ms ) {
+        return 0;
+    }
+
+    stamp = s->stamps[id];
+    if( 0 == stamp ) {
+        return 0;
+    }
+
+    /* Updated after the clock was read but before the copy. */
+    if( s->taken <= stamp ) {
+        return s->time_ms;
+    }
+
+    return s->time_ms - (s->taken - stamp);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <stdlib.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+
+/* Provided by the linker when any object declares a static metric.  They are
+ * weak so a program without static metrics still links. */
+extern struct metrics_static *const __start_metriks_static[] __attribute__((weak));
+extern struct metrics_static *const __stop_metriks_static[] __attribute__((weak));
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static int __unsafe_register( __metrics_t*, struct metrics_static* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+int __unsafe_register_static( __metrics_t *m )
+{
+    struct metrics_static *const *p;
+    int rv = 0;
+
+    if( (NULL == __start_metriks_static) || (NULL == __stop_metriks_static) ) {
+        return 0;
+    }
+
+    for( p = __start_metriks_static; p < __stop_metriks_static; p++ ) {
+        if( 0 != __unsafe_register(m, *p) ) {
+            rv = -1;
+        }
+    }
+
+    return rv;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Creates the series for a static metric and points it at the static
+ *  storage.  The series record is freed at shutdown; the storage is not.
+ *  The series' own entry in the value blocks is left unused.
+ */
+static int __unsafe_register( __metrics_t *m, struct metrics_static *ms )
+{
+    struct series *s;
+    metric_type_t type;
+    size_t count = 0;
+    char *name;
+
+    while( NULL != ms->names[1 + count] ) {
+        count++;
+    }
+
+    name = __calculate_name( ms->names[0], count / 2, &ms->names[1] );
+    if( NULL == name ) {
+        return -1;
+    }
+
+    type = (METRICS_COUNTER == ms->type) ? MT_COUNTER : MT_GAUGE;
+    s = __unsafe_series( m, type, name );
+    free( name );
+
+    if( NULL == s ) {
+        return -1;
+    }
+
+    if( (uint64_t*) &ms->value.counter != s->slot ) {
+        struct series **tmp;
+
+        tmp = (struct series**) realloc( m->statics, (m->static_count + 1) *
+                                                     sizeof(struct series*) );
+        if( NULL == tmp ) {
+            return -1;
+        }
+        m->statics = tmp;
+        m->statics[m->static_count++] = s;
+        s->slot = &ms->value.counter;
+    }
+
+    return 0;
+}
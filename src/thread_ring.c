@@ -0,0 +1,326 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* Must be a power of 2. */
+#define THREAD_RING_SIZE    256
+
+/* How many entries are tried for a series before it is applied directly. */
+#define THREAD_RING_PROBES  8
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* The running total of a series' increments in one thread.  The owning
+ * thread only ever adds to the total, and whoever drains the ring remembers
+ * how much of it has been applied, so neither side needs an atomic
+ * read-modify-write.  An entry keeps its series until the ring is freed. */
+struct ring_entry {
+    struct series *series;
+    uint64_t total;
+};
+
+/* Each ring is an open addressed table of the counters one thread has
+ * incremented, with exactly one producer (the owning thread) and one consumer
+ * at a time (whoever holds m->mutex). */
+struct thread_ring {
+    struct ring_entry entries[THREAD_RING_SIZE];
+
+    /* How much of each entry's total has been applied, only touched by the
+     * consumer. */
+    uint64_t drained[THREAD_RING_SIZE];
+
+    __metrics_t *m;
+
+    /* The list of rings the registry drains, protected by m->mutex. */
+    struct thread_ring *next;
+
+    /* The list of rings owned by the thread, only touched by the thread. */
+    struct thread_ring *thread_next;
+
+    /* Set once the owning thread has exited. */
+    int thread_gone;
+
+    /* Set once the registry has been shut down. */
+    int registry_gone;
+
+    /* The ring is released by both the thread and the registry; whichever
+     * is last frees it. */
+    int refs;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static pthread_once_t __key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t __key;
+static __thread struct thread_ring *__thread_rings = NULL;
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static void __make_key( void );
+static void __thread_exit( void* );
+static void __release( struct thread_ring* );
+static struct thread_ring* __get_ring( __metrics_t* );
+static size_t __hash( const struct series* );
+static void __unsafe_drain( struct thread_ring* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+void metrics_thread_flush( metrics_t __m )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+
+    if( (NULL != m) && (&__metrics_disabled != m) ) {
+        pthread_mutex_lock( &m->mutex );
+        __unsafe_thread_rings_drain( m );
+        pthread_mutex_unlock( &m->mutex );
+    }
+}
+
+/* See internal.h for details. */
+int __thread_ring_push( __metrics_t *m, struct series *series, uint32_t inc )
+{
+    struct thread_ring *r;
+    struct ring_entry *e;
+    size_t h, i;
+
+    r = __get_ring( m );
+    if( NULL == r ) {
+        return -1;
+    }
+
+    h = __hash( series );
+    for( i = 0; i < THREAD_RING_PROBES; i++ ) {
+        e = &r->entries[(h + i) & (THREAD_RING_SIZE - 1)];
+
+        if( series == e->series ) {
+            __atomic_store_n( &e->total,
+                              __atomic_load_n(&e->total, __ATOMIC_RELAXED) + inc,
+                              __ATOMIC_RELAXED );
+            return 0;
+        }
+
+        if( NULL == e->series ) {
+            /* The total is published before the series that claims it. */
+            __atomic_store_n( &e->total, inc, __ATOMIC_RELAXED );
+            __atomic_store_n( &e->series, series, __ATOMIC_RELEASE );
+            return 0;
+        }
+    }
+
+    /* Too many other counters; let the caller apply the increment directly. */
+    return -1;
+}
+
+/* See internal.h for details. */
+void __unsafe_thread_rings_drain( __metrics_t *m )
+{
+    struct thread_ring **prev = &m->rings;
+
+    while( NULL != *prev ) {
+        struct thread_ring *r = *prev;
+
+        __unsafe_drain( r );
+
+        if( 0 != __atomic_load_n(&r->thread_gone, __ATOMIC_ACQUIRE) ) {
+            /* The thread is gone so nothing new can arrive; drain once more
+             * in case it pushed between the drain and the check. */
+            __unsafe_drain( r );
+            *prev = r->next;
+            __release( r );
+        } else {
+            prev = &r->next;
+        }
+    }
+}
+
+/* See internal.h for details. */
+void __thread_rings_destroy( __metrics_t *m )
+{
+    struct thread_ring *r;
+
+    pthread_mutex_lock( &m->mutex );
+    r = m->rings;
+    m->rings = NULL;
+    pthread_mutex_unlock( &m->mutex );
+
+    while( NULL != r ) {
+        struct thread_ring *next = r->next;
+
+        __atomic_store_n( &r->registry_gone, 1, __ATOMIC_RELEASE );
+        __release( r );
+        r = next;
+    }
+}
+
+/* See internal.h for details. */
+void __unsafe_thread_rings_forked( __metrics_t *m )
+{
+    struct thread_ring *r;
+    size_t i;
+
+    for( r = m->rings; NULL != r; r = r->next ) {
+        for( i = 0; i < THREAD_RING_SIZE; i++ ) {
+            r->drained[i] = r->entries[i].total;
+        }
+
+        /* Assume the owner is one of the parent's other threads, so only the
+         * registry's reference is left. */
+        r->thread_gone = 1;
+        r->refs = 1;
+    }
+
+    /* The forking thread is the one that carried on into the child. */
+    for( r = __thread_rings; NULL != r; r = r->thread_next ) {
+        if( m == r->m ) {
+            r->thread_gone = 0;
+            r->refs = 2;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static void __make_key( void )
+{
+    pthread_key_create( &__key, __thread_exit );
+}
+
+static void __thread_exit( void *arg )
+{
+    struct thread_ring *r = (struct thread_ring*) arg;
+
+    while( NULL != r ) {
+        struct thread_ring *next = r->thread_next;
+
+        __atomic_store_n( &r->thread_gone, 1, __ATOMIC_RELEASE );
+        __release( r );
+        r = next;
+    }
+    __thread_rings = NULL;
+}
+
+static void __release( struct thread_ring *r )
+{
+    if( 1 == __atomic_fetch_sub(&r->refs, 1, __ATOMIC_ACQ_REL) ) {
+        free( r );
+    }
+}
+
+/**
+ *  Finds the calling thread's ring for the metrics object, creating and
+ *  registering it on first use.
+ */
+static struct thread_ring* __get_ring( __metrics_t *m )
+{
+    struct thread_ring **prev = &__thread_rings;
+    struct thread_ring *r;
+
+    while( NULL != *prev ) {
+        r = *prev;
+
+        if( 0 != __atomic_load_n(&r->registry_gone, __ATOMIC_ACQUIRE) ) {
+            /* Stale ring from a registry that was shut down; the metrics
+             * object may even have been reallocated at the same address. */
+            *prev = r->thread_next;
+            __release( r );
+            pthread_setspecific( __key, __thread_rings );
+            continue;
+        }
+
+        if( m == r->m ) {
+            return r;
+        }
+        prev = &r->thread_next;
+    }
+
+    pthread_once( &__key_once, __make_key );
+
+    r = (struct thread_ring*) malloc( sizeof(struct thread_ring) );
+    if( NULL == r ) {
+        return NULL;
+    }
+    memset( r, 0, sizeof(struct thread_ring) );
+    r->m = m;
+    r->refs = 2;
+
+    pthread_mutex_lock( &m->mutex );
+    r->next = m->rings;
+    m->rings = r;
+    pthread_mutex_unlock( &m->mutex );
+
+    r->thread_next = __thread_rings;
+    __thread_rings = r;
+    pthread_setspecific( __key, __thread_rings );
+
+    return r;
+}
+
+/**
+ *  Spreads the series, which are heap allocated and so aligned, over the
+ *  table.
+ */
+static size_t __hash( const struct series *series )
+{
+    uint64_t h = (uint64_t) (uintptr_t) series * 0x9e3779b97f4a7c15ull;
+
+    return (size_t) (h >> 56);
+}
+
+static void __unsafe_drain( struct thread_ring *r )
+{
+    uint64_t now = 0;
+    size_t i;
+
+    for( i = 0; i < THREAD_RING_SIZE; i++ ) {
+        struct series *series;
+        uint64_t total;
+
+        series = __atomic_load_n( &r->entries[i].series, __ATOMIC_ACQUIRE );
+        if( NULL == series ) {
+            continue;
+        }
+
+        total = __atomic_load_n( &r->entries[i].total, __ATOMIC_RELAXED );
+        if( total == r->drained[i] ) {
+            continue;
+        }
+
+        __atomic_add_fetch( series->slot, total - r->drained[i],
+                            __ATOMIC_RELAXED );
+        r->drained[i] = total;
+        if( NULL != series->stamp ) {
+            if( 0 == now ) {
+                now = __stamp_now();
+            }
+            __atomic_store_n( series->stamp, now, __ATOMIC_RELAXED );
+        }
+    }
+}
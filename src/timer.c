@@ -0,0 +1,270 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_TSC
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* How long the TSC is compared with CLOCK_MONOTONIC for. */
+#define CALIBRATION_NS          2000000
+
+#define DURATION_SUFFIX         "_duration_ns"
+#define COUNT_SUFFIX            "_count"
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+struct timer {
+    __metrics_t *m;
+
+    /* The total time and the number of times. */
+    struct series *duration;
+    struct series *count;
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static pthread_once_t __calibrate_once = PTHREAD_ONCE_INIT;
+
+/* Set once by the first metrics_init(): whether the invariant TSC is used,
+ * and the length of one tick (1 for CLOCK_MONOTONIC). */
+static int __tsc = 0;
+static double __ns_per_tick = 1.0;
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static void __calibrate( void );
+static uint64_t __monotonic_ns( void );
+static struct timer* __unsafe_timer( __metrics_t*, const char*, const char* );
+static int __destroyer( const char*, void*, void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+metrics_timer_t metrics_timer( metrics_t __m, const char *name,
+                               size_t label_count, ... )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct timer *t;
+    va_list args;
+    char *labels;
+
+    if( (NULL == m) || (&__metrics_disabled == m) || (NULL == name) ||
+        (NULL != strchr(name, '{')) )
+    {
+        return NULL;
+    }
+
+    /* With no name this is just the labels. */
+    va_start( args, label_count );
+    labels = metrics_calculate_name_varidac( "", label_count, args );
+    va_end( args );
+
+    if( NULL == labels ) {
+        return NULL;
+    }
+
+    pthread_mutex_lock( &m->mutex );
+    t = __unsafe_timer( m, name, labels );
+    pthread_mutex_unlock( &m->mutex );
+
+    free( labels );
+
+    return (metrics_timer_t) t;
+}
+
+/* See metrics.h for details. */
+uint64_t metrics_timer_start( void )
+{
+#ifdef HAVE_TSC
+    if( 0 != __tsc ) {
+        /* Keep the work being timed from starting before the read. */
+        __builtin_ia32_lfence();
+        return __builtin_ia32_rdtsc();
+    }
+#endif
+
+    return __monotonic_ns();
+}
+
+/* See metrics.h for details. */
+void metrics_timer_stop( metrics_timer_t __t, uint64_t start )
+{
+    struct timer *t = (struct timer*) __t;
+    uint64_t end, ns;
+#ifdef HAVE_TSC
+    unsigned int aux;
+
+    if( 0 != __tsc ) {
+        /* Waits for the work being timed to finish before the read. */
+        end = __builtin_ia32_rdtscp( &aux );
+    } else
+#endif
+    {
+        end = __monotonic_ns();
+    }
+
+    if( NULL == t ) {
+        return;
+    }
+
+    ns = (start < end) ? (uint64_t) ((double) (end - start) * __ns_per_tick)
+                       : 0;
+
+    while( UINT32_MAX < ns ) {
+        __series_inc( t->m, t->duration, UINT32_MAX );
+        ns -= UINT32_MAX;
+    }
+    __series_inc( t->m, t->duration, (uint32_t) ns );
+    __series_inc( t->m, t->count, 1 );
+}
+
+/* See internal.h for details. */
+void __timer_calibrate( void )
+{
+    pthread_once( &__calibrate_once, __calibrate );
+}
+
+/* See internal.h for details. */
+void __timers_destroy( __metrics_t *m )
+{
+    trie_visit( m->timers, "", __destroyer, NULL );
+    trie_free( m->timers );
+    m->timers = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Uses the TSC if it ticks at the same rate in every power state and the
+ *  CPU has rdtscp, working out how long a tick is by timing a short busy
+ *  wait with both clocks.
+ */
+static void __calibrate( void )
+{
+#ifdef HAVE_TSC
+    unsigned int a, b, c, d;
+    uint64_t ns0, ns1, tsc0, tsc1;
+
+    if( (0 == __get_cpuid(0x80000007, &a, &b, &c, &d)) ||
+        (0 == (d & (1u << 8))) ||
+        (0 == __get_cpuid(0x80000001, &a, &b, &c, &d)) ||
+        (0 == (d & (1u << 27))) )
+    {
+        return;
+    }
+
+    ns0 = __monotonic_ns();
+    tsc0 = __builtin_ia32_rdtsc();
+    do {
+        ns1 = __monotonic_ns();
+        tsc1 = __builtin_ia32_rdtsc();
+    } while( ns1 - ns0 < CALIBRATION_NS );
+
+    if( tsc0 < tsc1 ) {
+        __ns_per_tick = (double) (ns1 - ns0) / (double) (tsc1 - tsc0);
+        __tsc = 1;
+    }
+#endif
+}
+
+static uint64_t __monotonic_ns( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+/**
+ *  Finds or creates the timer of a name and labels, with its series.
+ */
+static struct timer* __unsafe_timer( __metrics_t *m, const char *name,
+                                     const char *labels )
+{
+    size_t name_len = strlen( name );
+    size_t labels_len = strlen( labels );
+    struct timer *t;
+    char *full;
+
+    full = (char*) malloc( name_len + sizeof(DURATION_SUFFIX) + labels_len );
+    if( NULL == full ) {
+        return NULL;
+    }
+
+    memcpy( full, name, name_len );
+    memcpy( &full[name_len], labels, labels_len + 1 );
+
+    t = (struct timer*) trie_search( m->timers, full );
+    if( NULL == t ) {
+        t = (struct timer*) calloc( 1, sizeof(struct timer) );
+        if( (NULL == t) || (0 != trie_insert(m->timers, full, t)) ) {
+            free( t );
+            free( full );
+            return NULL;
+        }
+        t->m = m;
+
+        memcpy( &full[name_len], DURATION_SUFFIX,
+                sizeof(DURATION_SUFFIX) - 1 );
+        memcpy( &full[name_len + sizeof(DURATION_SUFFIX) - 1], labels,
+                labels_len + 1 );
+        t->duration = __unsafe_series( m, MT_COUNTER, full );
+
+        memcpy( &full[name_len], COUNT_SUFFIX, sizeof(COUNT_SUFFIX) - 1 );
+        memcpy( &full[name_len + sizeof(COUNT_SUFFIX) - 1], labels,
+                labels_len + 1 );
+        t->count = __unsafe_series( m, MT_COUNTER, full );
+    }
+    free( full );
+
+    /* One whose series could not be added stays in the trie, but as no
+     * timer at all. */
+    if( (NULL == t->duration) || (NULL == t->count) ) {
+        return NULL;
+    }
+
+    return t;
+}
+
+static int __destroyer( const char *key, void *data, void *arg )
+{
+    (void) key;
+    (void) arg;
+
+    free( data );
+
+    return 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The number of sketches each top-K metric is split over.  A thread always
+ * uses the same one, so threads only contend when there are more of them. */
+#define TOPK_SHARDS             8
+
+/* Each sketch keeps this many times as many keys as are reported, so a key
+ * near the top is rarely pushed out by a burst of others. */
+#define TOPK_SLACK              4
+
+#define DEFAULT_TOPK_SIZE       10
+#define DEFAULT_TOP_ENTRIES     16
+
+/* Longer keys are cut short to fit. */
+#define TOPK_KEY_SIZE           64
+
+#define FNV_OFFSET              0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+struct topk_slot {
+    uint64_t hash;
+    uint64_t count;
+    size_t key_len;
+    char key[TOPK_KEY_SIZE];
+};
+
+/* A Space-Saving sketch: the counted keys, where a new key replaces the
+ * least counted one and carries on from its count. */
+struct topk_shard {
+    pthread_mutex_t mutex;
+    size_t used;
+    struct topk_slot *slots;
+};
+
+struct topk {
+    struct topk_shard shards[TOPK_SHARDS];
+
+    /* The number of slots of each shard. */
+    size_t capacity;
+
+    /* The label the keys are reported as the values of. */
+    char *label;
+
+    size_t len;
+    char name[];
+};
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static size_t __threads = 0;
+static __thread size_t __thread_shard = 0;
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static struct topk* __unsafe_topk( __metrics_t*, const char*, const char* );
+static size_t __size( const __metrics_t* );
+static size_t __shard( void );
+static void __unsafe_add( struct topk_shard*, size_t, uint64_t, const char*,
+                          size_t, uint32_t );
+static size_t __merge( struct topk*, struct topk_slot* );
+static int __by_key( const void*, const void* );
+static int __by_count( const void*, const void* );
+static int __add_tops( __metrics_t*, struct snapshot*, const struct topk*,
+                       const struct topk_slot*, size_t );
+static void __free_tops( struct snapshot* );
+static int __clear( const char*, void*, void* );
+static int __destroyer( const char*, void*, void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See metrics.h for details. */
+void metrics_topk_add( metrics_t __m, const char *name, const char *label,
+                       const char *key, uint32_t count )
+{
+    __metrics_t *m = (__metrics_t*) __m;
+    struct topk_shard *shard;
+    struct topk *t;
+    uint64_t hash = FNV_OFFSET;
+    size_t len, i;
+
+    if( &__metrics_disabled == m ) {
+        return;
+    }
+
+    t = (struct topk*) trie_search( m->topks, name );
+    if( NULL == t ) {
+        pthread_mutex_lock( &m->mutex );
+        t = __unsafe_topk( m, name, label );
+        pthread_mutex_unlock( &m->mutex );
+
+        if( NULL == t ) {
+            return;
+        }
+    }
+
+    len = strnlen( key, TOPK_KEY_SIZE - 1 );
+    for( i = 0; i < len; i++ ) {
+        hash = (hash ^ (uint8_t) key[i]) * FNV_PRIME;
+    }
+
+    shard = &t->shards[__shard()];
+    pthread_mutex_lock( &shard->mutex );
+    __unsafe_add( shard, t->capacity, hash, key, len, count );
+    pthread_mutex_unlock( &shard->mutex );
+}
+
+/* See internal.h for details. */
+int __snapshot_tops( __metrics_t *m, struct snapshot *s, const char *prefix )
+{
+    struct topk_slot *merged = NULL;
+    size_t merged_len = 0;
+    struct trie_it *it;
+    int rv = 0;
+
+    __free_tops( s );
+
+    it = trie_it_create( m->topks, prefix );
+    if( NULL == it ) {
+        return -1;
+    }
+
+    for( ; (0 == rv) && (0 == trie_it_done(it)); trie_it_next(it) ) {
+        struct topk *t = (struct topk*) trie_it_data( it );
+        size_t n;
+
+        if( merged_len < TOPK_SHARDS * t->capacity ) {
+            free( merged );
+            merged_len = TOPK_SHARDS * t->capacity;
+            merged = (struct topk_slot*) malloc( merged_len *
+                                                 sizeof(struct topk_slot) );
+            if( NULL == merged ) {
+                rv = -1;
+                break;
+            }
+        }
+
+        n = __merge( t, merged );
+        rv = __add_tops( m, s, t, merged, n );
+    }
+
+    if( (0 == rv) && (0 != trie_it_error(it)) ) {
+        rv = -1;
+    }
+    trie_it_free( it );
+    free( merged );
+
+    if( 0 != rv ) {
+        __free_tops( s );
+    }
+
+    return rv;
+}
+
+/* See internal.h for details. */
+void __snapshot_tops_destroy( struct snapshot *s )
+{
+    __free_tops( s );
+    free( s->tops );
+}
+
+/* See internal.h for details. */
+void __topks_forked( __metrics_t *m )
+{
+    trie_visit( m->topks, "", __clear, NULL );
+}
+
+/* See internal.h for details. */
+void __topks_destroy( __metrics_t *m )
+{
+    trie_visit( m->topks, "", __destroyer, NULL );
+    trie_free( m->topks );
+    m->topks = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Finds or creates the top-K metric of a name.
+ */
+static struct topk* __unsafe_topk( __metrics_t *m, const char *name,
+                                   const char *label )
+{
+    size_t len = strlen( name );
+    size_t capacity = TOPK_SLACK * __size( m );
+    struct topk_slot *slots;
+    struct topk *t;
+    size_t i;
+
+    t = (struct topk*) trie_search( m->topks, name );
+    if( NULL != t ) {
+        return t;
+    }
+
+    t = (struct topk*) calloc( 1, sizeof(struct topk) + len + 1 );
+    slots = (struct topk_slot*) malloc( TOPK_SHARDS * capacity *
+                                        sizeof(struct topk_slot) );
+    if( (NULL == t) || (NULL == slots) ) {
+        free( t );
+        free( slots );
+        return NULL;
+    }
+
+    t->label = strdup( label );
+    if( NULL == t->label ) {
+        free( t );
+        free( slots );
+        return NULL;
+    }
+
+    for( i = 0; i < TOPK_SHARDS; i++ ) {
+        pthread_mutex_init( &t->shards[i].mutex, NULL );
+        t->shards[i].slots = &slots[i * capacity];
+    }
+    t->capacity = capacity;
+    t->len = len;
+    memcpy( t->name, name, len + 1 );
+
+    if( 0 != trie_insert(m->topks, name, t) ) {
+        __destroyer( NULL, t, NULL );
+        return NULL;
+    }
+
+    return t;
+}
+
+/**
+ *  The configured number of keys to report.
+ */
+static size_t __size( const __metrics_t *m )
+{
+    return (0 < m->c->topk_size) ? (size_t) m->c->topk_size
+                                 : DEFAULT_TOPK_SIZE;
+}
+
+/**
+ *  The shard of the calling thread.
+ */
+static size_t __shard( void )
+{
+    if( 0 == __thread_shard ) {
+        __thread_shard = __atomic_add_fetch( &__threads, 1, __ATOMIC_RELAXED );
+    }
+
+    return __thread_shard % TOPK_SHARDS;
+}
+
+/**
+ *  Counts a key in a shard.  The slots are few enough that checking the
+ *  hash of each one is quicker than keeping an index, and the same pass
+ *  finds the one to replace if the key is not there.
+ */
+static void __unsafe_add( struct topk_shard *shard, size_t capacity,
+                          uint64_t hash, const char *key, size_t len,
+                          uint32_t count )
+{
+    struct topk_slot *slot;
+    size_t i, least = 0;
+
+    for( i = 0; i < shard->used; i++ ) {
+        slot = &shard->slots[i];
+        if( (hash == slot->hash) && (len == slot->key_len) &&
+            (0 == memcmp(key, slot->key, len)) )
+        {
+            slot->count += count;
+            return;
+        }
+        if( slot->count < shard->slots[least].count ) {
+            least = i;
+        }
+    }
+
+    if( shard->used < capacity ) {
+        slot = &shard->slots[shard->used++];
+        slot->count = 0;
+    } else {
+        slot = &shard->slots[least];
+    }
+
+    slot->hash = hash;
+    slot->key_len = len;
+    memcpy( slot->key, key, len );
+    slot->key[len] = '\0';
+    slot->count += count;
+}
+
+/**
+ *  Copies the slots of every shard and adds up the counts of each key,
+ *  leaving the keys in order of their counts, largest first.
+ *
+ *  @return the number of keys
+ */
+static size_t __merge( struct topk *t, struct topk_slot *merged )
+{
+    size_t n = 0;
+    size_t i, j;
+
+    for( i = 0; i < TOPK_SHARDS; i++ ) {
+        struct topk_shard *shard = &t->shards[i];
+
+        pthread_mutex_lock( &shard->mutex );
+        memcpy( &merged[n], shard->slots, shard->used * sizeof(struct topk_slot) );
+        n += shard->used;
+        pthread_mutex_unlock( &shard->mutex );
+    }
+
+    if( 0 == n ) {
+        return 0;
+    }
+
+    qsort( merged, n, sizeof(struct topk_slot), __by_key );
+    for( i = 0, j = 1; j < n; j++ ) {
+        if( 0 == __by_key(&merged[i], &merged[j]) ) {
+            merged[i].count += merged[j].count;
+        } else {
+            merged[++i] = merged[j];
+        }
+    }
+    n = i + 1;
+
+    qsort( merged, n, sizeof(struct topk_slot), __by_count );
+
+    return n;
+}
+
+static int __by_key( const void *a, const void *b )
+{
+    const struct topk_slot *x = (const struct topk_slot*) a;
+    const struct topk_slot *y = (const struct topk_slot*) b;
+
+    if( x->hash != y->hash ) {
+        return (x->hash < y->hash) ? -1 : 1;
+    }
+
+    return strcmp( x->key, y->key );
+}
+
+/**
+ *  Orders keys by count, largest first, then by key so reports are stable.
+ */
+static int __by_count( const void *a, const void *b )
+{
+    const struct topk_slot *x = (const struct topk_slot*) a;
+    const struct topk_slot *y = (const struct topk_slot*) b;
+
+    if( x->count != y->count ) {
+        return (x->count > y->count) ? -1 : 1;
+    }
+
+    return strcmp( x->key, y->key );
+}
+
+/**
+ *  Adds the largest keys of a top-K metric to the snapshot as series.
+ */
+static int __add_tops( __metrics_t *m, struct snapshot *s,
+                       const struct topk *t, const struct topk_slot *merged,
+                       size_t n )
+{
+    size_t k = __size( m );
+    size_t i;
+
+    if( n < k ) {
+        k = n;
+    }
+
+    if( s->top_len < s->top_count + k ) {
+        size_t len = (0 == s->top_len) ? DEFAULT_TOP_ENTRIES : s->top_len;
+        struct top_entry *p;
+
+        while( len < s->top_count + k ) {
+            len *= 2;
+        }
+        p = (struct top_entry*) realloc( s->tops,
+                                         len * sizeof(struct top_entry) );
+        if( NULL == p ) {
+            return -1;
+        }
+        s->tops = p;
+        s->top_len = len;
+    }
+
+    for( i = 0; i < k; i++ ) {
+        struct top_entry *e = &s->tops[s->top_count];
+
+        e->name = metrics_calculate_name( t->name, 1, t->label,
+                                          merged[i].key );
+        if( NULL == e->name ) {
+            return -1;
+        }
+        e->len = strlen( e->name );
+        e->family = t->name;
+        e->family_len = t->len;
+        e->count = (int64_t) merged[i].count;
+        s->top_count++;
+    }
+
+    return 0;
+}
+
+static void __free_tops( struct snapshot *s )
+{
+    size_t i;
+
+    for( i = 0; i < s->top_count; i++ ) {
+        free( s->tops[i].name );
+    }
+    s->top_count = 0;
+}
+
+/**
+ *  Empties the shards of a forked child, whose locks may have been held by
+ *  threads it does not have.
+ */
+static int __clear( const char *key, void *data, void *arg )
+{
+    struct topk *t = (struct topk*) data;
+    size_t i;
+
+    (void) key;
+    (void) arg;
+
+    for( i = 0; i < TOPK_SHARDS; i++ ) {
+        pthread_mutex_init( &t->shards[i].mutex, NULL );
+        t->shards[i].used = 0;
+    }
+
+    return 0;
+}
+
+static int __destroyer( const char *key, void *data, void *arg )
+{
+    struct topk *t = (struct topk*) data;
+    size_t i;
+
+    (void) key;
+    (void) arg;
+
+    for( i = 0; i < TOPK_SHARDS; i++ ) {
+        pthread_mutex_destroy( &t->shards[i].mutex );
+    }
+    free( t->shards[0].slots );
+    free( t->label );
+    free( t );
+
+    return 0;
+}
@@ -2,22 +2,88 @@
 #include <string.h>
 #include "trie.h"
 
+/* Readers may run concurrently with a single writer, see trie.h.  Nodes never
+ * move.  A node's children are kept sorted in an array with spare room, and
+ * a child is added in place under the array's sequence count: readers retry
+ * whatever they read while it changed.  Only when the array is full is a copy
+ * twice the size published, and the full one is kept on the root's retired
+ * list, as a reader may still be searching it, until trie_free(). */
+
+#define load(p)       __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store(p, v)   __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
 struct trieptr {
     struct trie *trie;
     int c;
 };
 
+struct children {
+    struct children *retired;
+    unsigned seq;
+    short nchildren;
+    short capacity;
+    struct trieptr ptrs[];
+};
+
 struct trie {
     void *data;
-    short nchildren, size;
-    struct trieptr children[];
+    struct children *children;
 };
 
-/* Mini stack library for non-recursive traversal. */
+struct root {
+    struct trie trie;
+    struct children *retired;
+};
+
+static int
+nchildren(const struct trie *self)
+{
+    struct children *children = load(&self->children);
+    return children ? load(&children->nchildren) : 0;
+}
+
+/* Finds the first child of SELF after the character C, or the first one if C
+ * is -1, from a consistent read of the children.
+ * @return 1 if found, 0 if there is none */
+static int
+child_after(const struct trie *self, int c, struct trieptr *found)
+{
+    for (;;) {
+        struct children *children = load(&self->children);
+        if (!children)
+            return 0;
+        unsigned seq = load(&children->seq);
+        if (seq & 1)
+            continue;
+        int first = 0;
+        int last = load(&children->nchildren) - 1;
+        int after = -1;
+        while (first <= last) {
+            int middle = (first + last) / 2;
+            if (load(&children->ptrs[middle].c) > c) {
+                after = middle;
+                last = middle - 1;
+            } else {
+                first = middle + 1;
+            }
+        }
+        if (after >= 0) {
+            found->c = load(&children->ptrs[after].c);
+            found->trie = load(&children->ptrs[after].trie);
+        }
+        /* The acquire loads keep this read after the ones before it. */
+        if (load(&children->seq) == seq)
+            return after >= 0;
+    }
+}
+
+/* Mini stack library for non-recursive traversal.  A node remembers the
+ * last child it went down by character rather than by position, as children
+ * may be added in front of it in the meantime. */
 
 struct stack_node {
     struct trie *trie;
-    int i;
+    int c;
 };
 
 struct stack {
@@ -61,7 +127,7 @@ stack_push(struct stack *s, struct trie *trie)
     if (s->fill == s->size)
         if (stack_grow(s) != 0)
             return -1;
-    s->stack[s->fill++] = (struct stack_node){trie, 0};
+    s->stack[s->fill++] = (struct stack_node){trie, -1};
     return 0;
 }
 
@@ -77,72 +143,72 @@ stack_peek(struct stack *s)
     return &s->stack[s->fill - 1];
 }
 
+/* Moves NODE on to its next child.
+ * @return the child, or NULL once they have all been visited */
+static struct trie *
+node_next(struct stack_node *node, int *c)
+{
+    struct trieptr next;
+    if (!child_after(node->trie, node->c, &next))
+        return 0;
+    node->c = next.c;
+    if (c)
+        *c = next.c;
+    return next.trie;
+}
+
 /* Constructor and destructor. */
 
 struct trie *
 trie_create(void)
 {
-    /* Root never needs to be resized. */
-    size_t tail_size = sizeof(struct trieptr) * 255;
-    struct trie *root = malloc(sizeof(*root) + tail_size);
+    struct root *root = malloc(sizeof(*root));
     if (!root)
         return 0;
-    root->size = 255;
-    root->nchildren = 0;
-    root->data = 0;
-    return root;
+    root->trie.data = 0;
+    root->trie.children = 0;
+    root->retired = 0;
+    return &root->trie;
 }
 
 int
 trie_free(struct trie *trie)
 {
+    struct children *retired = ((struct root *)trie)->retired;
     struct stack stack, *s = &stack;
     if (stack_init(s) != 0)
         return 1;
     stack_push(s, trie); /* first push always successful */
     while (s->fill > 0) {
-        struct stack_node *node = stack_peek(s);
-        if (node->i < node->trie->nchildren) {
-            int i = node->i++;
-            if (stack_push(s, node->trie->children[i].trie) != 0)
+        struct trie *child = node_next(stack_peek(s), 0);
+        if (child) {
+            if (stack_push(s, child) != 0)
                 return 1;
         } else {
-            free(stack_pop(s));
+            struct trie *t = stack_pop(s);
+            free(t->children);
+            free(t);
         }
     }
     stack_free(s);
+    while (retired) {
+        struct children *next = retired->retired;
+        free(retired);
+        retired = next;
+    }
     return 0;
 }
 
 /* Core search functions. */
 
 static size_t
-binary_search(struct trie *self, struct trie **child,
-              struct trieptr **ptr, const unsigned char *key)
+binary_search(struct trie *self, struct trie **child, const unsigned char *key)
 {
     size_t i = 0;
-    int found = 1;
-    *ptr = 0;
-    while (found && key[i]) {
-        int first = 0;
-        int last = self->nchildren - 1;
-        int middle;
-        found = 0;
-        while (first <= last) {
-            middle = (first + last) / 2;
-            struct trieptr *p = &self->children[middle];
-            if (p->c < key[i]) {
-                first = middle + 1;
-            } else if (p->c == key[i]) {
-                self = p->trie;
-                *ptr = p;
-                found = 1;
-                i++;
-                break;
-            } else {
-                last = middle - 1;
-            }
-        }
+    struct trieptr p;
+    while (key[i] && child_after(self, key[i] - 1, &p) && p.c == key[i]) {
+        self = p.trie;
+        i++;
     }
     *child = self;
     return i;
@@ -152,64 +218,91 @@ void *
 trie_search(const struct trie *self, const char *key)
 {
     struct trie *child;
-    struct trieptr *parent;
     unsigned char *ukey = (unsigned char *)key;
-    size_t depth = binary_search((struct trie *)self, &child, &parent, ukey);
-    return !key[depth] ? child->data : 0;
+    size_t depth = binary_search((struct trie *)self, &child, ukey);
+    return !key[depth] ? load(&child->data) : 0;
 }
 
 /* Insertion functions. */
 
-static struct trie *
-grow(struct trie *self) {
-    int size = self->size * 2;
-    if (size > 255)
-        size = 255;
-    size_t children_size = sizeof(struct trieptr) * size;
-    struct trie *resized = realloc(self, sizeof(*self) + children_size);
-    if (!resized)
+static struct children *
+children_create(int capacity)
+{
+    size_t size = sizeof(struct children) + sizeof(struct trieptr) * capacity;
+    struct children *children = malloc(size);
+    if (!children)
         return 0;
-    resized->size = size;
-    return resized;
+    children->retired = 0;
+    children->seq = 0;
+    children->nchildren = 0;
+    children->capacity = capacity;
+    return children;
 }
 
-static int
-ptr_cmp(const void *a, const void *b)
+static void
+retire(struct root *root, struct children *children)
 {
-    return ((struct trieptr *)a)->c - ((struct trieptr *)b)->c;
+    if (children) {
+        children->retired = root->retired;
+        root->retired = children;
+    }
 }
 
-static struct trie *
-node_add(struct trie *self, int c, struct trie *child)
-{
-    if (self->size == self->nchildren) {
-        self = grow(self);
-        if (!self)
-            return 0;
+static int
+node_add(struct root *root, struct trie *self, int c, struct trie *child)
+{
+    struct children *old = self->children;
+    int n = old ? old->nchildren : 0;
+    int i = 0;
+    while (i < n && old->ptrs[i].c < c)
+        i++;
+    if (old && n < old->capacity) {
+        unsigned seq = old->seq;
+        /* Each release store below also publishes the odd count. */
+        store(&old->seq, seq + 1);
+        for (int j = n; j > i; j--) {
+            store(&old->ptrs[j].c, old->ptrs[j - 1].c);
+            store(&old->ptrs[j].trie, old->ptrs[j - 1].trie);
+        }
+        store(&old->ptrs[i].c, c);
+        store(&old->ptrs[i].trie, child);
+        store(&old->nchildren, n + 1);
+        store(&old->seq, seq + 2);
+        return 0;
     }
-    int i = self->nchildren++;
-    self->children[i].c = c;
-    self->children[i].trie = child;
-    qsort(self->children, self->nchildren, sizeof(self->children[0]), ptr_cmp);
-    return self;
+    struct children *added = children_create(old ? 2 * old->capacity : 1);
+    if (!added)
+        return -1;
+    if (old) {
+        memcpy(added->ptrs, old->ptrs, i * sizeof(added->ptrs[0]));
+        memcpy(added->ptrs + i + 1, old->ptrs + i,
+               (n - i) * sizeof(added->ptrs[0]));
+    }
+    added->ptrs[i].c = c;
+    added->ptrs[i].trie = child;
+    added->nchildren = n + 1;
+    store(&self->children, added);
+    retire(root, old);
+    return 0;
 }
 
+/* Only called by trie_prune(), which has the trie to itself. */
 static void
 node_remove(struct trie *self, int i)
 {
-    size_t len = (--self->nchildren - i) * sizeof(self->children[0]);
-    memmove(self->children + i, self->children + i + 1, len);
+    struct children *children = self->children;
+    memmove(children->ptrs + i, children->ptrs + i + 1,
+            (children->nchildren - i - 1) * sizeof(children->ptrs[0]));
+    children->nchildren--;
 }
 
 static struct trie *
 create(void)
 {
-    int size = 1;
-    struct trie *trie = malloc(sizeof(*trie) + sizeof(struct trieptr) * size);
+    struct trie *trie = malloc(sizeof(*trie));
     if (!trie)
         return 0;
-    trie->size = size;
-    trie->nchildren = 0;
+    trie->children = 0;
     trie->data = 0;
     return trie;
 }
@@ -226,26 +319,20 @@ int
 trie_replace(struct trie *self, const char *key, trie_replacer f, void *arg)
 {
     struct trie *last;
-    struct trieptr *parent;
     unsigned char *ukey = (unsigned char *)key;
-    size_t depth = binary_search(self, &last, &parent, ukey);
+    size_t depth = binary_search(self, &last, ukey);
     while (ukey[depth]) {
         struct trie *subtrie = create();
         if (!subtrie)
             return 1;
-        struct trie *added = node_add(last, ukey[depth], subtrie);
-        if (!added) {
+        if (node_add((struct root *)self, last, ukey[depth], subtrie) != 0) {
             free(subtrie);
             return 1;
         }
-        if (parent) {
-            parent->trie = added;
-            parent = 0;
-        }
         last = subtrie;
         depth++;
     }
-    last->data = f(key, last->data, arg);
+    store(&last->data, f(key, last->data, arg));
     return 0;
 }
 
@@ -327,17 +414,17 @@ visit(struct trie *self, const char *prefix, trie_visitor visitor, void *arg)
     stack_push(s, self);
     while (s->fill > 0) {
         struct stack_node *node = stack_peek(s);
-        if (node->i == 0 && node->trie->data) {
-            if (visitor(b->buffer, node->trie->data, arg) != 0) {
+        void *data = node->c == -1 ? load(&node->trie->data) : 0;
+        if (data) {
+            if (visitor(b->buffer, data, arg) != 0) {
                 buffer_free(b);
                 stack_free(s);
                 return 1;
             }
         }
-        if (node->i < node->trie->nchildren) {
-            struct trie *trie = node->trie->children[node->i].trie;
-            int c = node->trie->children[node->i].c;
-            node->i++;
+        int c;
+        struct trie *trie = node_next(node, &c);
+        if (trie) {
             if (stack_push(s, trie) != 0) {
                 buffer_free(b);
                 return -1;
@@ -360,9 +447,8 @@ int
 trie_visit(struct trie *self, const char *prefix, trie_visitor v, void *arg)
 {
     struct trie *start = self;
-    struct trieptr *ptr;
     unsigned char *uprefix = (unsigned char *)prefix;
-    int depth = binary_search(self, &start, &ptr, uprefix);
+    int depth = binary_search(self, &start, uprefix);
     if (prefix[depth])
         return 0;
     int r = visit(start, prefix, v, arg);
@@ -397,20 +483,23 @@ trie_prune(struct trie *trie)
         return -1;
     stack_push(s, trie);
     while (s->fill > 0) {
-        struct stack_node *node = stack_peek(s);
-        int i = node->i++;
-        if (i < node->trie->nchildren) {
-            if (stack_push(s, node->trie->children[i].trie) != 0)
+        struct trie *child = node_next(stack_peek(s), 0);
+        if (child) {
+            if (stack_push(s, child) != 0)
                 return 0;
         } else {
             struct trie *t = stack_pop(s);
-            for (int i = 0; i < t->nchildren; i++) {
-                struct trie *child = t->children[i].trie;
-                if (!child->nchildren && !child->data) {
+            for (int i = 0; i < nchildren(t); i++) {
+                struct trie *child = t->children->ptrs[i].trie;
+                if (!nchildren(child) && !child->data) {
                     node_remove(t, i--);
                     free(child);
                 }
             }
+            if (t->children && !t->children->nchildren) {
+                free(t->children);
+                t->children = 0;
+            }
         }
     }
     stack_free(s);
@@ -426,14 +515,16 @@ trie_size(struct trie *trie)
     stack_push(s, trie);
     size_t size = 0;
     while (s->fill > 0) {
-        struct stack_node *node = stack_peek(s);
-        int i = node->i++;
-        if (i < node->trie->nchildren) {
-            if (stack_push(s, node->trie->children[i].trie) != 0)
+        struct trie *child = node_next(stack_peek(s), 0);
+        if (child) {
+            if (stack_push(s, child) != 0)
                 return 0;
         } else {
             struct trie *t = stack_pop(s);
-            size += sizeof(*t) + sizeof(*t->children) * t->size;
+            size += sizeof(*t);
+            if (t->children)
+                size += sizeof(*t->children) +
+                        sizeof(t->children->ptrs[0]) * t->children->capacity;
         }
     }
     stack_free(s);
@@ -462,7 +553,10 @@ trie_it_create(struct trie *trie, const char *prefix)
         free(it);
         return 0;
     }
-    stack_push(&it->stack, trie); /* first push always successful */
+    struct trie *start;
+    size_t depth = binary_search(trie, &start, (const unsigned char *)prefix);
+    if (!prefix[depth])
+        stack_push(&it->stack, start); /* first push always successful */
     it->data = 0;
     it->error = 0;
     trie_it_next(it);
@@ -475,19 +569,19 @@ trie_it_next(struct trie_it *it)
     while (!it->error && it->stack.fill) {
         struct stack_node *node = stack_peek(&it->stack);
 
-        if (node->i == 0 && node->trie->data) {
+        void *data = node->c == -1 ? load(&node->trie->data) : 0;
+        if (data) {
             if (!it->data) {
-                it->data = node->trie->data;
+                it->data = data;
                 return 1;
             } else {
                 it->data = 0;
             }
         }
 
-        if (node->i < node->trie->nchildren) {
-            struct trie *trie = node->trie->children[node->i].trie;
-            int c = node->trie->children[node->i].c;
-            node->i++;
+        int c;
+        struct trie *trie = node_next(node, &c);
+        if (trie) {
             if (stack_push(&it->stack, trie)) {
                 it->error = 1;
                 return 0;
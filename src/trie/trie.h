@@ -14,6 +14,12 @@
  * Except for trie_free() and trie_prune(), memory is never freed by the
  * trie, even when entries are "removed" by associating a NULL pointer.
  *
+ * trie_search(), trie_visit(), trie_count() and the iterators may run
+ * concurrently with one thread calling trie_insert() or trie_replace(): a
+ * reader finds each key either with its old or its new data.  Writers must
+ * be serialized by the caller, and trie_prune() and trie_free() need the
+ * trie to themselves.
+ *
  * @see http://en.wikipedia.org/wiki/Trie
  */
 
@@ -88,8 +94,8 @@ size_t trie_size(struct trie *);
 
 /**
  * Create an iterator that visits each key with the given prefix, in
- * lexicographical order. Making any modifications to the trie
- * invalidates the iterator.
+ * lexicographical order. The iterator stays valid while keys are
+ * inserted, which it may or may not visit; trie_prune() invalidates it.
  * @return a fresh iterator pointing to the first key
  */
 struct trie_it *trie_it_create(struct trie *, const char *prefix);
@@ -0,0 +1,468 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+
+/* Direct descriptors (opening into the ring's file table) are what let the
+ * open be linked with the write; they arrived with IORING_FILE_INDEX_ALLOC. */
+#if defined(IORING_FILE_INDEX_ALLOC) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+#define TEMP_SUFFIX         ".tmp"
+
+#ifdef HAVE_IO_URING
+
+/* openat -> write -> fsync -> close -> renameat */
+#define CHAIN_LENGTH        5
+#define RING_ENTRIES        8
+
+/* The slot in the ring's file table the report file is opened into. */
+#define FILE_SLOT           0
+
+/* The largest write a single sqe can describe. */
+#define MAX_WRITE           0x7ffff000
+
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+#ifdef HAVE_IO_URING
+
+struct uring_writer {
+    int fd;
+
+    /* The mapped rings; both are in the one mapping. */
+    void *sq_ring;
+    size_t sq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *filename;
+    char *tmpname;
+
+    /* The buffer being written; it must not change until the chain is done. */
+    char *buf;
+    size_t len;
+
+    /* The completions still expected and the first error among them. */
+    unsigned pending;
+    int error;
+
+    /* A forked child shares the ring with its parent and must not use it. */
+    pid_t pid;
+};
+
+#else
+
+struct uring_writer {
+    int unused;
+};
+
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+#ifdef HAVE_IO_URING
+static int __setup( struct uring_writer* );
+static int __supported( int );
+static void __reap( struct uring_writer* );
+static struct io_uring_sqe* __next_sqe( struct uring_writer*, unsigned* );
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+#ifdef HAVE_IO_URING
+
+/* See internal.h for details. */
+struct uring_writer* __uring_writer_create( const char *filename )
+{
+    struct uring_writer *w;
+    size_t len = strlen( filename );
+
+    w = (struct uring_writer*) malloc( sizeof(struct uring_writer) );
+    if( NULL == w ) {
+        return NULL;
+    }
+    memset( w, 0, sizeof(struct uring_writer) );
+    w->fd = -1;
+    w->pid = getpid();
+
+    w->filename = strdup( filename );
+    w->tmpname = (char*) malloc( len + sizeof(TEMP_SUFFIX) );
+    if( (NULL == w->filename) || (NULL == w->tmpname) || (0 != __setup(w)) ) {
+        __uring_writer_destroy( w );
+        return NULL;
+    }
+    memcpy( w->tmpname, filename, len );
+    memcpy( &w->tmpname[len], TEMP_SUFFIX, sizeof(TEMP_SUFFIX) );
+
+    return w;
+}
+
+/* See internal.h for details. */
+int __uring_writer_wait( struct uring_writer *w )
+{
+    int rv;
+
+    if( getpid() != w->pid ) {
+        w->pending = 0;
+        return -1;
+    }
+
+    __reap( w );
+    while( 0 < w->pending ) {
+        if( (0 > syscall(__NR_io_uring_enter, w->fd, 0, w->pending,
+                         IORING_ENTER_GETEVENTS, NULL, 0)) &&
+            (EINTR != errno) )
+        {
+            /* The ring is unusable; nothing more will complete. */
+            w->pending = 0;
+            w->error = -errno;
+            break;
+        }
+        __reap( w );
+    }
+
+    rv = (0 == w->error) ? 0 : -1;
+    w->error = 0;
+
+    return rv;
+}
+
+/* See internal.h for details. */
+int __uring_writer_submit( struct uring_writer *w, char **buf, size_t *len,
+                           size_t used )
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    char *tmp_buf;
+    size_t tmp_len;
+    long rv;
+
+    if( (0 < w->pending) || (MAX_WRITE < used) || (getpid() != w->pid) ) {
+        return -1;
+    }
+
+    /* The buffer the caller renders into next; as large as this one. */
+    if( NULL == w->buf ) {
+        w->buf = (char*) malloc( *len );
+        if( NULL == w->buf ) {
+            return -1;
+        }
+        w->len = *len;
+    }
+
+    tail = *w->sq_tail;
+
+    sqe = __next_sqe( w, &tail );
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) w->tmpname;
+    sqe->len = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    /* Direct descriptors are never inherited; O_CLOEXEC is refused. */
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->file_index = FILE_SLOT + 1;
+
+    sqe = __next_sqe( w, &tail );
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+    sqe->fd = FILE_SLOT;
+    sqe->addr = (uintptr_t) *buf;
+    sqe->len = (unsigned) used;
+    sqe->off = 0;
+
+    sqe = __next_sqe( w, &tail );
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+    sqe->fd = FILE_SLOT;
+
+    sqe = __next_sqe( w, &tail );
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->file_index = FILE_SLOT + 1;
+
+    sqe = __next_sqe( w, &tail );
+    sqe->opcode = IORING_OP_RENAMEAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) w->tmpname;
+    sqe->len = (unsigned) AT_FDCWD;
+    sqe->addr2 = (uintptr_t) w->filename;
+
+    __atomic_store_n( w->sq_tail, tail, __ATOMIC_RELEASE );
+
+    rv = syscall( __NR_io_uring_enter, w->fd, CHAIN_LENGTH, 0, 0, NULL, 0 );
+    if( CHAIN_LENGTH != rv ) {
+        /* Anything submitted still has to finish before the buffer is
+         * reused; the caller writes this report itself. */
+        w->pending = (0 < rv) ? (unsigned) rv : 0;
+        return -1;
+    }
+    w->pending = CHAIN_LENGTH;
+
+    /* Ping-pong: the kernel owns the rendered buffer until the chain is done
+     * and the caller renders the next report into the other one. */
+    tmp_buf = *buf;
+    tmp_len = *len;
+    *buf = w->buf;
+    *len = w->len;
+    w->buf = tmp_buf;
+    w->len = tmp_len;
+
+    return 0;
+}
+
+/* See internal.h for details. */
+void __uring_writer_destroy( struct uring_writer *w )
+{
+    if( NULL == w ) {
+        return;
+    }
+
+    if( -1 != w->fd ) {
+        __uring_writer_wait( w );
+        if( NULL != w->sqes ) {
+            munmap( w->sqes, w->sqes_len );
+        }
+        if( NULL != w->sq_ring ) {
+            munmap( w->sq_ring, w->sq_ring_len );
+        }
+        close( w->fd );
+    }
+
+    free( w->buf );
+    free( w->tmpname );
+    free( w->filename );
+    free( w );
+}
+
+#else
+
+/* See internal.h for details. */
+struct uring_writer* __uring_writer_create( const char *filename )
+{
+    (void) filename;
+
+    return NULL;
+}
+
+/* See internal.h for details. */
+int __uring_writer_wait( struct uring_writer *w )
+{
+    (void) w;
+
+    return 0;
+}
+
+/* See internal.h for details. */
+int __uring_writer_submit( struct uring_writer *w, char **buf, size_t *len,
+                           size_t used )
+{
+    (void) w;
+    (void) buf;
+    (void) len;
+    (void) used;
+
+    return -1;
+}
+
+/* See internal.h for details. */
+void __uring_writer_destroy( struct uring_writer *w )
+{
+    (void) w;
+}
+
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+#ifdef HAVE_IO_URING
+
+/**
+ *  Creates and maps the ring and registers its one slot file table.  Fails
+ *  if the kernel (or a seccomp policy) does not allow io_uring or lacks any
+ *  of the operations of the chain.
+ */
+static int __setup( struct uring_writer *w )
+{
+    struct io_uring_params p;
+    int files[1] = { -1 };
+    size_t cq_ring_len;
+    char *sq, *cq;
+
+    memset( &p, 0, sizeof(p) );
+    w->fd = (int) syscall( __NR_io_uring_setup, RING_ENTRIES, &p );
+    if( 0 > w->fd ) {
+        w->fd = -1;
+        return -1;
+    }
+
+    if( (0 == (IORING_FEAT_SINGLE_MMAP & p.features)) || (0 != __supported(w->fd)) ) {
+        return -1;
+    }
+
+    w->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if( w->sq_ring_len < cq_ring_len ) {
+        w->sq_ring_len = cq_ring_len;
+    }
+    w->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq = (char*) mmap( NULL, w->sq_ring_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, w->fd, IORING_OFF_SQ_RING );
+    if( MAP_FAILED == sq ) {
+        return -1;
+    }
+    w->sq_ring = sq;
+
+    /* With IORING_FEAT_SINGLE_MMAP both rings share the one mapping. */
+    cq = sq;
+
+    w->sqes = (struct io_uring_sqe*) mmap( NULL, w->sqes_len,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           w->fd, IORING_OFF_SQES );
+    if( MAP_FAILED == (void*) w->sqes ) {
+        w->sqes = NULL;
+        return -1;
+    }
+
+    w->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    w->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    w->sq_array = (unsigned*) (sq + p.sq_off.array);
+    w->cq_head = (unsigned*) (cq + p.cq_off.head);
+    w->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    w->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    return (int) syscall( __NR_io_uring_register, w->fd, IORING_REGISTER_FILES,
+                          files, 1 );
+}
+
+/**
+ *  Returns 0 if the ring supports every operation of the chain.
+ */
+static int __supported( int fd )
+{
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE,
+                               IORING_OP_FSYNC, IORING_OP_CLOSE,
+                               IORING_OP_RENAMEAT };
+    struct io_uring_probe *probe;
+    size_t size, i;
+    int rv = 0;
+
+    size = sizeof(struct io_uring_probe) +
+           IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    probe = (struct io_uring_probe*) malloc( size );
+    if( NULL == probe ) {
+        return -1;
+    }
+    memset( probe, 0, size );
+
+    if( 0 != syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                     probe, IORING_OP_LAST) )
+    {
+        rv = -1;
+    }
+
+    for( i = 0; (0 == rv) && (i < sizeof(ops) / sizeof(ops[0])); i++ ) {
+        if( (probe->last_op < ops[i]) ||
+            (0 == (IO_URING_OP_SUPPORTED & probe->ops[ops[i]].flags)) )
+        {
+            rv = -1;
+        }
+    }
+
+    free( probe );
+
+    return rv;
+}
+
+/**
+ *  Consumes the completions available without waiting.
+ */
+static void __reap( struct uring_writer *w )
+{
+    unsigned head = *w->cq_head;
+    unsigned tail = __atomic_load_n( w->cq_tail, __ATOMIC_ACQUIRE );
+
+    while( head != tail ) {
+        const struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+
+        /* A failed step cancels the rest; keep the cause. */
+        if( (0 > cqe->res) && (0 == w->error) ) {
+            w->error = cqe->res;
+        }
+        head++;
+        w->pending--;
+    }
+
+    __atomic_store_n( w->cq_head, head, __ATOMIC_RELEASE );
+}
+
+/**
+ *  Returns the next submission entry, cleared, and advances the local tail.
+ */
+static struct io_uring_sqe* __next_sqe( struct uring_writer *w, unsigned *tail )
+{
+    unsigned index = *tail & *w->sq_mask;
+    struct io_uring_sqe *sqe = &w->sqes[index];
+
+    memset( sqe, 0, sizeof(struct io_uring_sqe) );
+    w->sq_array[index] = index;
+    (*tail)++;
+
+    return sqe;
+}
+
+#endif
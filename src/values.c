@@ -0,0 +1,299 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+/* The values per block: 8 KiB, a whole number of vectors and cache lines. */
+#define VALUE_BLOCK_SIZE        1024
+
+#define VALUE_BLOCK_ALIGNMENT   64
+
+/* Only Linux has the coarse clocks; elsewhere the plain one is the cheapest. */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define STAMP_CLOCK             CLOCK_MONOTONIC_COARSE
+#else
+#define STAMP_CLOCK             CLOCK_MONOTONIC
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static size_t __block_size( const __metrics_t* );
+static void* __block_alloc( const __metrics_t* );
+static void __block_free( const __metrics_t*, void* );
+static int __zero_counter( const char*, void*, void* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+
+/* See internal.h for details. */
+uint64_t* __unsafe_value_alloc( __metrics_t *m, size_t *id, uint64_t **stamp )
+{
+    size_t block = m->value_count / VALUE_BLOCK_SIZE;
+    uint64_t *value;
+
+    if( 0 == (m->value_count % VALUE_BLOCK_SIZE) ) {
+        uint64_t *p;
+
+        if( block == m->value_blocks_len ) {
+            size_t len = (0 == block) ? 16 : 2 * block;
+            uint64_t **tmp;
+
+            tmp = (uint64_t**) realloc( m->value_blocks, len * sizeof(uint64_t*) );
+            if( NULL == tmp ) {
+                return NULL;
+            }
+            m->value_blocks = tmp;
+            m->value_blocks_len = len;
+        }
+
+        p = (uint64_t*) __block_alloc( m );
+        if( NULL == p ) {
+            return NULL;
+        }
+        m->value_blocks[block] = p;
+    }
+
+    *id = m->value_count++;
+    value = &m->value_blocks[block][*id % VALUE_BLOCK_SIZE];
+
+    /* The update times follow the values in the same block. */
+    *stamp = (0 != m->c->timestamps) ? &value[VALUE_BLOCK_SIZE] : NULL;
+
+    return value;
+}
+
+/* See internal.h for details. */
+int __unsafe_values_reserve( __metrics_t *m, struct snapshot *s )
+{
+    if( s->ids_len < m->value_count ) {
+        uint64_t *tmp;
+
+        tmp = (uint64_t*) realloc( s->raw, m->value_count * sizeof(uint64_t) );
+        if( NULL == tmp ) {
+            return -1;
+        }
+        s->raw = tmp;
+
+        if( 0 != m->c->timestamps ) {
+            tmp = (uint64_t*) realloc( s->stamps, m->value_count * sizeof(uint64_t) );
+            if( NULL == tmp ) {
+                return -1;
+            }
+            s->stamps = tmp;
+        }
+        s->ids_len = m->value_count;
+    }
+
+    s->ids = m->value_count;
+
+    return 0;
+}
+
+/* See internal.h for details. */
+size_t __unsafe_values_copy( __metrics_t *m, struct snapshot *s, size_t from,
+                             size_t max )
+{
+    const struct kernels *k = __kernels();
+    size_t end = from + max;
+    size_t i;
+
+    /* Whole blocks, so no vector is split between two slices. */
+    end += VALUE_BLOCK_SIZE - 1;
+    end -= end % VALUE_BLOCK_SIZE;
+    if( s->ids < end ) {
+        end = s->ids;
+    }
+
+    for( i = from; i < end; i += VALUE_BLOCK_SIZE ) {
+        const uint64_t *block = m->value_blocks[i / VALUE_BLOCK_SIZE];
+        size_t count = end - i;
+
+        if( VALUE_BLOCK_SIZE < count ) {
+            count = VALUE_BLOCK_SIZE;
+        }
+        k->copy( &s->raw[i], block, count );
+        if( 0 != m->c->timestamps ) {
+            k->copy( &s->stamps[i], &block[VALUE_BLOCK_SIZE], count );
+        }
+    }
+
+    if( end == s->ids ) {
+        /* The static metrics have an unused entry in the blocks. */
+        for( i = 0; i < m->static_count; i++ ) {
+            const struct series *series = m->statics[i];
+
+            if( series->id < s->ids ) {
+                s->raw[series->id] = __atomic_load_n( series->slot, __ATOMIC_RELAXED );
+            }
+        }
+    }
+
+    return end;
+}
+
+/* See internal.h for details. */
+void __values_destroy( __metrics_t *m )
+{
+    size_t i;
+
+    for( i = 0; i * VALUE_BLOCK_SIZE < m->value_count; i++ ) {
+        __block_free( m, m->value_blocks[i] );
+    }
+    free( m->value_blocks );
+    free( m->statics );
+
+    m->value_blocks = NULL;
+    m->value_blocks_len = 0;
+    m->value_count = 0;
+    m->statics = NULL;
+    m->static_count = 0;
+}
+
+/* See internal.h for details. */
+void __unsafe_values_forked( __metrics_t *m )
+{
+    size_t rest = m->value_count % VALUE_BLOCK_SIZE;
+    size_t i;
+
+    if( 0 == m->c->fork_shared_values ) {
+        trie_visit( m->counters, "", __zero_counter, NULL );
+        return;
+    }
+
+    /* The parent keeps filling its last block; the child's new series start
+     * in a block of its own.  The ids skipped are never used. */
+    if( 0 != rest ) {
+        m->value_count += VALUE_BLOCK_SIZE - rest;
+    }
+    m->shared_ids = m->value_count;
+
+    /* The child's copy of a static counter still holds the parent's count. */
+    for( i = 0; i < m->static_count; i++ ) {
+        if( MT_COUNTER == m->statics[i]->type ) {
+            __zero_counter( NULL, m->statics[i], NULL );
+        }
+    }
+}
+
+/* See internal.h for details. */
+int __unsafe_value_shared( const __metrics_t *m, const struct series *series )
+{
+    size_t id = series->id;
+
+    /* Static metrics keep their values outside the blocks. */
+    return (id < m->shared_ids) &&
+           (&m->value_blocks[id / VALUE_BLOCK_SIZE][id % VALUE_BLOCK_SIZE] ==
+            series->slot);
+}
+
+/* See internal.h for details. */
+uint64_t __stamp_now( void )
+{
+    struct timespec now;
+
+    clock_gettime( STAMP_CLOCK, &now );
+
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+
+/**
+ *  Returns the bytes in a value block, which also holds the update times when
+ *  the registry keeps them.
+ */
+static size_t __block_size( const __metrics_t *m )
+{
+    size_t n = (0 != m->c->timestamps) ? 2 * VALUE_BLOCK_SIZE : VALUE_BLOCK_SIZE;
+
+    return n * sizeof(uint64_t);
+}
+
+/**
+ *  Allocates a zeroed value block.  With fork_shared_values the block is
+ *  shared memory, so the updates of forked children land in the same values.
+ */
+static void* __block_alloc( const __metrics_t *m )
+{
+    void *p;
+
+    if( 0 != m->c->fork_shared_values ) {
+        /* Anonymous mappings are zeroed and page aligned. */
+        p = mmap( NULL, __block_size(m), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+        return (MAP_FAILED == p) ? NULL : p;
+    }
+
+    if( 0 != posix_memalign(&p, VALUE_BLOCK_ALIGNMENT, __block_size(m)) ) {
+        return NULL;
+    }
+    memset( p, 0, __block_size(m) );
+
+    return p;
+}
+
+static void __block_free( const __metrics_t *m, void *p )
+{
+    if( 0 != m->c->fork_shared_values ) {
+        munmap( p, __block_size(m) );
+    } else {
+        free( p );
+    }
+}
+
+/**
+ *  Resets a counter of a forked child, which only counts its own updates.
+ */
+static int __zero_counter( const char *key, void *data, void *arg )
+{
+    struct series *s = (struct series*) data;
+
+    (void) key;
+    (void) arg;
+
+    if( 0 != s->sampled ) {
+        return 0;
+    }
+
+    __atomic_store_n( s->slot, 0, __ATOMIC_RELAXED );
+    if( NULL != s->stamp ) {
+        __atomic_store_n( s->stamp, 0, __ATOMIC_RELAXED );
+    }
+
+    return 0;
+}
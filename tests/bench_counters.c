@@ -0,0 +1,139 @@
+/**
+ *  Copyright 2010-2016 Comcast Cable Communications Management, LLC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include "../src/internal.h"
+
+/* Compares incrementing counters directly with thread_buffered_counters, with
+ * every thread incrementing the same few counters far more often than a
+ * report drains them:
+ *
+ *      ./bench_counters [threads] [increments per thread]
+ */
+
+#define DEFAULT_THREADS     4
+#define DEFAULT_INCREMENTS  (10 * 1000 * 1000)
+
+#define COUNTERS            8
+
+struct worker {
+    pthread_t thread;
+    __metrics_t *m;
+    struct series **series;
+    size_t increments;
+};
+
+static double __now( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void* __worker( void *arg )
+{
+    struct worker *w = (struct worker*) arg;
+    size_t i;
+
+    for( i = 0; i < w->increments; i++ ) {
+        __series_inc( w->m, w->series[i % COUNTERS], 1 );
+    }
+
+    return NULL;
+}
+
+static int __run( const char *mode, int buffered, size_t threads,
+                  size_t increments )
+{
+    struct metrics_config c;
+    struct series *series[COUNTERS];
+    struct worker *w;
+    __metrics_t *m;
+    uint64_t total = 0;
+    char name[32];
+    double start;
+    size_t i;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "bench";
+    c.report_period_s = 3600;
+    c.thread_buffered_counters = buffered;
+
+    m = (__metrics_t*) metrics_init( &c );
+    w = (struct worker*) calloc( threads, sizeof(struct worker) );
+    if( (NULL == m) || (NULL == w) ) {
+        return 1;
+    }
+
+    pthread_mutex_lock( &m->mutex );
+    for( i = 0; i < COUNTERS; i++ ) {
+        sprintf( name, "bench_%zu", i );
+        series[i] = __unsafe_series( m, MT_COUNTER, name );
+    }
+    pthread_mutex_unlock( &m->mutex );
+
+    start = __now();
+    for( i = 0; i < threads; i++ ) {
+        w[i].m = m;
+        w[i].series = series;
+        w[i].increments = increments;
+        pthread_create( &w[i].thread, NULL, __worker, &w[i] );
+    }
+    for( i = 0; i < threads; i++ ) {
+        pthread_join( w[i].thread, NULL );
+    }
+    metrics_thread_flush( (metrics_t) m );
+
+    printf( "%-10s %8.3f ns/increment\n", mode,
+            (__now() - start) * 1e9 / ((double) threads * (double) increments) );
+
+    for( i = 0; i < COUNTERS; i++ ) {
+        total += *series[i]->slot;
+    }
+
+    metrics_shutdown( (metrics_t) m );
+    free( w );
+
+    return (total == threads * increments) ? 0 : 1;
+}
+
+int main( int argc, char *argv[] )
+{
+    size_t threads = DEFAULT_THREADS;
+    size_t increments = DEFAULT_INCREMENTS;
+    int failed = 0;
+
+    if( 1 < argc ) {
+        threads = strtoul( argv[1], NULL, 10 );
+    }
+    if( 2 < argc ) {
+        increments = strtoul( argv[2], NULL, 10 );
+    }
+
+    failed |= __run( "direct", 0, threads, increments );
+    failed |= __run( "buffered", 1, threads, increments );
+
+    return failed;
+}
@@ -0,0 +1,111 @@
+/**
+ *  Copyright 2010-2016 Comcast Cable Communications Management, LLC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include "../src/internal.h"
+
+/* Compares the bulk value kernels of each instruction set on a registry
+ * sized set of values:
+ *
+ *      ./bench_kernels [values] [rounds]
+ */
+
+#define DEFAULT_VALUES  (1024 * 1024)
+#define DEFAULT_ROUNDS  50
+
+static double __now( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void __report( const char *kernel, const char *name, double start,
+                      size_t values, size_t rounds )
+{
+    double ns = (__now() - start) * 1e9 / ((double) values * (double) rounds);
+
+    printf( "%-8s %-8s %8.3f ns/value\n", kernel, name, ns );
+}
+
+int main( int argc, char *argv[] )
+{
+    size_t values = DEFAULT_VALUES;
+    size_t rounds = DEFAULT_ROUNDS;
+    uint64_t *a, *b, *dst;
+    kernel_level_t level;
+    size_t i, r;
+
+    if( 1 < argc ) {
+        values = strtoul( argv[1], NULL, 10 );
+    }
+    if( 2 < argc ) {
+        rounds = strtoul( argv[2], NULL, 10 );
+    }
+
+    a = (uint64_t*) malloc( values * sizeof(uint64_t) );
+    b = (uint64_t*) malloc( values * sizeof(uint64_t) );
+    dst = (uint64_t*) malloc( values * sizeof(uint64_t) );
+    if( (NULL == a) || (NULL == b) || (NULL == dst) ) {
+        return 1;
+    }
+
+    for( i = 0; i < values; i++ ) {
+        a[i] = i * 7;
+        b[i] = (0 == i % 4) ? a[i] : a[i] + i % 13;
+    }
+
+    printf( "%zu values, %zu rounds, selected: %s\n", values, rounds,
+            __kernels()->name );
+
+    for( level = KERNEL_SCALAR; level <= KERNEL_AVX2; level++ ) {
+        const struct kernels *k = __kernels_get( level );
+        double start;
+
+        if( NULL == k ) {
+            continue;
+        }
+
+        start = __now();
+        for( r = 0; r < rounds; r++ ) {
+            k->copy( dst, b, values );
+        }
+        __report( k->name, "copy", start, values, rounds );
+
+        start = __now();
+        for( r = 0; r < rounds; r++ ) {
+            k->delta( dst, b, a, values );
+        }
+        __report( k->name, "delta", start, values, rounds );
+    }
+
+    /* Keep the results alive. */
+    printf( "checksum %"PRIu64"\n", dst[values / 2] );
+
+    free( a );
+    free( b );
+    free( dst );
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+/**
+ *  Copyright 2010-2016 Comcast Cable Communications Management, LLC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <string.h>
+#include <CUnit/Basic.h>
+
+/* Every call in this file must compile away. */
+#define METRIKS_DISABLED
+#include "../src/metrics.h"
+
+METRIKS_COUNTER( disabled_requests, "requests", "method", "get" );
+
+void test_disabled_build( void )
+{
+    struct metrics_config c;
+    metrics_scope_t s;
+    metrics_batch_t b;
+    metrics_timer_t t;
+    metrics_t m;
+    uint64_t start;
+    char *name;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "disabled_build";
+
+    m = metrics_init( &c );
+    CU_ASSERT( NULL == m );
+
+    name = metrics_calculate_name( "requests", 1, "method", "get" );
+    CU_ASSERT( NULL == name );
+
+    metrics_counter_inc( m, "requests", 1 );
+    metrics_counter_inc_labels( m, "requests", 1, 1, "method", "get" );
+    metrics_gauge_set( m, "depth", 1 );
+    metrics_gauge_set_labels( m, "depth", 1, 1, "queue", "in" );
+    metrics_ewma_mark( m, "requests", 1 );
+    metrics_ewma_mark_labels( m, "requests", 1, 1, "method", "get" );
+    metrics_distinct_add( m, "users", "a", 1 );
+    metrics_distinct_add_labels( m, "users", "a", 1, 1, "region", "eu" );
+    metrics_topk_add( m, "errors", "message", "timeout", 1 );
+    metrics_timer_stop( metrics_timer(m, "query", 0), metrics_timer_start() );
+
+    /* The start is only ever used by the stop. */
+    t = metrics_timer( m, "query", 0 );
+    start = metrics_timer_start();
+    metrics_timer_stop( t, start );
+    CU_ASSERT( 0 == metrics_aggregate(NULL) );
+    CU_ASSERT( 0 == metrics_help(m, METRICS_COUNTER, "requests", "Requests") );
+    metrics_thread_flush( m );
+    CU_ASSERT( 0 == metrics_freeze(m) );
+    METRIKS_INC( disabled_requests, 1 );
+
+    b = metrics_batch_create( m );
+    CU_ASSERT( NULL == b );
+    metrics_batch_counter_inc( b, "requests", 1 );
+    metrics_batch_gauge_set( b, "depth", 1 );
+    metrics_batch_apply( b );
+    metrics_batch_destroy( b );
+
+    s = metrics_scope( m, "cache_", 1, "shard", "3" );
+    CU_ASSERT( NULL == s );
+    metrics_scope_counter_inc( s, "hits", 1 );
+    metrics_scope_gauge_set( s, "entries", 1 );
+    CU_ASSERT( 0 == metrics_scope_report(s, NULL) );
+
+    metrics_shutdown( m );
+}
@@ -13,16 +13,43 @@
  *  See the License for the specific language governing permissions and
  *  limitations under the License.
  */
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <CUnit/Basic.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "../src/metrics.h"
+#include "../src/internal.h"
+
+/* See disabled.c */
+void test_disabled_build( void );
+
+METRIKS_COUNTER( static_requests, "static_requests", "method", "get" );
+METRIKS_GAUGE( static_depth, "static_depth" );
+
+static void* __slot( struct trie *t, const char *name )
+{
+    struct series *s = (struct series*) trie_search( t, name );
+
+    return (NULL != s) ? s->slot : NULL;
+}
 
 void test_counter( void )
 {
@@ -58,10 +85,1853 @@ void test_counter( void )
     CU_ASSERT( 1 );
 }
 
+void test_batch( void )
+{
+    struct metrics_config c;
+    metrics_t *m;
+    metrics_batch_t b;
+    __metrics_t *_m;
+    uint64_t *bytes;
+    int64_t *latency;
+    int i;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "batch";
+    c.report_period_s = 1;
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    b = metrics_batch_create( m );
+    CU_ASSERT( NULL != b );
+
+    for( i = 0; i < 3; i++ ) {
+        metrics_batch_counter_inc( b, "bytes_in", 10 );
+        metrics_batch_counter_inc_labels( b, "status", 1, 1, "code", "200" );
+        metrics_batch_gauge_set( b, "latency_ms", i );
+        metrics_batch_apply( b );
+    }
+
+    /* A different sequence replaces the cached entries. */
+    metrics_batch_gauge_set( b, "bytes_in", 7 );
+    metrics_batch_counter_inc( b, "bytes_in", 1 );
+    metrics_batch_apply( b );
+
+    bytes = (uint64_t*) __slot( _m->counters, "bytes_in" );
+    CU_ASSERT( NULL != bytes && 31 == *bytes );
+    bytes = (uint64_t*) __slot( _m->counters, "status{code=\"200\"}" );
+    CU_ASSERT( NULL != bytes && 3 == *bytes );
+    latency = (int64_t*) __slot( _m->gauges, "latency_ms" );
+    CU_ASSERT( NULL != latency && 2 == *latency );
+    latency = (int64_t*) __slot( _m->gauges, "bytes_in" );
+    CU_ASSERT( NULL != latency && 7 == *latency );
+
+    metrics_batch_destroy( b );
+    metrics_shutdown( m );
+}
+
+static void* __buffered_worker( void *m )
+{
+    int i;
+
+    for( i = 0; i < 1000; i++ ) {
+        metrics_counter_inc( m, "buffered", 1 );
+    }
+
+    return NULL;
+}
+
+void test_thread_buffered( void )
+{
+    struct metrics_config c;
+    metrics_t *m;
+    __metrics_t *_m;
+    uint64_t *counter;
+    char name[32];
+    pthread_t t;
+    int i;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "buffered";
+    c.report_period_s = 1;
+    c.thread_buffered_counters = 1;
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    /* The first increment creates the counter directly. */
+    metrics_counter_inc( m, "buffered", 1 );
+
+    /* Repeated increments add up in the thread's own total. */
+    for( i = 0; i < 999; i++ ) {
+        metrics_counter_inc( m, "buffered", 1 );
+    }
+
+    /* More counters than the thread buffers exercise the direct fallback. */
+    for( i = 0; i < 400; i++ ) {
+        sprintf( name, "buffered_%d", i );
+        metrics_counter_inc( m, name, 2 );
+        metrics_counter_inc( m, name, 1 );
+    }
+
+    CU_ASSERT( 0 == pthread_create(&t, NULL, __buffered_worker, m) );
+    pthread_join( t, NULL );
+
+    metrics_thread_flush( m );
+
+    counter = (uint64_t*) __slot( _m->counters, "buffered" );
+    CU_ASSERT( NULL != counter && 2000 == *counter );
+    for( i = 0; i < 400; i++ ) {
+        sprintf( name, "buffered_%d", i );
+        counter = (uint64_t*) __slot( _m->counters, name );
+        CU_ASSERT( NULL != counter && 3 == *counter );
+    }
+
+    metrics_shutdown( m );
+}
+
+static int __count_series( void *arg, const char *base,
+                           const struct metrics_series *s )
+{
+    size_t *count = (size_t*) arg;
+
+    CU_ASSERT( 0 == strcmp("exporters", base) );
+    CU_ASSERT( strlen(s->name) == s->name_len );
+    (*count)++;
+
+    return 0;
+}
+
+void test_exporters( void )
+{
+    struct metrics_config c;
+    struct metrics_exporter *e[3];
+    struct metrics_series s;
+    struct sockaddr_un addr;
+    metrics_t *m;
+    size_t count = 0;
+    char buf[1024];
+    char *huge;
+    uint32_t n;
+    ssize_t len;
+    FILE *f;
+    int fd;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, "/tmp/metriks_statsd.sock" );
+    unlink( addr.sun_path );
+    fd = socket( AF_UNIX, SOCK_DGRAM, 0 );
+    CU_ASSERT( 0 == bind(fd, (struct sockaddr*) &addr, sizeof(addr)) );
+
+    e[0] = metrics_exporter_callback( __count_series, &count );
+    e[1] = metrics_exporter_binary_file( "/tmp/metriks_exporters.bin" );
+    e[2] = metrics_exporter_statsd( addr.sun_path, 1 );
+    CU_ASSERT( NULL != e[0] && NULL != e[1] && NULL != e[2] );
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "exporters";
+    c.report_period_s = 1;
+    c.exporters = e;
+    c.exporter_count = 3;
+
+    m = metrics_init( &c );
+    metrics_counter_inc_labels( m, "requests", 3, 1, "method", "get" );
+    metrics_gauge_set( m, "depth", -2 );
+    metrics_gauge_set_labels( m, "queue", -1, 1, "name", "in" );
+    sleep( 2 );
+    metrics_shutdown( m );
+
+    /* metrics_report_count, requests, metrics_boot_time, depth */
+    CU_ASSERT( 4 <= count );
+
+    len = recv( fd, buf, sizeof(buf) - 1, MSG_DONTWAIT );
+    CU_ASSERT( 0 < len );
+    if( 0 < len ) {
+        buf[len] = '\0';
+        CU_ASSERT( NULL != strstr(buf, "exporters_requests:3|c|#method:get") );
+        CU_ASSERT( NULL != strstr(buf, "exporters_depth:0|g\nexporters_depth:-2|g") );
+        CU_ASSERT( NULL != strstr(buf, "exporters_queue:0|g|#name:in\n"
+                                       "exporters_queue:-1|g|#name:in") );
+    }
+    close( fd );
+    unlink( addr.sun_path );
+
+    f = fopen( "/tmp/metriks_exporters.bin", "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        CU_ASSERT( 4 == fread(buf, 1, 4, f) );
+        CU_ASSERT( 0 == memcmp(buf, "MTRK", 4) );
+        fclose( f );
+    }
+
+    /* A name too long to frame is left out rather than cut short. */
+    huge = (char*) malloc( 70000 );
+    CU_ASSERT_FATAL( NULL != huge );
+    memset( huge, 'x', 70000 );
+    memset( &s, 0, sizeof(s) );
+    s.type = METRICS_COUNTER;
+    s.value.counter = 1;
+    e[1]->begin( e[1]->ctx, "b", 2 );
+    s.name = huge;
+    s.name_len = 70000;
+    CU_ASSERT( 0 != e[1]->series(e[1]->ctx, &s) );
+    s.name = "ok";
+    s.name_len = 2;
+    CU_ASSERT( 0 == e[1]->series(e[1]->ctx, &s) );
+    e[1]->flush( e[1]->ctx );
+    free( huge );
+
+    f = fopen( "/tmp/metriks_exporters.bin", "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        len = (ssize_t) fread( buf, 1, sizeof(buf), f );
+        /* header (4 + 4 + 4 + 2 + 1) and one series (1 + 2 + 2 + 8) */
+        CU_ASSERT( 15 + 13 == len );
+        memcpy( &n, &buf[8], sizeof(n) );
+        CU_ASSERT( 1 == n );
+        CU_ASSERT( 0 == memcmp(&buf[18], "ok", 2) );
+        fclose( f );
+    }
+
+    metrics_exporter_destroy( e[0] );
+    metrics_exporter_destroy( e[1] );
+    metrics_exporter_destroy( e[2] );
+}
+
+/* Scrapes the endpoint at path into buf, returning the whole response. */
+static char* __scrape( const char *path, char *buf, size_t size )
+{
+    const char *request = "GET /metrics HTTP/1.1\r\n\r\n";
+    struct sockaddr_un addr;
+    size_t used = 0;
+    ssize_t len;
+    int fd;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+    fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    CU_ASSERT( 0 == connect(fd, (struct sockaddr*) &addr, sizeof(addr)) );
+    CU_ASSERT( 0 < write(fd, request, strlen(request)) );
+
+    while( 0 < (len = read(fd, &buf[used], size - 1 - used)) ) {
+        used += len;
+    }
+    buf[used] = '\0';
+    close( fd );
+
+    return buf;
+}
+
+void test_scrape( void )
+{
+    struct metrics_config c;
+    metrics_t *m;
+    char buf[4096];
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "scrape";
+    c.report_period_s = 1;
+    c.scrape_socket_path = "/tmp/metriks_scrape.sock";
+
+    m = metrics_init( &c );
+    CU_ASSERT( NULL != m );
+    metrics_counter_inc_labels( m, "requests", 7, 1, "method", "get" );
+    metrics_counter_inc_labels( m, "requests", 1, 1, "method", "a\"b\\c\n" );
+    metrics_counter_inc( m, "requests_failed", 1 );
+    CU_ASSERT( 0 == metrics_help(m, METRICS_COUNTER, "requests", "All\\requests\n") );
+
+    __scrape( c.scrape_socket_path, buf, sizeof(buf) );
+    CU_ASSERT( 0 == strncmp(buf, "HTTP/1.0 200 OK", 15) );
+    CU_ASSERT( NULL != strstr(buf, "\n# HELP scrape_requests All\\\\requests\\n\n"
+                                   "# TYPE scrape_requests counter\n"
+                                   "scrape_requests{method=\"a\\\"b\\\\c\\n\"} 1\n"
+                                   "scrape_requests{method=\"get\"} 7\n"
+                                   "# TYPE scrape_requests_failed counter\n"
+                                   "scrape_requests_failed 1\n") );
+    CU_ASSERT( NULL != strstr(buf, "\nscrape_metrics_scrape_count 1\n") );
+
+    metrics_shutdown( m );
+    CU_ASSERT( 0 != access(c.scrape_socket_path, F_OK) );
+}
+
+static int __count_reports( void *ctx, const char *base, size_t count )
+{
+    int *reports = (int*) ctx;
+
+    (void) base;
+    (void) count;
+
+    __atomic_add_fetch( reports, 1, __ATOMIC_RELAXED );
+
+    return 0;
+}
+
+void test_shared_reporter( void )
+{
+    struct metrics_config c[2];
+    struct metrics_exporter e[2];
+    struct metrics_exporter *ep[2];
+    metrics_t m[2];
+    int reports[2] = { 0, 0 };
+    int i;
+
+    for( i = 0; i < 2; i++ ) {
+        memset( &e[i], 0, sizeof(e[i]) );
+        e[i].ctx = &reports[i];
+        e[i].begin = __count_reports;
+        ep[i] = &e[i];
+
+        memset( &c[i], 0, sizeof(c[i]) );
+        c[i].base = "shared";
+        c[i].report_period_s = 1;
+        c[i].exporters = &ep[i];
+        c[i].exporter_count = 1;
+        c[i].shared_reporter = 1;
+
+        m[i] = metrics_init( &c[i] );
+        CU_ASSERT( NULL != m[i] );
+    }
+
+    sleep( 2 );
+    CU_ASSERT( 1 <= __atomic_load_n(&reports[0], __ATOMIC_RELAXED) );
+    CU_ASSERT( 1 <= __atomic_load_n(&reports[1], __ATOMIC_RELAXED) );
+
+    /* Shutdown does not wait for the next period but still reports. */
+    i = __atomic_load_n( &reports[0], __ATOMIC_RELAXED );
+    metrics_shutdown( m[0] );
+    CU_ASSERT( i + 1 == reports[0] );
+    metrics_shutdown( m[1] );
+
+    /* The shared thread starts again for a later registry. */
+    m[0] = metrics_init( &c[0] );
+    CU_ASSERT( NULL != m[0] );
+    metrics_shutdown( m[0] );
+}
+
+void test_disabled( void )
+{
+    struct metrics_config c;
+    metrics_t m;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "disabled";
+    c.disabled = 1;
+
+    m = metrics_init( &c );
+    CU_ASSERT( NULL != m );
+    metrics_counter_inc( m, "requests", 1 );
+    metrics_counter_inc_labels( m, "requests", 1, 1, "method", "get" );
+    metrics_gauge_set( m, "depth", 1 );
+    metrics_gauge_set_labels( m, "depth", 1, 1, "queue", "in" );
+    CU_ASSERT( 0 == metrics_help(m, METRICS_COUNTER, "requests", "Requests") );
+    metrics_thread_flush( m );
+    CU_ASSERT( NULL == metrics_batch_create(m) );
+    metrics_shutdown( m );
+
+    test_disabled_build();
+}
+
+void test_static( void )
+{
+    struct metrics_config c;
+    struct snapshot snap;
+    struct series *s;
+    __metrics_t *_m;
+    metrics_t m;
+    size_t i;
+    int found = 0;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "static";
+
+    m = metrics_init( &c );
+    CU_ASSERT( NULL != m );
+    _m = (__metrics_t*) m;
+
+    METRIKS_INC( static_requests, 3 );
+    METRIKS_SET( static_depth, -4 );
+
+    /* The static storage is also reached by name. */
+    metrics_counter_inc_labels( m, "static_requests", 2, 1, "method", "get" );
+    CU_ASSERT( 5 == static_requests.value.counter );
+
+    s = (struct series*) trie_search( _m->counters, "static_requests{method=\"get\"}" );
+    CU_ASSERT( NULL != s && &static_requests.value.counter == s->slot );
+    s = (struct series*) trie_search( _m->gauges, "static_depth" );
+    CU_ASSERT( NULL != s && (uint64_t*) &static_depth.value.gauge == s->slot );
+
+    __snapshot_init( &snap );
+    CU_ASSERT( 0 == __snapshot_take(_m, &snap) );
+    for( i = 0; i < snap.count; i++ ) {
+        if( 0 == strcmp("static_depth", snap.series[i]->name) ) {
+            CU_ASSERT( -4 == (int64_t) snap.values[i] );
+            found++;
+        }
+        if( 0 == strcmp("static_requests{method=\"get\"}", snap.series[i]->name) ) {
+            CU_ASSERT( 5 == snap.values[i] );
+            found++;
+        }
+    }
+    CU_ASSERT( 2 == found );
+    __snapshot_destroy( &snap );
+
+    metrics_shutdown( m );
+
+    /* The storage outlives the registry. */
+    METRIKS_INC( static_requests, 1 );
+    CU_ASSERT( 6 == static_requests.value.counter );
+}
+
+struct derived_values {
+    int64_t delta;
+    double rate;
+    int rate_header;
+    int rates;
+};
+
+static int __capture_derived( void *arg, const char *base,
+                              const struct metrics_series *s )
+{
+    struct derived_values *d = (struct derived_values*) arg;
+
+    (void) base;
+
+    CU_ASSERT( strlen(s->name) == s->name_len );
+    if( 0 == strcmp("requests_delta{method=\"get\"}", s->name) ) {
+        CU_ASSERT( METRICS_GAUGE == s->type );
+        d->delta = s->value.gauge;
+    }
+    if( 0 == strcmp("requests_rate_per_s{method=\"get\"}", s->name) ) {
+        CU_ASSERT( METRICS_RATE == s->type );
+        d->rate = s->value.rate;
+        d->rates++;
+        if( (NULL != s->header) &&
+            (0 == strncmp("# TYPE deltas_requests_rate_per_s gauge\n",
+                          s->header, s->header_len)) )
+        {
+            d->rate_header = 1;
+        }
+    }
+
+    return 0;
+}
+
+void test_deltas( void )
+{
+    struct timespec pause = { 0, 250 * 1000 * 1000 };
+    struct metrics_config c;
+    struct metrics_exporter *e;
+    struct derived_values d;
+    struct snapshot prev, cur;
+    __metrics_t *_m;
+    metrics_t m;
+    uint64_t *counter;
+
+    memset( &d, 0, sizeof(d) );
+    e = metrics_exporter_callback( __capture_derived, &d );
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "deltas";
+    c.exporters = &e;
+    c.exporter_count = 1;
+    c.report_deltas = 1;
+
+    m = metrics_init( &c );
+    CU_ASSERT( NULL != m );
+    _m = (__metrics_t*) m;
+
+    __snapshot_init( &prev );
+    __snapshot_init( &cur );
+
+    metrics_counter_inc_labels( m, "requests", 10, 1, "method", "get" );
+    CU_ASSERT( 0 == __snapshot_take(_m, &prev) );
+    CU_ASSERT( 0 == __snapshot_deltas(&prev, &cur, 1.0) );
+
+    /* Same series: the aligned pass. */
+    metrics_counter_inc_labels( m, "requests", 6, 1, "method", "get" );
+    CU_ASSERT( 0 == __snapshot_take(_m, &cur) );
+    CU_ASSERT( 0 == __snapshot_deltas(&cur, &prev, 2.0) );
+    __snapshot_export( &cur, "deltas", e );
+    CU_ASSERT( 6 == d.delta );
+    CU_ASSERT( 3.0 == d.rate );
+    CU_ASSERT( 1 == d.rate_header );
+
+    /* A new series moves the others; a reset counter counts from 0. */
+    metrics_counter_inc( m, "aaa_first", 1 );
+    counter = (uint64_t*) __slot( _m->counters, "requests{method=\"get\"}" );
+    *counter = 4;
+    CU_ASSERT( 0 == __snapshot_take(_m, &prev) );
+    CU_ASSERT( 0 == __snapshot_deltas(&prev, &cur, 4.0) );
+    __snapshot_export( &prev, "deltas", e );
+    CU_ASSERT( 4 == d.delta );
+    CU_ASSERT( 1.0 == d.rate );
+
+    __snapshot_destroy( &prev );
+    __snapshot_destroy( &cur );
+
+    metrics_shutdown( m );
+
+    /* The first report counts from metrics_init().  This one is at
+     * shutdown, well within the period, so it has no rate. */
+    m = metrics_init( &c );
+    metrics_counter_inc_labels( m, "requests", 20, 1, "method", "get" );
+    memset( &d, 0, sizeof(d) );
+    metrics_shutdown( m );
+    CU_ASSERT( 20 == d.delta );
+    CU_ASSERT( 0 == d.rates );
+
+    /* The reports a period apart do. */
+    c.report_period_ms = 100;
+    memset( &d, 0, sizeof(d) );
+    m = metrics_init( &c );
+    metrics_counter_inc_labels( m, "requests", 20, 1, "method", "get" );
+    nanosleep( &pause, NULL );
+    metrics_shutdown( m );
+    CU_ASSERT( 0 < d.rates );
+
+    metrics_exporter_destroy( e );
+}
+
+void test_kernels( void )
+{
+    const struct kernels *scalar = __kernels_get( KERNEL_SCALAR );
+    const struct kernels *k;
+    uint64_t a[67], b[67], want[67], got[67];
+    kernel_level_t level;
+    size_t i;
+
+    for( i = 0; i < 67; i++ ) {
+        a[i] = i * 0x9e3779b97f4a7c15ULL;
+        b[i] = (0 == i % 3) ? a[i] : a[i] + i;
+    }
+    /* Resets and the sign bit edges. */
+    a[5] = 0;
+    b[5] = 10;
+    a[6] = ~((uint64_t) 0);
+    b[6] = 1;
+    a[7] = 0x8000000000000000ULL;
+    b[7] = 0x7fffffffffffffffULL;
+
+    CU_ASSERT( NULL != __kernels() );
+    CU_ASSERT( NULL != scalar );
+
+    for( level = KERNEL_SCALAR; level <= KERNEL_AVX2; level++ ) {
+        k = __kernels_get( level );
+        if( NULL == k ) {
+            continue;
+        }
+
+        /* Odd lengths to exercise the scalar tails. */
+        k->copy( got, a, 67 );
+        CU_ASSERT( 0 == memcmp(got, a, sizeof(a)) );
+
+        scalar->delta( want, b, a, 67 );
+        k->delta( got, b, a, 67 );
+        CU_ASSERT( 0 == memcmp(got, want, sizeof(want)) );
+        CU_ASSERT( 10 == got[5] );
+        CU_ASSERT( 1 == got[6] );
+    }
+}
+
+static uint64_t __now_ms( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+struct timestamp_values {
+    uint64_t timestamp_ms;
+    uint64_t depth_ms;
+    uint64_t static_ms;
+};
+
+static int __capture_timestamps( void *arg, const char *base,
+                                 const struct metrics_series *s )
+{
+    struct timestamp_values *v = (struct timestamp_values*) arg;
+
+    (void) base;
+
+    v->timestamp_ms = s->timestamp_ms;
+    if( 0 == strcmp("depth", s->name) ) {
+        v->depth_ms = s->updated_ms;
+    }
+    if( 0 == strcmp("static_depth", s->name) ) {
+        v->static_ms = s->updated_ms;
+    }
+
+    return 0;
+}
+
+void test_timestamps( void )
+{
+    struct metrics_config c;
+    struct metrics_exporter *e, *text;
+    struct timestamp_values v;
+    struct snapshot s;
+    __metrics_t *_m;
+    metrics_t m;
+    uint64_t before, after, scraped = 0;
+    char buf[4096];
+    char *line;
+    FILE *f;
+
+    memset( &v, 0, sizeof(v) );
+    e = metrics_exporter_callback( __capture_timestamps, &v );
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "timestamps";
+    c.exporters = &e;
+    c.exporter_count = 1;
+    c.timestamps = 1;
+    c.scrape_socket_path = "/tmp/metriks_timestamps.sock";
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    __snapshot_init( &s );
+
+    before = __now_ms();
+    metrics_gauge_set( m, "depth", 3 );
+    METRIKS_SET( static_depth, 4 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    after = __now_ms();
+    __snapshot_export( &s, "timestamps", e );
+
+    CU_ASSERT( before <= v.timestamp_ms && v.timestamp_ms <= after );
+    CU_ASSERT( 0 != v.depth_ms && v.depth_ms <= v.timestamp_ms );
+    CU_ASSERT( before <= v.depth_ms + 20 );
+
+    /* Only updates by name are stamped. */
+    CU_ASSERT( 0 == v.static_ms );
+
+    /* The text format appends the snapshot time. */
+    text = __text_exporter_create( "/tmp/metriks_timestamps.txt", 0, NULL );
+    __snapshot_export( &s, "timestamps", text );
+    metrics_exporter_destroy( text );
+    f = fopen( "/tmp/metriks_timestamps.txt", "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        char expected[64];
+        size_t len = fread( buf, 1, sizeof(buf) - 1, f );
+
+        buf[len] = '\0';
+        sprintf( expected, "timestamps_depth 3 %"PRIu64"\n", v.timestamp_ms );
+        CU_ASSERT( NULL != strstr(buf, expected) );
+        fclose( f );
+    }
+
+    /* So does a scrape, with the time of its own snapshot. */
+    before = __now_ms();
+    __scrape( c.scrape_socket_path, buf, sizeof(buf) );
+    after = __now_ms();
+    line = strstr( buf, "\ntimestamps_depth 3 " );
+    CU_ASSERT_FATAL( NULL != line );
+    sscanf( line, "\ntimestamps_depth 3 %"SCNu64, &scraped );
+    CU_ASSERT( before <= scraped && scraped <= after );
+
+    __snapshot_destroy( &s );
+    metrics_shutdown( m );
+    metrics_exporter_destroy( e );
+}
+
+void test_async_file_io( void )
+{
+    struct metrics_config c;
+    struct uring_writer *w;
+    metrics_t m;
+    char buf[512];
+    char *out;
+    size_t len;
+    FILE *f;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "async";
+    c.metrics_path = "/tmp/metriks_async";
+    c.process_name = "report";
+    c.async_file_io = 1;
+
+    /* The final report is written at shutdown, whichever way is used. */
+    unlink( "/tmp/metriks_async/report" );
+    m = metrics_init( &c );
+    metrics_counter_inc( m, "written", 7 );
+    metrics_shutdown( m );
+
+    f = fopen( "/tmp/metriks_async/report", "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        len = fread( buf, 1, sizeof(buf) - 1, f );
+        buf[len] = '\0';
+        CU_ASSERT( NULL != strstr(buf, "async_written 7\n") );
+        fclose( f );
+    }
+    CU_ASSERT( 0 != access("/tmp/metriks_async/report.tmp", F_OK) );
+
+    /* The rest needs a kernel that allows io_uring. */
+    w = __uring_writer_create( "/tmp/metriks_async/direct" );
+    if( NULL == w ) {
+        return;
+    }
+
+    len = 16;
+    out = (char*) malloc( len );
+    memcpy( out, "ping\n", 5 );
+    CU_ASSERT( 0 == __uring_writer_submit(w, &out, &len, 5) );
+    CU_ASSERT( 0 == __uring_writer_wait(w) );
+
+    /* The buffers alternate. */
+    memcpy( out, "pong\n", 5 );
+    CU_ASSERT( 0 == __uring_writer_submit(w, &out, &len, 5) );
+    CU_ASSERT( 0 == __uring_writer_wait(w) );
+
+    f = fopen( "/tmp/metriks_async/direct", "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        len = fread( buf, 1, sizeof(buf) - 1, f );
+        CU_ASSERT( 5 == len && 0 == memcmp(buf, "pong\n", 5) );
+        fclose( f );
+    }
+
+    __uring_writer_destroy( w );
+    free( out );
+
+    /* A failed step is reported by the next wait. */
+    w = __uring_writer_create( "/tmp/metriks_async/missing/direct" );
+    CU_ASSERT( NULL != w );
+    len = 16;
+    out = (char*) malloc( len );
+    CU_ASSERT( 0 == __uring_writer_submit(w, &out, &len, 0) );
+    CU_ASSERT( -1 == __uring_writer_wait(w) );
+    __uring_writer_destroy( w );
+    free( out );
+}
+
+void test_compression( void )
+{
+#ifdef HAVE_ZLIB
+    struct metrics_config c;
+    metrics_t m;
+    char name[32];
+    char *text;
+    gzFile gz;
+    int len, i;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "gz";
+    c.metrics_path = "/tmp/metriks_gz";
+    c.process_name = "report";
+    c.compression_level = 6;
+    c.async_file_io = 1;
+
+    /* Enough series that the text is compressed in several chunks. */
+    m = metrics_init( &c );
+    for( i = 0; i < 4000; i++ ) {
+        sprintf( name, "%d", i );
+        metrics_counter_inc_labels( m, "requests", i, 1, "id", name );
+    }
+    metrics_shutdown( m );
+
+    gz = gzopen( "/tmp/metriks_gz/report.gz", "rb" );
+    CU_ASSERT( NULL != gz );
+    if( NULL != gz ) {
+        text = (char*) malloc( 1024 * 1024 );
+        len = gzread( gz, text, 1024 * 1024 - 1 );
+        CU_ASSERT( 64 * 1024 < len );
+        if( 0 < len ) {
+            text[len] = '\0';
+            CU_ASSERT( NULL != strstr(text, "gz_requests{id=\"0\"} 0\n") );
+            CU_ASSERT( NULL != strstr(text, "gz_requests{id=\"3999\"} 3999\n") );
+        }
+        free( text );
+        gzclose( gz );
+    }
+#endif
+}
+
+void test_fork( void )
+{
+    struct metrics_aggregate_config a;
+    struct metrics_config c;
+    __metrics_t *_m;
+    metrics_t m;
+    char filename[64];
+    char buf[512];
+    uint64_t *counter;
+    pid_t pid;
+    size_t len;
+    FILE *f;
+    int status;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "fork";
+    c.metrics_path = "/tmp/metriks_fork";
+    c.process_name = "report";
+    c.thread_buffered_counters = 1;
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    metrics_counter_inc( m, "forks", 5 );
+
+    /* The child counts from 0, into a file of its own. */
+    pid = fork();
+    if( 0 == pid ) {
+        metrics_counter_inc( m, "forks", 2 );
+        metrics_shutdown( m );
+        _exit( 0 );
+    }
+    CU_ASSERT( 0 < pid );
+    CU_ASSERT( pid == waitpid(pid, &status, 0) );
+
+    sprintf( filename, "/tmp/metriks_fork/report.%d", (int) pid );
+    f = fopen( filename, "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        len = fread( buf, 1, sizeof(buf) - 1, f );
+        buf[len] = '\0';
+        CU_ASSERT( NULL != strstr(buf, "fork_forks 2\n") );
+        fclose( f );
+        unlink( filename );
+    }
+
+    /* The parent carries on with its own count and lock. */
+    metrics_counter_inc( m, "forks", 1 );
+    metrics_thread_flush( m );
+    counter = (uint64_t*) __slot( _m->counters, "forks" );
+    CU_ASSERT( NULL != counter && 6 == *counter );
+    metrics_shutdown( m );
+
+    /* With shared values the parent sees the child's increments, and the
+     * child only reports its own series. */
+    c.fork_shared_values = 1;
+    c.thread_buffered_counters = 0;
+    c.metrics_path = "/tmp/metriks_fork_shared";
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    metrics_counter_inc( m, "forks", 5 );
+
+    pid = fork();
+    if( 0 == pid ) {
+        metrics_counter_inc( m, "forks", 3 );
+        metrics_counter_inc( m, "child_only", 1 );
+        metrics_shutdown( m );
+        _exit( 0 );
+    }
+    CU_ASSERT( pid == waitpid(pid, &status, 0) );
+
+    counter = (uint64_t*) __slot( _m->counters, "forks" );
+    CU_ASSERT( NULL != counter && 8 == *counter );
+    CU_ASSERT( NULL == __slot(_m->counters, "child_only") );
+    metrics_shutdown( m );
+
+    /* So the reports of both add up to each update once. */
+    memset( &a, 0, sizeof(a) );
+    a.dir = "/tmp/metriks_fork_shared";
+    a.output = "/tmp/metriks_fork_host";
+    CU_ASSERT( 0 == metrics_aggregate(&a) );
+
+    f = fopen( a.output, "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        len = fread( buf, 1, sizeof(buf) - 1, f );
+        buf[len] = '\0';
+        CU_ASSERT( NULL != strstr(buf, "fork_forks 8\n") );
+        CU_ASSERT( NULL != strstr(buf, "fork_child_only 1\n") );
+        fclose( f );
+    }
+
+    sprintf( filename, "/tmp/metriks_fork_shared/report.%d", (int) pid );
+    unlink( filename );
+    unlink( "/tmp/metriks_fork_shared/report" );
+    unlink( a.output );
+}
+
+static int __scope_series( void *arg, const char *base,
+                           const struct metrics_series *s )
+{
+    size_t *count = (size_t*) arg;
+
+    CU_ASSERT( 0 == strcmp("scope", base) );
+    CU_ASSERT( 0 == strncmp("comp_", s->name, 5) );
+    (*count)++;
+
+    return 0;
+}
+
+void test_scope( void )
+{
+    struct metrics_config c;
+    struct metrics_exporter *e;
+    metrics_scope_t s;
+    __metrics_t *_m;
+    metrics_t m;
+    uint64_t *counter;
+    int64_t *gauge;
+    size_t count = 0;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "scope";
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    s = metrics_scope( m, "comp_", 1, "shard", "1" );
+    CU_ASSERT( NULL != s );
+    CU_ASSERT( s == metrics_scope(m, "comp_", 1, "shard", "1") );
+    CU_ASSERT( s != metrics_scope(m, "comp_", 1, "shard", "2") );
+    CU_ASSERT( NULL == metrics_scope(m, "comp{", 0) );
+
+    metrics_scope_counter_inc( s, "requests", 2 );
+    metrics_scope_counter_inc( s, "requests", 3 );
+    metrics_scope_gauge_set( s, "depth", -4 );
+    metrics_counter_inc( m, "other", 1 );
+
+    /* Updates through the scope and by the complete name are the same. */
+    metrics_counter_inc_labels( m, "comp_requests", 1, 1, "shard", "1" );
+    counter = (uint64_t*) __slot( _m->counters, "comp_requests{shard=\"1\"}" );
+    CU_ASSERT( NULL != counter && 6 == *counter );
+    gauge = (int64_t*) __slot( _m->gauges, "comp_depth{shard=\"1\"}" );
+    CU_ASSERT( NULL != gauge && -4 == *gauge );
+
+    /* Only the scope's families are reported. */
+    e = metrics_exporter_callback( __scope_series, &count );
+    CU_ASSERT( 0 == metrics_scope_report(s, e) );
+    CU_ASSERT( 2 == count );
+    metrics_exporter_destroy( e );
+
+    metrics_shutdown( m );
+}
+
+void test_report_slices( void )
+{
+    struct metrics_config c;
+    struct snapshot snap;
+    __metrics_t *_m;
+    metrics_t m;
+    char value[16];
+    size_t i, found, a;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "slices";
+    c.report_slice_size = 7;
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    /* More than one value block, in slices that do not divide it. */
+    for( i = 0; i < 3000; i++ ) {
+        sprintf( value, "%zu", i );
+        metrics_counter_inc_labels( m, "b", (uint32_t) i + 1, 1, "i", value );
+    }
+    metrics_counter_inc( m, "a", 1 );
+    metrics_counter_inc_labels( m, "a", 2, 1, "k", "x" );
+    metrics_gauge_set_labels( m, "g", -1, 1, "k", "x" );
+
+    __snapshot_init( &snap );
+    CU_ASSERT( 0 == __snapshot_take(_m, &snap) );
+
+    for( found = 0, a = snap.count, i = 0; i < snap.count; i++ ) {
+        const struct series *series = snap.series[i];
+
+        CU_ASSERT( (i < snap.counters) == (MT_COUNTER == series->type) );
+        if( 0 == strncmp("b{", series->name, 2) ) {
+            CU_ASSERT( strtoul(&series->name[5], NULL, 10) + 1 == snap.values[i] );
+            found++;
+        }
+        if( 0 == strcmp("a", series->name) ) {
+            CU_ASSERT( 1 == snap.values[i] );
+            a = i;
+        }
+        if( 0 == strcmp("g{k=\"x\"}", series->name) ) {
+            CU_ASSERT( -1 == (int64_t) snap.values[i] );
+        }
+    }
+    CU_ASSERT( 3000 == found );
+
+    /* The family's series are together, the one without labels first. */
+    CU_ASSERT( a + 1 < snap.count );
+    if( a + 1 < snap.count ) {
+        CU_ASSERT( 0 == strcmp("a{k=\"x\"}", snap.series[a + 1]->name) );
+        CU_ASSERT( 2 == snap.values[a + 1] );
+    }
+
+    /* Adding a series builds the order again. */
+    found = snap.count;
+    metrics_counter_inc( m, "c", 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &snap) );
+    CU_ASSERT( found + 1 == snap.count );
+    __snapshot_destroy( &snap );
+
+    metrics_shutdown( m );
+}
+
+static void __flip_byte( const char *filename, long offset )
+{
+    FILE *f = fopen( filename, "r+" );
+    int c;
+
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        fseek( f, offset, SEEK_SET );
+        c = fgetc( f );
+        fseek( f, offset, SEEK_SET );
+        fputc( c ^ 0xff, f );
+        fclose( f );
+    }
+}
+
+void test_persist( void )
+{
+    const char *filename = "/tmp/metriks_persist.bin";
+    struct metrics_config c;
+    struct snapshot snap;
+    struct stat st;
+    __metrics_t *_m;
+    metrics_t m, m2;
+    uint64_t *counter;
+    uint32_t count = 0;
+    long slot_size;
+    FILE *f;
+
+    unlink( filename );
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "persist";
+    c.persist_path = filename;
+
+    /* The final report saves the counters. */
+    m = metrics_init( &c );
+    metrics_counter_inc( m, "restarts", 5 );
+    metrics_counter_inc_labels( m, "requests", 7, 1, "code", "200" );
+    metrics_gauge_set( m, "depth", 3 );
+    metrics_shutdown( m );
+
+    /* The next registry carries on, apart from the gauges. */
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    counter = (uint64_t*) __slot( _m->counters, "restarts" );
+    CU_ASSERT( NULL != counter && 5 == *counter );
+    counter = (uint64_t*) __slot( _m->counters, "requests{code=\"200\"}" );
+    CU_ASSERT( NULL != counter && 7 == *counter );
+    CU_ASSERT( NULL == __slot(_m->gauges, "depth") );
+
+    /* Two saves with the same counters fill both copies. */
+    __snapshot_init( &snap );
+    metrics_counter_inc( m, "restarts", 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &snap) );
+    __persist_save( _m, &snap );
+    metrics_counter_inc( m, "restarts", 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &snap) );
+    __persist_save( _m, &snap );
+    __snapshot_destroy( &snap );
+
+    m2 = metrics_init( &c );
+    counter = (uint64_t*) __slot( ((__metrics_t*) m2)->counters, "restarts" );
+    CU_ASSERT( NULL != counter && 7 == *counter );
+    metrics_shutdown( m2 );
+    metrics_shutdown( m );
+
+    /* Damage the newer copy, the first slot, and the older one is used. */
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    __snapshot_init( &snap );
+    metrics_counter_inc( m, "restarts", 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &snap) );
+    __persist_save( _m, &snap );
+    metrics_counter_inc( m, "restarts", 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &snap) );
+    __persist_save( _m, &snap );
+    __snapshot_destroy( &snap );
+
+    f = fopen( filename, "r" );
+    CU_ASSERT( NULL != f );
+    if( NULL != f ) {
+        fseek( f, 12, SEEK_SET );
+        CU_ASSERT( 1 == fread(&count, sizeof(count), 1, f) );
+        fclose( f );
+    }
+    CU_ASSERT( 0 == stat(filename, &st) );
+    slot_size = 16 + 8 * (long) count;
+    __flip_byte( filename, (long) st.st_size - 2 * slot_size + 16 );
+
+    m2 = metrics_init( &c );
+    counter = (uint64_t*) __slot( ((__metrics_t*) m2)->counters, "restarts" );
+    CU_ASSERT( NULL != counter && 8 == *counter );
+    metrics_shutdown( m2 );
+    metrics_shutdown( m );
+
+    /* A torn file restores nothing. */
+    CU_ASSERT( 0 == stat(filename, &st) );
+    CU_ASSERT( 0 == truncate(filename, st.st_size - 1) );
+    m = metrics_init( &c );
+    CU_ASSERT( NULL == __slot(((__metrics_t*) m)->counters, "restarts") );
+    metrics_shutdown( m );
+
+    unlink( filename );
+}
+
+void test_label_cache( void )
+{
+    struct metrics_config c;
+    __metrics_t *_m;
+    metrics_t m;
+    uint64_t *counter;
+    int64_t *gauge;
+    char value[16];
+    int i;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "labels";
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    for( i = 0; i < 10; i++ ) {
+        metrics_counter_inc_labels( m, "hits", 1, 2, "a", "x", "b", "q\"\n" );
+    }
+    counter = (uint64_t*) __slot( _m->counters,
+                                  "hits{a=\"x\",b=\"q\\\"\\n\"}" );
+    CU_ASSERT( NULL != counter && 10 == *counter );
+
+    /* The same buffer with new contents is a different series. */
+    for( i = 0; i < 4; i++ ) {
+        sprintf( value, "%d", i % 2 );
+        metrics_counter_inc_labels( m, "hits", 2, 1, "a", value );
+        metrics_gauge_set_labels( m, "level", i, 1, "a", value );
+    }
+    counter = (uint64_t*) __slot( _m->counters, "hits{a=\"0\"}" );
+    CU_ASSERT( NULL != counter && 4 == *counter );
+    counter = (uint64_t*) __slot( _m->counters, "hits{a=\"1\"}" );
+    CU_ASSERT( NULL != counter && 4 == *counter );
+    gauge = (int64_t*) __slot( _m->gauges, "level{a=\"1\"}" );
+    CU_ASSERT( NULL != gauge && 3 == *gauge );
+
+    /* Too many labels to cache. */
+    metrics_counter_inc_labels( m, "many", 1, 5, "a", "1", "b", "2", "c", "3",
+                                "d", "4", "e", "5" );
+    counter = (uint64_t*) __slot( _m->counters,
+            "many{a=\"1\",b=\"2\",c=\"3\",d=\"4\",e=\"5\"}" );
+    CU_ASSERT( NULL != counter && 1 == *counter );
+
+    CU_ASSERT( 1 == __name_matches("x{a=\"1\"}", "x", 1,
+                                   (const char*[]) { "a", "1" }) );
+    CU_ASSERT( 0 == __name_matches("x{a=\"1\"}", "x", 1,
+                                   (const char*[]) { "a", "12" }) );
+    CU_ASSERT( 0 == __name_matches("x{a=\"12\"}", "x", 1,
+                                   (const char*[]) { "a", "1" }) );
+    CU_ASSERT( 0 == __name_matches("xy", "x", 0, NULL) );
+    metrics_shutdown( m );
+
+    /* A new registry, quite possibly at the same address, does not use the
+     * series cached for the old one. */
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    metrics_counter_inc_labels( m, "hits", 1, 2, "a", "x", "b", "q\"\n" );
+    counter = (uint64_t*) __slot( _m->counters,
+                                  "hits{a=\"x\",b=\"q\\\"\\n\"}" );
+    CU_ASSERT( NULL != counter && 1 == *counter );
+    metrics_shutdown( m );
+}
+
+void test_freeze( void )
+{
+    struct metrics_config c;
+    __metrics_t *_m;
+    metrics_t m;
+    uint64_t *counter;
+    int64_t *gauge;
+    char name[32];
+    size_t i, wrong = 0;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "freeze";
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    for( i = 0; i < 1000; i++ ) {
+        sprintf( name, "frozen_%zu", i );
+        metrics_counter_inc( m, name, 1 );
+    }
+    metrics_gauge_set( m, "frozen_0", -1 );
+
+    CU_ASSERT( 0 != metrics_freeze(NULL) );
+    CU_ASSERT( 0 == metrics_freeze(m) );
+
+    /* Every name finds its own series, and no other name finds one. */
+    for( i = 0; i < 1000; i++ ) {
+        sprintf( name, "frozen_%zu", i );
+        wrong += ( trie_search(_m->counters, name) !=
+                   __search(_m, MT_COUNTER, name) );
+        sprintf( name, "thawed_%zu", i );
+        wrong += ( NULL != __search(_m, MT_COUNTER, name) );
+    }
+    CU_ASSERT( 0 == wrong );
+    CU_ASSERT( trie_search(_m->gauges, "frozen_0") ==
+               __search(_m, MT_GAUGE, "frozen_0") );
+
+    metrics_counter_inc( m, "frozen_7", 2 );
+    metrics_counter_inc_labels( m, "frozen_7", 1, 0 );
+    metrics_gauge_set( m, "frozen_0", 5 );
+    counter = (uint64_t*) __slot( _m->counters, "frozen_7" );
+    CU_ASSERT( NULL != counter && 4 == *counter );
+    gauge = (int64_t*) __slot( _m->gauges, "frozen_0" );
+    CU_ASSERT( NULL != gauge && 5 == *gauge );
+
+    /* A series added later is still found, and is in the next table. */
+    metrics_counter_inc( m, "late", 1 );
+    metrics_counter_inc( m, "late", 1 );
+    counter = (uint64_t*) __slot( _m->counters, "late" );
+    CU_ASSERT( NULL != counter && 2 == *counter );
+    CU_ASSERT( 0 == metrics_freeze(m) );
+    CU_ASSERT( trie_search(_m->counters, "late") ==
+               __search(_m, MT_COUNTER, "late") );
+
+    metrics_shutdown( m );
+}
+
+void test_process_metrics( void )
+{
+    struct metrics_config c;
+    __metrics_t *_m;
+    metrics_t m;
+    int64_t *threads, *resident, *virtual, *fds;
+    uint64_t *cpu, *switches;
+    int64_t before;
+    char name[17];
+    int fd;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "process";
+    c.report_period_s = 3600;
+    c.process_metrics = 1;
+    c.persist_path = "/tmp/metriks_process.bin";
+    unlink( c.persist_path );
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    /* The command may contain what separates the fields of the stat file. */
+    memset( name, 0, sizeof(name) );
+    prctl( PR_GET_NAME, name, 0, 0, 0 );
+    prctl( PR_SET_NAME, "t) 1 2 (x", 0, 0, 0 );
+    __procfs_sample( _m );
+    prctl( PR_SET_NAME, name, 0, 0, 0 );
+
+    threads = (int64_t*) __slot( _m->gauges, "process_threads" );
+    resident = (int64_t*) __slot( _m->gauges, "process_resident_memory_bytes" );
+    virtual = (int64_t*) __slot( _m->gauges, "process_virtual_memory_bytes" );
+    fds = (int64_t*) __slot( _m->gauges, "process_open_fds" );
+
+    /* The totals are counters, so they get deltas and add up across
+     * processes. */
+    cpu = (uint64_t*) __slot( _m->counters, "process_cpu_user_ms" );
+    switches = (uint64_t*) __slot( _m->counters,
+                                   "process_voluntary_context_switches" );
+    CU_ASSERT( NULL == __slot(_m->gauges, "process_cpu_user_ms") );
+
+    /* This thread and the report thread. */
+    CU_ASSERT( NULL != threads && 2 <= *threads );
+    CU_ASSERT( NULL != resident && 0 < *resident );
+    CU_ASSERT( NULL != virtual && NULL != resident && *resident <= *virtual );
+    CU_ASSERT( NULL != cpu );
+    CU_ASSERT( NULL != switches );
+    CU_ASSERT( NULL != fds && 3 <= *fds );
+
+    if( NULL != fds ) {
+        before = *fds;
+        fd = open( "/dev/null", O_RDONLY );
+        __procfs_sample( _m );
+        CU_ASSERT( before + 1 == *fds );
+        close( fd );
+    }
+
+    /* But they are the kernel's, so they are not saved. */
+    metrics_counter_inc( m, "saved", 1 );
+    metrics_shutdown( m );
+
+    c.process_metrics = 0;
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    cpu = (uint64_t*) __slot( _m->counters, "saved" );
+    CU_ASSERT( NULL != cpu && 1 == *cpu );
+    CU_ASSERT( NULL == __slot(_m->counters, "process_cpu_user_ms") );
+    metrics_shutdown( m );
+    unlink( c.persist_path );
+
+    /* Nothing is collected unless configured. */
+    c.persist_path = NULL;
+    m = metrics_init( &c );
+    CU_ASSERT( NULL == __slot(((__metrics_t*) m)->gauges, "process_threads") );
+    metrics_shutdown( m );
+}
+
+struct ewma_values {
+    char names[16][64];
+    double rates[16];
+    int headers;
+    size_t count;
+};
+
+static int __capture_ewmas( void *arg, const char *base,
+                            const struct metrics_series *s )
+{
+    struct ewma_values *v = (struct ewma_values*) arg;
+
+    (void) base;
+
+    if( (METRICS_RATE == s->type) && (v->count < 16) ) {
+        snprintf( v->names[v->count], 64, "%s", s->name );
+        v->rates[v->count] = s->value.rate;
+        v->count++;
+        if( NULL != s->header ) {
+            v->headers++;
+        }
+    }
+
+    return 0;
+}
+
+void test_ewma( void )
+{
+    struct metrics_config c;
+    struct metrics_exporter *e;
+    struct ewma_values v;
+    struct snapshot s;
+    __metrics_t *_m;
+    metrics_t m;
+    double expected;
+    char buf[4096];
+    int i;
+
+    memset( &v, 0, sizeof(v) );
+    e = metrics_exporter_callback( __capture_ewmas, &v );
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "ewma";
+    c.report_period_s = 3600;
+    c.scrape_socket_path = "/tmp/metriks_ewma.sock";
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    __snapshot_init( &s );
+
+    /* The first tick starts every window at the rate of that tick. */
+    metrics_ewma_mark( m, "requests", 60 );
+    metrics_ewma_mark( m, "requests", 40 );
+    __ewma_advance( _m, 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    CU_ASSERT( 1 == s.ewma_count );
+    CU_ASSERT( 20.0 == s.ewma_rates[0] );
+    CU_ASSERT( 20.0 == s.ewma_rates[1] );
+    CU_ASSERT( 20.0 == s.ewma_rates[2] );
+
+    /* A minute without a mark. */
+    __ewma_advance( _m, 12 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    expected = 20.0;
+    for( i = 0; i < 12; i++ ) {
+        expected -= 0.07995558537067671 * expected;
+    }
+    CU_ASSERT( expected - 1e-9 < s.ewma_rates[0] );
+    CU_ASSERT( s.ewma_rates[0] < expected + 1e-9 );
+    /* About 1/e of the rate is left after one time constant. */
+    CU_ASSERT( 7.35 < s.ewma_rates[0] && s.ewma_rates[0] < 7.36 );
+    CU_ASSERT( s.ewma_rates[0] < s.ewma_rates[1] );
+    CU_ASSERT( s.ewma_rates[1] < s.ewma_rates[2] );
+
+    /* Families stay together even where "a_b" sorts between "a" and "a{". */
+    metrics_ewma_mark_labels( m, "a", 5, 1, "l", "x" );
+    metrics_ewma_mark( m, "a_b", 10 );
+    metrics_ewma_mark( m, "a", 5 );
+    __ewma_advance( _m, 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    CU_ASSERT( 4 == s.ewma_count );
+    __snapshot_export( &s, "ewma", e );
+
+    CU_ASSERT( 12 == v.count );
+    CU_ASSERT_STRING_EQUAL( "a_rate_1m", v.names[0] );
+    CU_ASSERT_STRING_EQUAL( "a_rate_1m{l=\"x\"}", v.names[1] );
+    CU_ASSERT_STRING_EQUAL( "a_rate_5m", v.names[2] );
+    CU_ASSERT_STRING_EQUAL( "a_b_rate_1m", v.names[6] );
+    CU_ASSERT_STRING_EQUAL( "requests_rate_15m", v.names[11] );
+    CU_ASSERT( 1.0 == v.rates[0] );
+    CU_ASSERT( 2.0 == v.rates[6] );
+    CU_ASSERT( 9 == v.headers );
+
+    /* A scrape has the same moving averages as a report. */
+    __scrape( c.scrape_socket_path, buf, sizeof(buf) );
+    CU_ASSERT( NULL != strstr(buf, "\n# TYPE ewma_a_rate_1m gauge\n"
+                                   "ewma_a_rate_1m 1\n"
+                                   "ewma_a_rate_1m{l=\"x\"} 1\n") );
+    CU_ASSERT( NULL != strstr(buf, "\n# TYPE ewma_a_b_rate_15m gauge\n"
+                                   "ewma_a_b_rate_15m 2\n") );
+
+    /* A forked child starts again without what the parent saw. */
+    metrics_ewma_mark( m, "a", 50 );
+    __ewmas_forked( _m );
+    __ewma_advance( _m, 1 );
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    CU_ASSERT( 0.0 == s.ewma_rates[0] );
+    CU_ASSERT( 0.0 == s.ewma_rates[3 * EWMA_WINDOWS - 1] );
+
+    __snapshot_destroy( &s );
+    metrics_shutdown( m );
+
+    /* The report thread ticks between reports, whichever thread it is. */
+    for( i = 0; i < 2; i++ ) {
+        struct timespec pause = { 0, 10 * 1000 * 1000 };
+        const struct ewma *waiting;
+        double rate = 0.0;
+        int tries;
+
+        c.shared_reporter = i;
+        m = metrics_init( &c );
+        _m = (__metrics_t*) m;
+
+        /* As if the last tick was two ticks ago. */
+        pthread_mutex_lock( &_m->mutex );
+        _m->ewma_ticked.tv_sec -= 10;
+        pthread_mutex_unlock( &_m->mutex );
+
+        metrics_ewma_mark( m, "waiting", 100 );
+        waiting = (const struct ewma*) trie_search( _m->ewmas, "waiting" );
+        CU_ASSERT_FATAL( NULL != waiting );
+        for( tries = 0; (0.0 == rate) && (tries < 200); tries++ ) {
+            nanosleep( &pause, NULL );
+            __atomic_load( &waiting->rates[0], &rate, __ATOMIC_RELAXED );
+        }
+        CU_ASSERT( 10.0 == rate );
+
+        metrics_shutdown( m );
+    }
+    metrics_exporter_destroy( e );
+}
+
+void test_distinct( void )
+{
+    struct metrics_config c;
+    __metrics_t *_m;
+    metrics_t m;
+    int64_t *users, *eu;
+    uint32_t i;
+    char key[32];
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "distinct";
+    c.report_period_s = 3600;
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    /* Few keys are counted exactly, however often they are added. */
+    for( i = 0; i < 1000; i++ ) {
+        uint32_t k = i % 10;
+
+        metrics_distinct_add( m, "users", &k, sizeof(k) );
+    }
+    __distinct_sample( _m );
+    users = (int64_t*) __slot( _m->gauges, "users" );
+    CU_ASSERT( NULL != users && 10 == *users );
+
+    /* Many are counted to within a few standard errors of 1.6%. */
+    for( i = 0; i < 100000; i++ ) {
+        snprintf( key, sizeof(key), "device-%u", i );
+        metrics_distinct_add( m, "users", key, strlen(key) );
+    }
+    __distinct_sample( _m );
+    CU_ASSERT( 95000 < *users && *users < 105000 );
+
+    /* Without distinct_reset the count carries on. */
+    __distinct_sample( _m );
+    CU_ASSERT( 95000 < *users && *users < 105000 );
+
+    metrics_distinct_add_labels( m, "users", "a", 1, 1, "region", "eu" );
+    metrics_distinct_add_labels( m, "users", "b", 1, 1, "region", "eu" );
+    metrics_distinct_add_labels( m, "users", "a", 1, 1, "region", "eu" );
+    __distinct_sample( _m );
+    eu = (int64_t*) __slot( _m->gauges, "users{region=\"eu\"}" );
+    CU_ASSERT( NULL != eu && 2 == *eu );
+
+    metrics_shutdown( m );
+
+    /* With it each report only counts the keys since the one before. */
+    c.distinct_reset = 1;
+    c.distinct_precision = 4;
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    metrics_distinct_add( m, "users", "a", 1 );
+    __distinct_sample( _m );
+    users = (int64_t*) __slot( _m->gauges, "users" );
+    CU_ASSERT( NULL != users && 1 == *users );
+    __distinct_sample( _m );
+    CU_ASSERT( NULL != users && 0 == *users );
+
+    metrics_shutdown( m );
+}
+
+struct top_values {
+    char names[8][64];
+    int64_t counts[8];
+    int headers;
+    size_t count;
+};
+
+static int __capture_tops( void *arg, const char *base,
+                           const struct metrics_series *s )
+{
+    struct top_values *v = (struct top_values*) arg;
+
+    (void) base;
+
+    if( (0 == strncmp("errors", s->name, 6)) && (v->count < 8) ) {
+        CU_ASSERT( METRICS_GAUGE == s->type );
+        CU_ASSERT( strlen(s->name) == s->name_len );
+        snprintf( v->names[v->count], 64, "%s", s->name );
+        v->counts[v->count] = s->value.gauge;
+        v->count++;
+        if( NULL != s->header ) {
+            CU_ASSERT( 0 == strncmp("# TYPE topk_errors gauge\n", s->header,
+                                    s->header_len) );
+            v->headers++;
+        }
+    }
+
+    return 0;
+}
+
+static void* __topk_thread( void *arg )
+{
+    metrics_t m = (metrics_t) arg;
+    char key[32];
+    int i;
+
+    for( i = 0; i < 1000; i++ ) {
+        metrics_topk_add( m, "errors", "message", "timeout", 1 );
+        snprintf( key, sizeof(key), "%p-%d", (void*) &key, i );
+        metrics_topk_add( m, "errors", "message", key, 1 );
+    }
+
+    return NULL;
+}
+
+void test_topk( void )
+{
+    struct metrics_config c;
+    struct metrics_exporter *e;
+    struct top_values v;
+    struct snapshot s;
+    pthread_t threads[4];
+    __metrics_t *_m;
+    metrics_t m;
+    char buf[4096];
+    int i;
+
+    memset( &v, 0, sizeof(v) );
+    e = metrics_exporter_callback( __capture_tops, &v );
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "topk";
+    c.report_period_s = 3600;
+    c.topk_size = 3;
+    c.scrape_socket_path = "/tmp/metriks_topk.sock";
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+    __snapshot_init( &s );
+
+    /* Each thread counts the same key along with keys of its own. */
+    for( i = 0; i < 4; i++ ) {
+        pthread_create( &threads[i], NULL, __topk_thread, m );
+    }
+    for( i = 0; i < 4; i++ ) {
+        pthread_join( threads[i], NULL );
+    }
+    metrics_topk_add( m, "errors", "message", "refused", 500 );
+    metrics_topk_add( m, "errors", "message", "say \"no\"", 100 );
+    metrics_topk_add( m, "errors", "ignored", "refused", 1 );
+
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    CU_ASSERT( 3 == s.top_count );
+    __snapshot_export( &s, "topk", e );
+
+    CU_ASSERT( 3 == v.count );
+    CU_ASSERT( 1 == v.headers );
+    CU_ASSERT_STRING_EQUAL( "errors{message=\"timeout\"}", v.names[0] );
+    CU_ASSERT( 4000 == v.counts[0] );
+    CU_ASSERT_STRING_EQUAL( "errors{message=\"refused\"}", v.names[1] );
+    CU_ASSERT( 501 == v.counts[1] );
+    CU_ASSERT_STRING_EQUAL( "errors{message=\"say \\\"no\\\"\"}", v.names[2] );
+    /* It may have taken the slot, and count, of another key. */
+    CU_ASSERT( 100 <= v.counts[2] );
+
+    /* A scrape has the same keys as a report. */
+    __scrape( c.scrape_socket_path, buf, sizeof(buf) );
+    CU_ASSERT( NULL != strstr(buf, "\n# TYPE topk_errors gauge\n"
+                                   "topk_errors{message=\"timeout\"} 4000\n"
+                                   "topk_errors{message=\"refused\"} 501\n") );
+
+    /* Taking it again frees the keys of the last one. */
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    CU_ASSERT( 3 == s.top_count );
+
+    /* A forked child starts without the parent's keys. */
+    __topks_forked( _m );
+    CU_ASSERT( 0 == __snapshot_take(_m, &s) );
+    CU_ASSERT( 0 == s.top_count );
+
+    __snapshot_destroy( &s );
+    metrics_shutdown( m );
+    metrics_exporter_destroy( e );
+}
+
+void test_timer( void )
+{
+    struct metrics_config c;
+    struct timespec pause = { 0, 2000000 };
+    metrics_timer_t t;
+    __metrics_t *_m;
+    metrics_t m;
+    uint64_t *duration, *count;
+    uint64_t start;
+
+    memset( &c, 0, sizeof(c) );
+    c.base = "timer";
+    c.report_period_s = 3600;
+
+    m = metrics_init( &c );
+    _m = (__metrics_t*) m;
+
+    t = metrics_timer( m, "query", 1, "op", "get" );
+    CU_ASSERT( NULL != t );
+    CU_ASSERT( t == metrics_timer(m, "query", 1, "op", "get") );
+    CU_ASSERT( NULL == metrics_timer(m, "query{op=\"get\"}", 0) );
+
+    /* Whichever clock it uses, the times are in nanoseconds. */
+    start = metrics_timer_start();
+    nanosleep( &pause, NULL );
+    metrics_timer_stop( t, start );
+
+    start = metrics_timer_start();
+    metrics_timer_stop( t, start );
+
+    duration = (uint64_t*) __slot( _m->counters,
+                                   "query_duration_ns{op=\"get\"}" );
+    count = (uint64_t*) __slot( _m->counters, "query_count{op=\"get\"}" );
+    CU_ASSERT( NULL != count && 2 == *count );
+    CU_ASSERT( NULL != duration && 2000000 <= *duration );
+    CU_ASSERT( NULL != duration && *duration < 1000000000 );
+
+    /* Nothing to add to, but the time is still read. */
+    metrics_timer_stop( NULL, metrics_timer_start() );
+
+    metrics_shutdown( m );
+}
+
+static void __write_report( const char *filename, const char *text )
+{
+    FILE *f = fopen( filename, "w" );
+
+    CU_ASSERT_FATAL( NULL != f );
+    fputs( text, f );
+    fclose( f );
+}
+
+void test_aggregate( void )
+{
+    struct metrics_gauge_rule rules[] = {
+        { "svc_d", METRICS_GAUGE_MIN },
+        { "svc_depth", METRICS_GAUGE_MAX },
+    };
+    struct metrics_aggregate_config c;
+    const char *expect =
+        "# TYPE svc_depth gauge\n"
+        "svc_depth 9 2000\n"
+        "# TYPE svc_errors gauge\n"
+        "svc_errors{message=\"a b\"} 7 2000\n"
+        "svc_errors{message=\"timeout\"} 7 1000\n"
+        "svc_errors{message=\"x\"} 1 2000\n"
+        "# TYPE svc_load_rate_1m gauge\n"
+        "svc_load_rate_1m 3.75 2000\n"
+        "# HELP svc_requests Requests.\n"
+        "# TYPE svc_requests counter\n"
+        "svc_requests{code=\"200\"} 18446744073709551615 2000\n"
+        "svc_requests{code=\"404\"} 2 2000\n"
+        "svc_requests{code=\"500\"} 1 1000\n";
+    char buf[1024];
+    size_t len;
+    FILE *f;
+    int i;
+
+    mkdir( "/tmp/metriks_aggregate", 0755 );
+    __write_report( "/tmp/metriks_aggregate/report.1",
+                    "# HELP svc_requests Requests.\n"
+                    "# TYPE svc_requests counter\n"
+                    "svc_requests{code=\"200\"} 10 1000\n"
+                    "svc_requests{code=\"500\"} 1 1000\n"
+                    "# TYPE svc_depth gauge\n"
+                    "svc_depth 5 1000\n"
+                    "# TYPE svc_load_rate_1m gauge\n"
+                    "svc_load_rate_1m 1.5 1000\n"
+                    "# TYPE svc_errors gauge\n"
+                    "svc_errors{message=\"timeout\"} 7 1000\n"
+                    "svc_errors{message=\"a b\"} 3 1000\n" );
+    /* The counter saturates, and the unfinished last line is left out. */
+    __write_report( "/tmp/metriks_aggregate/report.2",
+                    "# TYPE svc_requests counter\n"
+                    "svc_requests{code=\"200\"} 18446744073709551615 2000\n"
+                    "svc_requests{code=\"404\"} 2 2000\n"
+                    "# TYPE svc_depth gauge\n"
+                    "svc_depth 9 2000\n"
+                    "# TYPE svc_load_rate_1m gauge\n"
+                    "svc_load_rate_1m 2.25 2000\n"
+                    "# TYPE svc_errors gauge\n"
+                    "svc_errors{message=\"x\"} 1 2000\n"
+                    "svc_errors{message=\"a b\"} 4 2000\n"
+                    "svc_cut 1" );
+    __write_report( "/tmp/metriks_aggregate/report.3", "" );
+    __write_report( "/tmp/metriks_aggregate/report.bin", "MTRK\1\0\0\0" );
+    __write_report( "/tmp/metriks_aggregate/.report.4",
+                    "# TYPE svc_hidden counter\nsvc_hidden 1\n" );
+
+    memset( &c, 0, sizeof(c) );
+    c.dir = "/tmp/metriks_aggregate";
+    c.output = "/tmp/metriks_aggregate/host";
+    c.gauge_rule = METRICS_GAUGE_SUM;
+    c.rules = rules;
+    c.rule_count = sizeof(rules) / sizeof(rules[0]);
+
+    /* The second run does not read the output of the first. */
+    for( i = 0; i < 2; i++ ) {
+        CU_ASSERT( 0 == metrics_aggregate(&c) );
+
+        f = fopen( c.output, "r" );
+        CU_ASSERT_FATAL( NULL != f );
+        len = fread( buf, 1, sizeof(buf) - 1, f );
+        buf[len] = '\0';
+        fclose( f );
+        CU_ASSERT_STRING_EQUAL( buf, expect );
+    }
+    CU_ASSERT( 0 != access("/tmp/metriks_aggregate/.host.tmp", F_OK) );
+
+    CU_ASSERT( 0 != metrics_aggregate(NULL) );
+    c.dir = "/tmp/metriks_aggregate/missing";
+    CU_ASSERT( 0 != metrics_aggregate(&c) );
+}
+
+#define TRIE_KEYS 2000
+
+static void __trie_key( char *key, int i )
+{
+    sprintf( key, "k{id=\"%d\"}", (i * 7919) % TRIE_KEYS );
+}
+
+struct trie_reader {
+    struct trie *t;
+    int inserted;
+    size_t missed;
+};
+
+static void* __trie_reader( void *arg )
+{
+    struct trie_reader *r = (struct trie_reader*) arg;
+    char key[32];
+    int done, i;
+
+    /* Every key inserted before the search started must be found. */
+    do {
+        done = __atomic_load_n( &r->inserted, __ATOMIC_ACQUIRE );
+        for( i = 0; i < done; i++ ) {
+            __trie_key( key, i );
+            if( NULL == trie_search(r->t, key) ) {
+                r->missed++;
+            }
+        }
+    } while( done < TRIE_KEYS );
+
+    return NULL;
+}
+
+void test_trie( void )
+{
+    struct trie_reader r;
+    struct trie_it *it;
+    char key[32], last[32];
+    pthread_t t;
+    size_t count = 0;
+    int i;
+
+    memset( &r, 0, sizeof(r) );
+    r.t = trie_create();
+    CU_ASSERT_FATAL( NULL != r.t );
+
+    /* The keys go in out of order, so children are added in front of
+     * others while the reader searches. */
+    CU_ASSERT( 0 == pthread_create(&t, NULL, __trie_reader, &r) );
+    for( i = 0; i < TRIE_KEYS; i++ ) {
+        __trie_key( key, i );
+        CU_ASSERT( 0 == trie_insert(r.t, key, r.t) );
+        __atomic_store_n( &r.inserted, i + 1, __ATOMIC_RELEASE );
+    }
+    pthread_join( t, NULL );
+    CU_ASSERT( 0 == r.missed );
+
+    last[0] = '\0';
+    for( it = trie_it_create(r.t, "k{"); !trie_it_done(it); trie_it_next(it) ) {
+        CU_ASSERT( 0 < strcmp(trie_it_key(it), last) );
+        strcpy( last, trie_it_key(it) );
+        count++;
+    }
+    CU_ASSERT( 0 == trie_it_error(it) );
+    trie_it_free( it );
+    CU_ASSERT( TRIE_KEYS == count );
+    CU_ASSERT( TRIE_KEYS == trie_count(r.t, "") );
+
+    /* Unused branches are removed in place. */
+    for( i = 1; i < TRIE_KEYS; i++ ) {
+        __trie_key( key, i );
+        trie_insert( r.t, key, NULL );
+    }
+    CU_ASSERT( 1 == trie_prune(r.t) );
+    __trie_key( key, 0 );
+    CU_ASSERT( r.t == trie_search(r.t, key) );
+    CU_ASSERT( 1 == trie_count(r.t, "") );
+
+    trie_free( r.t );
+}
+
 void add_suites( CU_pSuite *suite )
 {
     *suite = CU_add_suite( "metrics tests", NULL, NULL );
     CU_add_test( *suite, "Test counter", test_counter );
+    CU_add_test( *suite, "Test batch", test_batch );
+    CU_add_test( *suite, "Test thread buffered", test_thread_buffered );
+    CU_add_test( *suite, "Test exporters", test_exporters );
+    CU_add_test( *suite, "Test scrape", test_scrape );
+    CU_add_test( *suite, "Test shared reporter", test_shared_reporter );
+    CU_add_test( *suite, "Test disabled", test_disabled );
+    CU_add_test( *suite, "Test static", test_static );
+    CU_add_test( *suite, "Test deltas", test_deltas );
+    CU_add_test( *suite, "Test kernels", test_kernels );
+    CU_add_test( *suite, "Test timestamps", test_timestamps );
+    CU_add_test( *suite, "Test async file io", test_async_file_io );
+    CU_add_test( *suite, "Test compression", test_compression );
+    CU_add_test( *suite, "Test fork", test_fork );
+    CU_add_test( *suite, "Test scope", test_scope );
+    CU_add_test( *suite, "Test report slices", test_report_slices );
+    CU_add_test( *suite, "Test persist", test_persist );
+    CU_add_test( *suite, "Test label cache", test_label_cache );
+    CU_add_test( *suite, "Test freeze", test_freeze );
+    CU_add_test( *suite, "Test process metrics", test_process_metrics );
+    CU_add_test( *suite, "Test ewma", test_ewma );
+    CU_add_test( *suite, "Test distinct", test_distinct );
+    CU_add_test( *suite, "Test top k", test_topk );
+    CU_add_test( *suite, "Test timer", test_timer );
+    CU_add_test( *suite, "Test aggregate", test_aggregate );
+    CU_add_test( *suite, "Test trie", test_trie );
 }
 
 /*----------------------------------------------------------------------------*/
@@ -0,0 +1,367 @@
+/**
+ *  Copyright 2010-2016 Comcast Cable Communications Management, LLC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include "../src/metrics.h"
+#include "../src/trie/trie.h"
+
+/* Runs writer threads over a mixed workload of existing series, series every
+ * writer races to create and series of their own, while the registry is
+ * reported every millisecond, then checks the exact totals:
+ *
+ *      ./stress [writers] [operations per writer]
+ *
+ * Each writer draws its operations from a generator seeded with its index,
+ * so every run does the same updates; only the interleaving differs.  Build
+ * with -DSANITIZE=thread or -DSANITIZE=address to run it under a sanitizer.
+ */
+
+#define DEFAULT_WRITERS     8
+#define DEFAULT_OPERATIONS  50000
+
+#define HOT_KEYS            64
+#define SHARED_KEYS         512
+#define PRIVATE_KEYS        128
+
+/* What a report saw of a series, by name. */
+struct seen {
+    uint64_t counter;
+    int64_t gauge;
+};
+
+struct writer {
+    pthread_t thread;
+    metrics_t m;
+    uint32_t index;
+    size_t operations;
+    int flush;
+
+    /* What the writer did. */
+    uint64_t hot[HOT_KEYS];
+    uint64_t shared[SHARED_KEYS];
+    uint64_t private[PRIVATE_KEYS];
+    int64_t level;
+};
+
+struct reports {
+    struct trie *seen;
+    size_t count;
+    size_t went_backwards;
+};
+
+static char *__hot[HOT_KEYS];
+static char *__shared[SHARED_KEYS];
+
+static uint32_t __next( uint32_t *state )
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+static void* __writer( void *arg )
+{
+    struct writer *w = (struct writer*) arg;
+    uint32_t state = 2463534242u + w->index;
+    char private[32];
+    char index[24];
+    size_t i;
+
+    sprintf( index, "%u", w->index );
+
+    for( i = 0; i < w->operations; i++ ) {
+        uint32_t r = __next( &state );
+        uint32_t inc = (r >> 8) % 5 + 1;
+        uint32_t key = r >> 16;
+
+        switch( r % 8 ) {
+            case 5:
+                /* The first writer to get here creates it. */
+                key %= SHARED_KEYS;
+                metrics_counter_inc( w->m, __shared[key], inc );
+                w->shared[key] += inc;
+                break;
+            case 6:
+                key %= PRIVATE_KEYS;
+                sprintf( private, "%u", key );
+                metrics_counter_inc_labels( w->m, "stress_private", inc, 2,
+                                            "writer", index, "key", private );
+                w->private[key] += inc;
+                break;
+            case 7:
+                w->level = (int64_t) i - (int64_t) key;
+                metrics_gauge_set_labels( w->m, "stress_level", w->level, 1,
+                                          "writer", index );
+                break;
+            default:
+                key %= HOT_KEYS;
+                metrics_counter_inc( w->m, __hot[key], inc );
+                w->hot[key] += inc;
+                break;
+        }
+    }
+
+    if( 0 != w->flush ) {
+        metrics_thread_flush( w->m );
+    }
+
+    return NULL;
+}
+
+static int __begin( void *ctx, const char *base, size_t count )
+{
+    struct reports *r = (struct reports*) ctx;
+
+    (void) base;
+    (void) count;
+    r->count++;
+
+    return 0;
+}
+
+static int __series( void *ctx, const struct metrics_series *s )
+{
+    struct reports *r = (struct reports*) ctx;
+    struct seen *seen;
+
+    seen = (struct seen*) trie_search( r->seen, s->name );
+    if( NULL == seen ) {
+        seen = (struct seen*) calloc( 1, sizeof(struct seen) );
+        if( (NULL == seen) || (0 != trie_insert(r->seen, s->name, seen)) ) {
+            free( seen );
+            return -1;
+        }
+    }
+
+    if( METRICS_COUNTER == s->type ) {
+        if( s->value.counter < seen->counter ) {
+            r->went_backwards++;
+        }
+        seen->counter = s->value.counter;
+    } else {
+        seen->gauge = s->value.gauge;
+    }
+
+    return 0;
+}
+
+static int __free_seen( const char *key, void *data, void *arg )
+{
+    (void) key;
+    (void) arg;
+
+    free( data );
+
+    return 0;
+}
+
+static size_t __check_counter( struct reports *r, const char *name,
+                               uint64_t expected )
+{
+    struct seen *seen = (struct seen*) trie_search( r->seen, name );
+    uint64_t got = (NULL != seen) ? seen->counter : 0;
+
+    if( got != expected ) {
+        printf( "    %s: %" PRIu64 " expected %" PRIu64 "\n", name, got,
+                expected );
+        return 1;
+    }
+
+    return 0;
+}
+
+static size_t __check_gauge( struct reports *r, const char *name,
+                             int64_t expected )
+{
+    struct seen *seen = (struct seen*) trie_search( r->seen, name );
+
+    if( (NULL == seen) || (seen->gauge != expected) ) {
+        printf( "    %s: expected %" PRId64 "\n", name, expected );
+        return 1;
+    }
+
+    return 0;
+}
+
+static size_t __check( struct reports *r, struct writer *w, size_t writers )
+{
+    size_t errors = 0;
+    uint64_t total;
+    char *name;
+    char index[24], key[24];
+    size_t i, k;
+
+    for( k = 0; k < HOT_KEYS; k++ ) {
+        for( total = 0, i = 0; i < writers; i++ ) {
+            total += w[i].hot[k];
+        }
+        errors += __check_counter( r, __hot[k], total );
+    }
+
+    for( k = 0; k < SHARED_KEYS; k++ ) {
+        for( total = 0, i = 0; i < writers; i++ ) {
+            total += w[i].shared[k];
+        }
+        /* A shared key nobody drew is never created. */
+        if( 0 < total ) {
+            errors += __check_counter( r, __shared[k], total );
+        }
+    }
+
+    for( i = 0; i < writers; i++ ) {
+        sprintf( index, "%zu", i );
+        for( k = 0; k < PRIVATE_KEYS; k++ ) {
+            if( 0 == w[i].private[k] ) {
+                continue;
+            }
+            sprintf( key, "%zu", k );
+            name = metrics_calculate_name( "stress_private", 2, "writer", index,
+                                           "key", key );
+            errors += __check_counter( r, name, w[i].private[k] );
+            free( name );
+        }
+
+        name = metrics_calculate_name( "stress_level", 1, "writer", index );
+        errors += __check_gauge( r, name, w[i].level );
+        free( name );
+    }
+
+    return errors;
+}
+
+static int __run( const char *mode, struct metrics_config *c, size_t writers,
+                  size_t operations )
+{
+    struct metrics_exporter e;
+    struct metrics_exporter *exporters[1] = { &e };
+    struct reports r;
+    struct writer *w;
+    metrics_t m;
+    size_t errors;
+    size_t i;
+
+    memset( &r, 0, sizeof(r) );
+    r.seen = trie_create();
+
+    memset( &e, 0, sizeof(e) );
+    e.ctx = &r;
+    e.begin = __begin;
+    e.series = __series;
+
+    c->base = "stress";
+    c->report_period_ms = 1;
+    c->exporters = exporters;
+    c->exporter_count = 1;
+
+    w = (struct writer*) calloc( writers, sizeof(struct writer) );
+    m = metrics_init( c );
+    if( (NULL == r.seen) || (NULL == w) || (NULL == m) ) {
+        printf( "%-16s setup failed\n", mode );
+        return 1;
+    }
+
+    /* The hot keys exist before the writers start, so they are all hits. */
+    for( i = 0; i < HOT_KEYS; i++ ) {
+        metrics_counter_inc( m, __hot[i], 0 );
+    }
+
+    for( i = 0; i < writers; i++ ) {
+        w[i].m = m;
+        w[i].index = (uint32_t) i;
+        w[i].operations = operations;
+        w[i].flush = c->thread_buffered_counters;
+        pthread_create( &w[i].thread, NULL, __writer, &w[i] );
+    }
+    for( i = 0; i < writers; i++ ) {
+        pthread_join( w[i].thread, NULL );
+    }
+
+    /* The final report sees everything. */
+    metrics_shutdown( m );
+
+    errors = __check( &r, w, writers );
+    printf( "%-16s %zu reports, %zu went backwards, %zu wrong\n", mode,
+            r.count, r.went_backwards, errors );
+    errors += r.went_backwards;
+
+    trie_visit( r.seen, "", __free_seen, NULL );
+    trie_free( r.seen );
+    free( w );
+
+    return (0 == errors) ? 0 : 1;
+}
+
+int main( int argc, char *argv[] )
+{
+    struct metrics_config c;
+    size_t writers = DEFAULT_WRITERS;
+    size_t operations = DEFAULT_OPERATIONS;
+    char key[24];
+    int failed = 0;
+    size_t i;
+
+    if( 1 < argc ) {
+        writers = strtoul( argv[1], NULL, 10 );
+    }
+    if( 2 < argc ) {
+        operations = strtoul( argv[2], NULL, 10 );
+    }
+
+    for( i = 0; i < HOT_KEYS; i++ ) {
+        sprintf( key, "%zu", i );
+        __hot[i] = metrics_calculate_name( "stress_hot", 1, "key", key );
+    }
+    for( i = 0; i < SHARED_KEYS; i++ ) {
+        sprintf( key, "%zu", i );
+        __shared[i] = metrics_calculate_name( "stress_shared", 1, "key", key );
+    }
+
+    memset( &c, 0, sizeof(c) );
+    failed |= __run( "direct", &c, writers, operations );
+
+    memset( &c, 0, sizeof(c) );
+    c.thread_buffered_counters = 1;
+    failed |= __run( "thread buffered", &c, writers, operations );
+
+    memset( &c, 0, sizeof(c) );
+    c.report_slice_size = 1;
+    failed |= __run( "sliced", &c, writers, operations );
+
+    memset( &c, 0, sizeof(c) );
+    c.shared_reporter = 1;
+    c.timestamps = 1;
+    failed |= __run( "shared reporter", &c, writers, operations );
+
+    for( i = 0; i < HOT_KEYS; i++ ) {
+        free( __hot[i] );
+    }
+    for( i = 0; i < SHARED_KEYS; i++ ) {
+        free( __shared[i] );
+    }
+
+    return failed;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2019 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Merges the reports of every process on a host into one file:
+ *
+ *      metriks-aggregate [-g rule] [-r prefix=rule]... dir output
+ *
+ *  where a rule is sum, min, max or average, see metrics_aggregate().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/metrics.h"
+
+/*----------------------------------------------------------------------------*/
+/*                                   Macros                                   */
+/*----------------------------------------------------------------------------*/
+#define MAX_RULES   64
+
+/*----------------------------------------------------------------------------*/
+/*                               Data Structures                              */
+/*----------------------------------------------------------------------------*/
+/* none */
+
+/*----------------------------------------------------------------------------*/
+/*                            File Scoped Variables                           */
+/*----------------------------------------------------------------------------*/
+static const char *__rule_names[] = { "sum", "min", "max", "average" };
+
+/*----------------------------------------------------------------------------*/
+/*                             Function Prototypes                            */
+/*----------------------------------------------------------------------------*/
+static int __rule( const char*, metrics_gauge_rule_t* );
+static int __usage( const char* );
+
+/*----------------------------------------------------------------------------*/
+/*                             External Functions                             */
+/*----------------------------------------------------------------------------*/
+int main( int argc, char *argv[] )
+{
+    struct metrics_gauge_rule rules[MAX_RULES];
+    struct metrics_aggregate_config c;
+    char *eq;
+    int opt;
+
+    memset( &c, 0, sizeof(c) );
+    c.gauge_rule = METRICS_GAUGE_SUM;
+    c.rules = rules;
+
+    while( -1 != (opt = getopt(argc, argv, "g:r:h")) ) {
+        switch( opt ) {
+            case 'g':
+                if( 0 != __rule(optarg, &c.gauge_rule) ) {
+                    return __usage( argv[0] );
+                }
+                break;
+
+            case 'r':
+                eq = strrchr( optarg, '=' );
+                if( (NULL == eq) || (MAX_RULES == c.rule_count) ) {
+                    return __usage( argv[0] );
+                }
+                *eq = '\0';
+                rules[c.rule_count].prefix = optarg;
+                if( 0 != __rule(eq + 1, &rules[c.rule_count].rule) ) {
+                    return __usage( argv[0] );
+                }
+                c.rule_count++;
+                break;
+
+            default:
+                return __usage( argv[0] );
+        }
+    }
+
+    if( 2 != argc - optind ) {
+        return __usage( argv[0] );
+    }
+    c.dir = argv[optind];
+    c.output = argv[optind + 1];
+
+    if( 0 != metrics_aggregate(&c) ) {
+        fprintf( stderr, "%s: could not merge %s into %s\n", argv[0], c.dir,
+                 c.output );
+        return 1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/*                             Internal functions                             */
+/*----------------------------------------------------------------------------*/
+static int __rule( const char *name, metrics_gauge_rule_t *rule )
+{
+    size_t i;
+
+    for( i = 0; i < sizeof(__rule_names) / sizeof(__rule_names[0]); i++ ) {
+        if( 0 == strcmp(name, __rule_names[i]) ) {
+            *rule = (metrics_gauge_rule_t) i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int __usage( const char *name )
+{
+    fprintf( stderr,
+             "usage: %s [-g rule] [-r prefix=rule]... dir output\n"
+             "\n"
+             "Merges every report in dir into output.  Counters are added up\n"
+             "and gauges combined by the rule of the longest matching prefix,\n"
+             "or -g (default sum).  A rule is sum, min, max or average.\n",
+             name );
+
+    return 2;
+}